@@ -408,6 +408,29 @@ struct MTS_EXPORT_BIDIR PathEdge {
 		const PathVertex *vs, const PathVertex *vt,
 		const PathEdge *succEdge, int &interactions);
 
+	/**
+	 * \brief Connect two vertices without testing their visibility
+	 *
+	 * Sets up this edge like \ref pathConnectAndCollapse() would for an
+	 * unoccluded connection and returns the shadow ray that it would
+	 * have traced, so that the caller can resolve it later together with
+	 * others (see \ref ShadowRayQueue). This is only valid in scenes where
+	 * a single shadow ray determines visibility (see
+	 * \ref Scene::hasOpaqueVisibility()), in which case the edge carries
+	 * no medium and there are no intermediate interactions.
+	 *
+	 * \param vs
+	 *     First path vertex to be connected (not a supernode)
+	 * \param vt
+	 *     Second path vertex to be connected (not a supernode). The
+	 *     shadow ray starts at this vertex.
+	 * \param shadowRay
+	 *     Receives the segment that has to be free of intersections
+	 * \return \c false when one of the vertices is a supernode or
+	 *     both are located at the same position
+	 */
+	bool connectDeferred(const PathVertex *vs, const PathVertex *vt, Ray &shadowRay);
+
 	/// Create a deep copy of this edge
 	PathEdge *clone(MemoryPool &pool) const;
 
@@ -0,0 +1,390 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_BIDIR_GATHERTRIAL_H_)
+#define __MITSUBA_BIDIR_GATHERTRIAL_H_
+
+#include <mitsuba/bidir/vertex.h>
+#include <mitsuba/bidir/edge.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Batched estimator for the inverse connection probability
+ * of UPM vertex merges
+ *
+ * The scalar estimator in \ref PathSampler::sampleSplatsUPM() repeats
+ * restricted geometric trials (\ref PathVertex::sampleShoot()) until the
+ * first one lands inside the gather disk and uses the number of trials
+ * as an unbiased estimate of 1/p. This class runs the same trials for
+ * many merge candidates at once: the restricted directions of several
+ * trials are generated up front, interleaved into packets of four rays,
+ * traced with SSE packet traversal and tested against the gather disks
+ * in SIMD.
+ *
+ * A trial ends at the nearest surface, also in scenes with participating
+ * media: like the scalar trials, which start a new edge without a medium,
+ * the trials do not sample medium interactions.
+ *
+ * Every candidate still consumes its own trials in order and stops at
+ * its first accepted hit (or at the clamping threshold), so the trial
+ * counts follow exactly the same geometric distribution as the scalar
+ * loop. Trials that were issued in the same packet after the accepted
+ * one are discarded, which does not affect the estimator.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR GatherTrialBatch {
+public:
+	/// Per-candidate state of the batched estimator
+	struct Candidate {
+		/// Sample generator used for the restricted directions
+		Sampler *sampler;
+		/// Center of the gather disk
+		Point target;
+		/// Restricted sampling domain computed by \ref PathVertex::gatherAreaPdf()
+		GatherDomain domain;
+		/// Transport mode of the trials (\c ERadiance when shooting from the camera path)
+		ETransportMode mode;
+		/// Maximum number of trials of this candidate (0: use the threshold of \ref estimate())
+		size_t budget;
+		/// Number of issued and accepted trials
+		size_t totalShoot, acceptedShoot;
+		/// Set once the first trial was accepted or the threshold was reached
+		bool finished;
+
+	private:
+		friend class GatherTrialBatch;
+		/// Shooting vertex and its predecessor, unless they were copied
+		const PathVertex *m_vertex, *m_pred;
+		/// Index of the copied shooting vertices in the batch, or -1
+		int m_copy;
+		size_t m_pending;
+	};
+
+	inline GatherTrialBatch() : m_count(0), m_copyCount(0) { }
+
+	/// Remove all candidates and copied vertices (keeps the allocated storage)
+	inline void clear() { m_count = m_copyCount = 0; }
+
+	/// Append a new candidate and return a reference to it
+	Candidate &append();
+
+	/// Discard the most recently appended candidate
+	inline void removeLast() { --m_count; }
+
+	/// Return the number of candidates
+	inline size_t size() const { return m_count; }
+
+	/// Access a candidate
+	inline Candidate &operator[](size_t i) { return m_candidates[i]; }
+
+	/// Access a candidate (const version)
+	inline const Candidate &operator[](size_t i) const { return m_candidates[i]; }
+
+	/**
+	 * \brief Copy a shooting vertex and its predecessor into the batch
+	 *
+	 * This is needed for vertices that do not outlive the candidate loop
+	 * (e.g. expanded light vertices). The returned index can be passed to
+	 * \ref setVertices() for any number of candidates that shoot from the
+	 * same vertex, and stays valid until \ref clear() is called.
+	 */
+	uint32_t copyVertices(const PathVertex *vertex, const PathVertex *pred);
+
+	/// Let a candidate shoot from vertices that outlive the batch
+	inline void setVertices(Candidate &c, const PathVertex *vertex, const PathVertex *pred) const {
+		c.m_vertex = vertex;
+		c.m_pred = pred;
+		c.m_copy = -1;
+	}
+
+	/// Let a candidate shoot from vertices that were copied with \ref copyVertices()
+	inline void setVertices(Candidate &c, uint32_t copy) const {
+		c.m_vertex = c.m_pred = NULL;
+		c.m_copy = (int) copy;
+	}
+
+	/// Return the shooting vertex of a candidate
+	inline const PathVertex *getVertex(const Candidate &c) const {
+		return c.m_copy >= 0 ? &m_copies[c.m_copy].vertex : c.m_vertex;
+	}
+
+	/// Return the predecessor of the shooting vertex of a candidate (may be \c NULL)
+	inline const PathVertex *getPred(const Candidate &c) const {
+		if (c.m_copy < 0)
+			return c.m_pred;
+		const VertexCopy &copy = m_copies[c.m_copy];
+		return copy.hasPred ? &copy.pred : NULL;
+	}
+
+	/**
+	 * \brief Run the geometric trials of all candidates
+	 *
+	 * \param scene
+	 *     The underlying scene
+	 * \param gatherRadius
+	 *     Radius of the gather disks
+	 * \param clampThreshold
+	 *     Maximum number of trials per candidate
+	 * \param coherent
+	 *     Issue the trials of candidates with nearby shooting vertices
+	 *     in the same packets? This pays off for large batches that mix
+	 *     candidates from all over the scene.
+	 */
+	void estimate(const Scene *scene, Float gatherRadius, size_t clampThreshold, bool coherent = false);
+
+	/**
+	 * \brief Run one shared stream of geometric trials for all candidates
+	 *
+	 * All trials are shot from \c vertex over a single restricted domain
+	 * (usually the union of the gather disks around \c center, see
+	 * \ref PathVertex::gatherAreaPdf()) that must contain the gather disk
+	 * of every candidate. Each trial is tested against all candidates that
+	 * are still waiting for their first hit, and a candidate records the
+	 * index of that trial in \ref Candidate::totalShoot. Since the trials
+	 * are i.i.d., this index follows the same geometric distribution as an
+	 * independent loop over the shared domain, so dividing it by the
+	 * integral of the shared domain gives an unbiased estimate of 1/p.
+	 *
+	 * Only the \ref Candidate::target fields need to be set.
+	 *
+	 * \param domainCenter
+	 *     Center of the shared sampling domain
+	 * \param domainRadius
+	 *     Radius of the shared sampling domain
+	 * \param gatherRadius
+	 *     Radius of the gather disks of the candidates
+	 * \param clampThreshold
+	 *     Maximum number of trials of the shared stream
+	 * \return
+	 *     The number of trials that were shot
+	 */
+	size_t estimateShared(const Scene *scene, const PathVertex *vertex, const PathVertex *pred,
+		Sampler *sampler, ETransportMode mode, const Point &domainCenter, Float domainRadius,
+		const GatherDomain &domain, Float gatherRadius, size_t clampThreshold);
+
+private:
+	/// A trial that was issued for the current packet
+	struct Trial {
+		uint32_t candidate;
+		/// Packet lane of the trial, or -1 if no direction could be sampled
+		int lane;
+	};
+
+	/// Shooting vertices that were copied into the batch
+	struct VertexCopy {
+		PathVertex vertex, pred;
+		bool hasPred;
+	};
+
+	/// Sort the active candidates along a Morton curve over their shooting vertices
+	void sortActive();
+
+	std::vector<Candidate> m_candidates;
+	std::vector<VertexCopy> m_copies;
+	std::vector<uint32_t> m_active;
+	std::vector<Trial> m_trials;
+	std::vector<std::pair<uint32_t, uint32_t> > m_keys;
+	size_t m_count, m_copyCount;
+};
+
+/// A vertex merge whose 1/p estimate is deferred to the batched geometric trials
+struct PendingMerge {
+	Spectrum contrib;
+	Float miWeight;
+	Float invBrdfIntegral;
+	Point2 samplePos;
+	int s, t;
+	bool cameraDirConnection;
+	/// Statistics group of the adaptive trial policy, or -1
+	int trialSlot;
+};
+
+/**
+ * \brief Queue of the deferred vertex merges of many UPM camera paths
+ *
+ * With \ref GatherTrialBatch alone, the geometric trials of the merges
+ * of a gather point are run as soon as the gather point is done, so a
+ * batch rarely has more than a few dozen candidates. The merge queue keeps
+ * the merges of all camera paths of an iteration in flight instead and
+ * runs their trials in bulk once a few thousand of them have queued up
+ * (\ref isFull()), in an order that puts candidates with nearby shooting
+ * vertices into the same ray packets.
+ *
+ * Only the geometric trials are queued. The camera paths themselves are
+ * still traced one at a time, and their shadow rays are only batched
+ * per camera path (see \ref ShadowRayQueue).
+ *
+ * The candidates shoot from copies of their vertices (\ref copyVertices()),
+ * since the camera paths are released long before the queue is drained. All
+ * queued merges have to be drained with the gather radius they were
+ * created with, i.e. before the next iteration starts.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR MergeQueue {
+public:
+	inline MergeQueue() : m_capacity(0) { }
+
+	/// Set the number of merges after which the queue should be drained (0: disabled)
+	inline void setCapacity(size_t capacity) { m_capacity = capacity; }
+
+	/// Is the queue enabled?
+	inline bool isEnabled() const { return m_capacity > 0; }
+
+	/// Has the queue reached its capacity?
+	inline bool isFull() const { return m_trials.size() >= m_capacity; }
+
+	/// Return the number of queued merges
+	inline size_t size() const { return m_trials.size(); }
+
+	/// Queue a merge, the caller fills in the candidate and \ref getMerge()
+	inline GatherTrialBatch::Candidate &append() {
+		m_merges.push_back(PendingMerge());
+		return m_trials.append();
+	}
+
+	/// Discard the most recently queued merge
+	inline void removeLast() {
+		m_merges.pop_back();
+		m_trials.removeLast();
+	}
+
+	/// Copy the shooting vertices of queued merges, see \ref GatherTrialBatch::copyVertices()
+	inline uint32_t copyVertices(const PathVertex *vertex, const PathVertex *pred) {
+		return m_trials.copyVertices(vertex, pred);
+	}
+
+	/// Let a queued merge shoot from copied vertices
+	inline void setVertices(GatherTrialBatch::Candidate &c, uint32_t copy) const {
+		m_trials.setVertices(c, copy);
+	}
+
+	/// Run the geometric trials of all queued merges
+	void drain(const Scene *scene, Float gatherRadius, size_t clampThreshold);
+
+	/// Access the trial outcome of a drained merge
+	inline const GatherTrialBatch::Candidate &getCandidate(size_t i) const { return m_trials[i]; }
+
+	/// Access a queued merge
+	inline PendingMerge &getMerge(size_t i) { return m_merges[i]; }
+
+	/// Remove all merges (keeps the allocated storage)
+	inline void clear() {
+		m_merges.clear();
+		m_trials.clear();
+	}
+
+private:
+	GatherTrialBatch m_trials;
+	std::vector<PendingMerge> m_merges;
+	size_t m_capacity;
+};
+
+/// Maximum subpath depth that gets its own statistics in \ref GatherTrialPolicy
+#define MTS_TRIAL_POLICY_DEPTH 16
+
+/**
+ * \brief Online policy for the trial budget of UPM vertex merges
+ *
+ * Merges are grouped by their (s, t) strategy and by whether the shooting
+ * vertex has a glossy BSDF. For every group, the policy tracks the
+ * distribution of the trial counts (number of estimates, issued trials,
+ * accepted and clamped estimates) and the mean of the expected merge
+ * contribution before the 1/p factor, i.e. the MIS-weighted throughput
+ * divided by the integral of the restricted sampling domain.
+ *
+ * Based on the ratio of a merge's expected contribution to the mean of its
+ * group, the policy can
+ *
+ * - scale the clamping threshold, so that bright merges get more trials
+ *   and dim merges fewer (this moves the clamping bias towards merges that
+ *   matter less, but does not remove it), and
+ * - play Russian roulette on the trials of dim merges in groups whose
+ *   estimates are expensive. Surviving merges are divided by the survival
+ *   probability, so the roulette itself does not add any bias.
+ *
+ * The statistics are accumulated per \ref PathSampler and are not
+ * synchronized; decisions only depend on previous merges.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR GatherTrialPolicy {
+public:
+	/// Outcome of \ref decide()
+	struct Decision {
+		/// Maximum number of trials of the merge
+		size_t budget;
+		/// Weight of the merge, 0 if it was terminated by Russian roulette
+		Float weight;
+	};
+
+	GatherTrialPolicy();
+
+	/// Enable or disable the adaptive budgets and the Russian roulette
+	void configure(bool adaptiveBudget, bool roulette);
+
+	/// Is any part of the policy enabled?
+	inline bool isEnabled() const { return m_adaptiveBudget || m_roulette; }
+
+	/// Discard all statistics
+	void reset();
+
+	/// Return the statistics group of a merge
+	static inline int getSlot(int s, int t, bool glossy) {
+		s = std::min(std::max(s, 0), MTS_TRIAL_POLICY_DEPTH - 1);
+		t = std::min(std::max(t, 0), MTS_TRIAL_POLICY_DEPTH - 1);
+		return (s * MTS_TRIAL_POLICY_DEPTH + t) * 2 + (glossy ? 1 : 0);
+	}
+
+	/**
+	 * \brief Decide on the budget and roulette of a merge
+	 *
+	 * \param slot
+	 *     Statistics group returned by \ref getSlot()
+	 * \param contribution
+	 *     Expected contribution of the merge without the 1/p factor
+	 * \param clampThreshold
+	 *     Default maximum number of trials
+	 * \param sample
+	 *     Uniform random number for the Russian roulette
+	 */
+	Decision decide(int slot, Float contribution, size_t clampThreshold, Float sample);
+
+	/// Record the outcome of the trials of a merge
+	void record(int slot, size_t totalShoot, bool accepted, size_t budget);
+
+private:
+	struct Slot {
+		Float contributionSum;
+		size_t contributionCount;
+		size_t estimateCount;
+		size_t trialSum;
+		size_t acceptCount;
+		size_t clampCount;
+	};
+
+	std::vector<Slot> m_slots;
+	bool m_adaptiveBudget, m_roulette;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_BIDIR_GATHERTRIAL_H_ */
@@ -0,0 +1,93 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_BIDIR_LIGHTPATHBUDGET_H_)
+#define __MITSUBA_BIDIR_LIGHTPATHBUDGET_H_
+
+#include <mitsuba/bidir/common.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Number of light paths that a vertex merging iteration traces
+ *
+ * UPM and VCM iterations trace one camera path per pixel. The number of
+ * light paths is independent of that: it is either given relative to
+ * the number of camera paths or as an absolute count. These are two
+ * separate settings, since no value of a single one could tell them
+ * apart reliably. When auto-tuning
+ * is enabled, \ref update() adjusts it after every iteration so that
+ * tracing the light paths takes about as long as tracing and gathering
+ * the camera paths.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR LightPathBudget {
+public:
+	/// Auto-tuning keeps the ratio of light and camera paths within 1/maxRatio and maxRatio
+	static const Float maxRatio;
+
+	LightPathBudget();
+
+	/**
+	 * \brief Set the initial number of light paths
+	 *
+	 * \param ratio
+	 *    Number of light paths per camera path, or zero to use \c count
+	 * \param count
+	 *    Absolute number of light paths (only used when \c ratio is zero)
+	 * \param cameraPathCount
+	 *    Number of camera paths per iteration
+	 * \param autoTune
+	 *    Adjust the count in \ref update()? Auto-tuning stays within
+	 *    1/\ref maxRatio and \ref maxRatio times the camera path count.
+	 */
+	void configure(Float ratio, size_t count, size_t cameraPathCount, bool autoTune);
+
+	/// Number of light paths of the next iteration
+	inline int getLightPathCount() const { return m_lightPathCount; }
+
+	/// Number of camera paths per iteration
+	inline size_t getCameraPathCount() const { return m_cameraPathCount; }
+
+	/**
+	 * \brief Pick the light path count of the next iteration from the
+	 * timing of the last one (does nothing unless auto-tuning is enabled)
+	 *
+	 * \param traceTime
+	 *    Time spent on tracing the light paths in seconds
+	 * \param gatherTime
+	 *    Time spent on tracing and gathering the camera paths in seconds
+	 */
+	void update(Float traceTime, Float gatherTime);
+
+	/// Return a human-readable string representation
+	std::string toString() const;
+private:
+	size_t m_cameraPathCount;
+	int m_lightPathCount, m_minCount, m_maxCount;
+	/// Smoothed tracing time per light path and gather time per iteration
+	Float m_traceCost, m_gatherTime;
+	int m_updates;
+	bool m_autoTune;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_BIDIR_LIGHTPATHBUDGET_H_ */
@@ -21,15 +21,25 @@
 #define __MITSUBA_BIDIR_PATHSAMPLER_H_
 
 #include <mitsuba/bidir/path.h>
+#include <mitsuba/bidir/gathertrial.h>
+#include <mitsuba/bidir/sharedpaths.h>
 #include <boost/function.hpp>
 #include <mitsuba/core/fstream.h>
 #include <mitsuba/core/kdtree.h>
+#include <mitsuba/core/hashgrid.h>
+#include <mitsuba/render/tiledblock.h>
+#include <mitsuba/render/shadowqueue.h>
+#include <mitsuba/render/sequencer.h>
 
 MTS_NAMESPACE_BEGIN
 
 //#define UPM_DEBUG 1
 // #define UPM_DEBUG_HARD
 
+/* Store light/camera path vertices in a hashed uniform grid (cell size =
+   gather radius) instead of a kd-tree */
+// #define UPM_HASHGRID
+
 /*
 *	Misc for VCM
 */
@@ -50,6 +60,28 @@ struct MTS_EXPORT_BIDIR MisState{
 		return state[tech];
 	}
 };
+/**
+ * \brief The attributes of a path vertex that the MIS weights of vertex
+ * merging look at besides the pdfs
+ *
+ * This is what \c connectionDirection() and the effective merge densities
+ * need to know about the vertices of the other subpath, and it can be read
+ * straight from a \ref LightVertexStore.
+ */
+struct MTS_EXPORT_BIDIR MisVertex {
+	/// Vertex type (see \ref PathVertex::EVertexType)
+	uint8_t type;
+	/// See \ref PathVertex::isConnectable()
+	bool connectable;
+	/// Bandwidth of the BSDF or emitter at the vertex (see \ref BSDF::getBandwidth())
+	Float bandwidth;
+
+	/// Create the record of a missing vertex (never connectable)
+	inline MisVertex() : type(PathVertex::EInvalid), connectable(false), bandwidth(0.0f) { }
+
+	/// Extract the record of a path vertex (may be \c NULL)
+	explicit MisVertex(const PathVertex *v);
+};
 struct LightVertex{
 	Spectrum importanceWeight;
 	Vector wo;
@@ -126,8 +158,120 @@ struct LightVertexExt{
 		}
 	}
 };
+/**
+ * \brief Compact structure-of-arrays storage for the vertices of the
+ * light subpaths that are used for vertex merging
+ *
+ * Compared to a pair of \ref LightVertex and \ref LightVertexExt records,
+ * every attribute lives in its own array so that the gather loops only
+ * touch the fields they need (e.g. the positions and MIS states). Unit
+ * vectors are stored as 2x16 bit octahedral codes, the direction towards
+ * the predecessor is recomputed from the neighboring position, and the
+ * depth and vertex flags share a single word. The MIS states, pdfs and
+ * weights stay in single precision, as the MIS ratios are not bounded
+ * and regularly exceed the range of half precision floats.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR LightVertexStore {
+public:
+	/// Remove all vertices (keeps the allocated storage)
+	void clear();
+
+	/// Reserve storage for the given number of vertices
+	void reserve(size_t size);
+
+	/// Append a light vertex at the given subpath depth
+	void append(const PathVertex *vs, int depth, const MisState &state,
+		const Spectrum &importanceWeight);
+
+	/// Return the number of stored vertices
+	inline size_t size() const { return m_position.size(); }
+
+	/// Return the subpath depth of a vertex
+	inline int getDepth(size_t i) const { return (int) (m_flags[i] & 0xFFFF); }
+
+	/// Return the position of a vertex
+	inline const Point &getPosition(size_t i) const { return m_position[i]; }
+
+	/// Return the geometric normal of a vertex
+	inline Vector getGeometricNormal(size_t i) const { return decodeDirection(m_geoFrameN[i]); }
+
+	/// Return the throughput of the light subpath up to a vertex
+	inline const Spectrum &getImportanceWeight(size_t i) const { return m_importanceWeight[i]; }
+
+	/// Return the MIS state of the light subpath up to a vertex
+	inline const MisState &getMisState(size_t i) const { return m_misState[i]; }
+
+	/// Return the type of a vertex (see \ref PathVertex::EVertexType)
+	inline uint8_t getType(size_t i) const { return (uint8_t) ((m_flags[i] >> 16) & 0xFF); }
+
+	/// Return the sampling density of a vertex (see \ref PathVertex::pdf)
+	inline Float getPdf(size_t i, ETransportMode mode) const {
+		return mode == EImportance ? m_pdfImp[i] : m_pdfRad[i];
+	}
+
+	/// Return the attributes of a vertex that the MIS weights of vertex merging need
+	inline MisVertex getMisVertex(size_t i) const {
+		MisVertex v;
+		v.type = getType(i);
+		v.connectable = (m_flags[i] & (1u << 28)) == 0
+			&& ((m_flags[i] >> 24) & 0xF) != EDiscrete;
+		v.bandwidth = m_bandwidth[i];
+		return v;
+	}
+
+	/**
+	 * \brief Return the direction from a vertex towards its predecessor
+	 *
+	 * Only valid for surface interactions, whose predecessor is always
+	 * the previous vertex of the store.
+	 */
+	inline Vector getWo(size_t i) const {
+		return normalize(m_position[i - 1] - m_position[i]);
+	}
+
+	/**
+	 * \brief Rebuild a \ref PathVertex from the stored attributes
+	 *
+	 * Only the type, measure, pdfs and the geometric information are
+	 * restored; all other fields are set to zero.
+	 */
+	void expand(size_t i, PathVertex *vs) const;
+
+	/**
+	 * \brief Restore only the geometry of a vertex
+	 *
+	 * Sets the type, measure, pdfs, position, geometric normal and the
+	 * shape or emitter, but neither clears the vertex nor decodes the
+	 * shading frame. This is enough for a vertex that is only the neighbor
+	 * of an evaluation (e.g. the predecessor in \ref PathVertex::eval()),
+	 * while \ref expand() is needed to evaluate the vertex's own BSDF.
+	 */
+	void expandGeometry(size_t i, PathVertex *vs) const;
+
+	/// Encode a unit vector (or the zero vector) into a 32 bit octahedral code
+	static uint32_t encodeDirection(const Vector &d);
+
+	/// Decode a 32 bit octahedral code
+	static Vector decodeDirection(uint32_t code);
+
+private:
+	std::vector<Point> m_position;
+	std::vector<Spectrum> m_importanceWeight;
+	std::vector<MisState> m_misState;
+	std::vector<uint32_t> m_shFrameN, m_shFrameS, m_geoFrameN;
+	std::vector<const Shape *> m_shape;
+	std::vector<Float> m_pdfImp, m_pdfRad;
+	/// Bandwidth of the BSDF or emitter (see \ref MisVertex)
+	std::vector<Float> m_bandwidth;
+	/// Depth (bits 0-15), type (16-23), measure (24-27) and degenerate flag (28)
+	std::vector<uint32_t> m_flags;
+};
 struct LightPathNodeData{
 	int depth;
+	/// Slice of a \ref SharedLightPathStore that holds the vertex
+	int slice;
 	size_t vertexIndex;
 };
 struct LightPathNode : public SimpleKDNode < Point, LightPathNodeData > {
@@ -138,6 +282,7 @@ struct LightPathNode : public SimpleKDNode < Point, LightPathNodeData > {
 		position = p;
 		data.vertexIndex = vertexIndex;
 		data.depth = depth;
+		data.slice = 0;
 	}
 	inline LightPathNode(Stream *stream) {
 		// TODO
@@ -146,9 +291,76 @@ struct LightPathNode : public SimpleKDNode < Point, LightPathNodeData > {
 		// TODO
 	}
 };
+#if defined(UPM_HASHGRID)
+typedef PointHashGrid<LightPathNode>	LightPathTree;
+#else
 typedef PointKDTree<LightPathNode>		LightPathTree;
+#endif
 typedef LightPathTree::IndexType     IndexType;
-typedef LightPathTree::SearchResult SearchResult;
+
+/// Tell the light path tree about the gather radius of the next build (used by the hash grid)
+inline void setGatherRadius(PointKDTree<LightPathNode> &tree, Float radius) { }
+inline void setGatherRadius(PointHashGrid<LightPathNode> &tree, Float radius) { tree.setCellSize(radius); }
+typedef PointKDTree<LightPathNode>::SearchResult SearchResult;
+
+/**
+ * \brief UPM light vertices of an iteration that are shared by all
+ * workers of a machine (see \ref SharedLightPaths)
+ *
+ * A slice is the \ref LightVertexStore of a worker's \ref PathSampler
+ * together with the merge candidates that it collected. The candidates
+ * of all slices are copied into one \ref LightPathTree, whose nodes
+ * remember the slice of their vertex.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR SharedLightPathStore : public SharedLightPaths {
+public:
+	/// Create a new shared store
+	SharedLightPathStore(bool parallelBuild = false);
+
+	/// Unserialize an empty store
+	SharedLightPathStore(Stream *stream, InstanceManager *manager);
+
+	void serialize(Stream *stream, InstanceManager *manager) const;
+
+	/**
+	 * \brief Publish the slice of a worker and wait until the merge
+	 * tree of the round has been built
+	 *
+	 * \param vertices
+	 *    Light vertices of the slice
+	 * \param nodes
+	 *    Merge candidates of the slice (an unbuilt tree)
+	 * \param gatherRadius
+	 *    Gather radius of the round
+	 */
+	void publish(const Round &round, const LightVertexStore *vertices,
+		const LightPathTree *nodes, Float gatherRadius);
+
+	/// Return the merge tree of the current round
+	inline const LightPathTree &getTree() const { return m_tree; }
+
+	/// Return the light vertices of a slice of the current round
+	inline const LightVertexStore &getVertices(int slice) const { return *m_slices[slice].vertices; }
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Virtual destructor
+	virtual ~SharedLightPathStore() { }
+
+	void beginRound(int sliceCount);
+	void build(int sliceCount);
+private:
+	struct Slice {
+		const LightVertexStore *vertices;
+		const LightPathTree *nodes;
+		Float gatherRadius;
+	};
+
+	LightPathTree m_tree;
+	std::vector<Slice> m_slices;
+};
 
 
 /*
@@ -247,14 +459,17 @@ struct MTS_EXPORT_BIDIR SplatListImp {
 /* ==================================================================== */
 class UPMWorkResult : public WorkResult {
 public:
-	UPMWorkResult(const int width, const int height, const int maxDepth, const ReconstructionFilter *rfilter, bool guided = false): m_guided(guided){
-		/* Stores the 'camera image' -- this can be blocked when
-		spreading out work to multiple workers */
+	/**
+	 * The images are stored in tiles that are only allocated where splats
+	 * land. The accumulated result of a process should be \c dense, which
+	 * allows several threads to merge into it at the same time (see
+	 * \ref putImages()).
+	 */
+	UPMWorkResult(const int width, const int height, const int maxDepth, const ReconstructionFilter *rfilter, bool guided = false, bool dense = false): m_guided(guided){
+		/* Stores the 'camera image'. Splats can land anywhere in the frame */
 		Vector2i blockSize = Vector2i(width, height);
 
-		m_block = new ImageBlock(Bitmap::ESpectrum, blockSize, rfilter);
-		m_block->setOffset(Point2i(0, 0));
-		m_block->setSize(blockSize);
+		m_block = new TiledImageBlock(Bitmap::ESpectrum, blockSize, rfilter, dense);
 
 		/* When debug mode is active, we additionally create
 		full-resolution bitmaps storing the contributions of
@@ -265,27 +480,22 @@ public:
 		m_debugBlocksM.resize(
 			maxDepth*(5 + maxDepth) / 2);		
 
-		for (size_t i = 0; i<m_debugBlocks.size(); ++i) {
-			m_debugBlocks[i] = new ImageBlock(
-				Bitmap::ESpectrum, blockSize, rfilter);
-			m_debugBlocks[i]->setOffset(Point2i(0, 0));
-			m_debugBlocks[i]->setSize(blockSize);
-		}
-		for (size_t i = 0; i < m_debugBlocksM.size(); ++i) {
-			m_debugBlocksM[i] = new ImageBlock(
-				Bitmap::ESpectrum, blockSize, rfilter);
-			m_debugBlocksM[i]->setOffset(Point2i(0, 0));
-			m_debugBlocksM[i]->setSize(blockSize);
-		}
+		for (size_t i = 0; i<m_debugBlocks.size(); ++i)
+			m_debugBlocks[i] = new TiledImageBlock(
+				Bitmap::ESpectrum, blockSize, rfilter, dense);
+		for (size_t i = 0; i < m_debugBlocksM.size(); ++i)
+			m_debugBlocksM[i] = new TiledImageBlock(
+				Bitmap::ESpectrum, blockSize, rfilter, dense);
 
-		m_block_vc = new ImageBlock(Bitmap::ESpectrum, blockSize, rfilter);
-		m_block_vm = new ImageBlock(Bitmap::ESpectrum, blockSize, rfilter);
+		m_block_vc = new TiledImageBlock(Bitmap::ESpectrum, blockSize, rfilter, dense);
+		m_block_vm = new TiledImageBlock(Bitmap::ESpectrum, blockSize, rfilter, dense);
 
 		tentativeDistribution.resize(100);
 		for (int i = 0; i < 100; i++)
 			tentativeDistribution[i] = 0.f;
 #endif
 		sampleCount = 0;
+		m_sequence = 0;
 
 		m_timeTraceKernel = new Timer(false);
 		m_timeBoundProb = new Timer(false);
@@ -327,6 +537,7 @@ public:
 		m_block_vm->load(stream);
 #endif
 		m_block->load(stream);
+		m_sequence = stream->readSize();
 	}
 
 	/// Serialize a work result to a binary data stream
@@ -341,10 +552,22 @@ public:
 		m_block_vm->save(stream);
 #endif
 		m_block->save(stream);
+		stream->writeSize(m_sequence);
 	}
 
 	/// Aaccumulate another work result into this one
 	void put(const UPMWorkResult *workResult){
+		putImages(workResult);
+		putCounters(workResult);
+	}
+
+	/**
+	 * \brief Accumulate the images of another work result into this one
+	 *
+	 * When this work result is dense, the tiles are locked individually,
+	 * so several threads can call this function at the same time.
+	 */
+	void putImages(const UPMWorkResult *workResult){
 #if UPM_DEBUG == 1
 		for (size_t i = 0; i < m_debugBlocks.size(); ++i)
 			m_debugBlocks[i]->put(workResult->m_debugBlocks[i].get());
@@ -353,11 +576,16 @@ public:
 
 		m_block_vc->put(workResult->m_block_vc.get());
 		m_block_vm->put(workResult->m_block_vm.get());
+#endif
+		m_block->put(workResult->m_block.get());
+	}
 
+	/// Accumulate the sample count and statistics of another work result (not thread-safe)
+	void putCounters(const UPMWorkResult *workResult){
+#if UPM_DEBUG == 1
 		for (int i = 0; i < 100; i++)
 			tentativeDistribution[i] += workResult->tentativeDistribution[i];
 #endif
-		m_block->put(workResult->m_block.get());
 		sampleCount += workResult->getSampleCount();
 	}
 
@@ -380,7 +608,7 @@ public:
 			kmap->clear();
 			for (int t = 0; t <= k + 1; ++t) {
 				size_t s = k + 1 - t;
-				Bitmap *bitmap = const_cast<Bitmap *>(m_debugBlocks[strategyIndex(s, t)]->getBitmap());
+				ref<Bitmap> bitmap = m_debugBlocks[strategyIndex(s, t)]->toBitmap();
 				if (bitmap->average().isZero()) continue;
 				kmap->accumulate(bitmap);
 				ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, -1, weight);
@@ -398,7 +626,7 @@ public:
 
 			for (int t = 0; t <= k + 1; ++t) {
 				size_t s = k + 1 - t;
-				Bitmap *bitmap = const_cast<Bitmap *>(m_debugBlocksM[strategyIndex(s, t)]->getBitmap());
+				ref<Bitmap> bitmap = m_debugBlocksM[strategyIndex(s, t)]->toBitmap();
 				if (bitmap->average().isZero()) continue;
 				ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, -1, weight);
 				fs::path filename =
@@ -408,7 +636,7 @@ public:
 				ldrBitmap->write(Bitmap::EPFM, targetFile, 1);
 			}
 		}
-		Bitmap *bitmap = const_cast<Bitmap *>(m_block_vc->getBitmap());
+		ref<Bitmap> bitmap = m_block_vc->toBitmap();
 		if (!bitmap->average().isZero()){
 			ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, 1.0, weight);
 			fs::path filename =
@@ -417,7 +645,7 @@ public:
 				FileStream::ETruncReadWrite);
 			ldrBitmap->write(Bitmap::EPFM, targetFile, 1);
 		}
-		bitmap = const_cast<Bitmap *>(m_block_vm->getBitmap());
+		bitmap = m_block_vm->toBitmap();
 		if (!bitmap->average().isZero()){
 			ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, 1.0, weight);
 			fs::path filename =
@@ -461,7 +689,7 @@ public:
 		const fs::path &prefix, const fs::path &stem, const int index,
 		const size_t  actualSampleCount, const bool isUPM) const{
 		Float weight = 1.f / (Float)actualSampleCount;
-		Bitmap *bitmap = const_cast<Bitmap *>(m_block_vc->getBitmap());
+		ref<Bitmap> bitmap = m_block_vc->toBitmap();
 		if (!bitmap->average().isZero()){
 			ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, 1.0, weight);
 			fs::path filename =
@@ -470,7 +698,7 @@ public:
 				FileStream::ETruncReadWrite);
 			ldrBitmap->write(Bitmap::EPFM, targetFile, 1);
 		}
-		bitmap = const_cast<Bitmap *>(m_block_vm->getBitmap());
+		bitmap = m_block_vm->toBitmap();
 		if (!bitmap->average().isZero()){
 			ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, 1.0, weight);
 			fs::path filename =
@@ -479,7 +707,7 @@ public:
 				FileStream::ETruncReadWrite);
 			ldrBitmap->write(Bitmap::EPFM, targetFile, 1);
 		}
-		bitmap = const_cast<Bitmap *>(m_block->getBitmap());
+		bitmap = m_block->toBitmap();
 		if (!bitmap->average().isZero()){
 			ref<Bitmap> ldrBitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat32, 1.0, weight);
 			fs::path filename =
@@ -499,10 +727,10 @@ public:
 	// 		m_lightImage->put(sample, spec, 1.0f);
 	// 	}
 
-	inline const ImageBlock *getImageBlock() const {
+	inline const TiledImageBlock *getImageBlock() const {
 		return m_block.get();
 	}
-	inline ImageBlock *getImageBlock() {
+	inline TiledImageBlock *getImageBlock() {
 		return m_block.get();
 	}
 
@@ -510,14 +738,6 @@ public:
 	// 		return m_lightImage.get();
 	// 	}
 
-	inline void setSize(const Vector2i &size) {
-		m_block->setSize(size);
-	}
-
-	inline void setOffset(const Point2i &offset) {
-		m_block->setOffset(offset);
-	}
-
 	void accumSampleCount(size_t count){
 		sampleCount += count;
 	}
@@ -525,6 +745,10 @@ public:
 		return sampleCount;
 	}
 
+	/// Sequence number of the work unit that produced this result (see \ref UPMResultSequencer)
+	inline size_t getSequence() const { return m_sequence; }
+	inline void setSequence(size_t sequence) { m_sequence = sequence; }
+
 	/// Return a string representation
 	std::string toString() const {
 		return m_block->toString();
@@ -541,14 +765,15 @@ protected:
 	}
 protected:
 #if UPM_DEBUG == 1	
-	ref_vector<ImageBlock> m_debugBlocks;
-	ref_vector<ImageBlock> m_debugBlocksM;
-	ref<ImageBlock> m_block_vc;
-	ref<ImageBlock> m_block_vm;
+	ref_vector<TiledImageBlock> m_debugBlocks;
+	ref_vector<TiledImageBlock> m_debugBlocksM;
+	ref<TiledImageBlock> m_block_vc;
+	ref<TiledImageBlock> m_block_vm;
 	std::vector<Float> tentativeDistribution;
 #endif
 	size_t sampleCount;
-	ref<ImageBlock> m_block; // , m_lightImage;
+	size_t m_sequence;
+	ref<TiledImageBlock> m_block; // , m_lightImage;
 	bool m_guided;
 
 public:
@@ -561,6 +786,48 @@ public:
 	ref<Timer> m_timeProbLobe;
 };
 
+/**
+ * \brief Accumulates the work results of a UPM/VCM process in the order
+ * of their sequence numbers (see \ref ResultSequencer)
+ */
+class UPMResultSequencer : public ResultSequencer<UPMWorkResult> {
+public:
+	/// Set the result that accumulates all work results, and the configuration of the copies
+	void setTarget(UPMWorkResult *target, int width, int height, int maxDepth,
+			const ReconstructionFilter *rfilter) {
+		m_target = target;
+		m_width = width;
+		m_height = height;
+		m_maxDepth = maxDepth;
+		m_rfilter = rfilter;
+	}
+protected:
+	ref<UPMWorkResult> copy(const UPMWorkResult *wr) {
+		ref<UPMWorkResult> copy = new UPMWorkResult(m_width, m_height, m_maxDepth, m_rfilter);
+		copy->clear();
+		copy->put(wr);
+		return copy;
+	}
+
+	void merge(const UPMWorkResult *wr) {
+		m_target->put(wr);
+	}
+private:
+	ref<UPMWorkResult> m_target;
+	ref<const ReconstructionFilter> m_rfilter;
+	int m_width, m_height, m_maxDepth;
+};
+
+/// A vertex merge of a UPM gather point that waits for its shadow ray
+struct DeferredMerge {
+	/// Index of the light vertex in the search results of the gather point
+	size_t k;
+	/// Contribution of the merge before the geometric trials
+	Spectrum contrib;
+
+	inline DeferredMerge(size_t k, const Spectrum &contrib) : k(k), contrib(contrib) { }
+};
+
 /**
  * \brief Implements a sampling strategy that is able to produce paths using
  * bidirectional path tracing or unidirectional volumetric path tracing.
@@ -737,11 +1004,86 @@ public:
 	void gatherLightPaths(const bool useVC, const bool useVM, const float gatherRadius, const int nsample, ImageBlock* lightImage = NULL);
 	void sampleSplatsVCM(const bool useVC, const bool useVM, const float gatherRadius, const Point2i &offset, const size_t cameraPathIndex, SplatList &list);
 
-	/// for UPM
-	void gatherLightPathsUPM(const bool useVC, const bool useVM, const float gatherRadius, const int nsample, UPMWorkResult *wr, ImageBlock *batres = NULL, Float rejectionProb = 0.f);
+	/// Build the light/camera path trees with multiple threads
+	inline void setParallelTreeBuild(bool parallel) {
+		m_lightPathTree.setParallelBuild(parallel);
+		m_cameraPathTree.setParallelBuild(parallel);
+	}
+
+	/// Adapt the 1/p trial budgets of UPM merges online and/or play Russian roulette on them
+	inline void setTrialPolicy(bool adaptiveClamp, bool rouletteShoot) {
+		m_trialPolicy.configure(adaptiveClamp, rouletteShoot);
+	}
+
+	/// Discard what the trial policy has learned from earlier merges
+	inline void resetTrialPolicy() {
+		m_trialPolicy.reset();
+	}
+
+	/**
+	 * \brief Draw every light path of \ref gatherLightPathsUPM() from a
+	 * stream of its own
+	 *
+	 * Light path \c k then calls <tt>generate(Point2i(k, -1))</tt> on the
+	 * light path sampler and restores the sample index that the sampler had
+	 * when the gather started. With a counter-based sampler (\c philox),
+	 * the paths only depend on their index and on that sample index, e.g.
+	 * the iteration, instead of on all paths traced before them.
+	 */
+	inline void setLightPathStreams(bool enable) {
+		m_lightPathStreams = enable;
+	}
+
+	/**
+	 * \brief Trace the light paths of the following UPM iterations as a
+	 * slice of a set that is shared with other workers
+	 *
+	 * \ref gatherLightPathsUPM() then traces \c nsample paths of the
+	 * given round, publishes them and waits for the merge tree of the
+	 * round, which \ref sampleSplatsUPM() gathers from. Pass \c NULL to
+	 * switch back to a private set.
+	 */
+	inline void setSharedLightPaths(SharedLightPathStore *paths, const SharedLightPaths::Round &round) {
+		m_sharedLightPaths = paths;
+		m_lightPathRound = round;
+	}
+
+	/**
+	 * \brief Trace the light paths of a UPM iteration (and their light image
+	 * contributions) and build the merge tree
+	 *
+	 * \param nsample
+	 *    Number of light paths
+	 * \param cameraPathCount
+	 *    Number of camera paths that \ref sampleSplatsUPM() traces against
+	 *    these light paths, 0 for one per light path. Camera paths connect
+	 *    to light path <tt>cameraPathIndex % nsample</tt>, the light image
+	 *    and the MIS weights of its strategies account for the ratio.
+	 */
+	void gatherLightPathsUPM(const bool useVC, const bool useVM, const float gatherRadius, const int nsample, UPMWorkResult *wr, ImageBlock *batres = NULL, Float rejectionProb = 0.f,
+		size_t cameraPathCount = 0);
 	void sampleSplatsUPM(UPMWorkResult *wr, const float gatherRadius, const Point2i &offset, const size_t cameraPathIndex, SplatList &list, 
 		bool useVC = false, bool useVM = true, 
-		Float rejectionProb = 0.f, size_t clampThreshold = 100, bool useVCMPdf = false);
+		Float rejectionProb = 0.f, size_t clampThreshold = 100, bool useVCMPdf = false,
+		bool batchedShoot = false, bool shareShoot = false, size_t shareShootThreshold = 32);
+
+	/**
+	 * \brief Keep the deferred merges of many UPM camera paths in flight
+	 *
+	 * \ref sampleSplatsUPM() then queues the geometric trials of its
+	 * merges (except for shared ones) instead of running them per gather
+	 * point, and drains the queue in bulk once it holds \c capacity merges.
+	 * The splats of a drain are appended to the list of the camera path
+	 * that triggered it, each at the pixel of the camera path that made
+	 * the merge. \ref flushUPM() has to be called at the end of
+	 * every iteration. Pass 0 to disable the queue.
+	 */
+	inline void setMergeQueue(size_t capacity) {
+		m_mergeQueue.setCapacity(capacity);
+	}
+
+	/// Drain the merges that are still queued into \c list
+	void flushUPM(UPMWorkResult *wr, const float gatherRadius, SplatList &list, size_t clampThreshold = 100);
 
 	/// for Extended PSSMLT
 	void gatherCameraPathsUPM(const bool useVC, const bool useVM, const float gatherRadius);
@@ -764,6 +1106,9 @@ public:
 protected:
 	/// Virtual destructor
 	virtual ~PathSampler();
+
+	/// Run the trials of all queued merges and splat them into \c list
+	void drainMergeQueue(UPMWorkResult *wr, SplatList &list, Float gatherRadius, size_t clampThreshold);
 //protected:
 public: // temprorily open them for guided upm
 	ETechnique m_technique;
@@ -783,13 +1128,30 @@ public: // temprorily open them for guided upm
 	MemoryPool m_pool;
 
 	ref<Sampler> m_lightPathSampler; // independent sampler for photon and importon trace
+	bool m_lightPathStreams;
 
 	// VCM
 	size_t m_lightPathNum;	
+	Float m_lightTracingRatio;
 	LightPathTree m_lightPathTree;
-	std::vector<LightVertex> m_lightVertices;
-	std::vector<LightVertexExt> m_lightVerticesExt;
+	LightVertexStore m_lightVertices;
 	std::vector<size_t> m_lightPathEnds;
+	ref<SharedLightPathStore> m_sharedLightPaths;
+	SharedLightPaths::Round m_lightPathRound;
+
+	// UPM
+	GatherTrialBatch m_gatherTrials;
+	GatherTrialBatch m_sharedTrials;
+	GatherTrialPolicy m_trialPolicy;
+	MergeQueue m_mergeQueue;
+	/// Restricted domains of the camera direction merges of one gather point
+	std::vector<GatherDomain> m_mergeDomains;
+
+	// Deferred visibility (see Scene::hasOpaqueVisibility())
+	bool m_opaqueVisibility;
+	ShadowRayQueue m_shadowQueue;
+	std::vector<Spectrum> m_deferredValues;
+	std::vector<DeferredMerge> m_deferredMerges;
 
 	// EPSSMLT
 	LightPathTree m_cameraPathTree;
@@ -848,11 +1210,16 @@ struct PathSeed {
  */
 class SeedWorkUnit : public WorkUnit {
 public:
+	inline SeedWorkUnit() : m_iterationOffset(0), m_iterationCount(0), m_sequence(0) { }
+
 	inline void set(const WorkUnit *wu) {
 		m_id = static_cast<const SeedWorkUnit *>(wu)->m_id;
 		m_seed = static_cast<const SeedWorkUnit *>(wu)->m_seed;
 		m_timeout = static_cast<const SeedWorkUnit *>(wu)->m_timeout;
 		m_worknum = static_cast<const SeedWorkUnit *>(wu)->m_worknum;
+		m_iterationOffset = static_cast<const SeedWorkUnit *>(wu)->m_iterationOffset;
+		m_iterationCount = static_cast<const SeedWorkUnit *>(wu)->m_iterationCount;
+		m_sequence = static_cast<const SeedWorkUnit *>(wu)->m_sequence;
 	}	
 
 	inline const PathSeed &getSeed() const {
@@ -871,14 +1238,56 @@ public:
 		m_timeout = timeout;
 	}
 
+	/**
+	 * \brief Index of the first progressive iteration of this work unit
+	 *
+	 * Used by checkpointed renderers that split the iterations of one
+	 * progressive chain over several consecutive work units.
+	 */
+	inline size_t getIterationOffset() const {
+		return m_iterationOffset;
+	}
+
+	inline void setIterationOffset(size_t offset) {
+		m_iterationOffset = offset;
+	}
+
+	/// Number of iterations to run (0: until the sample count or timeout is reached)
+	inline size_t getIterationCount() const {
+		return m_iterationCount;
+	}
+
+	inline void setIterationCount(size_t count) {
+		m_iterationCount = count;
+	}
+
+	/// Position of the work unit in the order in which the process handed them out
+	inline size_t getSequence() const {
+		return m_sequence;
+	}
+
+	inline void setSequence(size_t sequence) {
+		m_sequence = sequence;
+	}
+
 	inline void load(Stream *stream) {
 		m_seed = PathSeed(stream);
 		m_timeout = stream->readSize();
+		m_id = stream->readInt();
+		m_worknum = stream->readInt();
+		m_iterationOffset = stream->readSize();
+		m_iterationCount = stream->readSize();
+		m_sequence = stream->readSize();
 	}
 
 	inline void save(Stream *stream) const {
 		m_seed.serialize(stream);
 		stream->writeSize(m_timeout);
+		stream->writeInt(m_id);
+		stream->writeInt(m_worknum);
+		stream->writeSize(m_iterationOffset);
+		stream->writeSize(m_iterationCount);
+		stream->writeSize(m_sequence);
 	}
 
 	inline std::string toString() const {
@@ -905,6 +1314,8 @@ private:
 	int m_worknum;
 	PathSeed m_seed;
 	size_t m_timeout;
+	size_t m_iterationOffset, m_iterationCount;
+	size_t m_sequence;
 };
 
 /**
@@ -0,0 +1,119 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_BIDIR_SHAREDPATHS_H_)
+#define __MITSUBA_BIDIR_SHAREDPATHS_H_
+
+#include <mitsuba/bidir/common.h>
+#include <mitsuba/core/lock.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Light paths of a vertex merging iteration that all workers
+ * of a machine trace and merge against together
+ *
+ * Without this class, every worker of a UPM/VCM process traces the
+ * whole light path budget of an iteration and merges its camera paths
+ * only with these. With it, the workers proceed in \a rounds instead:
+ * every worker of a round traces its own \a slice of
+ * <tt>ceil(budget / sliceCount)</tt> light paths, the last one to \ref publish() its slice builds a single merge
+ * structure over all slices of the round (\ref build()), and all of
+ * them then merge their camera paths against it read-only. A slice
+ * stays owned by its worker and must not change until \ref finish()
+ * has returned.
+ *
+ * Workers can join and leave between rounds; the number of slices of
+ * a round is fixed when it starts. A worker that joined has to keep
+ * calling \ref publish() and \ref finish() until it leaves, otherwise
+ * the other workers of its round wait forever.
+ *
+ * Instances are registered as scheduler resources. Remote nodes receive
+ * an empty copy, so every machine shares the light paths among its own
+ * workers.
+ *
+ * \ingroup libbidir
+ */
+class MTS_EXPORT_BIDIR SharedLightPaths : public SerializableObject {
+public:
+	/// Part of a worker in a round
+	struct Round {
+		/// Slice traced by the worker
+		int slice;
+		/// Number of slices (= workers) of the round
+		int sliceCount;
+		/// Number of slices traced in all earlier rounds
+		uint64_t firstSlice;
+	};
+
+	/// Register for the next round and wait until it starts
+	void join(Round &round);
+
+	/**
+	 * \brief Wait until all workers of the round are done with their merges
+	 *
+	 * \param round
+	 *    Round of the worker, replaced by the next one when \c more is set
+	 * \param more
+	 *    Does the worker take part in the next round?
+	 */
+	void finish(Round &round, bool more);
+
+	void serialize(Stream *stream, InstanceManager *manager) const;
+
+	MTS_DECLARE_CLASS()
+protected:
+	SharedLightPaths();
+
+	/// Unserialize an empty instance
+	SharedLightPaths(Stream *stream, InstanceManager *manager);
+
+	/// Virtual destructor
+	virtual ~SharedLightPaths();
+
+	/**
+	 * \brief Wait until all slices of the round have been published and
+	 * the merge structure has been built
+	 *
+	 * Subclasses store the slice of the worker before calling this.
+	 */
+	void publish(const Round &round);
+
+	/// Prepare the storage for the slices of a new round (called with the lock held)
+	virtual void beginRound(int sliceCount) = 0;
+
+	/// Build the merge structure of the round, called by the last worker that publishes
+	virtual void build(int sliceCount) = 0;
+private:
+	/// Add the caller to the next round and wait until it starts (with the lock held)
+	void enroll(Round &round);
+
+	/// Start a round with the registered workers (with the lock held)
+	void startRound();
+private:
+	ref<Mutex> m_mutex;
+	ref<ConditionVariable> m_cond;
+	uint64_t m_generation, m_tracedSlices;
+	int m_sliceCount, m_registered, m_published, m_finished;
+	bool m_active, m_built;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_BIDIR_SHAREDPATHS_H_ */
@@ -911,12 +911,44 @@ struct MTS_EXPORT_BIDIR PathVertex {
 		return !operator==(vertex);
 	}
 
-	/// For UPM
-	Float gatherAreaPdf(Point p, Float radius, PathVertex* pPred, std::vector<Float> &componentProbs, std::vector<Vector4> &componentBounds);
+	/**
+	 * \brief Compute the restricted sampling domain of a UPM vertex merge
+	 *
+	 * Replaces the contents of \c domain with the set of directions from
+	 * this vertex that can reach the disk of the given radius around \c p
+	 * and returns the probability of that set under unrestricted sampling.
+	 * The domain is meant to be computed once per merge and then passed to
+	 * every trial of \ref sampleShoot().
+	 */
+	Float gatherAreaPdf(Point p, Float radius, PathVertex* pPred, GatherDomain &domain);
+	/**
+	 * \brief Batched version of \ref gatherAreaPdf() for many gather disks
+	 *
+	 * Computes the domains towards the disks around <tt>p[0..count-1]</tt>
+	 * into <tt>*domains[i]</tt> and their probabilities into \c probs. The
+	 * shading frame and the incident direction are set up once for the whole
+	 * batch, which is handed to \ref BSDF::gatherAreaPdfBatch().
+	 */
+	void gatherAreaPdfBatch(const Point *p, size_t count, Float radius, const PathVertex *pPred,
+		GatherDomain * const *domains, Float *probs);
+	/// Shoot one restricted UPM geometric trial over a domain computed by \ref gatherAreaPdf()
 	bool sampleShoot(const Scene *scene, Sampler *sampler,
 		const PathVertex *pred, const PathEdge *predEdge, PathEdge *succEdge, PathVertex *succ,
 		ETransportMode mode, Point gatherPosition, Float gatherRadius,
-		std::vector<Float> componentProbs, std::vector<Vector4> componentBounds);
+		const GatherDomain &domain);
+	/**
+	 * \brief Sample the restricted direction of a UPM geometric trial
+	 * without tracing it
+	 *
+	 * This is the first half of \ref sampleShoot(). It allows callers to
+	 * collect the rays of many trials and intersect them as packets.
+	 *
+	 * \return \c false when no direction could be generated (the trial
+	 *     then counts as a miss)
+	 */
+	bool sampleShootRay(Sampler *sampler, const PathVertex *pred,
+		Point gatherPosition, Float gatherRadius,
+		const GatherDomain &domain, Ray &ray) const;
 
 	//! @}
 	/* ==================================================================== */
@@ -0,0 +1,350 @@
+/*
+	This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_CORE_HASHGRID_H_)
+#define __MITSUBA_CORE_HASHGRID_H_
+
+#include <mitsuba/core/aabb.h>
+#include <mitsuba/core/timer.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Hashed uniform grid for fixed-radius queries on point data
+ *
+ * This class is a drop-in alternative to \ref PointKDTree for the common
+ * case where all queries use (roughly) the same search radius, e.g. the
+ * vertex merging radius of a photon mapping iteration. Space is divided
+ * into cubical cells whose size should match that radius, and the cells
+ * are hashed into a table with one bucket per point.
+ *
+ * The construction is a linear-time counting sort: the nodes are reordered
+ * so that the points of each bucket are stored contiguously, and a table
+ * of bucket offsets is built on the side. A query with a radius equal to
+ * the cell size then only has to scan at most 3^d adjacent cells without
+ * any pointer chasing.
+ *
+ * Queries with larger radii are supported as well (they simply visit more
+ * cells), but k-nearest-neighbor searches are not.
+ *
+ * \tparam _NodeType Underlying node data structure. Any node that works
+ * with \ref PointKDTree (e.g. \ref SimpleKDNode) can be used; the tree
+ * related fields are ignored.
+ *
+ * \ingroup libcore
+ * \see PointKDTree
+ */
+template <typename _NodeType> class PointHashGrid {
+public:
+	typedef _NodeType                        NodeType;
+	typedef typename NodeType::PointType     PointType;
+	typedef typename NodeType::IndexType     IndexType;
+	typedef typename PointType::Scalar       Scalar;
+	typedef typename PointType::VectorType   VectorType;
+	typedef TAABB<PointType>                 AABBType;
+
+	/**
+	 * \brief Create an empty hash grid that can hold the specified
+	 * number of points
+	 *
+	 * \param cellSize
+	 *     Side length of a grid cell. When set to zero, a value is
+	 *     chosen based on the point density at build time.
+	 */
+	inline PointHashGrid(size_t nodes = 0, Float cellSize = 0)
+		: m_nodes(nodes), m_cellSize(cellSize), m_invCellSize(0),
+		  m_retainStorage(true) { }
+
+	// =============================================================
+	//! @{ \name \c stl::vector-like interface
+	// =============================================================
+	/// Clear the node array (keeps the allocated storage)
+	inline void clear() { m_nodes.clear(); m_aabb.reset(); m_bucketStart.clear(); }
+	/// Resize the node array
+	inline void resize(size_t size) { m_nodes.resize(size); }
+	/// Reserve a certain amount of memory for the node array
+	inline void reserve(size_t size) { m_nodes.reserve(size); }
+	/// Return the number of points
+	inline size_t size() const { return m_nodes.size(); }
+	/// Return the capacity of the node array
+	inline size_t capacity() const { return m_nodes.capacity(); }
+	/// Append a node to the node array
+	inline void push_back(const NodeType &node) {
+		m_nodes.push_back(node);
+		m_aabb.expandBy(node.getPosition());
+	}
+	/// Return one of the nodes by index
+	inline NodeType &operator[](size_t idx) { return m_nodes[idx]; }
+	/// Return one of the nodes by index (const version)
+	inline const NodeType &operator[](size_t idx) const { return m_nodes[idx]; }
+	//! @}
+	// =============================================================
+
+	/// Set the AABB of the underlying point data
+	inline void setAABB(const AABBType &aabb) { m_aabb = aabb; }
+	/// Return the AABB of the underlying point data
+	inline const AABBType &getAABB() const { return m_aabb; }
+
+	/**
+	 * \brief Set the side length of the grid cells used by the next
+	 * \ref build() (zero selects a value automatically)
+	 */
+	inline void setCellSize(Float cellSize) { m_cellSize = cellSize; }
+	/// Return the side length of the grid cells
+	inline Float getCellSize() const { return m_cellSize; }
+
+	/**
+	 * \brief Specify whether the temporary build storage should be kept
+	 * allocated until the next build (enabled by default)
+	 */
+	inline void setRetainStorage(bool retain) {
+		m_retainStorage = retain;
+		if (!retain) {
+			std::vector<IndexType>().swap(m_bucket);
+			std::vector<IndexType>().swap(m_order);
+		}
+	}
+	/// Return whether the temporary build storage is kept between builds
+	inline bool getRetainStorage() const { return m_retainStorage; }
+
+	/**
+	 * \brief Provided for interface compatibility with \ref PointKDTree
+	 *
+	 * The counting sort runs in linear time and is always done serially.
+	 */
+	inline void setParallelBuild(bool) { }
+	/// Provided for interface compatibility with \ref PointKDTree
+	inline bool getParallelBuild() const { return false; }
+
+	/// Build the bucket table
+	void build(bool recomputeAABB = false) {
+		ref<Timer> timer = new Timer();
+
+		if (m_nodes.size() == 0) {
+			SLog(EWarn, "build(): hash grid is empty!");
+			return;
+		}
+
+		if (recomputeAABB) {
+			m_aabb.reset();
+			for (size_t i=0; i<m_nodes.size(); ++i)
+				m_aabb.expandBy(m_nodes[i].getPosition());
+		}
+
+		Float cellSize = m_cellSize;
+		if (!(cellSize > 0)) {
+			/* Aim for about one point per cell */
+			Float extent = (Float) m_aabb.getExtents()[m_aabb.getLargestAxis()];
+			cellSize = extent / std::pow((Float) m_nodes.size(), (Float) 1 / (Float) PointType::dim);
+			if (!(cellSize > 0))
+				cellSize = 1;
+		}
+		m_invCellSize = 1 / cellSize;
+
+		for (int i=0; i<PointType::dim; ++i) {
+			Float cells = std::floor((Float) (m_aabb.max[i] - m_aabb.min[i]) * m_invCellSize);
+			m_resolution[i] = (int) std::min(cells, (Float) (1 << 20)) + 1;
+		}
+
+		/* One bucket per point, rounded up to a power of two */
+		size_t tableSize = 1;
+		while (tableSize < m_nodes.size())
+			tableSize *= 2;
+		m_hashMask = (uint32_t) (tableSize - 1);
+
+		/* Counting sort by bucket */
+		std::vector<IndexType> localBucket, localOrder;
+		std::vector<IndexType> &bucket = m_retainStorage ? m_bucket : localBucket;
+		std::vector<IndexType> &order = m_retainStorage ? m_order : localOrder;
+		bucket.resize(m_nodes.size());
+		order.resize(m_nodes.size());
+		m_bucketStart.assign(tableSize + 1, 0);
+
+		int cell[PointType::dim];
+		for (size_t i=0; i<m_nodes.size(); ++i) {
+			getCell(m_nodes[i].getPosition(), cell);
+			bucket[i] = hash(cell);
+			m_bucketStart[bucket[i] + 1]++;
+		}
+		for (size_t i=0; i<tableSize; ++i)
+			m_bucketStart[i + 1] += m_bucketStart[i];
+		for (size_t i=0; i<m_nodes.size(); ++i)
+			order[m_bucketStart[bucket[i]]++] = (IndexType) i;
+
+		/* The scatter pass shifted every offset by one bucket */
+		for (size_t i=tableSize; i>0; --i)
+			m_bucketStart[i] = m_bucketStart[i - 1];
+		m_bucketStart[0] = 0;
+
+		permute_inplace(&m_nodes[0], order);
+
+		SLog(EDebug, "Built a %i-dimensional hash grid over " SIZE_T_FMT " data points "
+			"(cell size %f, " SIZE_T_FMT " buckets) in %i ms", PointType::dim, m_nodes.size(),
+			cellSize, tableSize, timer->getMilliseconds());
+	}
+
+	/**
+	 * \brief Execute a search query and run the specified functor on them
+	 *
+	 * The functor must have an operator() implementation, which accepts
+	 * a constant reference to a \a NodeType as its argument.
+	 *
+	 * \param p Search position
+	 * \param functor Functor to be called on each search result
+	 * \param searchRadius  Search radius
+	 * \return The number of functor invocations
+	 */
+	template <typename Functor> size_t executeQuery(const PointType &p,
+			Float searchRadius, Functor &functor) const {
+		NodeFunctor<Functor> nodeFunctor(m_nodes, functor);
+		return query(p, searchRadius, nodeFunctor);
+	}
+
+	/**
+	 * \brief Run a search query
+	 *
+	 * \param p Search position
+	 * \param results Index list of search results
+	 * \param searchRadius  Search radius
+	 * \return The number of search results
+	 */
+	size_t search(const PointType &p, Float searchRadius, std::vector<IndexType> &results) const {
+		IndexCollector collector(results);
+		return query(p, searchRadius, collector);
+	}
+
+protected:
+	/// Adapter that passes the node instead of its index to a functor
+	template <typename Functor> struct NodeFunctor {
+		inline NodeFunctor(const std::vector<NodeType> &nodes, Functor &functor)
+			: m_nodes(nodes), m_functor(functor) { }
+		inline void operator()(IndexType index) { m_functor(m_nodes[index]); }
+	private:
+		const std::vector<NodeType> &m_nodes;
+		Functor &m_functor;
+	};
+
+	/// Appends the node indices to a list
+	struct IndexCollector {
+		inline IndexCollector(std::vector<IndexType> &results) : m_results(results) { }
+		inline void operator()(IndexType index) { m_results.push_back(index); }
+	private:
+		std::vector<IndexType> &m_results;
+	};
+
+	/// Return the (clamped) grid cell of a point
+	inline void getCell(const PointType &p, int *cell) const {
+		for (int i=0; i<PointType::dim; ++i) {
+			Float c = std::floor((Float) (p[i] - m_aabb.min[i]) * m_invCellSize);
+			cell[i] = (int) std::max((Float) 0, std::min(c, (Float) (m_resolution[i] - 1)));
+		}
+	}
+
+	/// Spatial hash of a grid cell [Teschner et al. 2003]
+	inline uint32_t hash(const int *cell) const {
+		static const uint32_t primes[4] = { 73856093u, 19349663u, 83492791u, 2654435761u };
+		uint32_t value = 0;
+		for (int i=0; i<PointType::dim; ++i)
+			value ^= (uint32_t) cell[i] * primes[i & 3];
+		return value & m_hashMask;
+	}
+
+	/// Visit all points within \c searchRadius of \c p
+	template <typename Visitor> size_t query(const PointType &p,
+			Float searchRadius, Visitor &visitor) const {
+		if (m_bucketStart.empty())
+			return 0;
+
+		const Float distSquared = searchRadius * searchRadius;
+		int lo[PointType::dim], hi[PointType::dim], cell[PointType::dim], nodeCell[PointType::dim];
+		size_t cellCount = 1, found = 0;
+
+		for (int i=0; i<PointType::dim; ++i) {
+			Float rel = (Float) (p[i] - m_aabb.min[i]) * m_invCellSize,
+			      rad = searchRadius * m_invCellSize;
+			Float fLo = std::floor(rel - rad), fHi = std::floor(rel + rad),
+			      fMax = (Float) (m_resolution[i] - 1);
+			/* Points outside of the AABB were clamped to the boundary cells */
+			lo[i] = (int) std::max((Float) 0, std::min(fLo, fMax));
+			hi[i] = (int) std::max((Float) 0, std::min(fHi, fMax));
+			cellCount *= (size_t) (hi[i] - lo[i] + 1);
+		}
+
+		if (cellCount > m_bucketStart.size()) {
+			/* The query covers more cells than there are buckets */
+			for (size_t i=0; i<m_nodes.size(); ++i) {
+				if ((m_nodes[i].getPosition() - p).lengthSquared() < distSquared) {
+					visitor((IndexType) i);
+					++found;
+				}
+			}
+			return found;
+		}
+
+		for (int i=0; i<PointType::dim; ++i)
+			cell[i] = lo[i];
+
+		while (true) {
+			uint32_t bucket = hash(cell);
+			for (IndexType i=m_bucketStart[bucket]; i<m_bucketStart[bucket+1]; ++i) {
+				const PointType &pos = m_nodes[i].getPosition();
+				if ((pos - p).lengthSquared() >= distSquared)
+					continue;
+
+				/* Several cells of the query can share a bucket -- only
+				   report points that actually belong to the current cell */
+				getCell(pos, nodeCell);
+				bool sameCell = true;
+				for (int j=0; j<PointType::dim; ++j)
+					sameCell &= nodeCell[j] == cell[j];
+				if (!sameCell)
+					continue;
+
+				visitor(i);
+				++found;
+			}
+
+			/* Advance to the next cell */
+			int axis = 0;
+			while (axis < PointType::dim && cell[axis] == hi[axis]) {
+				cell[axis] = lo[axis];
+				++axis;
+			}
+			if (axis == PointType::dim)
+				break;
+			++cell[axis];
+		}
+
+		return found;
+	}
+
+	std::vector<NodeType> m_nodes;
+	std::vector<IndexType> m_bucketStart;
+	AABBType m_aabb;
+	Float m_cellSize, m_invCellSize;
+	int m_resolution[PointType::dim];
+	uint32_t m_hashMask;
+	bool m_retainStorage;
+	std::vector<IndexType> m_bucket;
+	std::vector<IndexType> m_order;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_CORE_HASHGRID_H_ */
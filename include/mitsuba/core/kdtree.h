@@ -22,6 +22,13 @@
 
 #include <mitsuba/core/aabb.h>
 #include <mitsuba/core/timer.h>
+#include <mitsuba/core/thread.h>
+
+/// Point kd-trees with fewer nodes are always built serially
+#define MTS_POINTKD_PARALLEL_MIN_SIZE 32768
+
+/// Number of deferred subtrees per core in a parallel point kd-tree build
+#define MTS_POINTKD_TASKS_PER_CORE 8
 
 MTS_NAMESPACE_BEGIN
 
@@ -208,6 +215,11 @@ template <typename _PointType, typename _DataRecord> struct LeftBalancedKDNode {
  * have some kind of spatial extent, the classes \ref GenericKDTree and
  * \ref ShapeKDTree will be more appropriate.
  *
+ * For point sets that are rebuilt very frequently (e.g. the light vertices
+ * of every iteration of a bidirectional renderer), the construction can be
+ * parallelized (\ref setParallelBuild()) and the temporary build storage
+ * can be kept around between builds (\ref setRetainStorage()).
+ *
  * \tparam _NodeType Underlying node data structure. See \ref SimpleKDNode as
  * an example for the required public interface
  *
@@ -286,12 +298,18 @@ public:
 	 * number of points
 	 */
 	inline PointKDTree(size_t nodes = 0, EHeuristic heuristic = ESlidingMidpoint)
-		: m_nodes(nodes), m_heuristic(heuristic), m_depth(0) { }
+		: m_nodes(nodes), m_heuristic(heuristic), m_depth(0),
+		  m_parallelBuild(false), m_retainStorage(false) { }
 
 	// =============================================================
 	//! @{ \name \c stl::vector-like interface
 	// =============================================================
-	/// Clear the kd-tree array
+	/**
+	 * \brief Clear the kd-tree array
+	 *
+	 * The node storage itself stays allocated, hence refilling the
+	 * tree with a similar number of points does not reallocate.
+	 */
 	inline void clear() { m_nodes.clear(); m_aabb.reset(); }
 	/// Resize the kd-tree array
 	inline void resize(size_t size) { m_nodes.resize(size); }
@@ -322,6 +340,37 @@ public:
 	/// Set the depth of the constructed KD-tree (be careful with this)
 	inline void setDepth(size_t depth) { m_depth = depth; }
 
+	/**
+	 * \brief Specify whether or not the tree should be built in parallel
+	 *
+	 * When enabled, the upper levels of the tree are constructed
+	 * serially until there are enough independent subtrees to keep all
+	 * cores busy. The subtrees are then built by the calling thread and
+	 * the process-wide \ref ThreadPool, which is shared by all trees that
+	 * are built at the same time. The resulting tree is identical to the
+	 * serially constructed one.
+	 */
+	inline void setParallelBuild(bool parallel) { m_parallelBuild = parallel; }
+	/// Return whether or not the tree is built in parallel
+	inline bool getParallelBuild() const { return m_parallelBuild; }
+
+	/**
+	 * \brief Specify whether the temporary storage used by \ref build()
+	 * should be kept allocated until the next build
+	 *
+	 * This avoids reallocating the indirection tables when the tree is
+	 * cleared and rebuilt over and over (e.g. once per iteration).
+	 */
+	inline void setRetainStorage(bool retain) {
+		m_retainStorage = retain;
+		if (!retain) {
+			std::vector<IndexType>().swap(m_indirection);
+			std::vector<IndexType>().swap(m_permutation);
+		}
+	}
+	/// Return whether the temporary build storage is kept between builds
+	inline bool getRetainStorage() const { return m_retainStorage; }
+
 	/// Construct the KD-tree hierarchy
 	void build(bool recomputeAABB = false) {
 		ref<Timer> timer = new Timer();
@@ -347,34 +396,54 @@ public:
 		   an indirection table initially. Once the tree construction
 		   is done, this table will contain a indirection that can then
 		   be applied to the data in one pass */
-		std::vector<IndexType> indirection(m_nodes.size());
+		std::vector<IndexType> localIndirection, localPermutation;
+		std::vector<IndexType> &indirection = m_retainStorage ? m_indirection : localIndirection;
+		std::vector<IndexType> &permutation = m_retainStorage ? m_permutation : localPermutation;
+		indirection.resize(m_nodes.size());
 		for (size_t i=0; i<m_nodes.size(); ++i)
 			indirection[i] = (IndexType) i;
+		if (NodeType::leftBalancedLayout)
+			permutation.resize(m_nodes.size());
+
+		/* Build the upper levels of the tree, and possibly defer
+		   subtrees to the helper threads */
+		std::vector<BuildTask> tasks;
+		BuildContext ctx(indirection.begin(), permutation);
+		ThreadPool *pool = m_parallelBuild ? ThreadPool::getInstance() : NULL;
+		size_t threadCount = pool ? pool->getThreadCount() + 1 : 1;
+		if (threadCount > 1 && m_nodes.size() >= MTS_POINTKD_PARALLEL_MIN_SIZE) {
+			ctx.tasks = &tasks;
+			ctx.grainSize = std::max(m_nodes.size() / (MTS_POINTKD_TASKS_PER_CORE * threadCount),
+				(size_t) MTS_POINTKD_PARALLEL_MIN_SIZE / 4);
+		}
 
-		m_depth = 0;
-		int constructionTime;
-		if (NodeType::leftBalancedLayout) {
-			std::vector<IndexType> permutation(m_nodes.size());
-			buildLB(0, 1, indirection.begin(), indirection.begin(),
-				indirection.end(), permutation);
-			constructionTime = timer->getMilliseconds();
-			timer->reset();
+		AABBType aabb(m_aabb);
+		if (NodeType::leftBalancedLayout)
+			buildLB(ctx, 0, 1, aabb, indirection.begin(), indirection.end());
+		else
+			build(ctx, 1, aabb, indirection.begin(), indirection.end());
+
+		m_depth = ctx.depth;
+		if (!tasks.empty())
+			buildSubtrees(ctx, tasks, pool);
+
+		int constructionTime = timer->getMilliseconds();
+		timer->reset();
+		if (NodeType::leftBalancedLayout)
 			permute_inplace(&m_nodes[0], permutation);
-		} else {
-			build(1, indirection.begin(), indirection.begin(), indirection.end());
-			constructionTime = timer->getMilliseconds();
-			timer->reset();
+		else
 			permute_inplace(&m_nodes[0], indirection);
-		}
 
 		int permutationTime = timer->getMilliseconds();
 
 		if (recomputeAABB)
-			SLog(EDebug, "Done after %i ms (breakdown: aabb: %i ms, build: %i ms, permute: %i ms). ",
-				aabbTime + constructionTime + permutationTime, aabbTime, constructionTime, permutationTime);
+			SLog(EDebug, "Done after %i ms (breakdown: aabb: %i ms, build: %i ms, permute: %i ms, "
+				SIZE_T_FMT " parallel subtrees). ", aabbTime + constructionTime + permutationTime,
+				aabbTime, constructionTime, permutationTime, tasks.size());
 		else
-			SLog(EDebug, "Done after %i ms (breakdown: build: %i ms, permute: %i ms). ",
-				constructionTime + permutationTime, constructionTime, permutationTime);
+			SLog(EDebug, "Done after %i ms (breakdown: build: %i ms, permute: %i ms, "
+				SIZE_T_FMT " parallel subtrees). ", constructionTime + permutationTime,
+				constructionTime, permutationTime, tasks.size());
 	}
 
 	/**
@@ -873,60 +942,143 @@ protected:
 		return p - 1;
 	}
 
-	/// Left-balanced tree construction routine
-	void buildLB(IndexType idx, size_t depth,
-			  typename std::vector<IndexType>::iterator base,
-			  typename std::vector<IndexType>::iterator rangeStart,
-			  typename std::vector<IndexType>::iterator rangeEnd,
-			  typename std::vector<IndexType> &permutation) {
-		m_depth = std::max(depth, m_depth);
+	typedef typename std::vector<IndexType>::iterator IndexIterator;
 
+	/// A subtree whose construction was deferred to the helper threads
+	struct BuildTask {
+		IndexType idx;
+		size_t depth;
+		AABBType aabb;
+		IndexIterator rangeStart, rangeEnd;
+
+		inline BuildTask(IndexType idx, size_t depth, const AABBType &aabb,
+				IndexIterator rangeStart, IndexIterator rangeEnd)
+			: idx(idx), depth(depth), aabb(aabb),
+			  rangeStart(rangeStart), rangeEnd(rangeEnd) { }
+	};
+
+	/// Per-thread state of the tree construction
+	struct BuildContext {
+		IndexIterator base;
+		std::vector<IndexType> &permutation;
+		/// Subtrees with at most \c grainSize points are deferred to this list (if not \c NULL)
+		std::vector<BuildTask> *tasks;
+		size_t grainSize;
+		/// Maximum depth reached so far
+		size_t depth;
+
+		inline BuildContext(IndexIterator base, std::vector<IndexType> &permutation)
+			: base(base), permutation(permutation), tasks(NULL), grainSize(0), depth(0) { }
+	};
+
+	/// Builds the deferred subtrees on the threads of the \ref ThreadPool
+	class SubtreeLoop : public ThreadPool::Loop {
+	public:
+		SubtreeLoop(PointKDTree *parent, const BuildContext &ctx,
+				const std::vector<BuildTask> &tasks, std::vector<size_t> &depths)
+			: m_parent(parent), m_context(ctx), m_tasks(tasks), m_depths(depths) { }
+
+		void run(size_t i) {
+			BuildContext ctx(m_context);
+			const BuildTask &task = m_tasks[i];
+			AABBType aabb(task.aabb);
+			if (NodeType::leftBalancedLayout)
+				m_parent->buildLB(ctx, task.idx, task.depth, aabb, task.rangeStart, task.rangeEnd);
+			else
+				m_parent->build(ctx, task.depth, aabb, task.rangeStart, task.rangeEnd);
+			m_depths[i] = ctx.depth;
+		}
+
+	private:
+		PointKDTree *m_parent;
+		const BuildContext &m_context;
+		const std::vector<BuildTask> &m_tasks;
+		std::vector<size_t> &m_depths;
+	};
+
+	/**
+	 * \brief Build the deferred subtrees using the calling thread
+	 * and the process-wide \ref ThreadPool
+	 *
+	 * The pool is shared by all trees, so concurrent builds (e.g. one per
+	 * scheduler worker) do not start more threads than there are cores.
+	 * The subtrees cover disjoint ranges of the indirection table (and
+	 * of the permutation in the left-balanced case), hence no further
+	 * synchronization is needed.
+	 */
+	void buildSubtrees(const BuildContext &parentCtx, const std::vector<BuildTask> &tasks,
+			ThreadPool *pool) {
+		BuildContext ctx(parentCtx);
+		ctx.tasks = NULL;
+		ctx.depth = 0;
+
+		std::vector<size_t> depths(tasks.size(), 0);
+		SubtreeLoop loop(this, ctx, tasks, depths);
+		pool->run(&loop, tasks.size());
+
+		for (size_t i=0; i<depths.size(); ++i)
+			m_depth = std::max(m_depth, depths[i]);
+	}
+
+	/// Left-balanced tree construction routine
+	void buildLB(BuildContext &ctx, IndexType idx, size_t depth, AABBType &aabb,
+			  IndexIterator rangeStart, IndexIterator rangeEnd) {
 		IndexType count = (IndexType) (rangeEnd-rangeStart);
 		SAssert(count > 0);
 
+		if (ctx.tasks && count <= ctx.grainSize) {
+			ctx.tasks->push_back(BuildTask(idx, depth, aabb, rangeStart, rangeEnd));
+			return;
+		}
+
+		ctx.depth = std::max(depth, ctx.depth);
+
 		if (count == 1) {
 			/* Create a leaf node */
 			m_nodes[*rangeStart].setLeaf(true);
-			permutation[idx] = *rangeStart;
+			ctx.permutation[idx] = *rangeStart;
 			return;
 		}
 
-		typename std::vector<IndexType>::iterator split
-			= rangeStart + leftSubtreeSize(count);
-		int axis = m_aabb.getLargestAxis();
+		IndexIterator split = rangeStart + leftSubtreeSize(count);
+		int axis = aabb.getLargestAxis();
 		std::nth_element(rangeStart, split, rangeEnd,
 			CoordinateOrdering(m_nodes, axis));
 
 		NodeType &splitNode = m_nodes[*split];
 		splitNode.setAxis(axis);
 		splitNode.setLeaf(false);
-		permutation[idx] = *split;
+		ctx.permutation[idx] = *split;
 
 		/* Recursively build the children */
-		Scalar temp = m_aabb.max[axis],
+		Scalar temp = aabb.max[axis],
 			splitPos = splitNode.getPosition()[axis];
-		m_aabb.max[axis] = splitPos;
-		buildLB(2*idx+1, depth+1, base, rangeStart, split, permutation);
-		m_aabb.max[axis] = temp;
+		aabb.max[axis] = splitPos;
+		buildLB(ctx, 2*idx+1, depth+1, aabb, rangeStart, split);
+		aabb.max[axis] = temp;
 
 		if (split+1 != rangeEnd) {
-			temp = m_aabb.min[axis];
-			m_aabb.min[axis] = splitPos;
-			buildLB(2*idx+2, depth+1, base, split+1, rangeEnd, permutation);
-			m_aabb.min[axis] = temp;
+			temp = aabb.min[axis];
+			aabb.min[axis] = splitPos;
+			buildLB(ctx, 2*idx+2, depth+1, aabb, split+1, rangeEnd);
+			aabb.min[axis] = temp;
 		}
 	}
 
 	/// Default tree construction routine
-	void build(size_t depth,
-			  typename std::vector<IndexType>::iterator base,
-			  typename std::vector<IndexType>::iterator rangeStart,
-			  typename std::vector<IndexType>::iterator rangeEnd) {
-		m_depth = std::max(depth, m_depth);
-
+	void build(BuildContext &ctx, size_t depth, AABBType &aabb,
+			  IndexIterator rangeStart, IndexIterator rangeEnd) {
 		IndexType count = (IndexType) (rangeEnd-rangeStart);
 		SAssert(count > 0);
 
+		if (ctx.tasks && count <= ctx.grainSize) {
+			ctx.tasks->push_back(BuildTask(0, depth, aabb, rangeStart, rangeEnd));
+			return;
+		}
+
+		ctx.depth = std::max(depth, ctx.depth);
+		IndexIterator base = ctx.base;
+
 		if (count == 1) {
 			/* Create a leaf node */
 			m_nodes[*rangeStart].setLeaf(true);
@@ -934,12 +1086,12 @@ protected:
 		}
 
 		int axis = 0;
-		typename std::vector<IndexType>::iterator split;
+		IndexIterator split;
 
 		switch (m_heuristic) {
 			case EBalanced: {
 					split = rangeStart + count/2;
-					axis = m_aabb.getLargestAxis();
+					axis = aabb.getLargestAxis();
 					std::nth_element(rangeStart, split, rangeEnd,
 						CoordinateOrdering(m_nodes, axis));
 				};
@@ -947,7 +1099,7 @@ protected:
 
 			case ELeftBalanced: {
 					split = rangeStart + leftSubtreeSize(count);
-					axis = m_aabb.getLargestAxis();
+					axis = aabb.getLargestAxis();
 					std::nth_element(rangeStart, split, rangeEnd,
 						CoordinateOrdering(m_nodes, axis));
 				};
@@ -955,10 +1107,10 @@ protected:
 
 			case ESlidingMidpoint: {
 					/* Sliding midpoint rule: find a split that is close to the spatial median */
-					axis = m_aabb.getLargestAxis();
+					axis = aabb.getLargestAxis();
 
 					Scalar midpoint = (Scalar) 0.5f
-						* (m_aabb.max[axis]+m_aabb.min[axis]);
+						* (aabb.max[axis]+aabb.min[axis]);
 
 					size_t nLT = std::count_if(rangeStart, rangeEnd,
 							LessThanOrEqual(m_nodes, axis, midpoint));
@@ -984,10 +1136,9 @@ protected:
 							CoordinateOrdering(m_nodes, dim));
 
 						size_t numLeft = 1, numRight = count-2;
-						AABBType leftAABB(m_aabb), rightAABB(m_aabb);
-						Float invVolume = 1.0f / m_aabb.getVolume();
-						for (typename std::vector<IndexType>::iterator it = rangeStart+1;
-								it != rangeEnd; ++it) {
+						AABBType leftAABB(aabb), rightAABB(aabb);
+						Float invVolume = 1.0f / aabb.getVolume();
+						for (IndexIterator it = rangeStart+1; it != rangeEnd; ++it) {
 							++numLeft; --numRight;
 							Float pos = m_nodes[*it].getPosition()[dim];
 							leftAABB.max[dim] = rightAABB.min[dim] = pos;
@@ -1022,17 +1173,17 @@ protected:
 		std::iter_swap(rangeStart, split);
 
 		/* Recursively build the children */
-		Scalar temp = m_aabb.max[axis],
+		Scalar temp = aabb.max[axis],
 			splitPos = splitNode.getPosition()[axis];
-		m_aabb.max[axis] = splitPos;
-		build(depth+1, base, rangeStart+1, split+1);
-		m_aabb.max[axis] = temp;
+		aabb.max[axis] = splitPos;
+		build(ctx, depth+1, aabb, rangeStart+1, split+1);
+		aabb.max[axis] = temp;
 
 		if (split+1 != rangeEnd) {
-			temp = m_aabb.min[axis];
-			m_aabb.min[axis] = splitPos;
-			build(depth+1, base, split+1, rangeEnd);
-			m_aabb.min[axis] = temp;
+			temp = aabb.min[axis];
+			aabb.min[axis] = splitPos;
+			build(ctx, depth+1, aabb, split+1, rangeEnd);
+			aabb.min[axis] = temp;
 		}
 	}
 protected:
@@ -1040,6 +1191,10 @@ protected:
 	AABBType m_aabb;
 	EHeuristic m_heuristic;
 	size_t m_depth;
+	bool m_parallelBuild;
+	bool m_retainStorage;
+	std::vector<IndexType> m_indirection;
+	std::vector<IndexType> m_permutation;
 };
 
 MTS_NAMESPACE_END
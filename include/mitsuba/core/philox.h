@@ -0,0 +1,144 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_CORE_PHILOX_H_)
+#define __MITSUBA_CORE_PHILOX_H_
+
+#include <mitsuba/mitsuba.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Philox4x32-10 counter-based pseudorandom number generator
+ *
+ * Unlike \ref Random, this generator has no state that evolves from
+ * one number to the next: the numbers are a keyed bijection of a
+ * 128 bit counter (Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3", SC 2011). Any stream can therefore be reached in constant
+ * time with \ref seek(), which makes it possible to assign streams to
+ * units of work (e.g. pixels or light paths) instead of threads.
+ *
+ * A stream is identified by the 64 bit key and the three upper words
+ * of the counter. The lowest word counts blocks of four numbers, i.e.
+ * every stream holds 2^34 numbers.
+ *
+ * \ingroup libcore
+ */
+class Philox {
+public:
+	/// Create a generator with the given key, positioned at the stream (0, 0, 0)
+	inline explicit Philox(uint64_t key = 0) {
+		setKey(key);
+		seek(0, 0, 0);
+	}
+
+	/// Set the key (e.g. a user-specified seed); keeps the counter
+	inline void setKey(uint64_t key) {
+		m_key[0] = (uint32_t) key;
+		m_key[1] = (uint32_t) (key >> 32);
+		m_index = 4;
+	}
+
+	/// Return the key
+	inline uint64_t getKey() const {
+		return ((uint64_t) m_key[1] << 32) | m_key[0];
+	}
+
+	/// Move to the beginning of the stream identified by three counter words
+	inline void seek(uint32_t c0, uint32_t c1, uint32_t c2) {
+		m_counter[0] = 0;
+		m_counter[1] = c0;
+		m_counter[2] = c1;
+		m_counter[3] = c2;
+		m_index = 4;
+	}
+
+	/// Return a uniformly distributed 32 bit integer
+	inline uint32_t nextUInt() {
+		if (m_index == 4) {
+			bijection(m_counter, m_key, m_block);
+			++m_counter[0];
+			m_index = 0;
+		}
+		return m_block[m_index++];
+	}
+
+	/// Return a uniformly distributed 64 bit integer
+	inline uint64_t nextULong() {
+		uint64_t lo = nextUInt();
+		return lo | ((uint64_t) nextUInt() << 32);
+	}
+
+#if defined(DOUBLE_PRECISION)
+	/// Return a floating point value on the interval [0, 1)
+	inline Float nextFloat() {
+		/* Same conversion as Random::nextFloat() */
+		union {
+			uint64_t u;
+			double d;
+		} x;
+		x.u = (nextULong() >> 12) | 0x3ff0000000000000ULL;
+		return x.d - 1.0;
+	}
+#else
+	/// Return a floating point value on the interval [0, 1)
+	inline Float nextFloat() {
+		/* Same conversion as Random::nextFloat() */
+		union {
+			uint32_t u;
+			float f;
+		} x;
+		x.u = (nextUInt() >> 9) | 0x3f800000UL;
+		return x.f - 1.0f;
+	}
+#endif
+
+	/// Apply the ten rounds of Philox4x32 to a counter
+	static inline void bijection(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]) {
+		uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+		uint32_t k0 = key[0], k1 = key[1];
+
+		for (int round = 0; round < 10; ++round) {
+			if (round > 0) {
+				k0 += 0x9E3779B9U;
+				k1 += 0xBB67AE85U;
+			}
+			uint64_t p0 = (uint64_t) 0xD2511F53U * c0;
+			uint64_t p1 = (uint64_t) 0xCD9E8D57U * c2;
+			uint32_t hi0 = (uint32_t) (p0 >> 32), lo0 = (uint32_t) p0;
+			uint32_t hi1 = (uint32_t) (p1 >> 32), lo1 = (uint32_t) p1;
+			c0 = hi1 ^ c1 ^ k0;
+			c1 = lo1;
+			c2 = hi0 ^ c3 ^ k1;
+			c3 = lo0;
+		}
+
+		result[0] = c0; result[1] = c1;
+		result[2] = c2; result[3] = c3;
+	}
+private:
+	uint32_t m_counter[4];
+	uint32_t m_key[2];
+	uint32_t m_block[4];
+	int m_index;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_CORE_PHILOX_H_ */
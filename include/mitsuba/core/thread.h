@@ -22,6 +22,7 @@
 
 #include <mitsuba/mitsuba.h>
 #include <boost/scoped_ptr.hpp>
+#include <deque>
 
 MTS_NAMESPACE_BEGIN
 
@@ -196,6 +197,90 @@ private:
 	boost::scoped_ptr<ThreadPrivate> d;
 };
 
+/**
+ * \brief Process-wide pool of helper threads for fine-grained parallel loops
+ *
+ * Some data structures are rebuilt from inside of the scheduler's workers
+ * (e.g. \ref PointKDTree), where submitting a \ref ParallelProcess would
+ * dead-lock. Starting a set of threads for every such build oversubscribes
+ * the machine as soon as all workers build at the same time, so they share
+ * the <tt>getCoreCount()-1</tt> threads of this pool instead. The threads
+ * are started on first use. The calling thread always works on its own
+ * loop as well, hence a loop finishes even if all helpers are busy with
+ * the loops of other threads.
+ *
+ * \ingroup libcore
+ */
+class MTS_EXPORT_CORE ThreadPool : public Object {
+public:
+	/// Body of a parallel loop
+	class Loop {
+	public:
+		/// Run the iteration with the given index
+		virtual void run(size_t index) = 0;
+	protected:
+		virtual ~Loop() { }
+	};
+
+	/**
+	 * \brief Call <tt>loop->run(i)</tt> for every \c i in <tt>[0, count)</tt>
+	 * and wait until all calls have finished
+	 *
+	 * The iterations may run concurrently and in any order. If one of
+	 * them throws an exception, it is reported as an error once all
+	 * iterations finished.
+	 */
+	void run(Loop *loop, size_t count);
+
+	/// Return the number of helper threads (not counting the calling thread)
+	inline size_t getThreadCount() const { return m_threadCount; }
+
+	/// Return the process-wide pool (or \c NULL before \ref Thread::staticInitialization())
+	inline static ThreadPool *getInstance() { return m_instance; }
+
+	/// Create the process-wide pool, called by \ref Thread::staticInitialization()
+	static void staticInitialization();
+
+	/// Stop the helper threads, called by \ref Thread::staticShutdown()
+	static void staticShutdown();
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// A loop that was submitted by \ref run()
+	struct Job {
+		Loop *loop;
+		size_t count, next, done;
+		/// Message of the first exception thrown by an iteration
+		std::string error;
+	};
+
+	ThreadPool(size_t threadCount);
+
+	/// Virtual destructor
+	virtual ~ThreadPool();
+
+	/// Run iterations of the submitted loops until the pool is stopped
+	void work();
+
+	/// Claim the next iteration of a job (the lock must be held)
+	size_t claim(Job *job);
+
+	/// Mark an iteration of a job as finished (the lock must be held)
+	void finish(Job *job);
+
+	/// Run an iteration of a job and record any exception (the lock must not be held)
+	void execute(Job *job, size_t index);
+private:
+	class Helper;
+	static ref<ThreadPool> m_instance;
+	ref<Mutex> m_mutex;
+	ref<ConditionVariable> m_workCond, m_doneCond;
+	std::deque<Job *> m_jobs;
+	std::vector<ref<Thread> > m_threads;
+	size_t m_threadCount;
+	bool m_running;
+};
+
 #if defined(MTS_OPENMP)
 #if defined(__OSX__)
 /// Variant of \c omp_get_max_threads that works on OSX
@@ -24,6 +24,7 @@
 #include <mitsuba/core/frame.h>
 #include <mitsuba/core/properties.h>
 #include <mitsuba/render/common.h>
+#include <mitsuba/render/gatherdomain.h>
 #include <mitsuba/render/shader.h>
 #include <mitsuba/core/statistics.h>
 
@@ -499,13 +500,44 @@ public:
 	//! @}
 	// =============================================================
 
-	virtual Float gatherAreaPdf(Vector wi, Vector wo, Float gatherRadius, 
-		std::vector<Float> &componentCDFs, std::vector<Vector4> &componentBounds) const{
+	/**
+	 * \brief Compute the restricted sampling domain towards a gather disk
+	 *
+	 * Appends one node (plus the bounds it refers to) to \c domain that
+	 * describes the directions reaching the disk of radius \c gatherRadius
+	 * around \c wo (all in local coordinates), and returns the probability
+	 * that an unrestricted sample lands in this domain.
+	 */
+	virtual Float gatherAreaPdf(const Vector &wi, const Vector &wo, Float gatherRadius,
+		GatherDomain &domain) const{
 		SLog(EWarn, "Not implment bsdf->gatherAreaPdf");
 		return 0.f;
 	}
-	virtual Vector sampleGatherArea(Vector wi, Vector wo, Float gatherRadius, Point2 sample, 
-		std::vector<Float> componentCDFs, std::vector<Vector4> componentBounds) const{
+	/**
+	 * \brief Batched version of \ref gatherAreaPdf() for many gather disks
+	 * seen from the same surface point
+	 *
+	 * All disks share the incident direction \c wi, so implementations can
+	 * set up the frames and lobe parameters that only depend on \c wi once
+	 * per batch and evaluate the disks together. Appends one node to
+	 * <tt>*domains[i]</tt> for every disk with a nonzero probability and
+	 * stores the probabilities in \c probs. The default implementation
+	 * calls \ref gatherAreaPdf() for every disk.
+	 */
+	virtual void gatherAreaPdfBatch(const Vector &wi, const Vector *wo, size_t count, Float gatherRadius,
+		GatherDomain * const *domains, Float *probs) const{
+		for (size_t i = 0; i < count; ++i)
+			probs[i] = gatherAreaPdf(wi, wo[i], gatherRadius, *domains[i]);
+	}
+	/**
+	 * \brief Sample a direction from the restricted domain that was
+	 * created by \ref gatherAreaPdf()
+	 *
+	 * \param node
+	 *     Index of the node that \ref gatherAreaPdf() appended to \c domain
+	 */
+	virtual Vector sampleGatherArea(const Vector &wi, const Vector &wo, Float gatherRadius, Point2 sample,
+		const GatherDomain &domain, int node) const{
 		SLog(EWarn, "Not implment bsdf->sampleGatherArea");
 		return Vector(0.f);
 	}
@@ -513,19 +545,6 @@ public:
 		return 99999.f;
 	}
 
-	// for guided UPM
-	virtual Float gatherAreaPdf(Vector wi, Vector wo, Float gatherRadius,
-		Vector2* componentCDFs, Vector2* componentBounds,
-		int &topComponentCDFs, int &topComponentBounds) const{
-		SLog(EWarn, "Not implment bsdf->gatherAreaPdf");
-		return 0.f;
-	}
-	virtual Vector sampleGatherArea(Vector wi, Vector wo, Float gatherRadius, Point2 sample,
-		int ptrTree, Vector2* componentCDFs, Vector2* componentBounds) const{
-		SLog(EWarn, "Not implment bsdf->sampleGatherArea");
-		return Vector(0.f);
-	}
-
 	MTS_DECLARE_CLASS()
 protected:
 	/// Create a new BSDF instance
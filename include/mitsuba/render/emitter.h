@@ -21,6 +21,7 @@
 #define __MITSUBA_RENDER_EMITTER_H_
 
 #include <mitsuba/render/common.h>
+#include <mitsuba/render/gatherdomain.h>
 #include <mitsuba/core/track.h>
 #include <mitsuba/core/properties.h>
 #include <mitsuba/core/cobject.h>
@@ -608,11 +609,11 @@ public:
 		return 99999.f;
 	}
 
-	virtual Float gatherAreaPdf(PositionSamplingRecord pRec, Point gatherPosition, Float gatherRadius, std::vector<Float> &componentProbs, std::vector<Vector4> &componentBounds) const{
+	virtual Float gatherAreaPdf(const PositionSamplingRecord &pRec, const Point &gatherPosition, Float gatherRadius, GatherDomain &domain) const{
 		SLog(EWarn, "Not implment emitter->gatherAreaPdf");
 		return 1.f;
 	}
-	virtual Vector sampleGatherArea(DirectionSamplingRecord &dRec, PositionSamplingRecord pRec, Point gatherPosition, Float gatherRadius, Point2 sample, std::vector<Float> componentProbs, std::vector<Vector4> componentBounds) const{
+	virtual Vector sampleGatherArea(DirectionSamplingRecord &dRec, PositionSamplingRecord pRec, const Point &gatherPosition, Float gatherRadius, Point2 sample, const GatherDomain &domain, int node) const{
 		SLog(EWarn, "Not implment emitter->sampleGatherArea");
 		Spectrum ret = sampleDirection(dRec, pRec, sample);
 		if (ret.isZero())
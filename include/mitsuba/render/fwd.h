@@ -72,6 +72,7 @@ class Sensor;
 class Scene;
 class SceneHandler;
 class Shader;
+class ShadowRayQueue;
 class Shape;
 class SparseMipmap3D;
 class Spiral;
@@ -0,0 +1,134 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_GATHERDOMAIN_H_)
+#define __MITSUBA_RENDER_GATHERDOMAIN_H_
+
+#include <mitsuba/core/vector.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Fixed-capacity restricted sampling domain of a UPM vertex merge
+ *
+ * The restricted (gather area) sampling techniques of the BSDFs, emitters
+ * and sensors describe the set of directions that can reach a gather disk
+ * as a small tree of discrete probabilities, whose leaves refer to
+ * rectangular bounds in the parameter space of the respective technique.
+ * The domain is computed once per merge candidate by \c gatherAreaPdf()
+ * and is then read by every trial of \c sampleGatherArea().
+ *
+ * Both arrays are stored inline, so a domain can live on the stack or
+ * inside another structure without any heap allocation.
+ *
+ * Every node stores its probability in \c x and a pointer in \c y (the
+ * bit pattern of an \c int). The meaning of the pointer is up to the
+ * technique that created the node, with one convention: leaves created by
+ * \ref appendLeaf() store the negated index of their first bounds entry.
+ * Bounds are stored as pairs of (min, max) corners, i.e. a leaf with the
+ * bounds \c [x0, x1] x \c [y0, y1] refers to the two entries
+ * <tt>(x0, y0)</tt> and <tt>(x1, y1)</tt>.
+ *
+ * \ingroup librender
+ */
+struct GatherDomain {
+	enum {
+		/// Maximum number of nodes (64 lobes x 3 + BSDF, GMM and root nodes)
+		EMaxNodes = 3 * 64 + 3 + 5 + 3,
+		/// Maximum number of bounds entries
+		EMaxBounds = 2 * EMaxNodes
+	};
+
+	/// Probability tree
+	Vector2 nodes[EMaxNodes];
+	/// Corners of the bounds referenced by the leaves
+	Vector2 bounds[EMaxBounds];
+	/// Number of used entries of \ref nodes and \ref bounds
+	int nodeCount, boundCount;
+
+	inline GatherDomain() : nodeCount(0), boundCount(0) { }
+
+	/// Remove all nodes and bounds (does not touch the storage)
+	inline void clear() { nodeCount = boundCount = 0; }
+
+	/// Copy the used entries of another domain
+	inline void assign(const GatherDomain &domain) {
+		nodeCount = domain.nodeCount;
+		boundCount = domain.boundCount;
+		for (int i = 0; i < nodeCount; ++i)
+			nodes[i] = domain.nodes[i];
+		for (int i = 0; i < boundCount; ++i)
+			bounds[i] = domain.bounds[i];
+	}
+
+	/// Append a node and return its index
+	inline int appendNode(Float prob, int pointer) {
+		SAssert(nodeCount < EMaxNodes);
+		nodes[nodeCount] = Vector2(prob, encodePointer(pointer));
+		return nodeCount++;
+	}
+
+	/**
+	 * \brief Append a leaf that refers to the bounds appended next
+	 *
+	 * The bounds of the leaf must be appended with \ref appendBounds()
+	 * right after this call. Returns the index of the new node.
+	 */
+	inline int appendLeaf(Float prob) {
+		return appendNode(prob, -boundCount);
+	}
+
+	/// Append a bounds entry given as <tt>(x0, x1, y0, y1)</tt>
+	inline void appendBounds(const Vector4 &bbox) {
+		SAssert(boundCount + 2 <= EMaxBounds);
+		bounds[boundCount++] = Vector2(bbox.x, bbox.z);
+		bounds[boundCount++] = Vector2(bbox.y, bbox.w);
+	}
+
+	/// Return the probability stored in a node
+	inline Float getProb(int node) const { return nodes[node].x; }
+
+	/// Return the pointer stored in a node
+	inline int getPointer(int node) const { return decodePointer(nodes[node].y); }
+
+	/// Return the \c index-th bounds entry referenced by a leaf
+	inline Vector4 getLeafBounds(int node, int index = 0) const {
+		int ptr = -getPointer(node) + 2 * index;
+		const Vector2 &xmin = bounds[ptr], &xmax = bounds[ptr + 1];
+		return Vector4(xmin.x, xmax.x, xmin.y, xmax.y);
+	}
+
+	/// Store an integer pointer in the bits of a \c float
+	static inline float encodePointer(int pointer) {
+		union { int i; float f; } conv;
+		conv.i = pointer;
+		return conv.f;
+	}
+
+	/// Inverse of \ref encodePointer()
+	static inline int decodePointer(float value) {
+		union { float f; int i; } conv;
+		conv.f = value;
+		return conv.i;
+	}
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_GATHERDOMAIN_H_ */
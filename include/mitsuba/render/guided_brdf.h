@@ -25,6 +25,8 @@
 
 #include <mitsuba/mitsuba.h>
 #include <mitsuba/render/libImpUtils.h>
+#include <mitsuba/render/gatherdomain.h>
+#include <mitsuba/render/guiding_arena.h>
 
 MTS_NAMESPACE_BEGIN
 
@@ -37,8 +39,8 @@ public:
 		Importance::Sampler*        importanceSampler,
 		Float                       bsdfSamplingProbability,
 		bool valid = true)
-		: m_its(its), m_importanceSampler(importanceSampler),
-		m_bsdfSamplingProbability(bsdfSamplingProbability), m_impDistrib(NULL), m_eta(-1.f) {
+		: m_its(its), m_importanceSampler(importanceSampler), m_arena(NULL),
+		m_bsdfSamplingProbability(bsdfSamplingProbability), m_impDistrib(NULL), m_product(NULL), m_restricted(NULL), m_eta(-1.f) {
 
 		if (!valid) return;
 
@@ -46,7 +48,7 @@ public:
 		m_bsdf = its.getBSDF();
 		if (m_importanceSampler != NULL) {
 			Importance::Hit hit = itsToHit(its);
-			m_impDistrib = m_importanceSampler->getDistribution(hit, m_distBuffer);
+			m_impDistrib = m_importanceSampler->getDistribution(hit, *allocDistBuffer());
 #ifdef LIBIMP_STATS
 			if (m_impDistrib != NULL) {
 				/// somehow prevent storing photons from EM if you don't need it and statistics are on
@@ -65,14 +67,14 @@ public:
         const RayDifferential&      ray, 
         Importance::Sampler*        importanceSampler,                     
         Float                       bsdfSamplingProbability ) 
-        : m_its( its ), m_importanceSampler( importanceSampler),
-        m_bsdfSamplingProbability( bsdfSamplingProbability ), m_impDistrib( NULL ), m_eta( -1.f ) {
+        : m_its( its ), m_importanceSampler( importanceSampler), m_arena( NULL ),
+        m_bsdfSamplingProbability( bsdfSamplingProbability ), m_impDistrib( NULL ), m_product( NULL ), m_restricted( NULL ), m_eta( -1.f ) {
 
             /* Prepare distribution if guided path-tracing is set on*/
             m_bsdf = its.getBSDF(ray);
             if ( m_importanceSampler != NULL ) {
                 Importance::Hit hit = itsToHit( its );
-                m_impDistrib = m_importanceSampler->getDistribution( hit, m_distBuffer );
+                m_impDistrib = m_importanceSampler->getDistribution( hit, *allocDistBuffer() );
 #ifdef LIBIMP_STATS
                 if ( m_impDistrib != NULL ) {
                     /// somehow prevent storing photons from EM if you don't need it and statistics are on
@@ -96,6 +98,53 @@ public:
         return m_importanceSampler == NULL || m_impDistrib != NULL;
     }
 
+    /**
+        Switches the guided strategy to the product of the distribution with a Gaussian lobe fitted to the bsdf
+        and/or replaces the bsdf sampling probability with the one learned by the cache records.
+        Has to be called before any sampling or pdf evaluation. Falls back to the plain distribution 
+        for bsdfs without a lobe fit and for distributions that do not support the product.
+    */
+    void enableProductSampling( bool productSampling, bool learnedSelection ) {
+        if ( m_impDistrib == NULL || m_pureSpecularBSDF ) {
+            return;
+        }
+        if ( learnedSelection ) {
+            m_bsdfSamplingProbability = m_impDistrib->bsdfSelection( m_bsdfSamplingProbability, m_selection );
+        }
+        Vector lobeDirection;
+        Float lobeVariance;
+        if ( productSampling && fitBSDFLobe( lobeDirection, lobeVariance ) ) {
+            m_product = m_arena->create<Importance::ProductBuffer>();
+            if ( !m_impDistrib->initProduct( IMP_VECTOR3( lobeDirection ), lobeVariance, *m_product ) ) {
+                m_product = NULL;
+            }
+        }
+    }
+
+    /**
+        Factorizes the lobes of the distribution once, so that gatherAreaPdfGuide() and sampleGatherAreaGuide()
+        can answer queries for many gather disks seen from this vertex without doing it again for every disk.
+        Falls back to the plain distribution if it does not support restricted sampling.
+    */
+    void enableRestrictedSampling() {
+        if ( m_impDistrib == NULL || m_pureSpecularBSDF || m_restricted != NULL ) {
+            return;
+        }
+        m_restricted = m_arena->create<Importance::RestrictedMixture>();
+        if ( !m_impDistrib->initRestricted( *m_restricted ) ) {
+            m_restricted = NULL;
+        }
+    }
+
+    /// Returns the record that trains the learned bsdf sampling probability with the last sampled direction
+    bool getSelectionRecord( Importance::BsdfSelectionRecord & record ) const {
+        if ( m_selection.count == 0 || m_selection.bsdfPdf < 0.f ) {
+            return false;
+        }
+        record = m_selection;
+        return true;
+    }
+
     /// Evaluates bsdf value at given an outgoing direction (direction is in world space!)
     Spectrum eval( const Vector & direction ) const {
         /* Evaluate BSDF * cos(theta) */
@@ -112,7 +161,7 @@ public:
         Float iiPdf = 0.0f;
         /// count in IIS strategy
         if ( m_impDistrib != NULL && !m_pureSpecularBSDF ) {
-            m_impDistrib->pdfs( &IMP_VECTOR3( direction ), &iiPdf, 1 );                    
+            iiPdf = guidePdf( direction );
             iiPdf *= (1 - m_bsdfSamplingProbability);
             bsdfPdf *= m_bsdfSamplingProbability;
         }
@@ -132,6 +181,7 @@ public:
         /* Determine whether to sample according to BSDS or according to illumination */
         bool sampleOnlyBSDF = m_pureSpecularBSDF || m_impDistrib == NULL;
         bool useBSDF = sampleOnlyBSDF || sampler->next1D() < m_bsdfSamplingProbability;
+        m_selection.bsdfPdf = -1.f;
 
         if ( useBSDF ) {
             /* Sample BSDF * cos(theta) */
@@ -146,11 +196,12 @@ public:
             direction = m_its.toWorld( bRec.wo );
             // Sampling from distribution is possible?
             if ( !sampleOnlyBSDF ) {
+                Float bsdfPdf = pdf;
                 pdf *= m_bsdfSamplingProbability; // Multiply by probability of selecting bsdf as sampling strategy
                 if ((!(bRec.sampledType & BSDF::EDelta)) ) {// Not dirac surface				
-                    Float iiPdf;
-                    m_impDistrib->pdfs( &IMP_VECTOR3( direction ), &iiPdf, 1 );
+                    Float iiPdf = guidePdf( direction );
                     pdf += iiPdf * ( 1 - m_bsdfSamplingProbability ); // Combined pdf
+                    recordSelection( bsdfPdf, iiPdf );
                 }
             }
             if ( pdf != 0.0f ) {
@@ -160,17 +211,18 @@ public:
             }
         } else {
             // Sample the distribution
-            Importance::Vector3 res;
-            Point2 s1 = sampler->next2D();                
-            Importance::Vector2 samples( s1.x, s1.y);
-            m_impDistrib->sampleDirections( &samples, &res, &pdf, 1 );
+            if ( !sampleGuide( direction, pdf, sampler ) ) {
+                albedo = Spectrum(0.0f);
+                return albedo;
+            }
+            Float iiPdf = pdf;
             pdf *= ( 1.0f - m_bsdfSamplingProbability );
-            direction = MTS_VECTOR( res );
             /// Evaluate BRDF in the new direction * cos(theta) 
             BSDFSamplingRecord bRec( m_its, m_its.toLocal( direction ) );
             m_eta = m_bsdf->getEta();
             m_lastSampledComponent = 0;
             Float bsdfPdf = m_bsdf->pdf( bRec );
+            recordSelection( bsdfPdf, iiPdf );
             pdf += bsdfPdf * m_bsdfSamplingProbability;
             if ( pdf != 0.0f ) {
                 Spectrum out = albedo = m_bsdf->eval( bRec );
@@ -189,12 +241,11 @@ public:
 
 	Spectrum sampleGMM(Vector & direction, Float & pdf, Sampler *sampler) {
 		// Sample the distribution
-		Importance::Vector3 res;
-		Point2 s1 = sampler->next2D();
-		Importance::Vector2 samples(s1.x, s1.y);
-		m_impDistrib->sampleDirections(&samples, &res, &pdf, 1);
+		m_selection.bsdfPdf = -1.f;
+		if (!sampleGuide(direction, pdf, sampler)) {
+			return Spectrum(0.0f);
+		}
 		pdf *= (1.0f - m_bsdfSamplingProbability);
-		direction = MTS_VECTOR(res);
 		/// Evaluate BRDF in the new direction * cos(theta) 
 		BSDFSamplingRecord bRec(m_its, m_its.toLocal(direction));
 		m_eta = m_bsdf->getEta();
@@ -210,8 +261,7 @@ public:
 		}
 	}
 
-	Float gatherAreaPdfGuide(Vector wo_, Float radius,
-		Vector2* componentCDFs, Vector2* componentBounds, int &topComponentCDFs, int &topComponentBounds,
+	Float gatherAreaPdfGuide(Vector wo_, Float radius, GatherDomain &domain,
 		Importance::Vector2* componentCDFsImp, Importance::Vector2* componentBoundsImp,
 		Timer* timerDistrib, Timer* timerGMM, Timer* timerLobe){
 
@@ -219,23 +269,25 @@ public:
 		Importance::Vector3 wo(wo_.x, wo_.y, wo_.z);
 
 		timerDistrib->start();
-		Float prob = m_impDistrib->gatherAreaPdfDistrib(wo, radius, 
-			componentCDFsImp, componentBoundsImp, topCDFs, topBounds,
-			topComponentCDFs, topComponentBounds);
+		Float prob = (m_restricted != NULL) ?
+			m_impDistrib->gatherAreaPdfRestricted(*m_restricted, wo, radius,
+				componentCDFsImp, componentBoundsImp, topCDFs, topBounds,
+				domain.nodeCount, domain.boundCount) :
+			m_impDistrib->gatherAreaPdfDistrib(wo, radius, 
+				componentCDFsImp, componentBoundsImp, topCDFs, topBounds,
+				domain.nodeCount, domain.boundCount);
 		timerDistrib->stop();
 
-		// merge Importance type cdfs back to original cdf tree
+		// merge Importance type cdfs back to the gather domain
+		SAssert(domain.nodeCount + topCDFs <= GatherDomain::EMaxNodes
+			&& domain.boundCount + topBounds <= GatherDomain::EMaxBounds);
 		for (int i = 0; i < topCDFs; i++){
 			Importance::Vector2 iv = componentCDFsImp[i];
-			Vector2 v = Vector2(iv.x, iv.y);
-			componentCDFs[topComponentCDFs] = v;
-			topComponentCDFs++;
+			domain.nodes[domain.nodeCount++] = Vector2(iv.x, iv.y);
 		}
 		for (int i = 0; i < topBounds; i++){
 			Importance::Vector2 iv = componentBoundsImp[i];
-			Vector2 v = Vector2(iv.x, iv.y);
-			componentBounds[topComponentBounds] = v;
-			topComponentBounds++;
+			domain.bounds[domain.boundCount++] = Vector2(iv.x, iv.y);
 		}
 		return prob;
 	}
@@ -248,7 +300,10 @@ public:
 		Importance::Vector3 wo(wo_.x, wo_.y, wo_.z);
 		Importance::Vector3 diri(-10000.f);		
 
-		diri = m_impDistrib->sampleGatherAreaDistrib(samples, wo, radius, ptrNode, componentCDFs, componentBounds);
+		if (m_restricted != NULL)
+			diri = m_impDistrib->sampleGatherAreaRestricted(*m_restricted, samples, ptrNode, componentCDFs, componentBounds);
+		else
+			diri = m_impDistrib->sampleGatherAreaDistrib(samples, wo, radius, ptrNode, componentCDFs, componentBounds);
 
 		return Vector(diri.x, diri.y, diri.z);
 	}
@@ -270,18 +325,103 @@ public:
             m_impDistrib->release();
             m_impDistrib = NULL;
         }
+        if ( m_arena != NULL ) {
+            m_arena->rewind( m_arenaMark );
+        }
+    }
+
+private:
+    /// Takes the buffer for the distribution from the scratch arena of the thread
+    Importance::ResultBuffer * allocDistBuffer() {
+        m_arena = GuidingArena::getThreadArena();
+        m_arenaMark = m_arena->mark();
+        return m_arena->allocResultBuffer();
+    }
+
+    /** 
+        Fits an isotropic Gaussian lobe (variance in steradians) to the reflection of the bsdf. 
+        Glossy reflection is approximated around the mirror direction from the Beckmann-equivalent 
+        roughness, the outgoing directions spread twice as much as the microfacet normals. Diffuse 
+        reflection is approximated by a wide lobe around the normal, cos(theta) ~ exp(-theta^2/2).
+        If there are several components, the widest lobe is used. Transmission is not supported.
+    */
+    bool fitBSDFLobe( Vector & direction, Float & variance ) const {
+        if ( m_bsdf->getType() & ( BSDF::EDiffuseTransmission | BSDF::EGlossyTransmission ) ) {
+            return false;
+        }
+        variance = 0.0f;
+        for ( int i = 0; i < m_bsdf->getComponentCount(); ++i ) {
+            const unsigned int type = m_bsdf->getType( i );
+            Float componentVariance;
+            if ( type & BSDF::EDiffuseReflection ) {
+                componentVariance = 1.0f;
+            } else if ( type & BSDF::EGlossyReflection ) {
+                Float roughness = m_bsdf->getRoughness( m_its, i );
+                componentVariance = std::min( 2.0f * roughness * roughness, (Float) 1.0f );
+            } else {
+                continue;
+            }
+            variance = std::max( variance, componentVariance );
+        }
+        if ( variance <= 0.0f ) {
+            return false;
+        }
+        variance = std::max( variance, (Float) 1e-4f );
+        const Vector & wi = m_its.wi;
+        direction = ( variance < 1.0f ) ? m_its.toWorld( Vector( -wi.x, -wi.y, wi.z ) ) : Vector( m_its.shFrame.n );
+        return true;
+    }
+
+    /// Pdf of the guided strategy, i.e. of the distribution or of its product with the bsdf lobe
+    Float guidePdf( const Vector & direction ) const {
+        if ( m_product != NULL ) {
+            return m_impDistrib->pdfProduct( *m_product, IMP_VECTOR3( direction ) );
+        }
+        Float iiPdf;
+        m_impDistrib->pdfs( &IMP_VECTOR3( direction ), &iiPdf, 1 );
+        return iiPdf;
+    }
+
+    /// Samples the guided strategy, returns false if the sample does not lie in the distribution
+    bool sampleGuide( Vector & direction, Float & pdf, Sampler *sampler ) {
+        Importance::Vector3 res;
+        Point2 s1 = sampler->next2D();
+        Importance::Vector2 samples( s1.x, s1.y );
+        if ( m_product != NULL ) {
+            if ( !m_impDistrib->sampleProduct( *m_product, samples, res, pdf ) ) {
+                return false;
+            }
+        } else {
+            m_impDistrib->sampleDirections( &samples, &res, &pdf, 1 );
+        }
+        direction = MTS_VECTOR( res );
+        return true;
+    }
+
+    /// Stores the pdfs of both strategies for training the learned bsdf sampling probability
+    void recordSelection( Float bsdfPdf, Float iiPdf ) {
+        m_selection.probability = m_bsdfSamplingProbability;
+        m_selection.bsdfPdf = bsdfPdf;
+        m_selection.guidePdf = iiPdf;
     }
 public:
     /// Intersection from which we want to generate next ray
-    mitsuba::Intersection & m_its;
+    mitsuba::Intersection m_its;
     /// BSDF at intersection
     const BSDF *m_bsdf;
     /// Radiance/importance distribution sampler
     Importance::Sampler * m_importanceSampler;
-    /// Buffer where the current distribution is allocated to avoid expensive memory re-allocation
-    Importance::ResultBuffer m_distBuffer;
-    /// The distribution will be allocated into the distBuffer so do not dispose this memory by delete!!
+    /// Scratch arena that holds the buffer of the distribution, released when the sampler is destroyed
+    GuidingArena * m_arena;
+    GuidingArena::Mark m_arenaMark;
+    /// The distribution will be allocated into the arena so do not dispose this memory by delete!!
     Importance::Distribution * m_impDistrib;
+    /// Product of the distribution with the bsdf lobe (in the arena), NULL if the plain distribution is sampled
+    Importance::ProductBuffer * m_product;
+    /// Factorized lobes for restricted sampling towards gather disks (in the arena), NULL if not enabled
+    Importance::RestrictedMixture * m_restricted;
+    /// Cache records that learn the bsdf sampling probability and the pdfs of the last sampled direction
+    Importance::BsdfSelectionRecord m_selection;
     /// Probability to sample the next ray from bsdf
     Float m_bsdfSamplingProbability;
     /// Non-dirac bsdf?
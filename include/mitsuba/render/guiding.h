@@ -27,52 +27,215 @@
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/render/libImpUtils.h>
 #include <mitsuba/render/weightwindow.h>
+#include <mitsuba/core/random.h>
+#include <mitsuba/core/lock.h>
+#include <mitsuba/core/mmap.h>
+#include <mitsuba/core/fresolver.h>
+#include <mitsuba/render/taskproc.h>
+#include <mitsuba/render/guiding_resource.h>
 
 MTS_NAMESPACE_BEGIN 
 
-/** Holds and trains samplers for guiding both paths from light sources and from the camera. */
-class GuidingSamplers : public ConfigurableObject {
+/** Runs the parallel parts of the LibImportance samplers (e.g. the refit of the cache records in 
+    refreshSamples) on the local workers of the scheduler */
+class SchedulerTaskRunner : public Importance::TaskRunner {
 public:
+    virtual void run( int count, const Task & task ) {
+        LocalTaskProcess::run( (size_t) count, [&task]( size_t i ) { task( (int) i ); } );
+    }
 
-	GuidingSamplers::GuidingSamplers() : ConfigurableObject(Properties()) {
-		m_timer = new Timer();
-		m_trainingTimer = new Timer();
-		m_failureListMutex = new Mutex();
-	}
+    virtual int getThreadCount() const {
+        return (int) std::max( (size_t) 1, Scheduler::getInstance()->getLocalWorkerCount() );
+    }
+
+    static SchedulerTaskRunner * getInstance() {
+        static SchedulerTaskRunner runner;
+        return &runner;
+    }
+};
+
+/** Creates a LibImportance sampler that runs its parallel parts on the scheduler */
+inline Importance::Sampler * createGuidingSampler( const Importance::Config & cfg ) {
+    Importance::Sampler * sampler = Importance::SamplerFactory::createSampler( cfg );
+    if ( sampler ) {
+        sampler->setTaskRunner( SchedulerTaskRunner::getInstance() );
+    }
+    return sampler;
+}
+
+/** Radiance and importance samplers that are used together by the renderers while the 
+    guiding samplers are refined during the rendering phase (see GuidingSamplers::beginRefinement). 
+    A model is never modified while a renderer holds a reference to it. */
+class GuidingModel : public Object {
+public:
+    GuidingModel( Importance::Sampler * radianceSampler, Importance::Sampler * importanceSampler ) 
+        : m_radianceSampler( radianceSampler ), m_importanceSampler( importanceSampler ), m_batches( 0 ),
+          m_pretrained( radianceSampler != NULL ) {}
+
+    /** Refines the samplers by a batch of particles, samplers which do not exist yet are created */
+    void refine( const GuidingConfig & cfg, const Importance::Camera * camera, 
+        const ref<PhotonMap> & photons, Importance::Stats * radianceStats, 
+        const ref<PhotonMap> & importons, Importance::Stats * importanceStats ) {
+        refine( m_radianceSampler, cfg, camera, photons, radianceStats );
+        if ( importons.get() != NULL ) {
+            refine( m_importanceSampler, cfg, camera, importons, importanceStats );
+        }
+        m_batches++;
+    }
+
+    /** Hands the samplers over to the caller, the model does not dispose them anymore */
+    void detach() {
+        m_radianceSampler = m_importanceSampler = NULL;
+    }
+
+    Importance::Sampler * getRadianceSampler() const { return m_radianceSampler; }
+    Importance::Sampler * getImportanceSampler() const { return m_importanceSampler; }
+    /** Number of batches from the rendering phase the model was refined with */
+    size_t getBatchCount() const { return m_batches; }
+    /** Was the model created from the samplers of the training phase? */
+    bool isPretrained() const { return m_pretrained; }
+
+protected:
+    virtual ~GuidingModel() {
+        Importance::SamplerFactory::disposeSampler( m_radianceSampler );
+        Importance::SamplerFactory::disposeSampler( m_importanceSampler );
+    }
+
+    static void refine( Importance::Sampler *& sampler, const GuidingConfig & cfg, 
+        const Importance::Camera * camera, const ref<PhotonMap> & particles, Importance::Stats * stats ) {
+        if ( particles->size() == 0 ) {
+            return;
+        }
+        if ( !sampler ) {
+            sampler = createGuidingSampler( cfg.m_importance );
+            SAssert( sampler );
+            sampler->init( PhotonsIterator( particles ), cfg.m_importance, camera, stats );
+        } else {
+            sampler->refreshSamples( PhotonsIterator( particles ) );
+        }
+    }
+
+private:
+    Importance::Sampler * m_radianceSampler;
+    Importance::Sampler * m_importanceSampler;
+    size_t m_batches;
+    bool m_pretrained;
+};
+
+/** Reservoir sample of the particles a renderer observes during one iteration. Particles are 
+    scaled when they leave the reservoir so that they represent all observed particles. */
+class GuidingParticleReservoir {
+public:
+    struct Particle {
+        Point position;
+        Normal normal;
+        Vector dir;
+        Spectrum power;
+        int depth;
+        Float distance;
+    };
+
+    GuidingParticleReservoir() : m_capacity( 0 ), m_observed( 0 ) {}
+
+    void configure( size_t capacity, uint64_t seed ) {
+        m_capacity  = capacity;
+        m_observed  = 0;
+        m_particles.clear();
+        m_particles.reserve( capacity );
+        m_random    = new Random( seed );
+    }
+
+    inline bool isEnabled() const { return m_capacity > 0; }
+
+    inline void put( const Point & position, const Normal & normal, const Vector & dir, 
+        const Spectrum & power, int depth, Float distance ) {
+        if ( power.isZero() || !power.isValid() ) {
+            return;
+        }
+        size_t index = m_observed++;
+        if ( index >= m_capacity ) {
+            index = m_random->nextSize( m_observed );
+            if ( index >= m_capacity ) {
+                return;
+            }
+        }
+        Particle particle = { position, normal, dir, power, depth, distance };
+        if ( index < m_particles.size() ) {
+            m_particles[ index ] = particle;
+        } else {
+            m_particles.push_back( particle );
+        }
+    }
+
+    /** Moves the kept particles to target (or drops them if it is NULL), 
+        returns the number of observed particles */
+    size_t flush( std::vector<Particle> * target ) {
+        const size_t observed = m_observed;
+        if ( target && m_particles.size() > 0 ) {
+            const Float scale = (Float) observed / (Float) m_particles.size();
+            for ( size_t i = 0; i < m_particles.size(); ++i ) {
+                target->push_back( m_particles[ i ] );
+                target->back().power *= scale;
+            }
+        }
+        m_particles.clear();
+        m_observed = 0;
+        return observed;
+    }
+
+    /** Creates a photon map from particles, scaling their powers */
+    static ref<PhotonMap> toPhotonMap( const std::vector<Particle> & particles, Float scale ) {
+        ref<PhotonMap> photons = new PhotonMap( particles.size() );
+        for ( size_t i = 0; i < particles.size(); ++i ) {
+            const Particle & p = particles[ i ];
+            Photon photon( p.position, p.normal, p.dir, p.power * scale, (uint16_t) p.depth );
+            photon.setDistance( p.distance );
+            photons->push_back( photon );
+        }
+        return photons;
+    }
+
+private:
+    size_t m_capacity, m_observed;
+    std::vector<Particle> m_particles;
+    ref<Random> m_random;
+};
+
+class GuidingSamplers;
+
+/** Background thread that refines the guiding samplers (see GuidingSamplers::beginRefinement) */
+class GuidingRefinementThread : public Thread {
+public:
+    GuidingRefinementThread( GuidingSamplers * samplers ) 
+        : Thread( "gref" ), m_samplers( samplers ) {}
+
+protected:
+    virtual void run();
+
+private:
+    GuidingSamplers * m_samplers;
+};
+
+
+/** Holds and trains samplers for guiding both paths from light sources and from the camera. */
+class GuidingSamplers : public ConfigurableObject, public GuidingResource::Owner {
+public:
 
 	GuidingSamplers(const Properties &props)
 		  : ConfigurableObject(props), m_cfg(GuidingConfig(props)),
             m_qmcSamplerID_photons( -1 ), m_qmcSamplerID_importons( -1 ), 
             m_photonTracingState( 0 ), m_importonTracingState( 0 ),
             m_radianceSampler( NULL ), m_importanceSampler( NULL ), m_enviroSampler( NULL ),
-            m_scene( NULL ), m_canceled( false ) {
+            m_scene( NULL ), m_canceled( false ), 
+            m_observedPhotons( 0 ), m_observedImportons( 0 ), m_reservoirCount( 0 ),
+            m_refineImportance( false ), m_refining( false ), m_refineCamera( NULL ), m_batchOffset( 0 ) {
         m_timer					= new Timer();
         m_trainingTimer			= new Timer();
         m_failureListMutex		= new Mutex();
+        m_refineMutex			= new Mutex();
+        m_refineCond			= new ConditionVariable( m_refineMutex );
     }
 
-	ref<GuidingSamplers> clone(){
-		ref<GuidingSamplers> sampler = new GuidingSamplers();
-		sampler->m_cfg = m_cfg;
-		sampler->m_qmcSamplerID_photons = m_qmcSamplerID_photons;
-		sampler->m_qmcSamplerID_importons = m_qmcSamplerID_importons;
-		sampler->m_photonTracingState = m_photonTracingState;
-		sampler->m_importonTracingState = m_importonTracingState;
-		sampler->m_radianceSampler = m_radianceSampler;
-		sampler->m_importanceSampler = m_importanceSampler;
-		sampler->m_enviroSampler = m_enviroSampler;
-		sampler->m_scene = m_scene;
-		sampler->m_canceled = false;
-		
-		sampler->m_radianceStats.reset();
-		sampler->m_importanceStats.reset();
-		sampler->m_enviroSamplerStats.reset();
-		sampler->m_failureList.clear();
-
-		sampler->m_ww = m_ww;
-		return sampler.get();
-	}
-
     void trainingPhase( const RenderJob *job, int sceneResID, int sensorResID ) {
         if ( m_cfg.m_mitsuba.useGuidedSampling) {
             if ( !m_cfg.m_mitsuba.usePingPong ) {
@@ -85,18 +248,28 @@ public:
             m_cfg.m_mitsuba.nPasses = 0;
         }
 
+        // Reuses the distributions of a previous render, the training passes then only refine them
+        int nPasses = m_cfg.m_mitsuba.nPasses;
+        fs::path distributionsPath;
+        if ( m_cfg.m_mitsuba.useGuidedSampling && !m_cfg.m_mitsuba.distributionsFile.empty() ) {
+            distributionsPath = Thread::getThread()->getFileResolver()->resolve( m_cfg.m_mitsuba.distributionsFile );
+            if ( fs::exists( distributionsPath ) && loadDistributions( distributionsPath ) && !m_cfg.m_mitsuba.warmStart ) {
+                nPasses = 0;
+            }
+        }
+
         // Starts training phase
         m_trainingTimer->reset();
-        for ( int iPass = 0; iPass < m_cfg.m_mitsuba.nPasses && !m_canceled; ++iPass ) {
+        for ( int iPass = 0; iPass < nPasses && !m_canceled; ++iPass ) {
             if ( m_cfg.m_mitsuba.usePingPong || ( m_cfg.m_mitsuba.useEnvironmentSampler && iPass == 0 ) ) {	
                 // Evaluates as true for all passes if ping pong is used or for first pass if only env. sampler is used
                 /* IMPORTONS TRACING */
                 ref<BgParticlesVec> bgParticles;
-                SLog( EInfo, "Training (pass %i/%i): tracing importons", iPass+1, m_cfg.m_mitsuba.nPasses);
+                SLog( EInfo, "Training (pass %i/%i): tracing importons", iPass+1, nPasses);
                 ref<PhotonMap> importonsMap = particleTracingPass( job, sceneResID, sensorResID, m_radianceSampler, GuidedEmitParticleProcess::EFromSensor, &bgParticles );
                 //SLog( EInfo, "Training: importance cache update" );
                 if ( !m_importanceSampler) {
-                    m_importanceSampler = Importance::SamplerFactory::createSampler( m_cfg.m_importance );
+                    m_importanceSampler = createGuidingSampler( m_cfg.m_importance );
                     SAssert(m_importanceSampler);
                     m_importanceSampler->init( PhotonsIterator( importonsMap ),
                         m_cfg.m_importance,
@@ -131,7 +304,7 @@ public:
                             } 
                         }
                         else {
-                            SLog( EInfo, "Training (pass %i/%i): training environment sampler", iPass+1, m_cfg.m_mitsuba.nPasses );
+                            SLog( EInfo, "Training (pass %i/%i): training environment sampler", iPass+1, nPasses );
                             m_enviroSampler->refreshSamples( EnviroImportonsIterator( bgParticles ), enviroMap );
                         }
                     }
@@ -149,11 +322,11 @@ public:
                 //SLog( EInfo, "%s", cacheStatsToString( m_importanceStats, "Importance" ).c_str() );
             }
             /* PHOTONS TRACING */
-            SLog( EInfo, "Training (pass %i/%i): tracing photons", iPass+1, m_cfg.m_mitsuba.nPasses );
+            SLog( EInfo, "Training (pass %i/%i): tracing photons", iPass+1, nPasses );
             ref<PhotonMap> photonMap = particleTracingPass( job, sceneResID, sensorResID, m_importanceSampler, GuidedEmitParticleProcess::EFromEmitters, NULL );
             //SLog( EInfo, "Training: radiance cache update" );
             if ( !m_radianceSampler) {
-                m_radianceSampler = Importance::SamplerFactory::createSampler( m_cfg.m_importance );
+                m_radianceSampler = createGuidingSampler( m_cfg.m_importance );
                 SAssert(m_radianceSampler);
                 m_radianceSampler->init( PhotonsIterator( photonMap ),
                     m_cfg.m_importance,
@@ -169,6 +342,9 @@ public:
         if ( m_canceled ) {
             SLog( EWarn, "The training phase was stopped by the user." );
         }
+        else if ( nPasses > 0 && !distributionsPath.empty() ) {
+            saveDistributions( distributionsPath );
+        }
 
         if ( m_cfg.m_mitsuba.useGuidedSampling ) {
             SLog( EInfo, "Training phase took %s", timeString( m_trainingTimer->getMilliseconds() / 1000.f ).c_str() );
@@ -221,7 +397,76 @@ public:
 		m_failureList.clear();
 	}
 
+    /** Starts refining the radiance and importance samplers in the background by particles 
+        that the renderers observe during the rendering phase (see GuidingContext::beginIteration). Does nothing 
+        unless interleavedTraining is on. Until endRefinement is called, the samplers are owned by 
+        the published model, which is replaced whenever a refinement step has finished. */
+    void beginRefinement() {
+        if ( !m_cfg.m_mitsuba.useGuidedSampling || !m_cfg.m_mitsuba.interleavedTraining || 
+             !m_radianceSampler || m_canceled || m_refineThread ) {
+            return;
+        }
+
+        m_refineImportance  = m_importanceSampler != NULL;
+        m_model             = new GuidingModel( m_radianceSampler, m_importanceSampler );
+        m_spareModel        = NULL;
+        m_radianceSampler   = NULL;
+        m_importanceSampler = NULL;
+
+        m_pendingPhotons.clear();
+        m_pendingImportons.clear();
+        m_observedPhotons   = m_observedImportons = 0;
+        m_reservoirCount    = 0;
+        m_batches.clear();
+        m_batchOffset       = 0;
+        m_refineCamera      = getImportanceCamera();
+        m_refining          = true;
+
+        m_refineThread = new GuidingRefinementThread( this );
+        m_refineThread->start();
+    }
+
+    /** Stops the background refinement, the samplers of the last published model become the 
+        samplers of this object again */
+    void endRefinement() {
+        if ( !m_refineThread ) {
+            return;
+        }
+        m_refineMutex->lock();
+        m_refining = false;
+        m_refineCond->broadcast();
+        m_refineMutex->unlock();
+        m_refineThread->join();
+        m_refineThread = NULL;
+
+        m_radianceSampler   = m_model->getRadianceSampler();
+        m_importanceSampler = m_model->getImportanceSampler();
+        m_model->detach();
+        SLog( EInfo, "Guiding samplers were refined by %i batches during rendering", (int) m_model->getBatchCount() );
+
+        m_model = m_spareModel = NULL;
+        m_pendingPhotons.clear();
+        m_pendingImportons.clear();
+        m_batches.clear();
+    }
+
+    /** Creates the resource the renderers query during the rendering phase, the samplers stay 
+        owned by this object. Call it after beginRefinement. */
+    ref<GuidingResource> createResource() {
+        return new GuidingResource( this, getProperties(), m_cfg, m_ww );
+    }
+
+    /** Returns the samplers of the most recently published model while they are being refined */
+    virtual ref<Object> acquireSamplers( Importance::Sampler *& radianceSampler, 
+        Importance::Sampler *& importanceSampler ) const {
+        ref<GuidingModel> model = acquireModel();
+        radianceSampler   = model ? model->getRadianceSampler() : m_radianceSampler;
+        importanceSampler = model ? model->getImportanceSampler() : m_importanceSampler;
+        return model.get();
+    }
+
     void postprocess() {
+        endRefinement();
         if ( !m_cfg.m_mitsuba.useGuidedSampling ) {
             return;
         }             
@@ -307,11 +552,11 @@ public:
     /************************************************************************/
     /* Getters                                                              */
     /************************************************************************/
-    Importance::Sampler * getRadianceSampler() const { return m_radianceSampler; }
-    Importance::Sampler * getImportanceSampler() const { return m_importanceSampler; }
+    virtual Importance::Sampler * getRadianceSampler() const { return m_model.get() != NULL ? m_model->getRadianceSampler() : m_radianceSampler; }
+    virtual Importance::Sampler * getImportanceSampler() const { return m_model.get() != NULL ? m_model->getImportanceSampler() : m_importanceSampler; }
     Importance::IEnviroSampler * getEnviroSampler() const { return m_enviroSampler; }
-    Importance::Sampler * getRadianceSampler() { return m_radianceSampler; }
-    Importance::Sampler * getImportanceSampler() { return m_importanceSampler; }
+    Importance::Sampler * getRadianceSampler() { return m_model ? m_model->getRadianceSampler() : m_radianceSampler; }
+    Importance::Sampler * getImportanceSampler() { return m_model ? m_model->getImportanceSampler() : m_importanceSampler; }
     Importance::IEnviroSampler * getEnviroSampler() { return m_enviroSampler; }
     const GuidingConfig & getConfig() const { return m_cfg; }
 
@@ -404,6 +649,218 @@ protected:
 	}
 
 
+    /** Returns the most recently published model */
+    ref<GuidingModel> acquireModel() const {
+        LockGuard lock( m_refineMutex );
+        return m_model;
+    }
+
+    /** Sets up the particle reservoirs of a renderer's context for the background refinement, 
+        returns false if the samplers are not being refined */
+    bool attachContext( GuidingParticleReservoir & photons, GuidingParticleReservoir & importons ) {
+        LockGuard lock( m_refineMutex );
+        if ( !m_refineThread ) {
+            return false;
+        }
+        const size_t coreCount = std::max( (size_t) 1, Scheduler::getInstance()->getCoreCount() );
+        photons.configure( ( m_cfg.m_mitsuba.nPhotons + coreCount - 1 ) / coreCount, 2 * m_reservoirCount );
+        if ( m_refineImportance ) {
+            importons.configure( ( m_cfg.m_mitsuba.nImportons + coreCount - 1 ) / coreCount, 2 * m_reservoirCount + 1 );
+        }
+        m_reservoirCount++;
+        return true;
+    }
+
+    /** Moves the particles of a renderer into the pending batch. Once the batch is full, further 
+        particles are dropped until the refinement thread takes it. */
+    void feed( GuidingParticleReservoir & photons, GuidingParticleReservoir & importons ) {
+        LockGuard lock( m_refineMutex );
+        if ( !m_refining || m_pendingPhotons.size() >= m_cfg.m_mitsuba.nPhotons ) {
+            photons.flush( NULL );
+        } else {
+            m_observedPhotons += photons.flush( &m_pendingPhotons );
+        }
+        if ( importons.isEnabled() ) {
+            if ( !m_refining || m_pendingImportons.size() >= m_cfg.m_mitsuba.nImportons ) {
+                importons.flush( NULL );
+            } else {
+                m_observedImportons += importons.flush( &m_pendingImportons );
+            }
+        }
+        m_refineCond->signal();
+    }
+
+    /** Can the refinement thread take the pending batch? The spare model can only be refined once 
+        no renderer holds it anymore. */
+    bool isBatchReady() const {
+        return m_pendingPhotons.size() >= m_cfg.m_mitsuba.nPhotons && 
+            ( !m_refineImportance || m_pendingImportons.size() >= m_cfg.m_mitsuba.nImportons ) &&
+            ( !m_spareModel || m_spareModel->getRefCount() == 1 );
+    }
+
+    /** Turns a pending batch into a photon map whose particles carry the power of a single observed particle */
+    static ref<PhotonMap> takeBatch( std::vector<GuidingParticleReservoir::Particle> & particles, size_t & observed ) {
+        ref<PhotonMap> photons = GuidingParticleReservoir::toPhotonMap( particles, 
+            observed > 0 ? (Float) particles.size() / (Float) observed : (Float) 0 );
+        particles.clear();
+        observed = 0;
+        return photons;
+    }
+
+    /** Main loop of the refinement thread: refines the spare model by the pending batch and 
+        publishes it. The previously published model becomes the spare one. */
+    void refinementLoop() {
+        m_refineMutex->lock();
+        while ( true ) {
+            while ( m_refining && !m_canceled && !isBatchReady() ) {
+                m_refineCond->wait();
+            }
+            if ( !m_refining || m_canceled ) {
+                break;
+            }
+
+            ref<PhotonMap> photons = takeBatch( m_pendingPhotons, m_observedPhotons );
+            ref<PhotonMap> importons;
+            if ( m_refineImportance ) {
+                importons = takeBatch( m_pendingImportons, m_observedImportons );
+            }
+            ref<GuidingModel> model = m_spareModel;
+            m_spareModel = NULL;
+            m_refineMutex->unlock();
+
+            /* The spare model catches up with the batches it has missed while it was published */
+            m_trainingTimer->reset();
+            m_batches.push_back( std::make_pair( photons, importons ) );
+            if ( !model ) {
+                model = new GuidingModel( NULL, NULL );
+            }
+            for ( size_t i = model->getBatchCount() - m_batchOffset; i < m_batches.size(); ++i ) {
+                model->refine( m_cfg, m_refineCamera, m_batches[ i ].first, &m_radianceStats, 
+                    m_batches[ i ].second, &m_importanceStats );
+            }
+
+            m_refineMutex->lock();
+            if ( model->isPretrained() || model->getBatchCount() >= std::max( m_cfg.m_mitsuba.nPasses, (size_t) 1 ) ) {
+                m_spareModel = m_model;
+                m_model = model;
+                SLog( EInfo, "Guiding samplers refined by " SIZE_T_FMT " photons and " SIZE_T_FMT " importons in %s", 
+                    photons->size(), importons ? importons->size() : (size_t) 0,
+                    timeString( m_trainingTimer->getMilliseconds() / 1000.f ).c_str() );
+            } else {
+                /* A model created from scratch is published once it has seen as many batches as the training phase */
+                m_spareModel = model;
+            }
+
+            /* Batches that both models have seen are not needed anymore */
+            const size_t seen = std::min( m_model->getBatchCount(), m_spareModel->getBatchCount() ) - m_batchOffset;
+            m_batches.erase( m_batches.begin(), m_batches.begin() + seen );
+            m_batchOffset += seen;
+        }
+        m_refineMutex->unlock();
+    }
+
+    /** Header of the file with trained distributions, see loadDistributions() and saveDistributions(). 
+        The samplers are stored in the native layout of the build, so the file is only meant to be 
+        reused on the same machine. */
+    struct DistributionsHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t floatSize;
+        uint32_t distType;
+        uint32_t useCache;
+        uint32_t hasImportanceSampler;
+        float    sceneMin[3];
+        float    sceneMax[3];
+
+        DistributionsHeader() {
+            memset( this, 0, sizeof( DistributionsHeader ) );
+        }
+
+        DistributionsHeader( const Importance::Config & cfg, const AABB & sceneBox, bool hasImportance ) {
+            memset( this, 0, sizeof( DistributionsHeader ) );
+            magic                = 0x44475453; /* 'STGD' */
+            version              = 1;
+            floatSize            = sizeof( Importance::Float );
+            distType             = (uint32_t) cfg.distType;
+            useCache             = cfg.cache.useCache ? 1 : 0;
+            hasImportanceSampler = hasImportance ? 1 : 0;
+            for ( int i = 0; i < 3; ++i ) {
+                sceneMin[i] = (float) sceneBox.min[i];
+                sceneMax[i] = (float) sceneBox.max[i];
+            }
+        }
+
+        /** Was the file written by this build for the same scene and sampler configuration? */
+        bool isCompatible( const DistributionsHeader & other ) const {
+            return memcmp( this, &other, offsetof( DistributionsHeader, hasImportanceSampler ) ) == 0 && 
+                memcmp( sceneMin, other.sceneMin, sizeof( sceneMin ) ) == 0 &&
+                memcmp( sceneMax, other.sceneMax, sizeof( sceneMax ) ) == 0;
+        }
+    };
+
+    /** Loads the radiance (and importance) sampler trained by a previous render. The environment 
+        sampler is not stored and is only created when training passes are run. 
+        Returns false and keeps no samplers if the file cannot be used. */
+    bool loadDistributions( const fs::path & path ) {
+        SAssert( m_radianceSampler == NULL && m_importanceSampler == NULL );
+        try {
+            ref<MemoryMappedFile> file = new MemoryMappedFile( path );
+            Importance::MemoryInputBuffer buffer( file->getData(), file->getSize() );
+            std::istream input( &buffer );
+
+            DistributionsHeader header;
+            Importance::deserializePod( input, header );
+            if ( !header.isCompatible( DistributionsHeader( m_cfg.m_importance, m_scene->getAABB(), false ) ) ) {
+                SLog( EWarn, "The distributions in \"%s\" were trained for a different scene or "
+                    "configuration, training new ones.", path.string().c_str() );
+                return false;
+            }
+
+            m_radianceSampler = createGuidingSampler( m_cfg.m_importance );
+            SAssert( m_radianceSampler );
+            m_radianceSampler->load( input, m_cfg.m_importance, getImportanceCamera(), &m_radianceStats );
+            if ( header.hasImportanceSampler ) {
+                m_importanceSampler = createGuidingSampler( m_cfg.m_importance );
+                SAssert( m_importanceSampler );
+                m_importanceSampler->load( input, m_cfg.m_importance, getImportanceCamera(), &m_importanceStats );
+            }
+        } catch ( const std::exception & e ) {
+            SLog( EWarn, "Could not load the distributions from \"%s\" (%s), training new ones.", 
+                path.string().c_str(), e.what() );
+            Importance::SamplerFactory::disposeSampler( m_radianceSampler );
+            m_radianceSampler = NULL;
+            Importance::SamplerFactory::disposeSampler( m_importanceSampler );
+            m_importanceSampler = NULL;
+            return false;
+        }
+        SLog( EInfo, "Loaded the trained distributions from \"%s\"", path.string().c_str() );
+        return true;
+    }
+
+    /** Stores the trained samplers so that later renders of the same scene can skip the training */
+    void saveDistributions( const fs::path & path ) const {
+        if ( !m_radianceSampler ) {
+            return;
+        }
+        try {
+            std::ostringstream output( std::ios::out | std::ios::binary );
+            Importance::serializePod( output, 
+                DistributionsHeader( m_cfg.m_importance, m_scene->getAABB(), m_importanceSampler != NULL ) );
+            m_radianceSampler->save( output );
+            if ( m_importanceSampler ) {
+                m_importanceSampler->save( output );
+            }
+
+            const std::string data = output.str();
+            ref<MemoryMappedFile> file = new MemoryMappedFile( path, data.size() );
+            memcpy( file->getData(), data.data(), data.size() );
+        } catch ( const std::exception & e ) {
+            SLog( EWarn, "Could not save the distributions to \"%s\" (%s)", path.string().c_str(), e.what() );
+            return;
+        }
+        SLog( EInfo, "Saved the trained distributions to \"%s\"", path.string().c_str() );
+    }
+
 	/** Returns a camera compatible with ImportanceLib */
 	inline const Importance::Camera * getImportanceCamera() {
 		return new MitsubaImportanceCamera( m_scene->getSensor() );
@@ -448,6 +905,128 @@ private:
     ref<Timer> m_trainingTimer;
     /** Timer for measurement of single particle tracing steps. */
     ref<Timer> m_timer;
+
+    /** Background refinement (see beginRefinement) */
+    friend class GuidingRefinementThread;
+    friend class GuidingContext;
+    /** Most recently published model */
+    ref<GuidingModel> m_model;
+    /** Previously published model, refined by the next batch */
+    ref<GuidingModel> m_spareModel;
+    /** Particles waiting for the next refinement step and the number of particles they represent */
+    std::vector<GuidingParticleReservoir::Particle> m_pendingPhotons, m_pendingImportons;
+    size_t m_observedPhotons, m_observedImportons;
+    /** Number of contexts attached to the refinement, used for seeding their reservoirs */
+    size_t m_reservoirCount;
+    /** Is the importance sampler refined too? */
+    bool m_refineImportance;
+    /** Keep the refinement thread running? */
+    bool m_refining;
+    /* Also taken by the const acquireModel() */
+    mutable ref<Mutex> m_refineMutex;
+    ref<ConditionVariable> m_refineCond;
+    ref<Thread> m_refineThread;
+    const Importance::Camera * m_refineCamera;
+    /** Batches from the rendering phase that have not been applied to both models yet, 
+        m_batchOffset is the index of the first one */
+    std::vector<std::pair<ref<PhotonMap>, ref<PhotonMap> > > m_batches;
+    size_t m_batchOffset;
 };
 
+/** View of a GuidingResource that a single renderer works with. It holds the state the renderer 
+    changes while it queries the shared samplers: the tracing mode of its weight window, the model 
+    picked up for the current iteration and the particles observed for the background refinement. */
+class GuidingContext : public Object {
+public:
+    GuidingContext( GuidingResource * resource ) 
+        : m_resource( resource ), m_ww( resource->getWeightWindow() ), m_parent( NULL ) {
+        /* Resources are only owned by GuidingSamplers (see GuidingSamplers::createResource) */
+        m_owner = static_cast<GuidingSamplers *>( resource->getOwner() );
+        if ( m_owner && m_owner->attachContext( m_photonReservoir, m_importonReservoir ) ) {
+            m_parent = m_owner;
+        }
+    }
+
+    /** Called by a renderer before each of its iterations, picks up the most recently refined model */
+    inline void beginIteration() {
+        if ( m_parent ) {
+            m_model = m_parent->acquireModel();
+        }
+    }
+
+    /** Called by a renderer after each of its iterations, releases the model and hands the 
+        observed particles over for refinement */
+    inline void endIteration() {
+        if ( m_parent ) {
+            m_model = NULL;
+            m_parent->feed( m_photonReservoir, m_importonReservoir );
+        }
+    }
+
+    /** Does the renderer observe particles for the background refinement? */
+    inline bool isObservingParticles() const { return m_parent != NULL; }
+
+    /** Observes a vertex of an emitter (EImportance) or sensor (ERadiance) subpath as a photon or 
+        importon. Like in GuidedEmitParticleWorker::handleSurfaceInteraction, only diffuse and glossy 
+        surfaces are kept. The vertex and edge types are template parameters, so that this header 
+        does not depend on libbidir. 
+        @param weight   Throughput of the subpath up to the vertex
+        @param depth    Number of interactions up to the vertex (1 for the first one after the endpoint) */
+    template <typename VertexType, typename EdgeType> 
+    inline void observeVertex( const VertexType * vertex, const EdgeType * edge, const Spectrum & weight, 
+        int depth, ETransportMode mode ) {
+        GuidingParticleReservoir & reservoir = ( mode == EImportance ) ? m_photonReservoir : m_importonReservoir;
+        if ( !reservoir.isEnabled() || !vertex->isSurfaceInteraction() ) {
+            return;
+        }
+        const Intersection & its = vertex->getIntersection();
+        if ( !( its.getBSDF()->getType() & ( BSDF::EDiffuseReflection | BSDF::EGlossyReflection ) ) ) {
+            return;
+        }
+        reservoir.put( its.p, its.geoFrame.n, edge->d, weight, depth, edge->length );
+    }
+
+    /** Observes all vertices of a subpath, weights are the throughputs of the vertices */
+    template <typename PathType> 
+    inline void observeSubpath( const PathType & path, const Spectrum * weights, ETransportMode mode ) {
+        if ( !m_parent ) {
+            return;
+        }
+        for ( int i = 2; i < (int) path.vertexCount(); ++i ) {
+            observeVertex( path.vertex( i ), path.edge( i - 1 ), weights[ i ], i - 1, mode );
+        }
+    }
+
+    /** Records a failed distribution construction in the owner of the samplers (local machine only) */
+    inline void distributionConstructionFailed( const Intersection & its ) const {
+        if ( m_owner ) {
+            m_owner->distributionConstructionFailed( its );
+        }
+    }
+
+    const WeightWindow & getWeightWindow() const { return m_ww; }
+    WeightWindow & getWeightWindow() { return m_ww; }
+
+    Importance::Sampler * getRadianceSampler() const { return m_model.get() != NULL ? m_model->getRadianceSampler() : m_resource->getRadianceSampler(); }
+    Importance::Sampler * getImportanceSampler() const { return m_model.get() != NULL ? m_model->getImportanceSampler() : m_resource->getImportanceSampler(); }
+    const GuidingConfig & getConfig() const { return m_resource->getConfig(); }
+
+private:
+    ref<GuidingResource> m_resource;
+    /** Weight window whose tracing mode the renderer switches */
+    WeightWindow m_ww;
+    /** Owner of the samplers on the local machine, NULL on remote nodes */
+    GuidingSamplers * m_owner;
+    /** Owner whose refinement the context feeds with particles, NULL if there is no refinement */
+    GuidingSamplers * m_parent;
+    /** Model acquired for the current iteration */
+    ref<GuidingModel> m_model;
+    /** Particles observed during the current iteration */
+    GuidingParticleReservoir m_photonReservoir, m_importonReservoir;
+};
+
+inline void GuidingRefinementThread::run() {
+    m_samplers->refinementLoop();
+}
+
 MTS_NAMESPACE_END
@@ -0,0 +1,132 @@
+/*
+    This file is part of a demo implementation of an importance sampling technique
+    described in the "On-line Learning of Parametric Mixture Models for Light Transport Simulation"
+    (SIGGRAPH 2014) paper.
+    The implementation is based on Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_GUIDING_ARENA_H_)
+#define __MITSUBA_RENDER_GUIDING_ARENA_H_
+
+#include <mitsuba/mitsuba.h>
+#include "LibImportance/LibImportance.h"
+
+MTS_NAMESPACE_BEGIN
+
+/** Scratch memory of one thread for guided sampling: the distributions that GuidedBRDF obtains 
+    from the samplers, and the CDF nodes and component bounds of restricted sampling. Memory is 
+    taken from a list of blocks which are kept until the arena is destroyed, so that after the first 
+    few paths no heap allocation happens anymore.
+
+    Memory is released in stack order, either by rewinding to a mark (GuidedBRDF does this when it 
+    is destroyed) or by reset(), which renderers call once per camera path. Objects placed in the 
+    arena are never destructed, so they must not own any resources. The largest amount of memory 
+    an arena held is reported in the statistics. */
+class MTS_EXPORT_RENDER GuidingArena : public Object {
+public:
+    /** Position in the arena, see mark() and rewind() */
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    GuidingArena();
+
+    /** Returns the arena of the calling thread */
+    static GuidingArena * getThreadArena();
+
+    /** Allocates memory aligned to 16 bytes */
+    inline void * alloc( size_t size ) {
+        const size_t offset = ( m_offset + 15 ) & ~(size_t) 15;
+        if ( m_block < m_blocks.size() && offset + size <= m_blocks[ m_block ].size ) {
+            m_offset = offset + size;
+            m_used = m_blockStart + m_offset;
+            m_peak = std::max( m_peak, m_used );
+            return m_blocks[ m_block ].data + offset;
+        }
+        return allocSlow( size );
+    }
+
+    /** Allocates and default-constructs an array of objects */
+    template <typename T> inline T * create( size_t count = 1 ) {
+        T * result = static_cast<T *>( alloc( count * sizeof( T ) ) );
+        for ( size_t i = 0; i < count; ++i ) {
+            new ( result + i ) T();
+        }
+        return result;
+    }
+
+    /** Storage for Importance::Sampler::getDistribution */
+    inline Importance::ResultBuffer * allocResultBuffer() {
+        return create<Importance::ResultBuffer>();
+    }
+
+    inline Mark mark() const {
+        Mark mark = { m_block, m_offset };
+        return mark;
+    }
+
+    /** Releases everything that was allocated since the mark was taken */
+    inline void rewind( const Mark & mark ) {
+        SAssert( mark.block < m_block || ( mark.block == m_block && mark.offset <= m_offset ) );
+        while ( m_block > mark.block ) {
+            m_block--;
+            m_blockStart -= m_blocks[ m_block ].size;
+        }
+        m_offset = mark.offset;
+        m_used = m_blockStart + m_offset;
+    }
+
+    /** Releases all memory for reuse and records the high-water mark in the statistics */
+    void reset();
+
+    /** Number of bytes currently in use */
+    inline size_t getUsedBytes() const { return m_used; }
+
+    /** Largest number of bytes that were in use at the same time */
+    inline size_t getPeakBytes() const { return m_peak; }
+
+    std::string toString() const;
+
+    MTS_DECLARE_CLASS()
+protected:
+    virtual ~GuidingArena();
+
+    /** Moves to the next block that is large enough, allocating it if necessary */
+    void * allocSlow( size_t size );
+
+    /** Records the high-water mark in the statistics if it has grown */
+    void reportPeak();
+
+private:
+    struct Block {
+        uint8_t * data;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    /** Current block, offset in it and the number of bytes in the blocks before it */
+    size_t m_block, m_offset, m_blockStart;
+    size_t m_used, m_peak, m_reportedPeak;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_GUIDING_ARENA_H_ */
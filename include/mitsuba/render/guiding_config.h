@@ -53,6 +53,12 @@ struct GuidingConfig {
 		m_importance.jensen.w		                = props.getInteger( "jensenRes", m_importance.jensen.w );
 		m_importance.jensen.h						= m_importance.jensen.w;
 
+		// SD-tree settings
+		m_importance.sdtree.maxMemoryMB				= props.getFloat( "sdtreeMemory", m_importance.sdtree.maxMemoryMB );
+		m_importance.sdtree.spatialThreshold		= props.getInteger( "sdtreeSpatialThreshold", m_importance.sdtree.spatialThreshold );
+		m_importance.sdtree.quadtreeThreshold		= props.getFloat( "sdtreeQuadtreeThreshold", m_importance.sdtree.quadtreeThreshold );
+		m_importance.sdtree.refinePasses			= props.getInteger( "sdtreeRefinePasses", m_importance.sdtree.refinePasses );
+
 		// Distribution to be fit
 		std::string iifName							= props.getString("IIF", "gaussian");
 
@@ -64,6 +70,8 @@ struct GuidingConfig {
             m_importance.distType = Importance::EGaussianMixture;
         } else if ( iifName == "jensen" ) {
             m_importance.distType = Importance::EJensen;
+        } else if ( iifName == "sdtree" ) {
+            m_importance.distType = Importance::ESDTree;
         } else {                
             SLog( EError, "Unknown importance function \"%s\".", iifName.c_str() );
         }
@@ -78,8 +86,13 @@ struct GuidingConfig {
 		m_mitsuba.useEnvironmentSampler		= props.getBoolean( "useEnvSampler", m_mitsuba.useEnvironmentSampler );
 		m_mitsuba.useGuidedSampling			= props.getBoolean( "useGuidedSampling", m_mitsuba.useGuidedSampling );
 		m_mitsuba.bsdfSamplingProbability	= props.getFloat( "bsdfSamplingProbability", m_mitsuba.bsdfSamplingProbability );
+        m_mitsuba.productSampling           = props.getBoolean( "productSampling", m_mitsuba.productSampling );
+        m_mitsuba.learnBsdfSamplingProbability = props.getBoolean( "learnBsdfSamplingProbability", m_mitsuba.learnBsdfSamplingProbability );
         m_mitsuba.maxDepth                  = props.getInteger( "maxDepth", m_mitsuba.maxDepth );
         m_mitsuba.useWeightWindow           = props.getBoolean( "useWeightWindow", m_mitsuba.useWeightWindow );
+        m_mitsuba.interleavedTraining       = props.getBoolean( "interleavedTraining", m_mitsuba.interleavedTraining );
+        m_mitsuba.distributionsFile         = props.getString( "distributionsFile", m_mitsuba.distributionsFile );
+        m_mitsuba.warmStart                 = props.getBoolean( "warmStart", m_mitsuba.warmStart );
     }
 
 	inline void computeBBox( const Scene * scene ) {
@@ -110,6 +123,9 @@ struct GuidingConfig {
         case Importance::EJensen:
             res = "EJensen";
             break;
+        case Importance::ESDTree:
+            res = "ESDTree";
+            break;
         default:
             res = "unknown";
             SLog( EError, "Unknown smapler type" );                
@@ -136,6 +152,10 @@ struct GuidingConfig {
 			<< "  knnParticles \t\t= " << m_importance.particles.knn << "," << std::endl
 			<< "  globalSizeMult \t\t= " << m_importance.globalSizeMult << "," << std::endl
 			<< "  jensenRes \t\t= " << m_importance.jensen.w << "," << std::endl
+			<< "  sdtreeMemory \t\t= " << m_importance.sdtree.maxMemoryMB << "," << std::endl
+			<< "  sdtreeSpatialThreshold \t= " << m_importance.sdtree.spatialThreshold << "," << std::endl
+			<< "  sdtreeQuadtreeThreshold \t= " << m_importance.sdtree.quadtreeThreshold << "," << std::endl
+			<< "  sdtreeRefinePasses \t= " << m_importance.sdtree.refinePasses << "," << std::endl
 			<< "  IFF \t\t\t= " << samplerTypeStr(m_importance.distType,true) << "," << std::endl
 			<< "  passes \t\t\t= " << m_mitsuba.nPasses << "," << std::endl
 			<< "  nPhotons \t\t\t= " << m_mitsuba.nPhotons << "," << std::endl
@@ -144,7 +164,12 @@ struct GuidingConfig {
 			<< "  usePingPong \t\t= " << m_mitsuba.usePingPong << "," << std::endl
 			<< "  useEnvSampler \t\t= " << m_mitsuba.useEnvironmentSampler << "," << std::endl
 			<< "  useGuidedSampling \t\t= " << m_mitsuba.useGuidedSampling << "," << std::endl
-			<< "  bsdfSamplingProbability \t= " << m_mitsuba.bsdfSamplingProbability << std::endl;
+			<< "  bsdfSamplingProbability \t= " << m_mitsuba.bsdfSamplingProbability << "," << std::endl
+			<< "  productSampling \t\t= " << m_mitsuba.productSampling << "," << std::endl
+			<< "  learnBsdfSamplingProbability \t= " << m_mitsuba.learnBsdfSamplingProbability << "," << std::endl
+			<< "  interleavedTraining \t= " << m_mitsuba.interleavedTraining << "," << std::endl
+			<< "  distributionsFile \t= \"" << m_mitsuba.distributionsFile << "\"," << std::endl
+			<< "  warmStart \t\t= " << m_mitsuba.warmStart << std::endl;
 		return oss.str();
 	}
 
@@ -165,12 +190,27 @@ struct GuidingConfig {
 		bool useEnvironmentSampler;
 		/** Bsdf sampling probability */
 		Float bsdfSamplingProbability;
+        /** Sample the product of the guiding distribution with a lobe fitted to the bsdf 
+            instead of the distribution alone? */
+        bool productSampling;
+        /** Learn the bsdf sampling probability per cache record during rendering?
+            bsdfSamplingProbability is then only the initial value. */
+        bool learnBsdfSamplingProbability;
 		/** Guided sampling? */
 		bool useGuidedSampling;
         /** Maximum lenght of a light-path (number of segments) */
         int maxDepth;
         /** Weight window on/off */
         bool useWeightWindow;
+        /** Keep refining the samplers with particles from the rendering phase?
+            Every batch of nPhotons photons and nImportons importons is used for one
+            refinement step that runs in the background. */
+        bool interleavedTraining;
+        /** File with the trained samplers. If it exists and matches the scene, the samplers are 
+            loaded from it instead of being trained, otherwise it is written after the training phase. */
+        std::string distributionsFile;
+        /** Run the training passes also when the samplers were loaded, refining the loaded ones? */
+        bool warmStart;
 
         struct WeightWindowConfig {
             /** Lower bound of weight window in multiplies of 1e-6.
@@ -198,8 +238,13 @@ struct GuidingConfig {
 			useEnvironmentSampler   = false;
 			useGuidedSampling       = true;
 			bsdfSamplingProbability = 0.5f;
+            productSampling         = false;
+            learnBsdfSamplingProbability = false;
             maxDepth                = -1;
             useWeightWindow         = true;
+            interleavedTraining     = false;
+            distributionsFile       = "";
+            warmStart               = false;
 		}
 	};
 
@@ -0,0 +1,116 @@
+/*
+    This file is part of a demo implementation of an importance sampling technique
+    described in the "On-line Learning of Parametric Mixture Models for Light Transport Simulation"
+    (SIGGRAPH 2014) paper.
+    The implementation is based on Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_GUIDING_RESOURCE_H_)
+#define __MITSUBA_RENDER_GUIDING_RESOURCE_H_
+
+#include <mitsuba/core/lock.h>
+#include <mitsuba/render/scene.h>
+#include <mitsuba/render/guiding_config.h>
+#include <mitsuba/render/weightwindow.h>
+
+MTS_NAMESPACE_BEGIN
+
+class MitsubaImportanceCamera;
+
+/** Trained guiding distributions that all renderers of a parallel process query. The resource is 
+    registered with the scheduler once and does not change while the process runs, every renderer 
+    wraps it in its own lightweight GuidingContext (see guiding.h), which holds the state that used 
+    to be duplicated per renderer (weight window mode, observed particles).
+
+    On the machine that trained the distributions, the samplers stay owned by GuidingSamplers, which 
+    may keep refining them in the background. When the resource is sent to a remote node, a snapshot 
+    of the samplers is serialized and loaded there by the first call to wakeup(). The samplers are 
+    not refined on remote nodes. */
+class MTS_EXPORT_RENDER GuidingResource : public SerializableObject {
+public:
+    /** Owner of the samplers on the machine that trained them (see GuidingSamplers) */
+    class Owner {
+    public:
+        virtual Importance::Sampler * getRadianceSampler() const = 0;
+        virtual Importance::Sampler * getImportanceSampler() const = 0;
+
+        /** Returns the current samplers together with an object that keeps them unchanged 
+            until it is released, used for serializing them while they are being refined */
+        virtual ref<Object> acquireSamplers( Importance::Sampler *& radianceSampler, 
+            Importance::Sampler *& importanceSampler ) const = 0;
+
+    protected:
+        virtual ~Owner() {}
+    };
+
+    /** Creates the resource on the machine that trained the samplers. The properties are the ones 
+        the configuration was created from, they are used to recreate it on remote nodes. */
+    GuidingResource( Owner * owner, const Properties & props, const GuidingConfig & cfg, const WeightWindow & ww );
+
+    /** Unserializes the resource on a remote node, the samplers are loaded by wakeup() */
+    GuidingResource( Stream * stream, InstanceManager * manager );
+
+    void serialize( Stream * stream, InstanceManager * manager ) const;
+
+    /** Makes the samplers ready for queries, has to be called by every renderer before it uses them 
+        (e.g. in WorkProcessor::prepare). Only the first call on a remote node does any work. */
+    void wakeup( const Scene * scene );
+
+    const GuidingConfig & getConfig() const { return m_cfg; }
+
+    /** Weight window of the rendering phase, renderers switch the tracing mode of their own copy */
+    const WeightWindow & getWeightWindow() const { return m_ww; }
+
+    Importance::Sampler * getRadianceSampler() const { 
+        return m_owner ? m_owner->getRadianceSampler() : m_radianceSampler; 
+    }
+
+    Importance::Sampler * getImportanceSampler() const { 
+        return m_owner ? m_owner->getImportanceSampler() : m_importanceSampler; 
+    }
+
+    /** Owner of the samplers, NULL on remote nodes */
+    Owner * getOwner() const { return m_owner; }
+
+    std::string toString() const;
+
+    MTS_DECLARE_CLASS()
+protected:
+    virtual ~GuidingResource();
+
+private:
+    Owner * m_owner;
+    Properties m_props;
+    GuidingConfig m_cfg;
+    WeightWindow m_ww;
+
+    /** Samplers loaded on a remote node and the data they are loaded from */
+    Importance::Sampler * m_radianceSampler;
+    Importance::Sampler * m_importanceSampler;
+    std::string m_radianceData, m_importanceData;
+    MitsubaImportanceCamera * m_camera;
+    Importance::Stats m_radianceStats, m_importanceStats;
+    ref<Mutex> m_mutex;
+    bool m_awake;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_GUIDING_RESOURCE_H_ */
@@ -116,6 +116,10 @@ inline const std::string cacheStatsToString( const Importance::Stats & cacheStat
         << "Rejected queries: " << cacheStats.queries.rejected << std::endl
         << "Cache records: " << cacheStats.cache.records << std::endl                    
         << "Cache records found: " << cacheStats.cache.recordsFound << std::endl                    
+        << "Cache snapshots published: " << cacheStats.cache.contention.snapshots << std::endl
+        << "Cache snapshots reclaimed: " << cacheStats.cache.contention.reclaimedSnapshots << std::endl
+        << "Cache insertions waiting for a writer: " << cacheStats.cache.contention.writerWaits << std::endl
+        << "Cache hits in pending records: " << cacheStats.cache.contention.pendingHits << std::endl
         << "]";
     
     return str.str();
@@ -381,6 +381,49 @@ public:
 	 */
 	bool rayIntersectAll(const Ray &ray) const;
 
+	/**
+	 * \brief Intersect up to four rays against all normal and "special"
+	 * primitives and only return the traveled distances
+	 *
+	 * When coherent ray tracing support is compiled in, the rays are
+	 * traversed as a single SSE packet (see \ref ShapeKDTree::rayIntersectPacket),
+	 * otherwise this function falls back to \ref rayIntersectAll().
+	 *
+	 * \param rays
+	 *    Array of \c count rays
+	 *
+	 * \param count
+	 *    Number of valid entries in \c rays (at most four)
+	 *
+	 * \param t
+	 *    Receives the traveled distance of each ray, or
+	 *    <tt>+infinity</tt> when no intersection was found
+	 */
+	void rayIntersectAllPacket(const Ray *rays, size_t count, Float *t) const;
+
+	/**
+	 * \brief Resolve a batch of deferred visibility queries
+	 *
+	 * The queries are grouped by the octant of their direction and
+	 * traced four at a time with \ref rayIntersectAllPacket().
+	 * Afterwards, \ref ShadowRayQueue::isVisible() returns whether
+	 * the segment of a query is free of any intersection.
+	 */
+	void resolveShadowRays(ShadowRayQueue &queue) const;
+
+	/**
+	 * \brief Can visibility between two points be determined by a
+	 * single shadow ray?
+	 *
+	 * This is the case when the scene contains no participating media,
+	 * no index-matched (\ref BSDF::ENull) surfaces (including the
+	 * "special" shapes) and no instanced geometry, whose materials
+	 * are not known here. Otherwise, connections have to
+	 * use \ref evalTransmittance() or a similar function instead of a
+	 * \ref ShadowRayQueue.
+	 */
+	bool hasOpaqueVisibility() const;
+
 	/**
 	 * \brief Return the transmittance between \c p1 and \c p2 at the
 	 * specified time (and acount for "special" primitives).
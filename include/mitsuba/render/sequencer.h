@@ -0,0 +1,149 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_SEQUENCER_H_)
+#define __MITSUBA_RENDER_SEQUENCER_H_
+
+#include <mitsuba/core/sched.h>
+#include <map>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Merges the work results of a parallel process in the order of
+ * the sequence numbers of their work units
+ *
+ * Floating point sums depend on the order of their terms, so merging
+ * the results in the order in which they complete makes the image depend
+ * on the scheduling. Results that arrive early are copied (\ref copy())
+ * and held back until all results with lower sequence numbers have been
+ * merged (\ref merge()).
+ *
+ * The number of held back copies is bounded by a window: the process
+ * asks \ref pause() before it hands out a work unit and returns
+ * \ref ParallelProcess::EPause if the unit would be more than
+ * \ref getWindow() units ahead of the next result to be merged. Once
+ * \ref put() has made room again, it tells the process to resubmit
+ * itself with \ref Scheduler::schedule(). That call must happen after
+ * the lock that protects the sequencer has been released, since the
+ * scheduler holds its own lock while it calls \ref pause() through
+ * \ref ParallelProcess::generateWork().
+ *
+ * Not thread-safe.
+ *
+ * \ingroup librender
+ */
+template <typename T> class ResultSequencer {
+public:
+	inline ResultSequencer() : m_next(0), m_window(0),
+		m_pausedAt(0), m_paused(false) { }
+
+	virtual ~ResultSequencer() { }
+
+	/**
+	 * \brief Set the maximum distance between the sequence number of a
+	 * new work unit and the next result to be merged
+	 *
+	 * At most <tt>window-1</tt> copies are held back. \c 0 means that
+	 * the process is never paused.
+	 */
+	inline void setWindow(size_t window) { m_window = window; }
+
+	/// Return the window (see \ref setWindow())
+	inline size_t getWindow() const { return m_window; }
+
+	/**
+	 * \brief Check whether the work unit \c sequence must wait until
+	 * earlier results have been merged
+	 *
+	 * \return \c true if the process should return \ref ParallelProcess::EPause
+	 */
+	bool pause(size_t sequence) {
+		if (m_window == 0 || sequence < m_next + m_window)
+			return false;
+		m_paused = true;
+		m_pausedAt = sequence;
+		return true;
+	}
+
+	/**
+	 * \brief Merge the result of the work unit \c sequence once its
+	 * predecessors are
+	 *
+	 * \param cancelled
+	 *    The result of a cancelled work unit is merged right away, since
+	 *    it is not reproducible anyway
+	 * \return \c true if the process was paused and can be resubmitted
+	 */
+	bool put(size_t sequence, const T *wr, bool cancelled) {
+		if (cancelled) {
+			merge(wr);
+			m_pending[sequence] = NULL;
+		} else if (sequence != m_next) {
+			m_pending[sequence] = copy(wr);
+		} else {
+			merge(wr);
+			++m_next;
+		}
+
+		/* Merge the held back results that are next in the sequence */
+		typename std::map<size_t, ref<T> >::iterator it = m_pending.begin();
+		while (it != m_pending.end() && it->first == m_next) {
+			if (it->second)
+				merge(it->second.get());
+			m_pending.erase(it++);
+			++m_next;
+		}
+
+		if (m_paused && m_pausedAt < m_next + m_window) {
+			m_paused = false;
+			return true;
+		}
+		return false;
+	}
+
+	/// Merge all held back results regardless of gaps in the sequence
+	void flush() {
+		for (typename std::map<size_t, ref<T> >::iterator it = m_pending.begin();
+				it != m_pending.end(); ++it) {
+			if (it->second)
+				merge(it->second.get());
+		}
+		m_pending.clear();
+	}
+
+	/// Number of results that are held back
+	inline size_t getPendingCount() const { return m_pending.size(); }
+protected:
+	/// Create a copy of a result that outlives the next use of its work processor
+	virtual ref<T> copy(const T *wr) = 0;
+
+	/// Accumulate a result into the output of the process
+	virtual void merge(const T *wr) = 0;
+private:
+	/// Held back copies; cancelled results only mark their place with \c NULL
+	std::map<size_t, ref<T> > m_pending;
+	size_t m_next, m_window;
+	size_t m_pausedAt;
+	bool m_paused;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_SEQUENCER_H_ */
@@ -0,0 +1,123 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_SHADOWQUEUE_H_)
+#define __MITSUBA_RENDER_SHADOWQUEUE_H_
+
+#include <mitsuba/core/ray.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Batch of deferred visibility queries
+ *
+ * Callers enqueue the shadow rays of several connections together with
+ * an arbitrary payload (e.g. the index of the connection in a local
+ * array) and let \ref Scene::resolveShadowRays() trace all of them at
+ * once in packets of four rays. Afterwards, \ref isVisible() tells which
+ * of the queries were unoccluded.
+ *
+ * The queries only test for \a any intersection, i.e. they are exact
+ * as long as the scene contains no index-matched (\ref BSDF::ENull)
+ * surfaces and no participating media, see
+ * \ref Scene::hasOpaqueVisibility().
+ *
+ * The storage is kept between batches, so a queue should be reused
+ * with \ref clear() rather than recreated.
+ *
+ * \ingroup librender
+ */
+class ShadowRayQueue {
+public:
+	inline ShadowRayQueue() : m_resolved(false) { }
+
+	/**
+	 * \brief Enqueue a visibility query between two points
+	 *
+	 * The ray starts at \c origin and uses the same offsets as
+	 * \ref Scene::evalTransmittance() to avoid self-intersections.
+	 *
+	 * \return \c false (and nothing is enqueued) when both points coincide
+	 */
+	inline bool enqueue(const Point &origin, bool originOnSurface,
+			const Point &target, bool targetOnSurface, Float time, uint32_t payload) {
+		Vector d = target - origin;
+		Float length = d.length();
+		if (length == 0)
+			return false;
+		d /= length;
+		enqueue(Ray(origin, d, originOnSurface ? Epsilon : 0,
+			length * (targetOnSurface ? (1-ShadowEpsilon) : 1), time), payload);
+		return true;
+	}
+
+	/// Enqueue a visibility query along a ray segment
+	inline void enqueue(const Ray &ray, uint32_t payload) {
+		m_rays.push_back(ray);
+		m_payloads.push_back(payload);
+		m_resolved = false;
+	}
+
+	/// Return the number of queries
+	inline size_t size() const { return m_rays.size(); }
+
+	/// Does the queue contain no queries?
+	inline bool isEmpty() const { return m_rays.empty(); }
+
+	/// Has the batch been resolved since the last query was enqueued?
+	inline bool isResolved() const { return m_resolved; }
+
+	/// Return the ray of a query
+	inline const Ray &getRay(size_t i) const { return m_rays[i]; }
+
+	/// Return the payload of a query
+	inline uint32_t getPayload(size_t i) const { return m_payloads[i]; }
+
+	/// Is the segment of a query unoccluded? (only valid after resolving)
+	inline bool isVisible(size_t i) const { return m_visible[i] != 0; }
+
+	/// Remove all queries (does not release the storage)
+	inline void clear() {
+		m_rays.clear();
+		m_payloads.clear();
+		m_visible.clear();
+		m_resolved = false;
+	}
+
+	/// Return a human-readable string representation
+	inline std::string toString() const {
+		std::ostringstream oss;
+		oss << "ShadowRayQueue[size=" << m_rays.size()
+			<< ", resolved=" << (m_resolved ? "true" : "false") << "]";
+		return oss.str();
+	}
+private:
+	friend class Scene;
+
+	std::vector<Ray> m_rays;
+	std::vector<uint32_t> m_payloads;
+	std::vector<uint8_t> m_visible;
+	/// Scratch space of the resolver: query indices sorted by direction octant
+	std::vector<uint32_t> m_order;
+	bool m_resolved;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_SHADOWQUEUE_H_ */
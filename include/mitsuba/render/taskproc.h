@@ -0,0 +1,81 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_TASKPROC_H_)
+#define __MITSUBA_RENDER_TASKPROC_H_
+
+#include <mitsuba/core/sched.h>
+#include <boost/function.hpp>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Runs the iterations of a parallel loop on the local workers
+ * of the scheduler
+ *
+ * This is meant for loops inside of a preprocessing step that are too
+ * fine-grained to deserve their own \ref ParallelProcess, e.g. the
+ * training of the guiding distributions. Every task becomes one work
+ * unit, and the tasks must not depend on the order in which they run.
+ * The process is strictly local, since the task function cannot be
+ * sent to remote workers.
+ *
+ * \ingroup librender
+ */
+class MTS_EXPORT_RENDER LocalTaskProcess : public ParallelProcess {
+public:
+	typedef boost::function<void (size_t)> Task;
+
+	/**
+	 * \brief Call <tt>task(i)</tt> for every \c i in <tt>[0, taskCount)</tt>
+	 * and wait until all calls have finished
+	 *
+	 * The tasks run in the calling thread when the scheduler has no
+	 * local workers or when it is called from a worker itself, where
+	 * waiting for other work units could dead-lock. An exception thrown
+	 * by a task is reported as an error once all work units finished.
+	 */
+	static void run(size_t taskCount, const Task &task);
+
+	// =============================================================
+	//! @{ \name Implementation of the ParallelProcess interface
+	// =============================================================
+
+	EStatus generateWork(WorkUnit *unit, int worker);
+	void processResult(const WorkResult *result, bool cancelled);
+	ref<WorkProcessor> createWorkProcessor() const;
+	bool isLocal() const;
+
+	//! @}
+	// =============================================================
+
+	MTS_DECLARE_CLASS()
+protected:
+	LocalTaskProcess(size_t taskCount, const Task &task);
+
+	/// Virtual destructor
+	virtual ~LocalTaskProcess() { }
+private:
+	const Task &m_task;
+	size_t m_taskCount, m_nextTask;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_TASKPROC_H_ */
@@ -0,0 +1,186 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_TILEDBLOCK_H_)
+#define __MITSUBA_RENDER_TILEDBLOCK_H_
+
+#include <mitsuba/render/imageblock.h>
+#include <mitsuba/core/lock.h>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Full-resolution splatting buffer made of lazily allocated tiles
+ *
+ * Splat-style integrators (light tracing, UPM, VCM, ...) can deposit a
+ * sample anywhere in the image, so every worker traditionally keeps a
+ * full-resolution \ref ImageBlock. This class instead splits the image
+ * into square tiles that are only allocated once a sample lands in them.
+ *
+ * Every sample is rasterized into exactly one tile, which is an
+ * \ref ImageBlock with a border that is one pixel wider than the one
+ * required by the reconstruction filter. The image is the sum of all
+ * tiles including their borders, see \ref develop().
+ *
+ * A block is either \a sparse (the default), which is meant for the
+ * private buffer of a single worker, or \a dense. Dense blocks allocate
+ * all tiles up front and guard each of them with its own lock, so that
+ * several threads can merge sparse blocks into them with
+ * \ref put(const TiledImageBlock *) at the same time. Both blocks of a
+ * merge must have the same size and tile size. Merges are cheapest when
+ * they also have the same filter border, since their tiles can then be
+ * added one by one.
+ *
+ * \ingroup librender
+ */
+class MTS_EXPORT_RENDER TiledImageBlock : public WorkResult {
+public:
+	/**
+	 * Construct a new tiled image block
+	 *
+	 * \param fmt
+	 *    Specifies the pixel format -- see \ref Bitmap::EPixelFormat
+	 * \param size
+	 *    Size of the image in pixels
+	 * \param filter
+	 *    Reconstruction filter used by \ref put(const Point2 &, const Float *)
+	 * \param dense
+	 *    Allocate all tiles up front and lock them individually in merges?
+	 * \param tileSize
+	 *    Width and height of a tile in pixels
+	 * \param channels
+	 *    Specifies the number of output channels. This is only necessary
+	 *    when \ref Bitmap::EMultiChannel is chosen as the pixel format
+	 */
+	TiledImageBlock(Bitmap::EPixelFormat fmt, const Vector2i &size,
+		const ReconstructionFilter *filter, bool dense = false,
+		int tileSize = 64, int channels = -1);
+
+	/// Return the size of the image
+	inline const Vector2i &getSize() const { return m_size; }
+
+	/// Return the width and height of a tile
+	inline int getTileSize() const { return m_tileSize; }
+
+	/// Return the number of tiles that cover the image
+	inline size_t getTileCount() const { return m_tiles.size(); }
+
+	/// Return the number of tiles that currently hold any samples
+	size_t getUsedTileCount() const;
+
+	/// Does this block allocate all tiles and lock them in merges?
+	inline bool isDense() const { return m_dense; }
+
+	/// Clear all used tiles to zero (keeps the allocated storage)
+	void clear();
+
+	/**
+	 * \brief Store a single sample
+	 *
+	 * Allocates the tile of the sample on first use. This function must
+	 * not be called concurrently on the same block.
+	 *
+	 * \param pos
+	 *    Denotes the sample position in fractional pixel coordinates
+	 * \param value
+	 *    Pointer to an array containing each channel of the sample values.
+	 * \return \c false if one of the sample values was \a invalid
+	 */
+	inline bool put(const Point2 &pos, const Float *value) {
+		int x = clamp(floorToInt(pos.x) / m_tileSize, 0, m_tileCount.x - 1),
+		    y = clamp(floorToInt(pos.y) / m_tileSize, 0, m_tileCount.y - 1);
+		size_t index = x + y * (size_t) m_tileCount.x;
+		if (EXPECT_NOT_TAKEN(!m_used[index]))
+			useTile(index);
+		return m_tiles[index]->put(pos, value);
+	}
+
+	/// Store a spectrum, alpha and weight sample (see \ref ImageBlock)
+	inline bool put(const Point2 &pos, const Spectrum &spec, Float alpha) {
+		Float temp[SPECTRUM_SAMPLES + 2];
+		for (int i=0; i<SPECTRUM_SAMPLES; ++i)
+			temp[i] = spec[i];
+		temp[SPECTRUM_SAMPLES] = alpha;
+		temp[SPECTRUM_SAMPLES + 1] = 1.0f;
+		return put(pos, temp);
+	}
+
+	/**
+	 * \brief Accumulate the used tiles of another block into this one
+	 *
+	 * When this block is dense, each tile is locked while it is being
+	 * updated, and the function can be called from several threads at
+	 * the same time.
+	 */
+	void put(const TiledImageBlock *block);
+
+	/**
+	 * \brief Write a weighted region of the image into a bitmap
+	 *
+	 * The region starts at \c offset and has the size of \c target, which
+	 * must be a floating point bitmap with the pixel format of this block.
+	 * Pixels without any tile are set to zero. When this block is dense,
+	 * the tiles are locked while they are read.
+	 */
+	void develop(Bitmap *target, const Point2i &offset = Point2i(0),
+		Float weight = 1.0f) const;
+
+	/// Return the whole image as a new bitmap
+	ref<Bitmap> toBitmap(Float weight = 1.0f) const;
+
+	// ======================================================================
+	//! @{ \name Implementation of the WorkResult interface
+	// ======================================================================
+
+	void load(Stream *stream);
+	void save(Stream *stream) const;
+	std::string toString() const;
+
+	//! @}
+	// ======================================================================
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Virtual destructor
+	virtual ~TiledImageBlock();
+
+	/// Allocate a tile if necessary and mark it as used
+	void useTile(size_t index);
+
+	/// Create the storage of a tile
+	ref<ImageBlock> createTile(size_t index) const;
+
+	/// Accumulate a tile with a different border into the tiles it overlaps
+	void putTile(const ImageBlock *tile);
+protected:
+	Bitmap::EPixelFormat m_pixelFormat;
+	int m_channels;
+	Vector2i m_size, m_tileCount;
+	int m_tileSize, m_borderSize;
+	const ReconstructionFilter *m_filter;
+	bool m_dense;
+	ref_vector<ImageBlock> m_tiles;
+	/* Also taken by the const readers (e.g. develop()) */
+	mutable ref_vector<Mutex> m_locks;
+	std::vector<bool> m_used;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_TILEDBLOCK_H_ */
@@ -41,6 +41,21 @@ public:
             SAssert( !eyeWeightScale.isZero() );            
     }
 
+    /// Unserialize a weight window, the tracing mode is not stored
+    WeightWindow( Stream * stream ) : m_useAdjoint( false ) {
+        lowerBound          = stream->readSingle();
+        upperBound          = stream->readSingle();
+        lightWeightScale    = Spectrum( stream );
+        eyeWeightScale      = Spectrum( stream );
+    }
+
+    void serialize( Stream * stream ) const {
+        stream->writeSingle( lowerBound );
+        stream->writeSingle( upperBound );
+        lightWeightScale.serialize( stream );
+        eyeWeightScale.serialize( stream );
+    }
+
     inline bool shouldSplit(const Spectrum & color, bool useAdjoint) const {        
         int index = getMaxBand(color);
         return color[index] > upperBound * getWeightScale(useAdjoint)[index];        
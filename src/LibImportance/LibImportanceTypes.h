@@ -35,6 +35,9 @@
 #include "shared/Hit.h"
 #include <iostream>
 #include "shared/Stack.h"
+#include "shared/ProductSampling.h"
+#include "shared/RestrictedSampling.h"
+#include "caching/CacheStats.h"
 
 #pragma warning(push)
 #pragma warning(disable:4100)
@@ -74,6 +77,54 @@ namespace Importance {
 		virtual Float gatherAreaPdfDistrib(Vector3 wo, Float radius, Vector2* componentCDFs, Vector2* componentBounds, int &topComponentCDFs, int &topComponentBounds, int baseCDFs, int baseBounds) = 0;
 		virtual Vector3 sampleGatherAreaDistrib(Vector2 samples, Vector3 wo, Float radius, int ptrNode, Vector2* componentCDFs, Vector2* componentBounds) = 0;
 
+        /// Product sampling with a bsdf lobe (see shared/ProductSampling.h)
+
+        /** 
+           Computes the product of the distribution with an isotropic Gaussian lobe around lobeDirection,
+           the variance of the lobe is in steradians. Returns false if the distribution does not support it.
+        */
+        virtual bool initProduct(const Vector3 & lobeDirection, const Float lobeVariance, ProductBuffer & product) const {
+            return false;
+        }
+
+        /// Samples a direction from the product, returns false if the sample is outside of the distribution
+        virtual bool sampleProduct(const ProductBuffer & product, const Vector2 & random, Vector3 & output, float & pdf) const {
+            return false;
+        }
+
+        virtual float pdfProduct(const ProductBuffer & product, const Vector3 & direction) const {
+            return 0.f;
+        }
+
+        /// Restricted sampling towards many gather disks (see shared/RestrictedSampling.h)
+
+        /** 
+           Prepares the lobes of the distribution for gatherAreaPdfRestricted() and sampleGatherAreaRestricted(),
+           which answer the same queries as gatherAreaPdfDistrib() and sampleGatherAreaDistrib() without 
+           factorizing the lobes again. Returns false if the distribution does not support it.
+        */
+        virtual bool initRestricted(RestrictedMixture & mixture) const {
+            return false;
+        }
+
+        /// Same as gatherAreaPdfDistrib(), the lobe CDF is stored as a single level under the root node
+        virtual Float gatherAreaPdfRestricted(const RestrictedMixture & mixture, Vector3 wo, Float radius, Vector2* componentCDFs, Vector2* componentBounds, int &topComponentCDFs, int &topComponentBounds, int baseCDFs, int baseBounds) const {
+            return 0.f;
+        }
+
+        virtual Vector3 sampleGatherAreaRestricted(const RestrictedMixture & mixture, Vector2 samples, int ptrNode, const Vector2* componentCDFs, const Vector2* componentBounds) const {
+            return Vector3(0.f);
+        }
+
+        /** 
+           Returns the learned probability of sampling the bsdf instead of the distribution (or defaultValue
+           if the distribution does not learn it) and fills the record that trains it.
+        */
+        virtual Float bsdfSelection(const Float defaultValue, BsdfSelectionRecord & record) const {
+            record.count = 0;
+            return defaultValue;
+        }
+
         virtual void release() = 0;
 
         virtual std::string toString() const {
@@ -176,7 +227,8 @@ lkhFunction = info.lkhFunction;
         EPharr,
         EHey,			
         EGaussianMixture,
-        EJensen
+        EJensen,
+        ESDTree
     };
 
     /************************************************************************/
@@ -345,6 +397,23 @@ lkhFunction = info.lkhFunction;
             int w, h;
         } jensen;
 
+        struct SDTree {
+            SDTree() {
+                maxMemoryMB         = 64.f;
+                spatialThreshold    = 4000;
+                quadtreeThreshold   = 0.01f;
+                refinePasses        = 2;
+            }
+            /// memory budget of the trained tree in megabytes
+            float maxMemoryMB;
+            /// number of particles in a spatial leaf above which the leaf is split
+            int spatialThreshold;
+            /// fraction of the energy of a quadtree above which its node is subdivided
+            float quadtreeThreshold;
+            /// how many times a training pass refines the tree and splats the particles again
+            int refinePasses;
+        } sdtree;
+
         ELogLevel logLevel;
 
         Vector3f sceneBboxMin;
@@ -470,6 +539,7 @@ lkhFunction = info.lkhFunction;
             TStatsInt64 recordsFound;          
             TStatsInt64 newRecords;
             TStatsInt64 newUndersampledRecords;
+            CacheContentionStats<TStatsInt64> contention;
         } cache;
 
         void reset() {
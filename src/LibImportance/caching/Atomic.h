@@ -0,0 +1,116 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ___ATOMIC___
+#define ___ATOMIC___
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include <cstddef>
+#include "../shared/Config.h"
+
+namespace Importance {
+    /// \brief Pointer that is read and written atomically. Loads have acquire semantics and 
+    ///        stores have release semantics.
+    ///
+    ///        Uses the Interlocked intrinsics with Visual Studio (which has no <atomic> before 
+    ///        Visual Studio 2012) and the __atomic builtins elsewhere.
+    template<class T>
+    class AtomicPointer {
+    protected:
+        T * volatile value;
+
+    private:
+        AtomicPointer(const AtomicPointer &);
+        AtomicPointer& operator=(const AtomicPointer &);
+
+    public:
+
+        explicit AtomicPointer(T * value = NULL) : value(value) {}
+
+        IMPORTANCE_INLINE T * load() const {
+#if defined(_MSC_VER)
+            /* Aligned loads are atomic and not reordered with later loads on x86 and x64, 
+               the barrier only stops the compiler */
+            T * result = value;
+            _ReadWriteBarrier();
+            return result;
+#else
+            return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+#endif
+        }
+
+        IMPORTANCE_INLINE void store(T * newValue) {
+            exchange(newValue);
+        }
+
+        /// \brief Stores a new value and returns the previous one
+        IMPORTANCE_INLINE T * exchange(T * newValue) {
+#if defined(_MSC_VER)
+#if defined(_WIN64)
+            return (T *) _InterlockedExchangePointer((void * volatile *) &value, (void *) newValue);
+#else
+            return (T *) _InterlockedExchange((volatile long *) &value, (long) newValue);
+#endif
+#else
+            return __atomic_exchange_n(&value, newValue, __ATOMIC_ACQ_REL);
+#endif
+        }
+    };
+
+    /// \brief Counter that is read and written atomically, with the same ordering as 
+    ///        \ref AtomicPointer
+    class AtomicCount {
+    protected:
+        volatile long value;
+
+    private:
+        AtomicCount(const AtomicCount &);
+        AtomicCount& operator=(const AtomicCount &);
+
+    public:
+
+        explicit AtomicCount(int value = 0) : value(value) {}
+
+        IMPORTANCE_INLINE int load() const {
+#if defined(_MSC_VER)
+            const long result = value;
+            _ReadWriteBarrier();
+            return (int) result;
+#else
+            return (int) __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+#endif
+        }
+
+        IMPORTANCE_INLINE void store(int newValue) {
+#if defined(_MSC_VER)
+            _InterlockedExchange(&value, newValue);
+#else
+            __atomic_store_n(&value, (long) newValue, __ATOMIC_RELEASE);
+#endif
+        }
+    };
+}
+
+#endif
\ No newline at end of file
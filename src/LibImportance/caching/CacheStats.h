@@ -73,4 +73,19 @@ namespace Importance {
         int particleSearchCount;
         Float sqrSearchRadius;
     };
+
+    /// \brief Contention counters of the importance cache (see \ref ImportanceCache). Readers 
+    ///        never lock, so the counters only cover the insertion of new records.
+    template<class TStatsInt64>
+    struct CacheContentionStats {
+        /// \brief Number of snapshots of the cache that were published to the readers
+        TStatsInt64 snapshots;
+        /// \brief Number of insertions that had to wait for another inserting thread
+        TStatsInt64 writerWaits;
+        /// \brief Number of lookups that missed the snapshot but found a record that was 
+        ///        inserted by another thread since the last publication
+        TStatsInt64 pendingHits;
+        /// \brief Number of old snapshots released at safe points
+        TStatsInt64 reclaimedSnapshots;
+    };
 }
\ No newline at end of file
@@ -157,6 +157,114 @@ public:
 		return dir;
 	}
 
+    virtual bool initProduct(const Vector3 & lobeDirection, const Float lobeVariance, ProductBuffer & product) const {
+        product.count = 0;
+        for ( int i = 0; i < found; i++ ) {
+            if ( !records[ i ]->productComponents( lobeDirection, lobeVariance, getWeight( i ) / cdf[ found - 1 ], i, product ) ) {
+                return false;
+            }
+        }
+        return product.finish();
+    }
+
+    virtual bool sampleProduct(const ProductBuffer & product, const Vector2 & random, Vector3 & output, float & pdf) const {
+        Vector2 newRandom = random;
+        const ProductComponent & component = product.select( newRandom.y );
+        if ( !records[ component.model ]->productDirection( component.sample( newRandom ), output ) ) {
+            return false;
+        }
+        pdf = pdfProduct( product, output );
+        return pdf > 0.f;
+    }
+
+    virtual float pdfProduct(const ProductBuffer & product, const Vector3 & direction) const {
+        ImStaticArray<Vector2, MAX_CACHE_KNN> points;
+        ImStaticArray<bool,    MAX_CACHE_KNN> valid;
+        for ( int i = 0; i < found; i++ ) {
+            valid[ i ] = records[ i ]->productPoint( direction, points[ i ] );
+        }
+        float result = 0.f;
+        for ( int i = 0; i < product.count; i++ ) {
+            const ProductComponent & component = product.components[ i ];
+            if ( valid[ component.model ] ) {
+                result += product.probability( i ) * component.pdf( points[ component.model ] );
+            }
+        }
+        return result / product.jacobian;
+    }
+
+    virtual bool initRestricted(RestrictedMixture & mixture) const {
+        mixture.count = 0;
+        mixture.models = found;
+        for ( int i = 0; i < found; i++ ) {
+            mixture.modelStart[ i ] = mixture.count;
+            if ( !records[ i ]->restrictedLobes( getWeight( i ) / cdf[ found - 1 ], i, mixture ) ) {
+                return false;
+            }
+        }
+        mixture.modelStart[ found ] = mixture.count;
+        return mixture.count > 0;
+    }
+
+    virtual Float gatherAreaPdfRestricted(const RestrictedMixture & mixture, Vector3 wo, Float radius, 
+        Vector2* componentCDFs, Vector2* componentBounds, int &topComponentCDFs, int &topComponentBounds,
+        int baseCDFs, int baseBounds) const {
+        // one root node over the lobes of all models, each lobe points to its two bounds
+        const int numNode = mixture.count;
+        const int pnode0 = topComponentCDFs;
+        componentCDFs[ pnode0 ].y = *(float*)&numNode;
+        topComponentCDFs += numNode + 1;
+
+        const int bound0 = topComponentBounds;
+        ImStaticArray<Float, MAX_RESTRICTED_LOBES> probs;
+        Float totalProb = 0.f;
+        for ( int i = 0; i < mixture.models; i++ ) {
+            totalProb += records[ i ]->restrictedPdf( mixture, i, wo, radius, probs.ptr(), componentBounds, topComponentBounds );
+        }
+        const Float invTotalProb = ( totalProb > 0.f ) ? 1.f / totalProb : 0.f;
+        for ( int i = 0; i < numNode; i++ ) {
+            int ptrBound = -( bound0 + 2 * i + baseBounds );
+            componentCDFs[ pnode0 + i + 1 ] = Vector2( probs[ i ] * invTotalProb, *(float*)&ptrBound );
+        }
+        componentCDFs[ pnode0 ].x = totalProb;
+        return totalProb;
+    }
+
+    virtual Vector3 sampleGatherAreaRestricted(const RestrictedMixture & mixture, Vector2 samples, int ptrNode, 
+        const Vector2* componentCDFs, const Vector2* componentBounds) const {
+        const int numNode = *(const int*)&componentCDFs[ ptrNode ].y;
+        Float cdfi = 0.f;
+        for ( int i = 0; i < numNode; i++ ) {
+            const Vector2 nodei = componentCDFs[ ptrNode + 1 + i ];
+            const Float pdfi = nodei.x;
+            if ( samples.x <= cdfi + pdfi && pdfi > 0.f ) {
+                const int ptrBound = -*(const int*)&nodei.y;
+                samples.x = ( samples.x - cdfi ) / pdfi;
+                const RestrictedLobe & lobe = mixture.lobes[ i ];
+                Vector3 dir;
+                if ( !records[ lobe.model ]->restrictedDirection( lobe, samples, 
+                    componentBounds[ ptrBound ], componentBounds[ ptrBound + 1 ], dir ) ) {
+                    return Vector3( 0.f );
+                }
+                return dir;
+            }
+            cdfi += pdfi;
+        }
+        return Vector3( 0.f );
+    }
+
+    virtual Float bsdfSelection(const Float defaultValue, BsdfSelectionRecord & record) const {
+        record.count = found;
+        record.defaultValue = defaultValue;
+        Float result = 0.f;
+        for ( int i = 0; i < found; i++ ) {
+            record.learners[ i ] = &records[ i ]->getBsdfSelection();
+            record.weights[ i ] = getWeight( i ) / cdf[ found - 1 ];
+            result += record.weights[ i ] * record.learners[ i ]->probability( defaultValue );
+        }
+        return result;
+    }
+
     virtual void release() {}
 
     virtual std::string toString() const {
@@ -53,6 +53,9 @@
 #include "MultirefOctree.h"
 #include "../shared/IIterator.h"
 #include "CacheTypes.h"
+#include "Atomic.h"
+#include <algorithm>
+#include <vector>
 
 #pragma warning(push)
 #pragma warning(disable:4127)
@@ -60,8 +63,6 @@
 
 namespace Importance {
 
-#define USE_OCTREE
-
     enum InterpolationMetricType {
         METRIC_KL_DIVERGENCE = 0,
         METRIC_IRRADIANCE = 1,
@@ -73,6 +74,26 @@ namespace Importance {
 
     const int NEIGHBOUR_CLAMPING_KNN = 20;
 
+    /// \brief Number of consecutive records refitted by a single task in \ref CachedSampler::refreshSamples
+    const int REFRESH_CHUNK_SIZE = 64;
+
+    /// \brief Cache of distribution records that are interpolated during rendering.
+    ///
+    ///        Lookups are lock-free: they search an immutable snapshot of the records and of 
+    ///        the octree over them, which is published through an atomic pointer. Inserting 
+    ///        threads are serialized by the write lock. New records are first appended to 
+    ///        the pending range after the snapshot and a new snapshot is published once there 
+    ///        are enough of them. Lookups that miss the snapshot check the pending range under 
+    ///        the shared lock before creating a new record (see \ref getInterpolatedPending).
+    ///
+    ///        Insertions clamp the validity radii of the neighbouring records in place. The 
+    ///        lock-free lookups therefore never read the radii from the records but from the 
+    ///        copy made when the snapshot was published, i.e. the clamped radii become visible 
+    ///        with the next snapshot.
+    ///
+    ///        Replaced snapshots may still be used by running lookups. They are only released 
+    ///        at safe points, i.e. in \ref init, \ref rebuildTree and \ref reclaimSnapshots, 
+    ///        which must not run concurrently with lookups or insertions.
     template<class TDistributionModel>
     class ImportanceCache {
         friend void testViz();
@@ -82,38 +103,76 @@ namespace Importance {
     public:
         typedef CacheRecord<TDistributionModel> Record;       
 
+        /// \brief Serializes insertions of new records, lookups never take it
         mutable ReaderWriterLock lock;
 
-        // all records in simple linear array
+        // all records in simple linear array, modified only under the write lock
         IStack<Record*> records;
     protected:
 
-        const Config* config;
+        /// \brief Immutable view of the cache used by the lock-free lookups
+        struct Snapshot {
+            /// \brief Copy of the first records.size() records of the cache
+            IStack<Record*> records;
+            /// \brief Validity radii of the records at the time of the publication
+            IStack<Float> radii;
+            /// \brief Octree over the records of the snapshot
+            MultirefOctree octree;
+        };
 
-#ifdef USE_OCTREE
-        MultirefOctree octree;
         typedef MultirefOctree::IIterator FoundRecordsIterator;
-#else
-        ImDynamicKdTree<DynamicKd3PtrPositionTraits> tree;
-        int newlyInserted;
-        static const int LEAF_SIZE = 25;
-        class FoundRecordsIterator {
+
+        /// \brief Iterates over the pending records whose validity sphere contains a point, 
+        ///        i.e. it reports the same records as \ref FoundRecordsIterator would if they 
+        ///        were already in the octree
+        class PendingRecordsIterator {
         public:
-            FoundRecordsIterator( const ImStaticArray<KdQueryResult, NEIGHBOUR_CLAMPING_KNN> & nearest, int found ) : m_nearest( nearest ), m_found( found ), m_position( 0 ) {}
+            PendingRecordsIterator( const IStack<Record*> & records, int begin, const Vector3 & query, 
+                const Float validityRadiusMult ) 
+                : m_records( &records ), m_query( query ), m_mult( validityRadiusMult ), m_position( begin - 1 ) { 
+                next(); 
+            }
             IMPORTANCE_INLINE int getNext() { 
-                IMPORTANCE_ASSERT( m_position < m_found );
-                return m_nearest[ m_position ].index; 
+                IMPORTANCE_ASSERT( hasNext() );
+                const int result = m_position;
+                next();
+                return result;
             }
-            IMPORTANCE_INLINE bool hasNext() const { return m_position < m_found; }
+            IMPORTANCE_INLINE bool hasNext() const { return m_position < m_records->size(); }
         private:
-            void operator=( const FoundRecordsIterator& ) {}
-            const ImStaticArray<KdQueryResult, NEIGHBOUR_CLAMPING_KNN> & m_nearest;
+            IMPORTANCE_INLINE void next() {
+                while ( ++m_position < m_records->size() ) {
+                    const Record * record = (*m_records)[ m_position ];
+                    const Float radius = record->validRadius()*m_mult;
+                    if ( (record->position - m_query).square() <= radius*radius ) {
+                        return;
+                    }
+                }
+            }
+            const IStack<Record*> * m_records;
+            Vector3 m_query;
+            Float m_mult;
             int m_position;
-            int m_found;
         };
-#endif
+
+        /// \brief Minimal number of pending records that triggers publication of a new snapshot
+        static const int MIN_PENDING_RECORDS = 32;
+
+        const Config* config;
 
         Stats* stats;
+
+        /// \brief Bounding box of the octree given in \ref init
+        BoundingBox3 bbox;
+
+        /// \brief Snapshot searched by the lock-free lookups
+        AtomicPointer<const Snapshot> published;
+
+        /// \brief Number of records including the pending ones, readable without the lock
+        AtomicCount recordCount;
+
+        /// \brief Replaced snapshots waiting for the next safe point
+        IStack<const Snapshot*> retired;
     protected:   
         struct RecordSearchResult {                
             int index;
@@ -167,6 +226,11 @@ namespace Importance {
             }
         };
 
+        IMPORTANCE_INLINE Float validityRadiusMult() const {
+            return 1/this->config->cache.invGeometryError;
+        }
+
+        /// \brief Must be called either under the write lock or at a safe point
         IMPORTANCE_INLINE void computeValidityCriteria( Float maxRadius, Float pixel2world, 
             bool changeOriginalRadius, Record * record, ValidityCriteria & c ) {
             const CacheStats & cstats = record->distr.m_cacheStats;
@@ -195,28 +259,24 @@ namespace Importance {
             c.R_near = INFINITY;
 
             if( config->cache.neighbourClamping ) {                                
-                lock.lockRead();
-#ifdef USE_OCTREE
-                FoundRecordsIterator it( &this->octree, record->position );
+                /* Neighbours are both in the published snapshot and in the pending range */
+                const Snapshot * snapshot = published.load();
+                FoundRecordsIterator it( &snapshot->octree, record->position );
                 FoundRecordsIterator it2 = it;
-#else
-                ImStaticArray<KdQueryResult, NEIGHBOUR_CLAMPING_KNN> nearest;
-                const int found = this->tree.getClosest(record->position, INFINITY, NEIGHBOUR_CLAMPING_KNN, nearest.ptr());
-                FoundRecordsIterator it( nearest, found );
-                FoundRecordsIterator it2( nearest, found );
-#endif
-                c.R_near = clampRecordByNeighbours( it, record );
+                PendingRecordsIterator pending( this->records, snapshot->records.size(), record->position, validityRadiusMult() );
+                PendingRecordsIterator pending2 = pending;
+                c.R_near = std::min( clampRecordByNeighbours( it, record ), clampRecordByNeighbours( pending, record ) );
                 c.R_tentative = std::min(c.R_near, std::min(c.R_max_photon, c.R_alpha));
                 // this is split in two phases so that we already know all 
                 clampNeighboursByRecord( it2, c, record, changeOriginalRadius );
-                lock.unlockRead();
+                clampNeighboursByRecord( pending2, c, record, changeOriginalRadius );
             }
 
             c.R_tentative = std::min(c.R_near, std::min(c.R_max_photon, c.R_alpha));
         }
 
-        IMPORTANCE_INLINE void takeTheBestResult( const int recordIndex, const Float maxDistanceInverse, const Hit & queryHit, RecordSearchResult & res ) const {
-            const Record * record       = records[ recordIndex ];
+        IMPORTANCE_INLINE void takeTheBestResult( const Record * record, const Float validRadius, const int recordIndex, 
+            const Float maxDistanceInverse, const Hit & queryHit, RecordSearchResult & res ) const {
             float distance              = (record->position - queryHit.position).sizeApprox();
             const float distanceTerm    = distance * maxDistanceInverse;
             const float normalTerm      = 2 * Ff::sqrtFast(1.001f - dot(record->normal, queryHit.normal));
@@ -227,12 +287,56 @@ namespace Importance {
                 res.index       = recordIndex;
                 res.distances   = distance;
                 res.error       = error;
-                res.rejected    = distance > record->validRadius() || normalTerm > 1.f;                
+                res.rejected    = distance > validRadius || normalTerm > 1.f;                
             }
         }
 
+        /// \brief Takes the write lock, counting the cases when another thread holds it
+        IMPORTANCE_INLINE void lockWriteCounted() {
+            if ( !this->lock.tryLockWrite() ) {
+                IMPORTANCE_INC_STATS(stats->cache.contention.writerWaits);
+                this->lock.lockWrite();
+            }
+        }
+
+        /// \brief Publishes the pending records in a new snapshot. Must be called either under 
+        ///        the write lock or at a safe point.
+        void publish() {
+            const Snapshot * old = published.load();
+            Snapshot * snapshot = new Snapshot( *old );
+            for ( int i = old->records.size(); i < this->records.size(); ++i ) {
+                snapshot->records.push( this->records[ i ] );
+                snapshot->octree.addRecord( this->records[ i ]->position, this->records[ i ]->validRadius(), validityRadiusMult() );
+            }
+            /* Also picks up the radii of the published records clamped since the last publication. 
+               Their octree entries keep the larger radii, which only makes the search conservative. */
+            copyRadii( snapshot );
+            published.store( snapshot );
+            retired.push( old );
+            IMPORTANCE_INC_STATS(stats->cache.contention.snapshots);
+        }
+
+        /// \brief Copies the current validity radii of the records of a snapshot that is not yet published
+        void copyRadii( Snapshot * snapshot ) const {
+            snapshot->radii.resize( snapshot->records.size() );
+            for ( int i = 0; i < snapshot->records.size(); ++i ) {
+                snapshot->radii[ i ] = snapshot->records[ i ]->validRadius();
+            }
+        }
+
+        /// \brief Releases all replaced snapshots, only at safe points
+        void releaseRetired() {
+            for ( int i = 0; i < retired.size(); ++i ) {
+                delete retired[ i ];
+                IMPORTANCE_INC_STATS(stats->cache.contention.reclaimedSnapshots);
+            }
+            retired.clear();
+        }
+
     public:
 
+        ImportanceCache() : config( NULL ), stats( NULL ), published( NULL ), recordCount( 0 ) {}
+
         const IStack<Record*>& getRecords() const {
             return records;
         }
@@ -246,17 +350,18 @@ namespace Importance {
             for(auto it = records.begin(); it != records.end(); it++) {
                 delete *it;
             }
+            for ( int i = 0; i < retired.size(); ++i ) {
+                delete retired[ i ];
+            }
+            delete published.load();
         }
 
         // initializes the cache for given scene
         void init(const Config& config, Stats* stats, const BoundingBox3 & bbox) {
             this->stats = stats;
             this->config = &config;            
-#ifdef USE_OCTREE
-            this->octree.build(this->records, bbox, 1/this->config->cache.invGeometryError);
-#else 
-            this->tree.build(this->records.cbegin(), this->records.cend(), bbox, LEAF_SIZE);
-#endif
+            this->bbox = bbox;
+            rebuildTree();
         }
 
         void fillRecords(ImStaticArray<const TDistributionModel*, MAX_CACHE_KNN> & distModels, const KdQueryResult * results, const int used) const {
@@ -276,32 +381,26 @@ namespace Importance {
         const TDistributionModel* add(Record * record, const Float pixel2world, 
 const Float maxRadius ) {
                 IMPORTANCE_ASSERT( record->validRadius() == INFINITY );
+                lockWriteCounted();
                 ValidityCriteria c;
                 computeValidityCriteria( maxRadius, pixel2world, true, record, c );                
                 record->setValidRadius( c.evaluateValidityRadius( record ) );
 				record->originalRadius = record->validRadius();
 
-                this->lock.lockWrite();
                 IMPORTANCE_INC_STATS(stats->cache.records);
                 IMPORTANCE_INC_STATS(stats->cache.newRecords);
                 if ( record->distr.isUndersampled() ) {
                     IMPORTANCE_INC_STATS(stats->cache.newUndersampledRecords);
                 }
                 this->records.push(record);
-#ifdef USE_OCTREE
-                this->octree.addRecord(record->position, record->validRadius(), 1/this->config->cache.invGeometryError);
-#else
-                this->tree.add(record->position, int(this->records.size()-1));
-                ++this->newlyInserted;
-                if(newlyInserted*2 > this->records.size() && this->records.size() > 1000) {
-                    BoundingBox3 bbox(this->config->sceneBboxMin, this->config->sceneBboxMax);
-                    this->tree.build(this->records.cbegin(), this->records.cend(), bbox, LEAF_SIZE);
-                    this->newlyInserted = 0;
-#ifdef LIBIMP_DEBUG
-                    std::cout << "---------Rebuilding tree\n";
-#endif
+                recordCount.store( this->records.size() );
+
+                /* Publish once the pending range is a fraction of the snapshot, so that copying 
+                   the snapshot stays amortized constant per record */
+                const int publishedCount = published.load()->records.size();
+                if ( this->records.size() - publishedCount >= std::max( MIN_PENDING_RECORDS, publishedCount/4 ) ) {
+                    publish();
                 }
-#endif
                 this->lock.unlockWrite();
                 return &record->distr;
         }
@@ -310,6 +409,7 @@ const Float maxRadius ) {
 
 		// This method serves for record validity radius reduction 
 		// Does not use finiteGradient -> hard to implement and not used anymore
+        // Must not run concurrently with add()
 		void updateRecordRadius( Record * record, Float pixel2world, const Float maxRadius ) {
             record->distr.m_cacheStats.sqrSearchRadius = record->distr.getPhotonMaxDistance();
             ValidityCriteria c;
@@ -318,6 +418,7 @@ const Float maxRadius ) {
 		}
       
 
+        /// \brief Lock-free lookup in the published snapshot
         InterpolationResult<TDistributionModel>* getInterpolated(const Hit& hit, const float pixel2world,
             const Float maxRadius, IResultBuffer& buffer, float& outMetric) const {
 
@@ -327,33 +428,25 @@ const Float maxRadius ) {
             RecordSearchResult res;
             res.error = INFINITY;
                     
-            this->lock.lockRead();
-#ifdef USE_OCTREE
-            MultirefOctree::IIterator it(&this->octree, hit.position);
+            const Snapshot * snapshot = published.load();
+            if ( snapshot == NULL ) {
+                return NULL;
+            }
+            MultirefOctree::IIterator it(&snapshot->octree, hit.position);
             int count = 0;
             while(it.hasNext()) {
                 count++;                
-                takeTheBestResult( it.getNext(), maxDistanceInverse, hit, res );
+                const int index = it.getNext();
+                takeTheBestResult( snapshot->records[ index ], snapshot->radii[ index ], index, maxDistanceInverse, hit, res );
             }
             const int found = count;
             IMPORTANCE_INC_STATS_MORE(stats->cache.recordsFound, count);
-#else 
-            const int KNN_SEARCHED = 8;
-            ImStaticArray<KdQueryResult, KNN_SEARCHED> knnResults;
-            const int found = tree.getClosest(hit.position, maximalDistance, KNN_SEARCHED, knnResults.ptr());
-            for(int i = 0; i < found; ++i) {                
-                takeTheBestResult( knnResults[i].index, maxDistanceInverse, hit, res );
-            }
-            IMPORTANCE_INC_STATS_MORE(stats->cache.recordsFound, found);
-#endif
 
             if(found == 0 || res.rejected) {                
-                lock.unlockRead();
                 return NULL;
             }
 
-            const Record* recordA = records[res.index];
-            lock.unlockRead();
+            const Record* recordA = snapshot->records[res.index];
 
 //            if( res.distances*2 < recordA->validRadius() ) {
 //                return new((void*)&buffer) CrossfadeInterpolationResult<TDistributionModel>(&recordA->distr) ;
@@ -364,20 +457,114 @@ const Float maxRadius ) {
               return new((void*)&buffer) CrossfadeInterpolationResult<TDistributionModel>(&recordA->distr) ;
         }
 
+        /// \brief Lookup in the records that were inserted since the last publication. Meant 
+        ///        to be called after \ref getInterpolated failed, before a new record is created.
+        ///        Takes the shared lock, so concurrent misses do not serialize each other and only 
+        ///        wait for a running insertion.
+        InterpolationResult<TDistributionModel>* getInterpolatedPending(const Hit& hit, const float pixel2world,
+            const Float maxRadius, IResultBuffer& buffer) const {
+            /* Avoid the lock when nothing is pending */
+            const Snapshot * snapshot = published.load();
+            if ( snapshot == NULL || recordCount.load() == snapshot->records.size() ) {
+                return NULL;
+            }
+
+            const float maxDistanceInverse = 1/(pixel2world * maxRadius);
+            RecordSearchResult res;
+            res.error = INFINITY;
 
+            /* Insertions modify the pending range and the radii under the write lock */
+            this->lock.lockRead();
+            snapshot = published.load();
+            PendingRecordsIterator it( this->records, snapshot->records.size(), hit.position, validityRadiusMult() );
+            int found = 0;
+            while ( it.hasNext() ) {
+                found++;
+                const int index = it.getNext();
+                takeTheBestResult( this->records[ index ], this->records[ index ]->validRadius(), index, maxDistanceInverse, hit, res );
+            }
+            const Record * recordA = ( found == 0 || res.rejected ) ? NULL : this->records[ res.index ];
+            this->lock.unlockRead();
+
+            if ( recordA == NULL ) {
+                return NULL;
+            }
+            IMPORTANCE_INC_STATS(stats->cache.contention.pendingHits);
+            return new((void*)&buffer) CrossfadeInterpolationResult<TDistributionModel>(&recordA->distr) ;
+        }
+
+
+        /// \brief Rebuilds the octree over all records and publishes it. Safe point.
         void rebuildTree() {
-            const BoundingBox3 bbox = BoundingBox3(this->config->sceneBboxMin, this->config->sceneBboxMax);
-#ifdef USE_OCTREE
-            this->octree.build(this->records, bbox, 1/this->config->cache.invGeometryError);
-#else 
-            newlyInserted = 0;
-            this->tree.build(this->records.cbegin(), this->records.cend(), bbox, LEAF_SIZE);
-#endif
+            Snapshot * snapshot = new Snapshot();
+            snapshot->records = this->records;
+            snapshot->octree.build(this->records, this->bbox, validityRadiusMult());
+            copyRadii( snapshot );
+            const Snapshot * old = published.exchange( snapshot );
+            if ( old ) {
+                retired.push( old );
+            }
+            releaseRetired();
+            IMPORTANCE_INC_STATS(stats->cache.contention.snapshots);
+        }
+
+        /// \brief Publishes the pending records and releases the replaced snapshots. Safe point.
+        void reclaimSnapshots() {
+            if ( this->records.size() > published.load()->records.size() ) {
+                publish();
+            }
+            releaseRetired();
+        }
+
+        /// \brief Writes all records including the pending ones. Must not run concurrently with 
+        ///        insertions.
+        void serialize( std::ostream & output ) const {
+            const unsigned int count = (unsigned int) this->records.size();
+            serializePod( output, count );
+            for ( int i = 0; i < this->records.size(); ++i ) {
+                const Record * record = this->records[ i ];
+                serializePod( output, record->position );
+                serializePod( output, record->normal );
+                serializePod( output, record->validRadius() );
+                serializePod( output, record->originalRadius );
+                serializePod( output, record->gradient );
+                record->distr.serialize( output );
+            }
+        }
+
+        /// \brief Replaces the records by the ones written by \ref serialize and publishes them. 
+        ///        Safe point.
+        void deserialize( std::istream & input ) {
+            for ( int i = 0; i < this->records.size(); ++i ) {
+                delete this->records[ i ];
+            }
+            this->records.clear();
+
+            unsigned int count = 0;
+            deserializePod( input, count );
+            this->records.reserve( count );
+            for ( unsigned int i = 0; i < count; ++i ) {
+                Vector3 position, normal;
+                Float validRadius;
+                deserializePod( input, position );
+                deserializePod( input, normal );
+                deserializePod( input, validRadius );
+                Record * record = new Record( position, normal, validRadius );
+                /* Owned by the cache from now on, even if the rest of the record is truncated */
+                this->records.push( record );
+                deserializePod( input, record->originalRadius );
+                deserializePod( input, record->gradient );
+                record->distr.deserialize( input );
+            }
+            recordCount.store( this->records.size() );
+            IMPORTANCE_INC_STATS_MORE(stats->cache.records, count);
+            rebuildTree();
         }
 
     protected:
 
-        Float clampRecordByNeighbours( FoundRecordsIterator & nearest, const Record * newRecord ) const {
+        template<class TIterator>
+        Float clampRecordByNeighbours( TIterator & nearest, const Record * newRecord ) const {
             Float R_near = INFINITY;            
 
             /* Check neighbours and clamp radius of newly added record so that at maximum it reaches to the closest further edge of a record. */                                    
@@ -393,7 +580,8 @@ const Float maxRadius ) {
         /* changeOriginalRadius has meaning only for debugging in the visualization tool. If nearest records are clamped 
            and changeOriginalRadius is true than we set this clamped radius as the original radius. Thus this should be 
            false if neighbourClamping is used in radius update. */
-        void clampNeighboursByRecord( FoundRecordsIterator & nearest, const ValidityCriteria & c, 
+        template<class TIterator>
+        void clampNeighboursByRecord( TIterator & nearest, const ValidityCriteria & c, 
             const Record * record, bool changeOriginalRadius ) {
             IMPORTANCE_ASSERT( c.isValid() );            
 
@@ -469,6 +657,23 @@ const Float maxRadius ) {
             cache.init(this->config, stats, bbox);
         }
 
+        /// \brief Restores the particles and the cache records with their distributions, 
+        ///        the octree over the records is rebuilt
+        virtual void loadImpl(std::istream& input, const Config& _config, const Camera* camera, Stats* stats) {
+            isCreateNewRecords = true;
+            this->config = _config;
+            SimpleSampler<TDistributionModel>::loadImpl(input, this->config, camera, stats);
+            const BoundingBox3 bbox = BoundingBox3(this->config.sceneBboxMin, this->config.sceneBboxMax);
+            cache.init(this->config, stats, bbox);
+            cache.deserialize(input);
+        }
+
+        /// \brief Must not run concurrently with rendering (see \ref ImportanceCache::serialize)
+        virtual void save( std::ostream & output ) const {
+            SimpleSampler<TDistributionModel>::save(output);
+            cache.serialize(output);
+        }
+
 
         float getInterpolationMetric(const Hit& hit, const InterpolationMetricType type) const {
             if(type == METRIC_KL_DIVERGENCE) {
@@ -546,6 +751,12 @@ const Float maxRadius ) {
                 return NULL;
             }
 
+            /* Another thread may have created a suitable record since the last publication */
+            tmpResult = cache.getInterpolatedPending(hit, pixel2world, config.cache.maxRadius, buffer);
+            if(tmpResult) {
+                return tmpResult;
+            }
+
             ImStaticArray<KdQueryResult, MAX_KNN_PARTICLES> particles;   
             const int found = this->nnquery(hit, particles);
             IMPORTANCE_ASSERT(found < 2 || particles[0].distSqr >= particles[1].distSqr);           
@@ -581,45 +792,93 @@ const Float maxRadius ) {
             }
         }
 
+        /// \brief Returns the indices of the records ordered along a Morton curve over the scene, 
+        ///        ties keep the order of the records
+        void sortRecordsSpatially( const IStack<CacheRecord<TDistributionModel>*> & recs, 
+            std::vector<int> & order ) const {
+            const Vector3 bboxMin( config.sceneBboxMin );
+            const Vector3 extent = Vector3( config.sceneBboxMax ) - bboxMin;
+            std::vector<std::pair<unsigned int, int> > keys( recs.size() );
+            for ( int i = 0; i < (int) recs.size(); ++i ) {
+                unsigned int code = 0;
+                for ( int axis = 0; axis < 3; ++axis ) {
+                    const Float t = extent[ axis ] > 0.f ? 
+                        ( recs[ i ]->position[ axis ] - bboxMin[ axis ] ) / extent[ axis ] : 0.f;
+                    const unsigned int cell = (unsigned int) clamp( int( t * 1024.f ), 0, 1023 );
+                    for ( int bit = 0; bit < 10; ++bit ) {
+                        code |= ( ( cell >> bit ) & 1u ) << ( 3 * bit + axis );
+                    }
+                }
+                keys[ i ] = std::make_pair( code, i );
+            }
+            std::sort( keys.begin(), keys.end() );
+            order.resize( keys.size() );
+            for ( size_t i = 0; i < keys.size(); ++i ) {
+                order[ i ] = keys[ i ].second;
+            }
+        }
+
+        /// \brief Refits the distribution of a record to the current particles
+        void refreshRecord( CacheRecord<TDistributionModel> * rec ) {
+            ImStaticArray<KdQueryResult, MAX_KNN_PARTICLES> searchResults;
+            Hit hit;
+            hit.normal      = rec->normal;
+            hit.position    = rec->position;
+            const int nFound = nnquery( hit, searchResults );
+            CacheStats & cstats         = rec->distr.m_cacheStats;
+            cstats.particleSearchCount  = nFound;
+            cstats.sqrSearchRadius      = searchResults[ 0 ].distSqr;
+            TDistributionModel::getDitributionUpdated( distFactory, hit, searchResults.ptr(), nFound, rec->distr);
+        }
+
+        /// \brief Refits all records to the new particles. The particle tree and the fits run on 
+        ///        the task runner of the sampler (see \ref Sampler::setTaskRunner). Each fit only 
+        ///        depends on its record and the particles, so the result is the same for any 
+        ///        number of threads.
         virtual void refreshSamples( InputIterator & samples, bool refineCache = true ) {            
             IMPORTANCE_ASSERT( this->config.particles.knn <= MAX_KNN_PARTICLES );            
             tree = PointKdTree<Kd3PositionTraits>();
             particles.clear();
 
             fill( particles, samples );
-            tree.build( particles.begin(), particles.end(), PARTICLE_TREE_LEAF_SIZE );
+            tree.build( particles.begin(), particles.end(), PARTICLE_TREE_LEAF_SIZE, *this->taskRunner );
 
 #ifdef LIBIMP_GATHER_PARTICLES
             gatherParticles();
 #endif
 			
-            int counter = 0;
             auto & recs = cache.getRecords();
-            
-            #pragma omp parallel for
-            for ( int i = 0; i < (int) recs.size(); ++i ) {
-                CacheRecord<TDistributionModel> * rec = recs[ i ];
-                counter++;
-                ImStaticArray<KdQueryResult, MAX_KNN_PARTICLES> searchResults;
-                Hit hit;
-                hit.normal      = rec->normal;
-                hit.position    = rec->position;
-                const int nFound = nnquery( hit, searchResults );
-                CacheStats & cstats         = rec->distr.m_cacheStats;
-                cstats.particleSearchCount  = nFound;
-                cstats.sqrSearchRadius      = searchResults[ 0 ].distSqr;
-                TDistributionModel::getDitributionUpdated( distFactory, hit, searchResults.ptr(), nFound, rec->distr);
-				if ( refineCache /*&& nFound > 0*/ ) {
+
+            /* Tasks take consecutive records along a space-filling curve, so that the records 
+               of a task search mostly the same particles */
+            std::vector<int> order;
+            sortRecordsSpatially( recs, order );
+            const int chunkCount = ( (int) order.size() + REFRESH_CHUNK_SIZE - 1 ) / REFRESH_CHUNK_SIZE;
+            this->taskRunner->run( chunkCount, [&]( int chunk ) {
+                const int end = std::min( (int) order.size(), ( chunk + 1 ) * REFRESH_CHUNK_SIZE );
+                for ( int i = chunk * REFRESH_CHUNK_SIZE; i < end; ++i ) {
+                    refreshRecord( recs[ order[ i ] ] );
+                }
+            } );
+
+			if ( refineCache ) {
+                /* Radii are clamped by the radii of the neighbouring records, so they are 
+                   updated serially in the order of the records */
+                for ( int i = 0; i < (int) recs.size(); ++i ) {
+                    CacheRecord<TDistributionModel> * rec = recs[ i ];
+                    Hit hit;
+                    hit.normal      = rec->normal;
+                    hit.position    = rec->position;
 					const Float pixel2world = config.pixel2WorldRatio(hit, camera);
 					cache.updateRecordRadius( rec, pixel2world, 
                                               config.cache.maxRadius );					
-				}
-            }
-			if ( refineCache ) {
+                }
 				cache.rebuildTree();
                 ILog( EInfo, "Cache was refined -i.e. we change records radii." );
-			}
-            ILog( EInfo, "Cache updated - approx. %d records were updated", (int) counter );
+			} else {
+                cache.reclaimSnapshots();
+            }
+            ILog( EInfo, "Cache updated - %d records were updated", (int) recs.size() );
         }
 
         virtual bool isCacheUsed() const {
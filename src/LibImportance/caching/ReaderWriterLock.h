@@ -23,6 +23,7 @@
 #ifndef ___READER_WRITER_LOCK___
 #define ___READER_WRITER_LOCK___
 
+#if defined(_WIN32)
 #include <windows.h>
 
 #ifdef min
@@ -31,44 +32,104 @@
 #ifdef max
     #undef max
 #endif
+#else
+#include <pthread.h>
+#endif
 
+#include <cstring>
 #include "../shared/Config.h"
 
 namespace Importance {
     /// \brief Abstraction of a reader-writer lock. It is used for synchronization of data 
     ///        structures which can be read by multiple readers at once, but only one thread 
     ///        can modify it at any given time.
+    ///
+    ///        Uses SRWLOCK on Windows and pthread_rwlock_t elsewhere. Copying a lock creates 
+    ///        a new unlocked lock.
     class ReaderWriterLock {
     protected:
 
+#if defined(_WIN32)
         /// \brief win API data structure for the lock
         SRWLOCK lock;
+#else
+        /// \brief POSIX data structure for the lock
+        pthread_rwlock_t lock;
+#endif
+
+        IMPORTANCE_INLINE void initialize() {
+#if defined(_WIN32)
+            memset(&lock, 0, sizeof(lock));
+            InitializeSRWLock(&lock);
+#else
+            pthread_rwlock_init(&lock, NULL);
+#endif
+        }
 
     public:
 
         ReaderWriterLock() {
-            memset(&lock, 0, sizeof(lock));
-            InitializeSRWLock(&lock);
+            initialize();
+        }
+
+        ReaderWriterLock(const ReaderWriterLock &) {
+            initialize();
+        }
+
+        ReaderWriterLock& operator=(const ReaderWriterLock &) {
+            return *this;
+        }
+
+        ~ReaderWriterLock() {
+#if !defined(_WIN32)
+            pthread_rwlock_destroy(&lock);
+#endif
         }
 
         /// \brief Locks for reading. Will not block other threads from reading.
         IMPORTANCE_INLINE void lockRead() {
+#if defined(_WIN32)
             AcquireSRWLockShared(&lock);
+#else
+            pthread_rwlock_rdlock(&lock);
+#endif
         }
 
         /// \brief Unlocks reading for current thread
         IMPORTANCE_INLINE void unlockRead() {
+#if defined(_WIN32)
             ReleaseSRWLockShared(&lock);
+#else
+            pthread_rwlock_unlock(&lock);
+#endif
         }
 
         /// \brief Locks writing and reading
         IMPORTANCE_INLINE void lockWrite() {
+#if defined(_WIN32)
             AcquireSRWLockExclusive(&lock);
+#else
+            pthread_rwlock_wrlock(&lock);
+#endif
+        }
+
+        /// \brief Tries to lock writing and reading without blocking
+        /// \return true if the lock was acquired
+        IMPORTANCE_INLINE bool tryLockWrite() {
+#if defined(_WIN32)
+            return TryAcquireSRWLockExclusive(&lock) != 0;
+#else
+            return pthread_rwlock_trywrlock(&lock) == 0;
+#endif
         }
 
         /// \brief Unlocks writing and reading
         IMPORTANCE_INLINE void unlockWrite() {
+#if defined(_WIN32)
             ReleaseSRWLockExclusive(&lock);
+#else
+            pthread_rwlock_unlock(&lock);
+#endif
         }
     };
 }
@@ -23,6 +23,8 @@
 #pragma once
 
 #include "../shared/basicfactory.h"
+#include "../shared/Serialization.h"
+#include "../shared/ProductSampling.h"
 
 namespace Importance {
 
@@ -84,11 +86,88 @@ namespace Importance {
             return m_cacheStats.maxDistance;
         }		
 
+        //////////////////////////////////////////////////////////////////////////
+        // Persistence - implement in every distribution which can be saved with a cache 
+        // (see CachedSampler::save). Hide these methods, do not override them.
+        //////////////////////////////////////////////////////////////////////////
+        void serialize( std::ostream & output ) const {
+            throw std::runtime_error( "serialize() method is not implemented for this distribution" );
+        }
+
+        void deserialize( std::istream & input ) {
+            throw std::runtime_error( "deserialize() method is not implemented for this distribution" );
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+        // Product sampling - implement in every distribution which supports Distribution::initProduct().
+        // Hide these methods, do not override them.
+        //////////////////////////////////////////////////////////////////////////
+
+        /// Appends the product of the model with an isotropic bsdf lobe (variance in steradians) to the buffer
+        IMPORTANCE_INLINE bool productComponents( const Vector3 & lobeDirection, Float lobeVariance, Float weight, 
+            int model, ProductBuffer & product ) const {
+            return false;
+        }
+
+        /// Maps a point of the square parametrization of the model to a direction
+        IMPORTANCE_INLINE bool productDirection( const Vector2 & point, Vector3 & direction ) const {
+            return false;
+        }
+
+        /// Maps a direction to a point of the square parametrization of the model
+        IMPORTANCE_INLINE bool productPoint( const Vector3 & direction, Vector2 & point ) const {
+            return false;
+        }
+
+        /// Learned probability of sampling the bsdf in the region of this model
+        IMPORTANCE_INLINE BsdfSelectionLearner & getBsdfSelection() const {
+            return m_bsdfSelection;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+        // Restricted sampling - implement in every distribution which supports Distribution::initRestricted().
+        // Hide these methods, do not override them.
+        //////////////////////////////////////////////////////////////////////////
+
+        /// Appends the factorized lobes of the model, scaled by weight, to the mixture
+        IMPORTANCE_INLINE bool restrictedLobes( Float weight, int model, RestrictedMixture & mixture ) const {
+            return false;
+        }
+
+        /** 
+            Writes the probability of the restricted domain towards a gather disk of every lobe of the model 
+            in the mixture to probs (already multiplied by the lobe weight) and appends their bounds
+        */
+        IMPORTANCE_INLINE Float restrictedPdf( const RestrictedMixture & mixture, int model, Vector3 wo, Float radius,
+            Float * probs, Vector2 * componentBounds, int & topComponentBounds ) const {
+            return 0.f;
+        }
+
+        /// Samples a direction from the restricted domain of a lobe
+        IMPORTANCE_INLINE bool restrictedDirection( const RestrictedLobe & lobe, Vector2 random, 
+            const Vector2 & bound0, const Vector2 & bound1, Vector3 & direction ) const {
+            return false;
+        }
+
+    protected:
+        /// Writes the caching information of this class, to be used by serialize() of descendants
+        void serializeCacheData( std::ostream & output ) const {
+            serializePod( output, m_cacheStats );
+            serializePod( output, m_undersampled );
+        }
+
+        void deserializeCacheData( std::istream & input ) {
+            deserializePod( input, m_cacheStats );
+            deserializePod( input, m_undersampled );
+        }
+
     public:
         /// Caching statistics 
         CacheStats  m_cacheStats;
     private:
         /// information for caching - says whether we can trust the distribution
         bool m_undersampled;
+        /// Not persisted, it is learned again during rendering
+        mutable BsdfSelectionLearner m_bsdfSelection;
     };
 }
\ No newline at end of file
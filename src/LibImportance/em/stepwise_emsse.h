@@ -117,7 +117,6 @@ namespace Importance {
                 ImStaticArray<TScalar,MAX_FITTED_LOBES / DIMENSION> pdf;
 //                int batchSize = clamp( cfg.batchSize, 1, nDatasetSize );
 				const int lobesCount = model.nComponents() / DIMENSION;
-				static const TScalar v1 = TScalar( 1.0f );
                 for ( int i = 0; i < nDatasetSize; ++i ) {
 
 					//////////////////////////////////////////////////////////////////////////
@@ -130,21 +129,14 @@ namespace Importance {
                     const TScalar & dataWeight    = dataset[ i ].getValue();            
                     const TVector & x			  = dataset[ i ].getPoint();
 
-                    for ( int h = 0; h < lobesCount; ++h ) {
-                        pdf[ h ] = model.responsibility( h, x );
-                        denom += pdf[ h ];
-                    }
-					denom = TScalar( TScalar::dot( denom, v1 ) );
+                    denom = TScalar( model.responsibilities( lobesCount, x, &pdf[ 0 ] ) );
                     auto stats  = model.getStats();
                     Float eta   = std::pow( stats.getCount() + 1.f, -cfg.alpha );
                     /// update weight statistic (common for all components)
                     stats.updateWeight( eta, dataWeight[ 0 ] );
 					TScalar etaV( eta );
 
-                    for ( int h = 0; h < lobesCount; ++h ) {
-                        TScalar posterior = pdf[ h ] / denom;
-                        stats.updateMultiLobe( h, etaV, x, dataWeight, posterior );
-                    }            
+                    stats.updateMultiLobes( lobesCount, etaV, x, dataWeight, &pdf[ 0 ], denom );
                     stats.increment();
 
 					//////////////////////////////////////////////////////////////////////////
@@ -176,15 +168,12 @@ namespace Importance {
             /// Compute log-likelihood for given dataset
             Float eval( const TDataSet & dataset, int nDatasetSize ) const {
 				const int lobesCount = m_model.nComponents() / DIMENSION;
+                ImStaticArray<TScalar,MAX_FITTED_LOBES / DIMENSION> pdf;
                 Float res = 0;
                 for ( int i = 0; i < nDatasetSize; ++i ) {
 
-                    TScalar val = TScalar( 0.f );
-                    for ( int h = 0; h < lobesCount; ++h ) {                 
-                        val += m_model.responsibility( h, dataset[ i ].getPoint() );
-                    }
-
-                    res += dataset[ i ].getValue()[ 0 ] * ( Ff::log( TScalar::dot( val , TScalar( 1.0f ) ) ) );
+                    const Float val = m_model.responsibilities( lobesCount, dataset[ i ].getPoint(), &pdf[ 0 ] );
+                    res += dataset[ i ].getValue()[ 0 ] * ( Ff::log( val ) );
                 }
 
                 return res;
@@ -232,7 +221,6 @@ namespace Importance {
                 Float prevLkh, currLkh = -std::numeric_limits<Float>::max();
                 size_t iterCounter = 0;
 				const int lobesCount = model.nComponents() / DIMENSION;
-				static const TScalar v1 = TScalar( 1.0f );
 
                 do {
                     //std::random_shuffle( dataset.begin(), dataset.end() );
@@ -250,21 +238,14 @@ namespace Importance {
 						const TScalar & dataWeight    = dataset[ i ].getValue();            
 						const TVector & x			  = dataset[ i ].getPoint();
 
-						for ( int h = 0; h < lobesCount; ++h ) {
-							pdf[ h ] = model.responsibility( h, x );
-							denom += pdf[ h ];
-						}
-						denom = TScalar( TScalar::dot( denom, v1 ) );
+						denom = TScalar( model.responsibilities( lobesCount, x, &pdf[ 0 ] ) );
 						auto stats  = model.getStats();
 						Float eta   = std::pow( stats.getCount() + 1.f, -cfg.alpha );
 						/// update weight statistic (common for all components)
 						stats.updateWeight( eta, dataWeight[ 0 ] );
 						TScalar etaV( eta );
 
-						for ( int h = 0; h < lobesCount; ++h ) {
-							TScalar posterior = pdf[ h ] / denom;
-							stats.updateMultiLobe( h, etaV, x, dataWeight, posterior );
-						}            
+						stats.updateMultiLobes( lobesCount, etaV, x, dataWeight, &pdf[ 0 ], denom );
 						stats.increment();
 
 						//////////////////////////////////////////////////////////////////////////
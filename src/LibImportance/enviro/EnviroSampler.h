@@ -151,6 +151,10 @@ namespace Importance {
             float dummy;
             Distribution* result = m_cache.getInterpolated(dummyHit, ONE_DEGREE_IN_EUCLIDIAN_DIST, m_config.cache.maxEnviroRadius, storage, dummy);
             
+            if(result == NULL) {
+                result = m_cache.getInterpolatedPending(dummyHit, ONE_DEGREE_IN_EUCLIDIAN_DIST, m_config.cache.maxEnviroRadius, storage);
+            }
+            
             if(result) {
                 return result;
             } else {
@@ -426,6 +430,8 @@ namespace Importance {
                 }
                 if ( refineCache ) {
                     m_cache.rebuildTree();
+                } else {
+                    m_cache.reclaimSnapshots();
                 }
                 ILog( EInfo, "Importance envmap: cache of position records updated - approx. %d records were updated", (int) counter );
             }            
@@ -64,6 +64,20 @@ namespace Importance {
                 IMPORTANCE_ASSERT( lobe.x1.isReal() && lobe.x2.isReal() );
             }
 
+            /// Updates the first lobesCount lobe groups with the posteriors pdf[ h ] / denom
+            IMPORTANCE_INLINE void updateMultiLobes( int lobesCount, TScalar eta, const QuadVector2 & point, TScalar weight, 
+                const TScalar * pdf, TScalar denom ) {
+                if ( const GaussianKernels * kernels = getGaussianKernels() ) {
+                    kernels->updateStats( GaussianStatsView::create( &m_dist.lobes[ 0 ], lobesCount ), 
+                        reinterpret_cast<const float *>( pdf ), denom[ 0 ], eta[ 0 ], weight[ 0 ], point.x[ 0 ], point.y[ 0 ] );
+                    return;
+                }
+                for ( int h = 0; h < lobesCount; ++h ) {
+                    TScalar posterior = pdf[ h ] / denom;
+                    updateMultiLobe( h, eta, point, weight, posterior );
+                }
+            }
+
             IMPORTANCE_INLINE unsigned int getCount() const { return m_dist.k; }
 
             IMPORTANCE_INLINE void increment() { m_dist.k ++; }
@@ -178,6 +192,20 @@ namespace Importance {
                 return m_dist.lobes[ h ].weights * m_dist.lobes[ h ].pdf( point );
             }
 
+            /// Computes the responsibilities of the first lobesCount lobe groups and returns their sum
+            IMPORTANCE_INLINE Float responsibilities( int lobesCount, const QuadVector2 & point, TScalar * pdf ) const {
+                if ( const GaussianKernels * kernels = getGaussianKernels() ) {
+                    return kernels->responsibilities( m_dist.lobesView( lobesCount ), point.x[ 0 ], point.y[ 0 ], 
+                        reinterpret_cast<float *>( pdf ) );
+                }
+                TScalar denom = TScalar( 0.f );
+                for ( int h = 0; h < lobesCount; ++h ) {
+                    pdf[ h ] = responsibility( h, point );
+                    denom += pdf[ h ];
+                }
+                return TScalar::dot( denom, TScalar( 1.0f ) );
+            }
+
             static Float getMinimalError() {
                 return 1e-3f;
             }
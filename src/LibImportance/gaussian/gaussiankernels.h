@@ -0,0 +1,136 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "../shared/CpuFeatures.h"
+
+#include <cstddef>
+
+/// The wide kernels need AVX2 (Visual Studio 2013) and AVX-512 (Visual Studio 2017) intrinsics
+#if !defined(_MSC_VER) || _MSC_VER >= 1800
+#define IMPORTANCE_AVX2_KERNELS
+#endif
+#if !defined(_MSC_VER) || _MSC_VER >= 1911
+#define IMPORTANCE_AVX512_KERNELS
+#endif
+
+namespace Importance {
+
+    /** Strided view of the 4-wide lobe groups of a Gaussian mixture (GaussianSamplingLobes<Float4>).
+        The offsets point to the first float of each field within a group, unused lanes must have zero weights. */
+    struct GaussianLobesView {
+        const char * base;
+        ptrdiff_t stride;
+        int groups;
+        ptrdiff_t meanX, meanY, cov0, cov1, cov2, normalization, weights;
+
+        template<class TLobe>
+        static IMPORTANCE_INLINE GaussianLobesView create( const TLobe * lobes, int groups ) {
+            const char * b = reinterpret_cast<const char *>( lobes );
+            GaussianLobesView view;
+            view.base           = b;
+            view.stride         = sizeof( TLobe );
+            view.groups         = groups;
+            view.meanX          = reinterpret_cast<const char *>( &lobes->mean.x ) - b;
+            view.meanY          = reinterpret_cast<const char *>( &lobes->mean.y ) - b;
+            view.cov0           = reinterpret_cast<const char *>( &lobes->cov.m[ 0 ] ) - b;
+            view.cov1           = reinterpret_cast<const char *>( &lobes->cov.m[ 1 ] ) - b;
+            view.cov2           = reinterpret_cast<const char *>( &lobes->cov.m[ 2 ] ) - b;
+            view.normalization  = reinterpret_cast<const char *>( &lobes->normalization ) - b;
+            view.weights        = reinterpret_cast<const char *>( &lobes->weights ) - b;
+            return view;
+        }
+    };
+
+    /** Strided view of the online EM sufficient statistics of the lobe groups (GaussianMultiLobe<Float4>) */
+    struct GaussianStatsView {
+        char * base;
+        ptrdiff_t stride;
+        int groups;
+        ptrdiff_t statsW, statsGammaW, x1, x2, x1sqr, x2sqr, x1x2;
+
+        template<class TLobe>
+        static IMPORTANCE_INLINE GaussianStatsView create( TLobe * lobes, int groups ) {
+            char * b = reinterpret_cast<char *>( lobes );
+            GaussianStatsView view;
+            view.base           = b;
+            view.stride         = sizeof( TLobe );
+            view.groups         = groups;
+            view.statsW         = reinterpret_cast<char *>( &lobes->statsW ) - b;
+            view.statsGammaW    = reinterpret_cast<char *>( &lobes->statsGamma_w ) - b;
+            view.x1             = reinterpret_cast<char *>( &lobes->x1 ) - b;
+            view.x2             = reinterpret_cast<char *>( &lobes->x2 ) - b;
+            view.x1sqr          = reinterpret_cast<char *>( &lobes->x1sqr ) - b;
+            view.x2sqr          = reinterpret_cast<char *>( &lobes->x2sqr ) - b;
+            view.x1x2           = reinterpret_cast<char *>( &lobes->x1x2 ) - b;
+            return view;
+        }
+    };
+
+    /** Gaussian mixture kernels that process 8 or 16 lobes at once. They evaluate the same expressions in the 
+        same order as the 4-wide templates in gaussiansse.h and gaussian_stepwise_emsse.h, results only differ 
+        by rounding in sums over the lobes and where the compiler contracts multiply-adds. */
+    struct GaussianKernels {
+        /// Number of lanes
+        int width;
+
+        /// Mixture pdf at a point of the square domain (without the Jacobian of the mapping)
+        float ( *mixturePdf )( const GaussianLobesView & lobes, float x, float y );
+
+        /// Writes the weighted pdfs of all lobes to out (4 floats per group) and returns their sum
+        float ( *responsibilities )( const GaussianLobesView & lobes, float x, float y, float * out );
+
+        /// Stepwise EM update of the sufficient statistics with the posteriors responsibilities/denom
+        void ( *updateStats )( const GaussianStatsView & stats, const float * responsibilities, float denom, 
+            float eta, float weight, float x, float y );
+
+        /// Selects a lobe by its weight, returns its index and its CDF interval
+        int ( *selectLobe )( const GaussianLobesView & lobes, int storedLobes, float u, float * prevCdf, float * cdf );
+
+        /// Bounding boxes of points transformed to the standardized space of every lobe (4 floats per group in the outputs)
+        void ( *gatherAreaBounds )( const GaussianLobesView & lobes, const float * xs, const float * ys, int count,
+            float * xmin, float * xmax, float * ymin, float * ymax );
+    };
+
+    /// Kernels of the individual instruction sets, NULL if they are not compiled in
+    const GaussianKernels * getAvx2GaussianKernels();
+    const GaussianKernels * getAvx512GaussianKernels();
+
+    /// Returns the kernels for the current SIMD level, or NULL if the 4-wide SSE code should be used
+    IMPORTANCE_INLINE const GaussianKernels * getGaussianKernels() {
+        const GaussianKernels * kernels = NULL;
+        switch ( getSimdLevel() ) {
+            case ESimdAVX512:
+                kernels = getAvx512GaussianKernels();
+                if ( kernels ) {
+                    break;
+                }
+            case ESimdAVX2:
+                kernels = getAvx2GaussianKernels();
+                break;
+            default:
+                break;
+        }
+        return kernels;
+    }
+}
@@ -0,0 +1,131 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/// 8-wide Gaussian mixture kernels. The file is compiled with AVX2 (see SConscript), the kernels are only 
+/// called after the run-time check in getGaussianKernels().
+#if defined(__GNUC__) && !defined(__AVX2__)
+#pragma GCC target("avx2,fma")
+#endif
+
+#include "gaussiankernels.h"
+
+#ifdef IMPORTANCE_AVX2_KERNELS
+
+#include <immintrin.h>
+#include "gaussiankernelsimpl.h"
+
+namespace Importance {
+    namespace {
+
+        /// 8 float lanes covering two lobe groups
+        class Float8 {
+        public:
+            enum { WIDTH = 8, GROUPS = 2 };
+
+            __m256 data;
+
+            IMPORTANCE_INLINE Float8() { }
+            IMPORTANCE_INLINE explicit Float8( const __m256 & data ) : data( data ) { }
+            IMPORTANCE_INLINE explicit Float8( const float value ) : data( _mm256_set1_ps( value ) ) { }
+
+            static IMPORTANCE_INLINE Float8 gather( const float * const ptrs[ GROUPS ] ) {
+                const __m128 lo = ptrs[ 0 ] ? _mm_load_ps( ptrs[ 0 ] ) : _mm_setzero_ps();
+                const __m128 hi = ptrs[ 1 ] ? _mm_load_ps( ptrs[ 1 ] ) : _mm_setzero_ps();
+                return Float8( _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 ) );
+            }
+            IMPORTANCE_INLINE void scatter( float * const ptrs[ GROUPS ] ) const {
+                if ( ptrs[ 0 ] ) {
+                    _mm_store_ps( ptrs[ 0 ], _mm256_castps256_ps128( data ) );
+                }
+                if ( ptrs[ 1 ] ) {
+                    _mm_store_ps( ptrs[ 1 ], _mm256_extractf128_ps( data, 1 ) );
+                }
+            }
+            static IMPORTANCE_INLINE Float8 loadu( const float * ptr ) {
+                return Float8( _mm256_loadu_ps( ptr ) );
+            }
+            IMPORTANCE_INLINE void storeu( float * ptr ) const {
+                _mm256_storeu_ps( ptr, data );
+            }
+
+            IMPORTANCE_INLINE Float8 operator+( const Float8 & other ) const {
+                return Float8( _mm256_add_ps( data, other.data ) );
+            }
+            IMPORTANCE_INLINE Float8 operator-( const Float8 & other ) const {
+                return Float8( _mm256_sub_ps( data, other.data ) );
+            }
+            IMPORTANCE_INLINE Float8 operator*( const Float8 & other ) const {
+                return Float8( _mm256_mul_ps( data, other.data ) );
+            }
+            IMPORTANCE_INLINE Float8 operator/( const Float8 & other ) const {
+                return Float8( _mm256_div_ps( data, other.data ) );
+            }
+
+            static IMPORTANCE_INLINE Float8 min( const Float8 & v1, const Float8 & v2 ) {
+                return Float8( _mm256_min_ps( v1.data, v2.data ) );
+            }
+            static IMPORTANCE_INLINE Float8 max( const Float8 & v1, const Float8 & v2 ) {
+                return Float8( _mm256_max_ps( v1.data, v2.data ) );
+            }
+            static IMPORTANCE_INLINE Float8 sqrt( const Float8 & v ) {
+                return Float8( _mm256_sqrt_ps( v.data ) );
+            }
+            /// a > b ? x : y
+            static IMPORTANCE_INLINE Float8 select( const Float8 & a, const Float8 & b, const Float8 & x, const Float8 & y ) {
+                return Float8( _mm256_blendv_ps( y.data, x.data, _mm256_cmp_ps( a.data, b.data, _CMP_GT_OQ ) ) );
+            }
+
+            IMPORTANCE_INLINE float sum() const {
+                __m128 s = _mm_add_ps( _mm256_castps256_ps128( data ), _mm256_extractf128_ps( data, 1 ) );
+                s = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+                s = _mm_add_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+                return _mm_cvtss_f32( s );
+            }
+
+            /// my_fastexp() from fastonebigheader.h
+            static IMPORTANCE_INLINE Float8 fastExp( const Float8 & x ) {
+                const __m256 p      = _mm256_mul_ps( _mm256_set1_ps( 1.442695040f ), x.data );
+                const __m256 clipp  = _mm256_max_ps( _mm256_set1_ps( -126.0f ), p );
+                const __m256 w      = _mm256_round_ps( clipp, _MM_FROUND_TO_ZERO );
+                const __m256 z      = _mm256_add_ps( _mm256_sub_ps( clipp, w ), _mm256_set1_ps( 1.f ) );
+                const __m256 v      = _mm256_sub_ps( _mm256_add_ps( _mm256_add_ps( clipp, _mm256_set1_ps( 121.2740575f ) ), 
+                    _mm256_div_ps( _mm256_set1_ps( 27.7280233f ), _mm256_sub_ps( _mm256_set1_ps( 4.84252568f ), z ) ) ), 
+                    _mm256_mul_ps( _mm256_set1_ps( 1.49012907f ), z ) );
+                return Float8( _mm256_castsi256_ps( _mm256_cvtps_epi32( _mm256_mul_ps( _mm256_set1_ps( 1 << 23 ), v ) ) ) );
+            }
+        };
+    }
+
+    const GaussianKernels * getAvx2GaussianKernels() {
+        return GaussianKernelsImpl::createKernels<Float8>();
+    }
+}
+
+#else
+
+namespace Importance {
+    const GaussianKernels * getAvx2GaussianKernels() {
+        return NULL;
+    }
+}
+
+#endif
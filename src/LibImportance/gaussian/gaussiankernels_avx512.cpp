@@ -0,0 +1,143 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/// 16-wide Gaussian mixture kernels. The file is compiled with AVX-512 (see SConscript), the kernels are only 
+/// called after the run-time check in getGaussianKernels().
+#if defined(__GNUC__) && !defined(__AVX512F__)
+#pragma GCC target("avx512f,avx2,fma")
+#endif
+
+#include "gaussiankernels.h"
+
+#ifdef IMPORTANCE_AVX512_KERNELS
+
+#include <immintrin.h>
+#include "gaussiankernelsimpl.h"
+
+namespace Importance {
+    namespace {
+
+        /// 16 float lanes covering four lobe groups
+        class Float16 {
+        public:
+            enum { WIDTH = 16, GROUPS = 4 };
+
+            __m512 data;
+
+            IMPORTANCE_INLINE Float16() { }
+            IMPORTANCE_INLINE explicit Float16( const __m512 & data ) : data( data ) { }
+            IMPORTANCE_INLINE explicit Float16( const float value ) : data( _mm512_set1_ps( value ) ) { }
+
+            static IMPORTANCE_INLINE Float16 gather( const float * const ptrs[ GROUPS ] ) {
+                const __m128 zero = _mm_setzero_ps();
+                __m512 res = _mm512_castps128_ps512( ptrs[ 0 ] ? _mm_load_ps( ptrs[ 0 ] ) : zero );
+                res = _mm512_insertf32x4( res, ptrs[ 1 ] ? _mm_load_ps( ptrs[ 1 ] ) : zero, 1 );
+                res = _mm512_insertf32x4( res, ptrs[ 2 ] ? _mm_load_ps( ptrs[ 2 ] ) : zero, 2 );
+                res = _mm512_insertf32x4( res, ptrs[ 3 ] ? _mm_load_ps( ptrs[ 3 ] ) : zero, 3 );
+                return Float16( res );
+            }
+            IMPORTANCE_INLINE void scatter( float * const ptrs[ GROUPS ] ) const {
+                if ( ptrs[ 0 ] ) {
+                    _mm_store_ps( ptrs[ 0 ], _mm512_castps512_ps128( data ) );
+                }
+                if ( ptrs[ 1 ] ) {
+                    _mm_store_ps( ptrs[ 1 ], _mm512_extractf32x4_ps( data, 1 ) );
+                }
+                if ( ptrs[ 2 ] ) {
+                    _mm_store_ps( ptrs[ 2 ], _mm512_extractf32x4_ps( data, 2 ) );
+                }
+                if ( ptrs[ 3 ] ) {
+                    _mm_store_ps( ptrs[ 3 ], _mm512_extractf32x4_ps( data, 3 ) );
+                }
+            }
+            static IMPORTANCE_INLINE Float16 loadu( const float * ptr ) {
+                return Float16( _mm512_loadu_ps( ptr ) );
+            }
+            IMPORTANCE_INLINE void storeu( float * ptr ) const {
+                _mm512_storeu_ps( ptr, data );
+            }
+
+            IMPORTANCE_INLINE Float16 operator+( const Float16 & other ) const {
+                return Float16( _mm512_add_ps( data, other.data ) );
+            }
+            IMPORTANCE_INLINE Float16 operator-( const Float16 & other ) const {
+                return Float16( _mm512_sub_ps( data, other.data ) );
+            }
+            IMPORTANCE_INLINE Float16 operator*( const Float16 & other ) const {
+                return Float16( _mm512_mul_ps( data, other.data ) );
+            }
+            IMPORTANCE_INLINE Float16 operator/( const Float16 & other ) const {
+                return Float16( _mm512_div_ps( data, other.data ) );
+            }
+
+            static IMPORTANCE_INLINE Float16 min( const Float16 & v1, const Float16 & v2 ) {
+                return Float16( _mm512_min_ps( v1.data, v2.data ) );
+            }
+            static IMPORTANCE_INLINE Float16 max( const Float16 & v1, const Float16 & v2 ) {
+                return Float16( _mm512_max_ps( v1.data, v2.data ) );
+            }
+            static IMPORTANCE_INLINE Float16 sqrt( const Float16 & v ) {
+                return Float16( _mm512_sqrt_ps( v.data ) );
+            }
+            /// a > b ? x : y
+            static IMPORTANCE_INLINE Float16 select( const Float16 & a, const Float16 & b, const Float16 & x, const Float16 & y ) {
+                return Float16( _mm512_mask_blend_ps( _mm512_cmp_ps_mask( a.data, b.data, _CMP_GT_OQ ), y.data, x.data ) );
+            }
+
+            /// Only uses AVX-512F instructions
+            IMPORTANCE_INLINE float sum() const {
+                __m128 s = _mm_add_ps( 
+                    _mm_add_ps( _mm512_castps512_ps128( data ), _mm512_extractf32x4_ps( data, 1 ) ),
+                    _mm_add_ps( _mm512_extractf32x4_ps( data, 2 ), _mm512_extractf32x4_ps( data, 3 ) ) );
+                s = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+                s = _mm_add_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+                return _mm_cvtss_f32( s );
+            }
+
+            /// my_fastexp() from fastonebigheader.h
+            static IMPORTANCE_INLINE Float16 fastExp( const Float16 & x ) {
+                const __m512 p      = _mm512_mul_ps( _mm512_set1_ps( 1.442695040f ), x.data );
+                const __m512 clipp  = _mm512_max_ps( _mm512_set1_ps( -126.0f ), p );
+                const __m512 w      = _mm512_roundscale_ps( clipp, _MM_FROUND_TO_ZERO );
+                const __m512 z      = _mm512_add_ps( _mm512_sub_ps( clipp, w ), _mm512_set1_ps( 1.f ) );
+                const __m512 v      = _mm512_sub_ps( _mm512_add_ps( _mm512_add_ps( clipp, _mm512_set1_ps( 121.2740575f ) ), 
+                    _mm512_div_ps( _mm512_set1_ps( 27.7280233f ), _mm512_sub_ps( _mm512_set1_ps( 4.84252568f ), z ) ) ), 
+                    _mm512_mul_ps( _mm512_set1_ps( 1.49012907f ), z ) );
+                return Float16( _mm512_castsi512_ps( _mm512_cvtps_epi32( _mm512_mul_ps( _mm512_set1_ps( 1 << 23 ), v ) ) ) );
+            }
+        };
+    }
+
+    const GaussianKernels * getAvx512GaussianKernels() {
+        return GaussianKernelsImpl::createKernels<Float16>();
+    }
+}
+
+#else
+
+namespace Importance {
+    const GaussianKernels * getAvx512GaussianKernels() {
+        return NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,246 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+/** Width independent part of the wide Gaussian mixture kernels. It is included by the translation units of the 
+    individual instruction sets (gaussiankernels_*.cpp), which provide the lane type TPack with an internal linkage:
+
+    - enum { WIDTH, GROUPS } - number of float lanes and of the 4-wide lobe groups they cover,
+    - gather()/scatter() of GROUPS groups (NULL pointers are read as zeros and not written), loadu()/storeu(),
+    - arithmetic operators, min(), max(), sqrt(), select( a, b, x, y ) = a > b ? x : y, 
+    - sum() of all lanes and fastExp() matching my_fastexp().
+
+    Only this file and gaussiankernels.h may be included there, other inline functions of the library would 
+    be compiled with the wider instruction set too. */
+
+#include "gaussiankernels.h"
+
+namespace Importance {
+    namespace GaussianKernelsImpl {
+
+        /// Plain loop instead of the standard algorithms, whose instantiations would be shared with other translation units
+        IMPORTANCE_INLINE void copyFloats( const float * src, int count, float * dst ) {
+            for ( int i = 0; i < count; ++i ) {
+                dst[ i ] = src[ i ];
+            }
+        }
+
+        template<class TPack>
+        IMPORTANCE_INLINE TPack loadField( const GaussianLobesView & view, int group, ptrdiff_t offset ) {
+            const float * ptrs[ TPack::GROUPS ];
+            for ( int i = 0; i < TPack::GROUPS; ++i ) {
+                ptrs[ i ] = group + i < view.groups ? 
+                    reinterpret_cast<const float *>( view.base + ( group + i ) * view.stride + offset ) : NULL;
+            }
+            return TPack::gather( ptrs );
+        }
+
+        template<class TPack>
+        IMPORTANCE_INLINE void fieldPointers( const GaussianStatsView & view, int group, ptrdiff_t offset, float * ptrs[ TPack::GROUPS ] ) {
+            for ( int i = 0; i < TPack::GROUPS; ++i ) {
+                ptrs[ i ] = group + i < view.groups ? 
+                    reinterpret_cast<float *>( view.base + ( group + i ) * view.stride + offset ) : NULL;
+            }
+        }
+
+        /// Weighted pdfs of the lanes, see GaussianSamplingLobes::pdf() and GaussianMixtureModel::responsibility()
+        template<class TPack>
+        IMPORTANCE_INLINE TPack weightedPdf( const GaussianLobesView & lobes, int group, const TPack & x, const TPack & y ) {
+            const TPack dx      = x - loadField<TPack>( lobes, group, lobes.meanX );
+            const TPack dy      = y - loadField<TPack>( lobes, group, lobes.meanY );
+            const TPack tmp     = dx * dy * loadField<TPack>( lobes, group, lobes.cov1 );
+            const TPack form    = dx * dx * loadField<TPack>( lobes, group, lobes.cov0 ) + tmp + tmp + 
+                dy * dy * loadField<TPack>( lobes, group, lobes.cov2 );
+            const TPack pdf     = TPack::fastExp( TPack( -0.5f ) * form ) * loadField<TPack>( lobes, group, lobes.normalization );
+            return loadField<TPack>( lobes, group, lobes.weights ) * pdf;
+        }
+
+        template<class TPack>
+        float mixturePdf( const GaussianLobesView & lobes, float x, float y ) {
+            const TPack xV( x ), yV( y );
+            TPack res( 0.f );
+            for ( int g = 0; g < lobes.groups; g += TPack::GROUPS ) {
+                res = res + weightedPdf<TPack>( lobes, g, xV, yV );
+            }
+            return res.sum();
+        }
+
+        template<class TPack>
+        float responsibilities( const GaussianLobesView & lobes, float x, float y, float * out ) {
+            const TPack xV( x ), yV( y );
+            TPack denom( 0.f );
+            float tail[ TPack::WIDTH ];
+            for ( int g = 0; g < lobes.groups; g += TPack::GROUPS ) {
+                const TPack pdf = weightedPdf<TPack>( lobes, g, xV, yV );
+                denom = denom + pdf;
+                if ( g + TPack::GROUPS <= lobes.groups ) {
+                    pdf.storeu( out + 4 * g );
+                } else {
+                    pdf.storeu( tail );
+                    copyFloats( tail, 4 * ( lobes.groups - g ), out + 4 * g );
+                }
+            }
+            return denom.sum();
+        }
+
+        template<class TPack>
+        IMPORTANCE_INLINE void updateStat( const GaussianStatsView & stats, int g, ptrdiff_t offset, const TPack & a, const TPack & b ) {
+            float * ptrs[ TPack::GROUPS ];
+            fieldPointers<TPack>( stats, g, offset, ptrs );
+            const TPack value = a * TPack::gather( ptrs ) + b;
+            value.scatter( ptrs );
+        }
+
+        /// See GaussianSufficientStats::updateMultiLobe()
+        template<class TPack>
+        void updateStats( const GaussianStatsView & stats, const float * responsibilities, float denom, 
+                float eta, float weight, float x, float y ) {
+            const TPack etaV( eta ), weightV( weight ), denomV( denom ), xV( x ), yV( y );
+            const TPack a = TPack( 1.0f ) - etaV;
+            float tail[ TPack::WIDTH ];
+            for ( int g = 0; g < stats.groups; g += TPack::GROUPS ) {
+                TPack pdf;
+                if ( g + TPack::GROUPS <= stats.groups ) {
+                    pdf = TPack::loadu( responsibilities + 4 * g );
+                } else {
+                    for ( int i = 0; i < TPack::WIDTH; ++i ) {
+                        tail[ i ] = 0.f;
+                    }
+                    copyFloats( responsibilities + 4 * g, 4 * ( stats.groups - g ), tail );
+                    pdf = TPack::loadu( tail );
+                }
+                const TPack posterior = pdf / denomV;
+                const TPack b = etaV * weightV * posterior;
+
+                updateStat<TPack>( stats, g, stats.statsW,      a, b );
+                updateStat<TPack>( stats, g, stats.x1,          a, b * xV );
+                updateStat<TPack>( stats, g, stats.x2,          a, b * yV );
+                updateStat<TPack>( stats, g, stats.x1x2,        a, b * xV * yV );
+                updateStat<TPack>( stats, g, stats.x1sqr,       a, b * xV * xV );
+                updateStat<TPack>( stats, g, stats.x2sqr,       a, b * yV * yV );
+                updateStat<TPack>( stats, g, stats.statsGammaW, a, etaV * posterior );
+            }
+        }
+
+        /// See GaussianSamplingMix::sampleDirection(), blocks of lobes that end below u are skipped at once
+        template<class TPack>
+        int selectLobe( const GaussianLobesView & lobes, int storedLobes, float u, float * prevCdf, float * cdf ) {
+            const int last = storedLobes - 1;
+            float values[ TPack::WIDTH ];
+            float c = 0.f;
+            for ( int g = 0; g < lobes.groups; g += TPack::GROUPS ) {
+                const int first = 4 * g;
+                const TPack weights = loadField<TPack>( lobes, g, lobes.weights );
+                if ( first + TPack::WIDTH <= last ) {
+                    const float blockSum = weights.sum();
+                    if ( c + blockSum < u ) {
+                        c += blockSum;
+                        continue;
+                    }
+                }
+                weights.storeu( values );
+                for ( int i = 0; i < TPack::WIDTH; ++i ) {
+                    const float prev = c;
+                    c += values[ i ];
+                    if ( c >= u || first + i == last ) {
+                        *prevCdf    = prev;
+                        *cdf        = c;
+                        return first + i;
+                    }
+                }
+            }
+            *prevCdf    = c;
+            *cdf        = c;
+            return last;
+        }
+
+        /// See GaussianSamplingLobes::toLobe() and gatherAreaPdfLobe()
+        template<class TPack>
+        void gatherAreaBounds( const GaussianLobesView & lobes, const float * xs, const float * ys, int count,
+                float * xmin, float * xmax, float * ymin, float * ymax ) {
+            float tail[ 4 ][ TPack::WIDTH ];
+            for ( int g = 0; g < lobes.groups; g += TPack::GROUPS ) {
+                const TPack c0     = loadField<TPack>( lobes, g, lobes.cov0 );
+                const TPack c1     = loadField<TPack>( lobes, g, lobes.cov1 );
+                const TPack c2     = loadField<TPack>( lobes, g, lobes.cov2 );
+                const TPack meanX  = loadField<TPack>( lobes, g, lobes.meanX );
+                const TPack meanY  = loadField<TPack>( lobes, g, lobes.meanY );
+
+                /// toLobe() first solves for y if c0 > c2 and for x otherwise, the variables below follow that order
+                const TPack c1Sqr       = c1 * c1;
+                const TPack invDetSqrt  = TPack( 1.0f ) / TPack::sqrt( c0 * c2 - c1Sqr );
+                const TPack diag        = TPack::select( c0, c2, c0, c2 );
+                const TPack otherDiag   = TPack::select( c0, c2, c2, c0 );
+                const TPack aFirst      = TPack::sqrt( diag );
+                const TPack aCross      = TPack( 0.f ) - c1 / aFirst;
+                const TPack aSecond     = TPack::sqrt( otherDiag - c1Sqr / diag );
+                const TPack meanFirst   = TPack::select( c0, c2, meanY, meanX );
+                const TPack meanSecond  = TPack::select( c0, c2, meanX, meanY );
+                const TPack scaleFirst  = invDetSqrt * aFirst;
+
+                TPack minX( 10000.f ), minY( 10000.f ), maxX( -10000.f ), maxY( -10000.f );
+                for ( int i = 0; i < count; ++i ) {
+                    const TPack px( xs[ i ] ), py( ys[ i ] );
+                    const TPack first   = ( TPack::select( c0, c2, py, px ) - meanFirst ) / scaleFirst;
+                    const TPack second  = ( ( TPack::select( c0, c2, px, py ) - meanSecond ) / invDetSqrt - aCross * first ) / aSecond;
+                    const TPack lx      = TPack::select( c0, c2, second, first );
+                    const TPack ly      = TPack::select( c0, c2, first, second );
+                    minX = TPack::min( minX, lx );
+                    minY = TPack::min( minY, ly );
+                    maxX = TPack::max( maxX, lx );
+                    maxY = TPack::max( maxY, ly );
+                }
+
+                if ( g + TPack::GROUPS <= lobes.groups ) {
+                    minX.storeu( xmin + 4 * g );
+                    maxX.storeu( xmax + 4 * g );
+                    minY.storeu( ymin + 4 * g );
+                    maxY.storeu( ymax + 4 * g );
+                } else {
+                    const int n = 4 * ( lobes.groups - g );
+                    minX.storeu( tail[ 0 ] );
+                    maxX.storeu( tail[ 1 ] );
+                    minY.storeu( tail[ 2 ] );
+                    maxY.storeu( tail[ 3 ] );
+                    copyFloats( tail[ 0 ], n, xmin + 4 * g );
+                    copyFloats( tail[ 1 ], n, xmax + 4 * g );
+                    copyFloats( tail[ 2 ], n, ymin + 4 * g );
+                    copyFloats( tail[ 3 ], n, ymax + 4 * g );
+                }
+            }
+        }
+
+        template<class TPack>
+        const GaussianKernels * createKernels() {
+            static const GaussianKernels kernels = {
+                TPack::WIDTH,
+                &mixturePdf<TPack>,
+                &responsibilities<TPack>,
+                &updateStats<TPack>,
+                &selectLobe<TPack>,
+                &gatherAreaBounds<TPack>
+            };
+            return &kernels;
+        }
+    }
+}
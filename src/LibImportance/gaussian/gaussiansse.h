@@ -32,6 +32,7 @@
 #include "../shared/frame.h"
 #include "../caching/CacheStats.h"
 #include "arraysse.h"
+#include "gaussiankernels.h"
 #include "../distribution/DefaultDistributionModel.h"
 
 #include <vector>
@@ -257,9 +258,9 @@ namespace Importance {
 			return x;
 		}
 
-		IMPORTANCE_INLINE Float gatherAreaPdfLobe(int index, std::vector<Vector2> criticalPoints, Vector2* componentBounds, int &topComponentBounds) const{
+		IMPORTANCE_INLINE Float gatherAreaPdfLobe(int index, const float* xs, const float* ys, int numCriticalPoints, Vector2* componentBounds, int &topComponentBounds) const{
 			// uniform sampling, add default bound and return
-			if (criticalPoints.size() == 0){
+			if (numCriticalPoints == 0){
 				componentBounds[topComponentBounds] = Vector2(0.f, 1.f);
 				componentBounds[topComponentBounds + 1] = Vector2(0.f, 1.f);
 				topComponentBounds += 2;
@@ -269,8 +270,8 @@ namespace Importance {
 			// project corner points to inside lobe coords
 			Vector2 xmax = Vector2(-10000.f, -10000.f);
 			Vector2 xmin = Vector2(10000.f, 10000.f);
-			for (int i = 0; i < criticalPoints.size(); i++){
-				Vector2 dir = criticalPoints[i];
+			for (int i = 0; i < numCriticalPoints; i++){
+				Vector2 dir(xs[i], ys[i]);
 				Vector2 x = toLobe(index, dir);
 				xmin.x = std::min(xmin.x, x.x);
 				xmin.y = std::min(xmin.y, x.y);
@@ -323,7 +324,11 @@ namespace Importance {
 				}
 			}
 			*/
+			return gatherAreaPdfBounds(xmin, xmax, componentBounds, topComponentBounds);
+		}
 
+		/// Probability of the bounding box of the critical points in the standardized space of a lobe
+		IMPORTANCE_INLINE static Float gatherAreaPdfBounds(Vector2 xmin, Vector2 xmax, Vector2* componentBounds, int &topComponentBounds) {
 			// calculate the cdfs of this bbox and the probability integral
 			Float cdfx0 = gaussianCDF(xmin.x);
 			Float cdfx1 = gaussianCDF(xmax.x);
@@ -387,6 +392,11 @@ namespace Importance {
         Frame localFrame;
         int storedLobes;
 
+        /// View of the first lobe groups for the wide kernels (gaussiankernels.h)
+        IMPORTANCE_INLINE GaussianLobesView lobesView(int groups) const {
+            return GaussianLobesView::create( &lobes[ 0 ], groups );
+        }
+
 		Vector2 fromPolarToSquareThetaPhi(Float costheta, Float sintheta, Float cosphi, Float sinphi) const{
 			Float z = costheta;
 			Float y = sinphi * sintheta;
@@ -427,18 +437,10 @@ namespace Importance {
 		}
 		
 
-		Float gatherAreaPdfGMM(Vector3 wo, Float radius, 
-			Vector2* componentCDFs, Vector2* componentBounds, int &topComponentCDFs, int &topComponentBounds,
-			int baseCDFs, int baseBounds) const{
-			// initiate sampling components
-			int numNode = storedLobes;
-			int pnode0 = topComponentCDFs;
-			componentCDFs[topComponentCDFs].y = *(float*)&numNode;
-			topComponentCDFs += numNode + 1;
-
-			// local bound
-			std::vector<Vector2> criticalPoints;
-			//criticalPoints.reserve(6);
+		/** Critical points (in the square) of the (theta, phi) box that bounds the directions towards a gather 
+			disk, at most 6 of them. Returns 0 if the disk covers the vertex and the whole domain has to be used. */
+		int gatherAreaCriticalPoints(Vector3 wo, Float radius, float* xs, float* ys) const{
+			int count = 0;
 			Vector3 woLocal = localFrame.toLocal(wo);
 			Float dist = woLocal.length();
 			if (dist > radius){
@@ -452,6 +454,7 @@ namespace Importance {
 				Float theta = acos(woLocal.z);
 				Float theta0 = std::max(0.f, theta - dTheta);
 				Float theta1 = theta + dTheta;
+				Vector2 d[6];
 				if (sqrDisTangent > 0.f){
 					// not covering north pole, theta-phi bounding
 					Float cosdPhi = sqrt(sqrDisTangent) / distProj;
@@ -459,30 +462,25 @@ namespace Importance {
 					Float phi = atan2(woProj.y, woProj.x);
 					Float phi0 = phi - dPhi;
 					Float phi1 = phi + dPhi;			
-
+
 					Float costheta0, costheta1, cosphi0, cosphi1;
 					Float sintheta0, sintheta1, sinphi0, sinphi1;
 					Ff::sincos(theta0, sintheta0, costheta0);
 					Ff::sincos(theta1, sintheta1, costheta1);
 					Ff::sincos(phi0, sinphi0, cosphi0);
-					Ff::sincos(phi1, sinphi1, cosphi1);										Vector2 d0 = fromPolarToSquareThetaPhi(costheta0, sintheta0, cosphi0, sinphi0);
-					Vector2 d1 = fromPolarToSquareThetaPhi(costheta0, sintheta0, cosphi1, sinphi1);
-					Vector2 d2 = fromPolarToSquareThetaPhi(costheta1, sintheta1, cosphi0, sinphi0);
-					Vector2 d3 = fromPolarToSquareThetaPhi(costheta1, sintheta1, cosphi1, sinphi1);
-					criticalPoints.push_back(d0);
-					criticalPoints.push_back(d1);
-					criticalPoints.push_back(d2);
-					criticalPoints.push_back(d3); 
+					Ff::sincos(phi1, sinphi1, cosphi1);
+					d[count++] = fromPolarToSquareThetaPhi(costheta0, sintheta0, cosphi0, sinphi0);
+					d[count++] = fromPolarToSquareThetaPhi(costheta0, sintheta0, cosphi1, sinphi1);
+					d[count++] = fromPolarToSquareThetaPhi(costheta1, sintheta1, cosphi0, sinphi0);
+					d[count++] = fromPolarToSquareThetaPhi(costheta1, sintheta1, cosphi1, sinphi1);
 					for (int i = 0; i < 8; i++){
 						// cover the mapping changing point at 1/4 PI, add corner points
 						Float deltaPhi = (-1.75f + 0.5f * (Float)i) * IMP_PI;
 						if (deltaPhi > phi0 && deltaPhi < phi1){
 							Float sinphi, cosphi;
 							Ff::sincos(deltaPhi, sinphi, cosphi);
-							Vector2 d4 = fromPolarToSquareThetaPhi(costheta0, sintheta0, cosphi, sinphi);
-							Vector2 d5 = fromPolarToSquareThetaPhi(costheta1, sintheta1, cosphi, sinphi);
-							criticalPoints.push_back(d4);
-							criticalPoints.push_back(d5);
+							d[count++] = fromPolarToSquareThetaPhi(costheta0, sintheta0, cosphi, sinphi);
+							d[count++] = fromPolarToSquareThetaPhi(costheta1, sintheta1, cosphi, sinphi);
 							break;
 						}
 						if (deltaPhi > phi1) break;
@@ -492,27 +490,52 @@ namespace Importance {
 					// covering north pole, theta bounding
 					Float costheta1, sintheta1;
 					Ff::sincos(theta1, sintheta1, costheta1);
-					Vector2 d0 = fromPolarToSquareTheta(costheta1, sintheta1, 0.25f * IMP_PI);
-					Vector2 d1 = fromPolarToSquareTheta(costheta1, sintheta1, 0.75f * IMP_PI);
-					Vector2 d2 = fromPolarToSquareTheta(costheta1, sintheta1, 1.25f * IMP_PI);
-					Vector2 d3 = fromPolarToSquareTheta(costheta1, sintheta1, 1.75f * IMP_PI);
-					criticalPoints.push_back(d0);
-					criticalPoints.push_back(d1);
-					criticalPoints.push_back(d2);
-					criticalPoints.push_back(d3);
+					d[count++] = fromPolarToSquareTheta(costheta1, sintheta1, 0.25f * IMP_PI);
+					d[count++] = fromPolarToSquareTheta(costheta1, sintheta1, 0.75f * IMP_PI);
+					d[count++] = fromPolarToSquareTheta(costheta1, sintheta1, 1.25f * IMP_PI);
+					d[count++] = fromPolarToSquareTheta(costheta1, sintheta1, 1.75f * IMP_PI);
+				}
+				for (int i = 0; i < count; i++){
+					xs[i] = (float) d[i].x;
+					ys[i] = (float) d[i].y;
 				}
 			}
 			else{
 				// uniform sampling without bounding
 			}
+			return count;
+		}
+
+		Float gatherAreaPdfGMM(Vector3 wo, Float radius, 
+			Vector2* componentCDFs, Vector2* componentBounds, int &topComponentCDFs, int &topComponentBounds,
+			int baseCDFs, int baseBounds) const{
+			// initiate sampling components
+			int numNode = storedLobes;
+			int pnode0 = topComponentCDFs;
+			componentCDFs[topComponentCDFs].y = *(float*)&numNode;
+			topComponentCDFs += numNode + 1;
+
+			// local bound
+			float xs[8], ys[8];
+			const int numCriticalPoints = gatherAreaCriticalPoints(wo, radius, xs, ys);
+
+			// project the critical points of all lobes at once with the wide kernels
+			const GaussianKernels * kernels = numCriticalPoints == 0 ? NULL : getGaussianKernels();
+			float xmin[MAX_FITTED_LOBES], xmax[MAX_FITTED_LOBES], ymin[MAX_FITTED_LOBES], ymax[MAX_FITTED_LOBES];
+			if (kernels) {
+				kernels->gatherAreaBounds(lobesView((numNode + TLobeType::WIDTH - 1) / TLobeType::WIDTH), 
+					xs, ys, numCriticalPoints, xmin, xmax, ymin, ymax);
+			}
 
 			// calculate bounding and pdf for each lobe
 			Float totalProb = 0.f;
 			int actualGroup = 0, actualLobe = 0;
 			for (int i = 0; i < numNode; i++){
-				int ptrBound = -(topComponentBounds + baseBounds);
-				componentCDFs[pnode0 + i + 1].y = *(float*)&ptrBound;
-				Float probLobe = lobes[actualGroup].gatherAreaPdfLobe(actualLobe, criticalPoints, componentBounds, topComponentBounds);
+				int ptrBound = -(topComponentBounds + baseBounds);
+				componentCDFs[pnode0 + i + 1].y = *(float*)&ptrBound;
+				Float probLobe = kernels ? 
+					TLobeType::gatherAreaPdfBounds(Vector2(xmin[i], ymin[i]), Vector2(xmax[i], ymax[i]), componentBounds, topComponentBounds) :
+					lobes[actualGroup].gatherAreaPdfLobe(actualLobe, xs, ys, numCriticalPoints, componentBounds, topComponentBounds);
 				Float probi = probLobe * lobes[actualGroup].weights[actualLobe];
 				componentCDFs[pnode0 + i + 1].x = probi;
 				totalProb += probi;
@@ -568,18 +591,26 @@ namespace Importance {
             float cdf = 0.f, prev_cdf = 0.0f;
             int actualGroup = 0, actualLobe = 0;
             int i = 0;
-            while(true) {
-                prev_cdf = cdf;
-                cdf += lobes[actualGroup].weights[actualLobe];
-                if(cdf >= searched || i == storedLobes-1) {
-                    break;
-                }
-                actualLobe++;
-                if(actualLobe == TLobeType::WIDTH) {
-                    actualLobe = 0;
-                    actualGroup++;
+            if ( const GaussianKernels * kernels = getGaussianKernels() ) {
+                i = kernels->selectLobe( lobesView( (storedLobes + TLobeType::WIDTH - 1) / TLobeType::WIDTH ), 
+                    storedLobes, searched, &prev_cdf, &cdf );
+                actualGroup = i / TLobeType::WIDTH;
+                actualLobe  = i - actualGroup * TLobeType::WIDTH;
+            }
+            else {
+                while(true) {
+                    prev_cdf = cdf;
+                    cdf += lobes[actualGroup].weights[actualLobe];
+                    if(cdf >= searched || i == storedLobes-1) {
+                        break;
+                    }
+                    actualLobe++;
+                    if(actualLobe == TLobeType::WIDTH) {
+                        actualLobe = 0;
+                        actualGroup++;
+                    }
+                    ++i;
                 }
-                ++i;
             }
             IMPORTANCE_ASSERT(i != storedLobes);
             //if ( i == storedLobes ) {
@@ -604,12 +635,107 @@ namespace Importance {
             }            
             float res = 0.f;
             const int cnt = (storedLobes+TLobeType::WIDTH-1) / TLobeType::WIDTH;
-            for (int i = 0; i < cnt; ++i ) {
-                res += TScalar::dot( lobes[ i ].weights, lobes[i].pdf(TScalar(x.x), TScalar(x.y)) );
+            if ( const GaussianKernels * kernels = getGaussianKernels() ) {
+                res = kernels->mixturePdf( lobesView( cnt ), (float) x.x, (float) x.y );
+            }
+            else {
+                for (int i = 0; i < cnt; ++i ) {
+                    res += TScalar::dot( lobes[ i ].weights, lobes[i].pdf(TScalar(x.x), TScalar(x.y)) );
+                }
             }
             return res / TMapping::jacobian();
         }
 
+        /// Product sampling, see DefaultDistributionModel::productComponents()
+        IMPORTANCE_INLINE bool productComponents( const Vector3 & lobeDirection, Float lobeVariance, Float weight, 
+            int model, ProductBuffer & product ) const {
+            Vector2 bsdfMean;
+            if ( getMapping().toSquare( localFrame, lobeDirection, bsdfMean ) == false ) {
+                return false;
+            }
+            /// The mapping preserves areas, so the variance shrinks by its jacobian
+            const Float bsdfPrecision = TMapping::jacobian() / lobeVariance;
+            product.jacobian = TMapping::jacobian();
+            for ( int i = 0; i < storedLobes && product.count < MAX_PRODUCT_COMPONENTS; ++i ) {
+                const int group = i / TLobeType::WIDTH, lobe = i - group * TLobeType::WIDTH;
+                const TLobeType & l = lobes[ group ];
+                if ( !( l.weights[ lobe ] > 0.f ) ) {
+                    continue;
+                }
+                ProductComponent & component = product.components[ product.count ];
+                if ( component.multiply( Vector2( l.mean.x[ lobe ], l.mean.y[ lobe ] ), 
+                    l.cov.m[ 0 ][ lobe ], l.cov.m[ 1 ][ lobe ], l.cov.m[ 2 ][ lobe ], 
+                    l.weights[ lobe ] * weight, bsdfMean, bsdfPrecision ) ) {
+                    component.model = model;
+                    ++product.count;
+                }
+            }
+            return true;
+        }
+
+        IMPORTANCE_INLINE bool productDirection( const Vector2 & point, Vector3 & direction ) const {
+            return getMapping().fromSquare( localFrame, point, direction );
+        }
+
+        IMPORTANCE_INLINE bool productPoint( const Vector3 & direction, Vector2 & point ) const {
+            return getMapping().toSquare( localFrame, direction, point );
+        }
+
+        /// Restricted sampling, see DefaultDistributionModel::restrictedLobes()
+        IMPORTANCE_INLINE bool restrictedLobes( Float weight, int model, RestrictedMixture & mixture ) const {
+            for ( int i = 0; i < storedLobes && mixture.count < MAX_RESTRICTED_LOBES; ++i ) {
+                const int group = i / TLobeType::WIDTH, lobe = i - group * TLobeType::WIDTH;
+                const TLobeType & l = lobes[ group ];
+                if ( mixture.lobes[ mixture.count ].init( Vector2( l.mean.x[ lobe ], l.mean.y[ lobe ] ), 
+                    l.cov.m[ 0 ][ lobe ], l.cov.m[ 1 ][ lobe ], l.cov.m[ 2 ][ lobe ], l.weights[ lobe ] * weight, model ) ) {
+                    ++mixture.count;
+                }
+            }
+            return true;
+        }
+
+        /// The bounds match gatherAreaPdfGMM(), only the factors of the lobes come from the mixture
+        IMPORTANCE_INLINE Float restrictedPdf( const RestrictedMixture & mixture, int model, Vector3 wo, Float radius,
+            Float * probs, Vector2 * componentBounds, int & topComponentBounds ) const {
+            float xs[ 8 ], ys[ 8 ];
+            const int numCriticalPoints = gatherAreaCriticalPoints( wo, radius, xs, ys );
+            Float totalProb = 0.f;
+            for ( int i = mixture.modelStart[ model ]; i < mixture.modelStart[ model + 1 ]; ++i ) {
+                const RestrictedLobe & lobe = mixture.lobes[ i ];
+                Float probLobe;
+                if ( numCriticalPoints == 0 ) {
+                    componentBounds[ topComponentBounds ] = Vector2( 0.f, 1.f );
+                    componentBounds[ topComponentBounds + 1 ] = Vector2( 0.f, 1.f );
+                    topComponentBounds += 2;
+                    probLobe = 1.f;
+                } else {
+                    Vector2 xmin( 10000.f, 10000.f ), xmax( -10000.f, -10000.f );
+                    for ( int j = 0; j < numCriticalPoints; ++j ) {
+                        const Vector2 x = lobe.toStandard( xs[ j ], ys[ j ] );
+                        xmin.x = std::min( xmin.x, x.x );
+                        xmin.y = std::min( xmin.y, x.y );
+                        xmax.x = std::max( xmax.x, x.x );
+                        xmax.y = std::max( xmax.y, x.y );
+                    }
+                    probLobe = TLobeType::gatherAreaPdfBounds( xmin, xmax, componentBounds, topComponentBounds );
+                }
+                probs[ i ] = probLobe * lobe.weight;
+                totalProb += probs[ i ];
+            }
+            return totalProb;
+        }
+
+        IMPORTANCE_INLINE bool restrictedDirection( const RestrictedLobe & lobe, Vector2 random, 
+            const Vector2 & bound0, const Vector2 & bound1, Vector3 & direction ) const {
+            random.x = random.x * ( bound0.y - bound0.x ) + bound0.x;
+            random.y = random.y * ( bound1.y - bound1.x ) + bound1.x;
+            if ( !( random.x > 0.f && random.x < 1.f && random.y > 0.f && random.y < 1.f ) ) {
+                return false;
+            }
+            const Vector2 x( (Float) inverseGaussianCDF( random.x ), (Float) inverseGaussianCDF( random.y ) );
+            return getMapping().fromSquare( localFrame, lobe.fromStandard( x ), direction );
+        }
+
         static IMPORTANCE_INLINE TMapping getMapping() {
             return TMapping();
         }
@@ -705,6 +831,27 @@ namespace Importance {
 			converged			= false;            
         }
 
+        /// Writes the mixture together with its online EM statistics, so that it can be refined after loading
+        void serialize( std::ostream & output ) const {
+            this->serializeCacheData( output );
+            serializePod( output, this->lobes );
+            serializePod( output, this->localFrame );
+            serializePod( output, this->storedLobes );
+            serializePod( output, k );
+            serializePod( output, statsPointWeight );
+            serializePod( output, converged );
+        }
+
+        void deserialize( std::istream & input ) {
+            this->deserializeCacheData( input );
+            deserializePod( input, this->lobes );
+            deserializePod( input, this->localFrame );
+            deserializePod( input, this->storedLobes );
+            deserializePod( input, k );
+            deserializePod( input, statsPointWeight );
+            deserializePod( input, converged );
+        }
+
 
 IMPORTANCE_INLINE const EmInfo * getInfo() const { 
 #ifdef LIBIMP_STATS
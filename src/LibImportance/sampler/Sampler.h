@@ -24,6 +24,7 @@
 
 #include "../LibImportanceTypes.h"
 #include "../shared/basicfactory.h"
+#include "../shared/TaskRunner.h"
 
 namespace Importance {    
 
@@ -39,14 +40,24 @@ namespace Importance {
         virtual Distribution* getDistributionImpl(const Hit& hit, IResultBuffer& buffer) = 0;
         virtual void initImpl(InputIterator& samples, const Config& config, const Camera* camera, Stats* stats) = 0;
 
+        /// Implement in your sampler to support persistence (see \ref load)
+        virtual void loadImpl(std::istream& input, const Config& config, const Camera* camera, Stats* stats) {
+            throw std::runtime_error( "load() method is not implemented" );
+        }
+
     public:
 
         BasicDistributionFactory * distFactory;
 
         Stats* stats;
 
+    protected:
+
+        /// \brief Runs the parallel parts of \ref refreshSamples, not owned by the sampler
+        TaskRunner * taskRunner;
+
     public:
-        Sampler() : distFactory( NULL ) {}
+        Sampler() : distFactory( NULL ), taskRunner( &SerialTaskRunner::getInstance() ) {}
 
         virtual ~Sampler() { 
             if ( distFactory != NULL ) { delete distFactory; }            
@@ -54,6 +65,12 @@ namespace Importance {
 
         void setDistributionFactory( BasicDistributionFactory * factory ) { distFactory = factory; }
 
+        /// \brief Sets the threads used by \ref refreshSamples, NULL runs everything in the 
+        ///        calling thread. The runner has to outlive the sampler.
+        void setTaskRunner( TaskRunner * runner ) { 
+            taskRunner = runner != NULL ? runner : &SerialTaskRunner::getInstance(); 
+        }
+
         IMPORTANCE_INLINE void init(InputIterator& samples, const Config& config, const Camera* camera, Stats* stats) {
             this->stats = stats;
             //memset(stats, 0, sizeof(*stats));
@@ -61,6 +78,19 @@ namespace Importance {
             SimpleLogger::getInstance()->setLogLevel( config.logLevel );
         }
 
+        /// \brief Restores a sampler written by \ref save instead of training it by \ref init. 
+        ///        The configuration has to be the one the saved sampler was trained with.
+        IMPORTANCE_INLINE void load(std::istream& input, const Config& config, const Camera* camera, Stats* stats) {
+            this->stats = stats;
+            loadImpl(input, config, camera, stats);
+            SimpleLogger::getInstance()->setLogLevel( config.logLevel );
+        }
+
+        /// \brief Writes the trained state of the sampler in the native binary layout
+        virtual void save( std::ostream & output ) const {
+            throw std::runtime_error( "save() method is not implemented" );
+        }
+
         virtual bool isCacheUsed() const = 0;
 
         virtual VizAPI * getVizApi() = 0;
@@ -28,6 +28,7 @@
 #include "../hey/heyfactory.h"
 #include "../gaussian/gaussian_implsse.h"
 #include "../jensen/jensenfactory.h"
+#include "../sdtree/SDTreeSampler.h"
 #include "../enviro/EnviroSampler.h"
 #include "../shared/buffers.h"
 
@@ -59,8 +60,10 @@ namespace Importance {
     public:
         static IEnviroSampler * createEnviroSampler( const Config & cfg ) {
             IEnviroSampler * sampler = NULL;
+            /// there is no SD-tree environment sampler, the Gaussian mixture one is used instead
+            const EDistributionType distType = ( cfg.distType == ESDTree ) ? EGaussianMixture : cfg.distType;
 
-            switch ( cfg.distType ) {
+            switch ( distType ) {
             case EPharr:
                 sampler = new EnviroSampler<Pharr>(); 
                 break;
@@ -75,7 +78,7 @@ namespace Importance {
                 break;
             }
 
-            sampler->setDistributionFactory( createDistributionFactory( cfg.distType ) );
+            sampler->setDistributionFactory( createDistributionFactory( distType ) );
             return sampler;
         }
 
@@ -111,6 +114,10 @@ namespace Importance {
                         sampler = new Importance::JensenSimpleSampler();
                     }
                     break;
+                case ESDTree:
+                    /// the tree replaces the cache, there is nothing to interpolate
+                    sampler = new Importance::SDTreeSampler();
+                    break;
             }
 
             sampler->setDistributionFactory( createDistributionFactory( cfg.distType ) );
@@ -133,6 +140,9 @@ namespace Importance {
                     return new GaussianMixtureFactorySSEHemisphere();
                 case EJensen:
                     return new JensenFactory();
+                case ESDTree:
+                    /// the SD-tree does not fit distributions from particles
+                    return NULL;
             }
 
             IMPORTANCE_ASSERT( false );
@@ -0,0 +1,741 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <queue>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+
+#include "../LibImportanceTypes.h"
+#include "../shared/Stack.h"
+#include "../shared/Particle.h"
+#include "../shared/Serialization.h"
+#include "../shared/TaskRunner.h"
+
+namespace Importance {
+
+    /************************************************************************/
+    /*  Spatio-directional tree                                             */
+    /************************************************************************/
+
+    /// \brief Maximal depth of the directional quadtrees
+    const int SDTREE_MAX_QUADTREE_DEPTH = 20;
+
+    /// \brief Maximal number of regions a gather area query is split into (see \ref SDTree::gatherRegions)
+    const int SDTREE_MAX_GATHER_REGIONS = 16;
+
+    /// \brief Number of bounds (Vector2) a gather area query stores for each region
+    const int SDTREE_GATHER_REGION_BOUNDS = 4;
+
+    /// \brief Number of particles splatted by a single task in \ref SDTree::splat
+    const int SDTREE_SPLAT_CHUNK_SIZE = 4096;
+
+    /// \brief Largest float below one, keeps the rescaled random numbers inside [0, 1)
+    const Float SDTREE_ONE_MINUS_EPS = 0.99999994f;
+
+    /// \brief Maps a unit direction to the cylindrical square ( (cos theta + 1)/2, phi/2pi ), which
+    ///        preserves area up to the factor 4pi
+    IMPORTANCE_INLINE Vector2 sphereToCylindrical( const Vector3 & dir ) {
+        Float phi = std::atan2( dir.y, dir.x ) * INV_TWOPI;
+        if ( phi < 0.f ) {
+            phi += 1.f;
+        }
+        return Vector2( clamp( ( dir.z + 1.f ) * 0.5f, 0.f, 1.f ), clamp( phi, 0.f, 1.f ) );
+    }
+
+    /// \brief Inverse of \ref sphereToCylindrical
+    IMPORTANCE_INLINE Vector3 cylindricalToSphere( const Vector2 & p ) {
+        const Float cosTheta = 2.f * p.x - 1.f;
+        const Float sinTheta = safe_sqrt( 1.f - cosTheta * cosTheta );
+        const Float phi = 2.f * IMP_PI * p.y;
+        return Vector3( sinTheta * std::cos( phi ), sinTheta * std::sin( phi ), cosTheta );
+    }
+
+    /// \brief Node of the spatial binary tree. Interior nodes split their box in the middle of
+    ///        its longest axis, leaves point to their directional quadtree.
+    struct STreeNode {
+        /// \brief Split axis, -1 for leaves
+        int axis;
+        /// \brief Position of the split plane
+        Float split;
+        /// \brief Index of the first of the two consecutive children, or of the quadtree in leaves
+        unsigned int index;
+    };
+
+    /// \brief Node of a directional quadtree over the cylindrical square. Bit 0 of a quadrant
+    ///        index selects the upper half in x, bit 1 the upper half in y.
+    struct DTreeNode {
+        /// \brief Energy that arrived through the quadrants
+        Float sum[ 4 ];
+        /// \brief Index of the node subdividing the quadrant, 0 for leaves (a root is never a child)
+        unsigned int child[ 4 ];
+    };
+
+    /// \brief Directional quadtree of one spatial leaf, its nodes are stored consecutively
+    ///        and children always follow their parents
+    struct DTreeRecord {
+        /// \brief Index of the root node
+        unsigned int root;
+        /// \brief Number of nodes
+        unsigned int nodeCount;
+        /// \brief Total energy, zero if no particle arrived to the leaf
+        Float total;
+        /// \brief Number of particles splatted into the leaf
+        unsigned int sampleCount;
+    };
+
+    /// \brief Adaptive spatial binary tree over the scene box with a directional quadtree in every
+    ///        leaf (the SD-tree of Mueller et al., "Practical Path Guiding for Efficient Light-Transport
+    ///        Simulation", 2017). The quadtrees live in world space and cover the whole sphere.
+    ///
+    ///        Lookups only descend the immutable tree, so they are lock-free and take O(depth) steps.
+    ///        Training alternates \ref splat, which replaces the energies of all quadtrees, and
+    ///        \ref refine, which adapts the topology to the last splat within a memory budget. Neither
+    ///        of them may run concurrently with lookups.
+    class SDTree {
+    public:
+
+        /// \brief Part of a quadtree region that is clipped by a rectangle of the cylindrical square
+        struct GatherRegion {
+            /// \brief Clipped part of the square of the region
+            Vector2 clipMin, clipMax;
+            /// \brief Square of the region
+            Vector2 origin;
+            Float size;
+            /// \brief The region is the quadrant of this node
+            unsigned int node;
+            int quadrant;
+            /// \brief Energy that arrived through the clipped part
+            Float energy;
+        };
+
+        /// \brief Creates a single leaf with an empty quadtree
+        void reset( const Vector3 & bboxMin, const Vector3 & bboxMax ) {
+            this->bboxMin = bboxMin;
+            this->bboxMax = bboxMax;
+            snodes.clear();
+            dtrees.clear();
+            dnodes.clear();
+
+            STreeNode leaf = { -1, 0.f, 0 };
+            snodes.push( leaf );
+            DTreeRecord dtree = { 0, 1, 0.f, 0 };
+            dtrees.push( dtree );
+            DTreeNode root = { { 0.f, 0.f, 0.f, 0.f }, { 0, 0, 0, 0 } };
+            dnodes.push( root );
+        }
+
+        /// \brief Returns the quadtree of the leaf that contains the position
+        IMPORTANCE_INLINE const DTreeRecord & findLeaf( const Vector3 & position ) const {
+            return dtrees[ findLeafIndex( position ) ];
+        }
+
+        /// \brief Solid angle pdf of a unit direction
+        Float pdf( const DTreeRecord & dtree, const Vector3 & direction ) const {
+            if ( !( dtree.total > 0.f ) ) {
+                return 0.f;
+            }
+            Vector2 p = sphereToCylindrical( direction );
+            unsigned int node = dtree.root;
+            Float density = 1.f;
+            for ( ;; ) {
+                const DTreeNode & n = dnodes[ node ];
+                const int q = selectQuadrant( p );
+                if ( !( n.sum[ q ] > 0.f ) ) {
+                    return 0.f;
+                }
+                density *= 4.f * n.sum[ q ] / ( n.sum[ 0 ] + n.sum[ 1 ] + n.sum[ 2 ] + n.sum[ 3 ] );
+                if ( n.child[ q ] == 0 ) {
+                    break;
+                }
+                node = n.child[ q ];
+            }
+            return density * ( 0.25f * INV_PI );
+        }
+
+        /// \brief Samples a unit direction proportionally to the energy, the quadtree must not be empty
+        Vector3 sample( const DTreeRecord & dtree, Vector2 random, Float & pdf ) const {
+            IMPORTANCE_ASSERT( dtree.total > 0.f );
+            unsigned int node = dtree.root;
+            Float density = 1.f;
+            Vector2 origin( 0.f, 0.f );
+            Float size = 1.f;
+            for ( ;; ) {
+                const DTreeNode & n = dnodes[ node ];
+                /// choose the half in x and then the quadrant in the chosen half
+                int q = 0;
+                const Float left = n.sum[ 0 ] + n.sum[ 2 ], nodeTotal = left + n.sum[ 1 ] + n.sum[ 3 ];
+                const Float px = left / nodeTotal;
+                if ( random.x < px ) {
+                    random.x /= px;
+                } else {
+                    random.x = ( random.x - px ) / ( 1.f - px );
+                    q |= 1;
+                }
+                const Float py = n.sum[ q ] / ( n.sum[ q ] + n.sum[ q | 2 ] );
+                if ( random.y < py ) {
+                    random.y /= py;
+                } else {
+                    random.y = ( random.y - py ) / ( 1.f - py );
+                    q |= 2;
+                }
+                random.x = std::min( random.x, SDTREE_ONE_MINUS_EPS );
+                random.y = std::min( random.y, SDTREE_ONE_MINUS_EPS );
+
+                density *= 4.f * n.sum[ q ] / nodeTotal;
+                size *= 0.5f;
+                origin.x += ( q & 1 ) * size;
+                origin.y += ( q >> 1 ) * size;
+                if ( n.child[ q ] == 0 ) {
+                    break;
+                }
+                node = n.child[ q ];
+            }
+            pdf = density * ( 0.25f * INV_PI );
+            return cylindricalToSphere( Vector2( origin.x + random.x * size, origin.y + random.y * size ) );
+        }
+
+        /// \brief Bounds the directions towards a gather disk of the radius around wo (unnormalized)
+        ///        by one or two rectangles of the cylindrical square, returns their number
+        static int coneRectangles( const Vector3 & wo, const Float radius, Vector2 * lo, Vector2 * hi ) {
+            const Float dist = wo.length();
+            if ( !( dist > radius ) ) {
+                lo[ 0 ] = Vector2( 0.f, 0.f );
+                hi[ 0 ] = Vector2( 1.f, 1.f );
+                return 1;
+            }
+            const Float sinAlpha = radius / dist;
+            const Float alpha = std::asin( sinAlpha );
+            const Float theta = std::acos( clamp( wo.z / dist, -1.f, 1.f ) );
+            const Float theta0 = theta - alpha, theta1 = theta + alpha;
+            const Float u0 = ( theta1 >= IMP_PI ) ? 0.f : ( std::cos( theta1 ) + 1.f ) * 0.5f;
+            const Float u1 = ( theta0 <= 0.f ) ? 1.f : ( std::cos( theta0 ) + 1.f ) * 0.5f;
+            if ( theta0 <= 0.f || theta1 >= IMP_PI ) {
+                /// the cone contains a pole, take the whole polar cap
+                lo[ 0 ] = Vector2( u0, 0.f );
+                hi[ 0 ] = Vector2( u1, 1.f );
+                return 1;
+            }
+            const Float dPhi = std::asin( std::min( sinAlpha / std::sin( theta ), 1.f ) ) * INV_TWOPI;
+            Float phi = std::atan2( wo.y, wo.x ) * INV_TWOPI;
+            if ( phi < 0.f ) {
+                phi += 1.f;
+            }
+            const Float v0 = phi - dPhi, v1 = phi + dPhi;
+            if ( v0 < 0.f ) {
+                lo[ 0 ] = Vector2( u0, 0.f );
+                hi[ 0 ] = Vector2( u1, v1 );
+                lo[ 1 ] = Vector2( u0, v0 + 1.f );
+                hi[ 1 ] = Vector2( u1, 1.f );
+                return 2;
+            }
+            if ( v1 > 1.f ) {
+                lo[ 0 ] = Vector2( u0, v0 );
+                hi[ 0 ] = Vector2( u1, 1.f );
+                lo[ 1 ] = Vector2( u0, 0.f );
+                hi[ 1 ] = Vector2( u1, v1 - 1.f );
+                return 2;
+            }
+            lo[ 0 ] = Vector2( u0, v0 );
+            hi[ 0 ] = Vector2( u1, v1 );
+            return 1;
+        }
+
+        /// \brief Splits the parts of the quadtree inside the rectangles into at most
+        ///        SDTREE_MAX_GATHER_REGIONS regions with non-zero energy. The partially covered regions
+        ///        with the most energy are refined first, the rest is sampled by \ref sampleRegion.
+        int gatherRegions( const DTreeRecord & dtree, const Vector2 * lo, const Vector2 * hi, const int rects,
+            GatherRegion * regions ) const {
+            int count = 0;
+            for ( int r = 0; r < rects; ++r ) {
+                for ( int q = 0; q < 4; ++q ) {
+                    const Vector2 origin( ( q & 1 ) * 0.5f, ( q >> 1 ) * 0.5f );
+                    if ( initRegion( dtree.root, q, origin, 0.5f, lo[ r ], hi[ r ], regions[ count ] ) ) {
+                        ++count;
+                    }
+                }
+            }
+            for ( ;; ) {
+                int best = -1;
+                for ( int i = 0; i < count; ++i ) {
+                    if ( isPartial( regions[ i ] ) && ( best < 0 || regions[ i ].energy > regions[ best ].energy ) ) {
+                        best = i;
+                    }
+                }
+                if ( best < 0 ) {
+                    break;
+                }
+                const GatherRegion parent = regions[ best ];
+                const unsigned int child = dnodes[ parent.node ].child[ parent.quadrant ];
+                const Float half = parent.size * 0.5f;
+                GatherRegion children[ 4 ];
+                int found = 0;
+                for ( int q = 0; q < 4; ++q ) {
+                    const Vector2 origin( parent.origin.x + ( q & 1 ) * half, parent.origin.y + ( q >> 1 ) * half );
+                    if ( initRegion( child, q, origin, half, parent.clipMin, parent.clipMax, children[ found ] ) ) {
+                        ++found;
+                    }
+                }
+                if ( count - 1 + found > SDTREE_MAX_GATHER_REGIONS ) {
+                    break;
+                }
+                regions[ best ] = regions[ --count ];
+                for ( int i = 0; i < found; ++i ) {
+                    regions[ count++ ] = children[ i ];
+                }
+            }
+            return count;
+        }
+
+        /// \brief Samples a unit direction in the clipped part of a region proportionally to the energy
+        Vector3 sampleRegion( const GatherRegion & region, Vector2 random ) const {
+            unsigned int node = region.node;
+            int quadrant = region.quadrant;
+            Vector2 origin = region.origin;
+            Float size = region.size;
+            for ( ;; ) {
+                const unsigned int child = dnodes[ node ].child[ quadrant ];
+                if ( child == 0 ) {
+                    break;
+                }
+                const Float half = size * 0.5f;
+                Float energies[ 4 ];
+                Float total = 0.f;
+                for ( int q = 0; q < 4; ++q ) {
+                    const Vector2 o( origin.x + ( q & 1 ) * half, origin.y + ( q >> 1 ) * half );
+                    energies[ q ] = clippedEnergy( child, q, o, half, region.clipMin, region.clipMax );
+                    total += energies[ q ];
+                }
+                if ( !( total > 0.f ) ) {
+                    return Vector3( 0.f );
+                }
+                int last = 3;
+                while ( !( energies[ last ] > 0.f ) ) {
+                    --last;
+                }
+                int q = 0;
+                Float cdf = 0.f;
+                random.x *= total;
+                while ( q < last && !( random.x < cdf + energies[ q ] ) ) {
+                    cdf += energies[ q++ ];
+                }
+                random.x = clamp( ( random.x - cdf ) / energies[ q ], 0.f, SDTREE_ONE_MINUS_EPS );
+                node = child;
+                quadrant = q;
+                origin = Vector2( origin.x + ( q & 1 ) * half, origin.y + ( q >> 1 ) * half );
+                size = half;
+            }
+            const Float x0 = std::max( origin.x, region.clipMin.x ), x1 = std::min( origin.x + size, region.clipMax.x );
+            const Float y0 = std::max( origin.y, region.clipMin.y ), y1 = std::min( origin.y + size, region.clipMax.y );
+            return cylindricalToSphere( Vector2( x0 + random.x * ( x1 - x0 ), y0 + random.y * ( y1 - y0 ) ) );
+        }
+
+        /// \brief Splats the particles into the current topology and replaces the energies of all
+        ///        quadtrees. Every task sums up the weights of its particles per quadtree leaf and the
+        ///        partial sums are added up in the order of the tasks, so the result does not depend
+        ///        on the number of threads or on the order in which the tasks run.
+        void splat( const IStack<Particle> & particles, TaskRunner & runner ) {
+            const int count = (int) particles.size();
+            const int chunks = ( count + SDTREE_SPLAT_CHUNK_SIZE - 1 ) / SDTREE_SPLAT_CHUNK_SIZE;
+            std::vector<std::vector<SplatSum> > partial( chunks );
+            runner.run( chunks, [&]( int chunk ) {
+                const int begin = chunk * SDTREE_SPLAT_CHUNK_SIZE;
+                const int end = std::min( count, begin + SDTREE_SPLAT_CHUNK_SIZE );
+                std::vector<SplatSum> & sums = partial[ chunk ];
+                sums.reserve( end - begin );
+                for ( int i = begin; i < end; ++i ) {
+                    const Particle & particle = particles[ i ];
+                    if ( !( particle.weight > 0.f ) ) {
+                        continue;
+                    }
+                    const unsigned int leaf = findLeafIndex( particle.position );
+                    /// particles store the direction they travelled in, guiding samples the opposite one
+                    const unsigned int slot = findSlot( dtrees[ leaf ], sphereToCylindrical( -particle.incidentDir ) );
+                    const SplatSum sum = { slot, leaf, double( particle.weight ), 1 };
+                    sums.push_back( sum );
+                }
+                /// merge the particles of the same slot, the stable sort keeps their order
+                std::stable_sort( sums.begin(), sums.end() );
+                size_t used = 0;
+                for ( size_t i = 0; i < sums.size(); ++i ) {
+                    if ( used > 0 && sums[ used - 1 ].slot == sums[ i ].slot ) {
+                        sums[ used - 1 ].energy += sums[ i ].energy;
+                        sums[ used - 1 ].count += sums[ i ].count;
+                    } else {
+                        sums[ used++ ] = sums[ i ];
+                    }
+                }
+                sums.resize( used );
+            } );
+
+            std::vector<double> energy( dnodes.size() * 4, 0.0 );
+            std::vector<unsigned int> counts( dtrees.size(), 0 );
+            for ( int chunk = 0; chunk < chunks; ++chunk ) {
+                const std::vector<SplatSum> & sums = partial[ chunk ];
+                for ( size_t i = 0; i < sums.size(); ++i ) {
+                    energy[ sums[ i ].slot ] += sums[ i ].energy;
+                    counts[ sums[ i ].leaf ] += sums[ i ].count;
+                }
+            }
+
+            /// sum up the interior nodes from the leaves, children always follow their parents
+            for ( size_t d = 0; d < dtrees.size(); ++d ) {
+                DTreeRecord & dtree = dtrees[ d ];
+                for ( unsigned int node = dtree.root + dtree.nodeCount; node-- > dtree.root; ) {
+                    DTreeNode & n = dnodes[ node ];
+                    for ( int q = 0; q < 4; ++q ) {
+                        if ( n.child[ q ] != 0 ) {
+                            double value = 0.0;
+                            for ( int k = 0; k < 4; ++k ) {
+                                value += energy[ n.child[ q ] * 4 + k ];
+                            }
+                            energy[ node * 4 + q ] = value;
+                        }
+                        n.sum[ q ] = Float( energy[ node * 4 + q ] );
+                    }
+                }
+                double total = 0.0;
+                for ( int q = 0; q < 4; ++q ) {
+                    total += energy[ dtree.root * 4 + q ];
+                }
+                dtree.total = Float( total );
+                dtree.sampleCount = counts[ d ];
+            }
+        }
+
+        /// \brief Adapts the topology to the last \ref splat. Leaves with more particles than the
+        ///        threshold are split, assuming that the particles halve with every split, and the
+        ///        quadtrees are rebuilt so that every node with more than the threshold fraction of
+        ///        the energy is subdivided. Both stop at the memory budget. The energies are only
+        ///        estimated from the previous topology, the tree has to be splatted again before use.
+        void refine( const Config::SDTree & cfg ) {
+            const size_t budget = size_t( double( cfg.maxMemoryMB ) * 1024.0 * 1024.0 );
+            /// the spatial tree may use half of the budget, a leaf needs at least a root quadtree node
+            const size_t leafBytes = 2 * sizeof( STreeNode ) + sizeof( DTreeRecord ) + sizeof( DTreeNode );
+            const size_t maxLeaves = std::max<size_t>( dtrees.size(), budget / 2 / leafBytes );
+
+            IStack<unsigned int> sources;
+            for ( unsigned int d = 0; d < (unsigned int) dtrees.size(); ++d ) {
+                sources.push( d );
+            }
+            splitLeaves( Float( cfg.spatialThreshold ), maxLeaves, sources );
+
+            const size_t spatialBytes = snodes.size() * sizeof( STreeNode ) + sources.size() * sizeof( DTreeRecord );
+            const size_t nodeBudget = std::max<size_t>( 1,
+                ( budget > spatialBytes ? budget - spatialBytes : 0 ) / ( sources.size() * sizeof( DTreeNode ) ) );
+
+            IStack<DTreeRecord> newTrees;
+            IStack<DTreeNode> newNodes;
+            newTrees.reserve( sources.size() );
+            for ( size_t d = 0; d < sources.size(); ++d ) {
+                newTrees.push( buildQuadtree( dtrees[ sources[ d ] ], cfg.quadtreeThreshold, nodeBudget, newNodes ) );
+            }
+            std::swap( dtrees, newTrees );
+            std::swap( dnodes, newNodes );
+        }
+
+        /// \brief Bytes used by the tree
+        size_t memoryUsage() const {
+            return snodes.size() * sizeof( STreeNode ) + dtrees.size() * sizeof( DTreeRecord ) +
+                dnodes.size() * sizeof( DTreeNode );
+        }
+
+        size_t getLeafCount() const { return dtrees.size(); }
+
+        size_t getQuadtreeNodeCount() const { return dnodes.size(); }
+
+        void serialize( std::ostream & output ) const {
+            bboxMin.serialize( output );
+            bboxMax.serialize( output );
+            serializeStack( output, snodes );
+            serializeStack( output, dtrees );
+            serializeStack( output, dnodes );
+        }
+
+        void deserialize( std::istream & input ) {
+            bboxMin.deserialize( input );
+            bboxMax.deserialize( input );
+            deserializeStack( input, snodes );
+            deserializeStack( input, dtrees );
+            deserializeStack( input, dnodes );
+        }
+
+        std::string toString() const {
+            std::ostringstream ostr;
+            ostr << "SDTree[ spatial nodes = " << snodes.size() << ", leaves = " << dtrees.size()
+                 << ", quadtree nodes = " << dnodes.size()
+                 << ", memory = " << memoryUsage() / ( 1024.0 * 1024.0 ) << " MB ]";
+            return ostr.str();
+        }
+
+    protected:
+
+        /// \brief Candidate for a split in \ref refine, the ones with the highest estimate go first
+        struct Candidate {
+            Float estimate;
+            unsigned int node;
+            int quadrant;
+            unsigned int source;
+            int depth;
+            Vector3 bboxMin, bboxMax;
+
+            IMPORTANCE_INLINE bool operator<( const Candidate & other ) const {
+                return estimate < other.estimate;
+            }
+        };
+
+        /// \brief Weights and number of the particles a task of \ref splat splatted into a quadtree leaf
+        struct SplatSum {
+            /// \brief Quadrant of the leaf node, i.e. the index into the energies of the quadrants
+            unsigned int slot;
+            /// \brief Spatial leaf of the quadtree
+            unsigned int leaf;
+            double energy;
+            unsigned int count;
+
+            IMPORTANCE_INLINE bool operator<( const SplatSum & other ) const {
+                return slot < other.slot;
+            }
+        };
+
+        /// \brief No node of the previous quadtree covers the region
+        static const unsigned int NO_SOURCE = 0xFFFFFFFF;
+
+        IMPORTANCE_INLINE unsigned int findLeafIndex( const Vector3 & position ) const {
+            const STreeNode * node = &snodes[ 0 ];
+            while ( node->axis >= 0 ) {
+                node = &snodes[ node->index + ( position[ node->axis ] < node->split ? 0 : 1 ) ];
+            }
+            return node->index;
+        }
+
+        /// \brief Selects the quadrant of a point of the unit square and maps the point to the quadrant
+        static IMPORTANCE_INLINE int selectQuadrant( Vector2 & p ) {
+            int q = 0;
+            if ( p.x < 0.5f ) {
+                p.x *= 2.f;
+            } else {
+                p.x = std::min( p.x * 2.f - 1.f, SDTREE_ONE_MINUS_EPS );
+                q |= 1;
+            }
+            if ( p.y < 0.5f ) {
+                p.y *= 2.f;
+            } else {
+                p.y = std::min( p.y * 2.f - 1.f, SDTREE_ONE_MINUS_EPS );
+                q |= 2;
+            }
+            return q;
+        }
+
+        /// \brief Returns node * 4 + quadrant of the leaf quadrant containing the point
+        IMPORTANCE_INLINE unsigned int findSlot( const DTreeRecord & dtree, Vector2 p ) const {
+            unsigned int node = dtree.root;
+            for ( ;; ) {
+                const int q = selectQuadrant( p );
+                const unsigned int child = dnodes[ node ].child[ q ];
+                if ( child == 0 ) {
+                    return node * 4 + q;
+                }
+                node = child;
+            }
+        }
+
+        /// \brief Energy of the quadrant of a node inside the rectangle
+        Float clippedEnergy( const unsigned int node, const int quadrant, const Vector2 & origin, const Float size,
+            const Vector2 & lo, const Vector2 & hi ) const {
+            const Float energy = dnodes[ node ].sum[ quadrant ];
+            const Float x0 = std::max( origin.x, lo.x ), x1 = std::min( origin.x + size, hi.x );
+            const Float y0 = std::max( origin.y, lo.y ), y1 = std::min( origin.y + size, hi.y );
+            if ( !( energy > 0.f ) || x0 >= x1 || y0 >= y1 ) {
+                return 0.f;
+            }
+            if ( lo.x <= origin.x && lo.y <= origin.y && hi.x >= origin.x + size && hi.y >= origin.y + size ) {
+                return energy;
+            }
+            const unsigned int child = dnodes[ node ].child[ quadrant ];
+            if ( child == 0 ) {
+                return energy * ( x1 - x0 ) * ( y1 - y0 ) / ( size * size );
+            }
+            const Float half = size * 0.5f;
+            Float result = 0.f;
+            for ( int q = 0; q < 4; ++q ) {
+                result += clippedEnergy( child, q, Vector2( origin.x + ( q & 1 ) * half, origin.y + ( q >> 1 ) * half ),
+                    half, lo, hi );
+            }
+            return result;
+        }
+
+        /// \brief Clips the quadrant of a node by a rectangle, returns false if no energy is left
+        bool initRegion( const unsigned int node, const int quadrant, const Vector2 & origin, const Float size,
+            const Vector2 & lo, const Vector2 & hi, GatherRegion & region ) const {
+            region.energy = clippedEnergy( node, quadrant, origin, size, lo, hi );
+            if ( !( region.energy > 0.f ) ) {
+                return false;
+            }
+            region.clipMin = Vector2( std::max( origin.x, lo.x ), std::max( origin.y, lo.y ) );
+            region.clipMax = Vector2( std::min( origin.x + size, hi.x ), std::min( origin.y + size, hi.y ) );
+            region.origin = origin;
+            region.size = size;
+            region.node = node;
+            region.quadrant = quadrant;
+            return true;
+        }
+
+        /// \brief Is the region subdivided and only partially covered by its clipping rectangle?
+        IMPORTANCE_INLINE bool isPartial( const GatherRegion & region ) const {
+            return dnodes[ region.node ].child[ region.quadrant ] != 0 &&
+                ( region.clipMin.x > region.origin.x || region.clipMin.y > region.origin.y ||
+                  region.clipMax.x < region.origin.x + region.size || region.clipMax.y < region.origin.y + region.size );
+        }
+
+        /// \brief Splits the leaves with the most particles first until the estimates drop below
+        ///        the threshold or the number of leaves reaches the maximum. The new leaves get
+        ///        new quadtrees which are built from the source quadtree of their parent.
+        void splitLeaves( const Float threshold, const size_t maxLeaves, IStack<unsigned int> & sources ) {
+            std::priority_queue<Candidate> queue;
+
+            /// collect the leaves with their boxes
+            std::vector<Candidate> stack;
+            Candidate root;
+            root.node = 0;
+            root.bboxMin = bboxMin;
+            root.bboxMax = bboxMax;
+            stack.push_back( root );
+            while ( !stack.empty() ) {
+                Candidate c = stack.back();
+                stack.pop_back();
+                const STreeNode & node = snodes[ c.node ];
+                if ( node.axis < 0 ) {
+                    c.estimate = Float( dtrees[ node.index ].sampleCount );
+                    queue.push( c );
+                    continue;
+                }
+                Candidate left = c, right = c;
+                left.node = node.index;
+                left.bboxMax[ node.axis ] = node.split;
+                right.node = node.index + 1;
+                right.bboxMin[ node.axis ] = node.split;
+                stack.push_back( right );
+                stack.push_back( left );
+            }
+
+            while ( !queue.empty() && sources.size() < maxLeaves ) {
+                const Candidate c = queue.top();
+                queue.pop();
+                if ( !( c.estimate > threshold ) ) {
+                    break;
+                }
+                const Vector3 extent = c.bboxMax - c.bboxMin;
+                const int axis = extent.argMax();
+                if ( !( extent[ axis ] > 0.f ) ) {
+                    continue;
+                }
+
+                const unsigned int first = (unsigned int) snodes.size();
+                const unsigned int dtree = snodes[ c.node ].index;
+                STreeNode left = { -1, 0.f, dtree };
+                STreeNode right = { -1, 0.f, (unsigned int) sources.size() };
+                sources.push( sources[ dtree ] );
+                snodes[ c.node ].axis = axis;
+                snodes[ c.node ].split = ( c.bboxMin[ axis ] + c.bboxMax[ axis ] ) * 0.5f;
+                snodes[ c.node ].index = first;
+                snodes.push( left );
+                snodes.push( right );
+
+                Candidate l = c, r = c;
+                l.estimate = r.estimate = c.estimate * 0.5f;
+                l.node = first;
+                l.bboxMax[ axis ] = snodes[ c.node ].split;
+                r.node = first + 1;
+                r.bboxMin[ axis ] = snodes[ c.node ].split;
+                queue.push( l );
+                queue.push( r );
+            }
+        }
+
+        /// \brief Builds a new quadtree from the energies of the source quadtree. Regions finer than
+        ///        the source get an equal share of the energy of the source leaf that contains them.
+        DTreeRecord buildQuadtree( const DTreeRecord & source, const Float threshold, const size_t maxNodes,
+            IStack<DTreeNode> & nodes ) const {
+            DTreeRecord result = { (unsigned int) nodes.size(), 1, 0.f, 0 };
+            DTreeNode root = { { 0.f, 0.f, 0.f, 0.f }, { 0, 0, 0, 0 } };
+            nodes.push( root );
+            if ( !( source.total > 0.f ) ) {
+                return result;
+            }
+
+            std::priority_queue<Candidate> queue;
+            const DTreeNode & sourceRoot = dnodes[ source.root ];
+            for ( int q = 0; q < 4; ++q ) {
+                nodes[ result.root ].sum[ q ] = sourceRoot.sum[ q ];
+                Candidate c;
+                c.estimate = sourceRoot.sum[ q ];
+                c.node = result.root;
+                c.quadrant = q;
+                c.source = sourceRoot.child[ q ] != 0 ? sourceRoot.child[ q ] : NO_SOURCE;
+                c.depth = 1;
+                queue.push( c );
+            }
+
+            while ( !queue.empty() && result.nodeCount < maxNodes ) {
+                const Candidate c = queue.top();
+                queue.pop();
+                if ( !( c.estimate > threshold * source.total ) ) {
+                    break;
+                }
+                if ( c.depth >= SDTREE_MAX_QUADTREE_DEPTH ) {
+                    continue;
+                }
+                const unsigned int child = (unsigned int) nodes.size();
+                nodes.push( root );
+                nodes[ c.node ].child[ c.quadrant ] = child;
+                ++result.nodeCount;
+                for ( int q = 0; q < 4; ++q ) {
+                    Candidate s;
+                    s.node = child;
+                    s.quadrant = q;
+                    s.depth = c.depth + 1;
+                    if ( c.source != NO_SOURCE ) {
+                        const DTreeNode & sourceNode = dnodes[ c.source ];
+                        s.estimate = sourceNode.sum[ q ];
+                        s.source = sourceNode.child[ q ] != 0 ? sourceNode.child[ q ] : NO_SOURCE;
+                    } else {
+                        s.estimate = c.estimate * 0.25f;
+                        s.source = NO_SOURCE;
+                    }
+                    nodes[ child ].sum[ q ] = s.estimate;
+                    queue.push( s );
+                }
+            }
+            return result;
+        }
+
+    protected:
+        Vector3 bboxMin, bboxMax;
+        IStack<STreeNode> snodes;
+        IStack<DTreeRecord> dtrees;
+        IStack<DTreeNode> dnodes;
+    };
+}
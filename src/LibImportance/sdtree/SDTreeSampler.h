@@ -0,0 +1,216 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "../LibImportanceTypes.h"
+#include "../sampler/Sampler.h"
+#include "SDTree.h"
+
+namespace Importance {
+
+    /************************************************************************/
+    /*  SDTreeDistribution                                                  */
+    /************************************************************************/
+
+    /// \brief Directional quadtree of one leaf of an \ref SDTree, directions are in world space
+    class SDTreeDistribution : public Distribution {
+        SDTreeDistribution& operator=(const SDTreeDistribution&);
+    public:
+
+        IMPORTANCE_INLINE SDTreeDistribution( const SDTree & tree, const DTreeRecord & dtree ) : tree( tree ), dtree( dtree ) {}
+
+        virtual void sampleDirections(const Vector2* random, Vector3 * output, float* pdfs, const int count) {
+            for ( int i = 0; i < count; i++ ) {
+                Float pdf;
+                output[ i ] = tree.sample( dtree, random[ i ], pdf );
+                pdfs[ i ] = float( pdf );
+            }
+        }
+
+        virtual void pdfs(const Vector3 * directions, float * pdfs, const int count) const {
+            for ( int i = 0; i < count; i++ ) {
+                pdfs[ i ] = float( tree.pdf( dtree, directions[ i ] ) );
+            }
+        }
+
+        /// The quadtree regions inside the bounds of the cone towards the disk are stored as a single level under the root node
+        virtual Float gatherAreaPdfDistrib(Vector3 wo, Float radius, Vector2* componentCDFs, Vector2* componentBounds,
+            int &topComponentCDFs, int &topComponentBounds, int baseCDFs, int baseBounds) {
+            Vector2 lo[ 2 ], hi[ 2 ];
+            const int rects = SDTree::coneRectangles( wo, radius, lo, hi );
+            SDTree::GatherRegion regions[ SDTREE_MAX_GATHER_REGIONS ];
+            const int numNode = tree.gatherRegions( dtree, lo, hi, rects, regions );
+
+            const int pnode0 = topComponentCDFs;
+            componentCDFs[ pnode0 ].y = *(float*)&numNode;
+            topComponentCDFs += numNode + 1;
+
+            Float energy = 0.f;
+            for ( int i = 0; i < numNode; i++ ) {
+                energy += regions[ i ].energy;
+            }
+            const Float invEnergy = ( energy > 0.f ) ? 1.f / energy : 0.f;
+            for ( int i = 0; i < numNode; i++ ) {
+                // each region points to its clipped rectangle, its square and its quadrant
+                const SDTree::GatherRegion & region = regions[ i ];
+                const int bound = topComponentBounds;
+                const unsigned int quadrant = region.node * 4 + region.quadrant;
+                componentBounds[ bound ] = region.clipMin;
+                componentBounds[ bound + 1 ] = region.clipMax;
+                componentBounds[ bound + 2 ] = region.origin;
+                componentBounds[ bound + 3 ] = Vector2( region.size, *(const float*)&quadrant );
+                topComponentBounds += SDTREE_GATHER_REGION_BOUNDS;
+
+                int ptrBound = -( bound + baseBounds );
+                componentCDFs[ pnode0 + i + 1 ] = Vector2( region.energy * invEnergy, *(float*)&ptrBound );
+            }
+            const Float prob = energy / dtree.total;
+            componentCDFs[ pnode0 ].x = prob;
+            return prob;
+        }
+
+        virtual Vector3 sampleGatherAreaDistrib(Vector2 samples, Vector3 wo, Float radius, int ptrNode, Vector2* componentCDFs, Vector2* componentBounds) {
+            const int numNode = *(const int*)&componentCDFs[ ptrNode ].y;
+            Float cdfi = 0.f;
+            for ( int i = 0; i < numNode; i++ ) {
+                const Vector2 nodei = componentCDFs[ ptrNode + 1 + i ];
+                const Float pdfi = nodei.x;
+                if ( samples.x <= cdfi + pdfi && pdfi > 0.f ) {
+                    const int ptrBound = -*(const int*)&nodei.y;
+                    samples.x = std::min( ( samples.x - cdfi ) / pdfi, SDTREE_ONE_MINUS_EPS );
+                    SDTree::GatherRegion region;
+                    region.clipMin = componentBounds[ ptrBound ];
+                    region.clipMax = componentBounds[ ptrBound + 1 ];
+                    region.origin = componentBounds[ ptrBound + 2 ];
+                    region.size = componentBounds[ ptrBound + 3 ].x;
+                    const unsigned int quadrant = *(const unsigned int*)&componentBounds[ ptrBound + 3 ].y;
+                    region.node = quadrant / 4;
+                    region.quadrant = int( quadrant % 4 );
+                    return tree.sampleRegion( region, samples );
+                }
+                cdfi += pdfi;
+            }
+            return Vector3( 0.f );
+        }
+
+        virtual void release() {}
+
+        virtual std::string toString() const {
+            std::ostringstream ostr;
+            ostr << "SDTreeDistribution[ nodes = " << dtree.nodeCount << ", samples = " << dtree.sampleCount
+                 << ", total = " << dtree.total << " ]";
+            return ostr.str();
+        }
+
+    protected:
+        const SDTree & tree;
+        const DTreeRecord & dtree;
+    };
+
+    /************************************************************************/
+    /*  SDTreeSampler                                                       */
+    /************************************************************************/
+
+    /// \brief Guides by an \ref SDTree trained from the particles. Lookups descend the spatial tree
+    ///        to the leaf of the hit and return its quadtree, they are lock-free and never fit anything.
+    ///        \ref refreshSamples trains the tree again from the new particles, starting from the
+    ///        current topology, and must not run concurrently with lookups.
+    class SDTreeSampler : public Sampler {
+    protected:
+
+        SDTree tree;
+        Config config;
+        const Camera* camera;
+
+        virtual void initImpl(InputIterator& samples, const Config& config, const Camera* camera, Stats* stats) {
+            this->config = config;
+            this->camera = camera;
+            tree.reset( config.sceneBboxMin, config.sceneBboxMax );
+            train( samples, true );
+        }
+
+        /// \brief Restores the tree, the configuration has to be the one the tree was trained with
+        virtual void loadImpl(std::istream& input, const Config& config, const Camera* camera, Stats* stats) {
+            this->config = config;
+            this->camera = camera;
+            tree.deserialize( input );
+        }
+
+    public:
+
+        SDTreeSampler() : camera( NULL ) {}
+
+        virtual void save( std::ostream & output ) const {
+            tree.serialize( output );
+        }
+
+        /// \brief Returns NULL for leaves that no particle arrived to
+        virtual Distribution* getDistributionImpl(const Hit& hit, IResultBuffer& buffer) {
+            const DTreeRecord & dtree = tree.findLeaf( hit.position );
+            if ( !( dtree.total > 0.f ) ) {
+                return NULL;
+            }
+            return new ((void*)&buffer) SDTreeDistribution( tree, dtree );
+        }
+
+        /// \brief Splats the new particles, the topology is refined only if refineCache is set
+        virtual void refreshSamples( InputIterator & samples, bool refineCache = true ) {
+            train( samples, refineCache );
+        }
+
+        virtual bool isCacheUsed() const {
+            return false;
+        }
+
+        /// There is no visualization of the tree
+        virtual VizAPI * getVizApi() { return NULL; }
+
+        virtual std::string toString() const {
+            return tree.toString();
+        }
+
+    protected:
+
+        /// \brief Splats the particles and then refines the topology and splats them again
+        ///        config.sdtree.refinePasses times
+        void train( InputIterator & samples, const bool refine ) {
+            IStack<Particle> particles;
+            while ( samples.isValid() ) {
+                Particle photon;
+                photon.incidentDir  = Vector3( samples.incidentDirection() );
+                photon.position     = Vector3( samples.position() );
+                photon.weight       = config.isWeightOverride ? 1.f : samples.weight();
+                photon.normal       = Vector3( samples.normal() );
+                photon.distance     = samples.distance();
+                particles.push( photon );
+                samples.next();
+            }
+            tree.splat( particles, *taskRunner );
+            for ( int i = 0; refine && i < config.sdtree.refinePasses; ++i ) {
+                tree.refine( config.sdtree );
+                tree.splat( particles, *taskRunner );
+            }
+            ILog( EInfo, "SD-tree trained from %d particles: %s", (int) particles.size(), tree.toString().c_str() );
+        }
+    };
+}
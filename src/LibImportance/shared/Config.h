@@ -90,7 +90,11 @@ namespace Importance {
     class Vector3d;
     class Vector3f;    
 
+#if defined(_MSC_VER)
     typedef _int64 StatsInt64;
+#else
+    typedef long long StatsInt64;
+#endif
 
 #ifdef IMPORTANCE_SINGLE_PRECISION
     typedef float Float;
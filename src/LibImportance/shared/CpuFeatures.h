@@ -0,0 +1,113 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "Config.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace Importance {
+
+    /// Widest SIMD instruction set used by the mixture kernels, the value is the number of float lanes
+    enum ESimdLevel {
+        ESimdSSE    = 4,
+        ESimdAVX2   = 8,
+        ESimdAVX512 = 16
+    };
+
+    namespace CpuFeatures {
+
+        IMPORTANCE_INLINE void cpuid( unsigned int leaf, unsigned int subleaf, unsigned int regs[ 4 ] ) {
+#if defined(_MSC_VER)
+            __cpuidex( (int *) regs, (int) leaf, (int) subleaf );
+#else
+            __cpuid_count( leaf, subleaf, regs[ 0 ], regs[ 1 ], regs[ 2 ], regs[ 3 ] );
+#endif
+        }
+
+        /// Returns the register states enabled by the operating system (XCR0)
+        IMPORTANCE_INLINE unsigned long long xgetbv() {
+#if defined(_MSC_VER)
+            return _xgetbv( 0 );
+#else
+            unsigned int eax, edx;
+            __asm__ __volatile__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+            return ( (unsigned long long) edx << 32 ) | eax;
+#endif
+        }
+
+        /// Detects the widest SIMD level supported by both the CPU and the operating system
+        inline ESimdLevel detect() {
+            unsigned int regs[ 4 ];
+            cpuid( 0, 0, regs );
+            if ( regs[ 0 ] < 7 ) {
+                return ESimdSSE;
+            }
+
+            cpuid( 1, 0, regs );
+            const bool osxsave = ( regs[ 2 ] & ( 1 << 27 ) ) != 0;
+            const bool fma     = ( regs[ 2 ] & ( 1 << 12 ) ) != 0;
+            if ( !osxsave ) {
+                return ESimdSSE;
+            }
+            const unsigned long long xcr0 = xgetbv();
+            /// XMM and YMM state
+            if ( ( xcr0 & 0x6 ) != 0x6 ) {
+                return ESimdSSE;
+            }
+
+            cpuid( 7, 0, regs );
+            const bool avx2    = ( regs[ 1 ] & ( 1 << 5 ) ) != 0;
+            const bool avx512f = ( regs[ 1 ] & ( 1 << 16 ) ) != 0;
+            /// opmask and ZMM state
+            if ( avx2 && fma && avx512f && ( xcr0 & 0xe6 ) == 0xe6 ) {
+                return ESimdAVX512;
+            }
+            if ( avx2 && fma ) {
+                return ESimdAVX2;
+            }
+            return ESimdSSE;
+        }
+
+        IMPORTANCE_INLINE ESimdLevel & currentLevel() {
+            static ESimdLevel level = detect();
+            return level;
+        }
+    }
+
+    /// Returns the SIMD level of the mixture kernels, by default the widest one supported by this machine
+    IMPORTANCE_INLINE ESimdLevel getSimdLevel() {
+        return CpuFeatures::currentLevel();
+    }
+
+    /// Restricts the mixture kernels to a narrower SIMD level (e.g. for testing or benchmarking), 
+    /// levels above the detected one are clamped
+    inline void setSimdLevel( ESimdLevel level ) {
+        const ESimdLevel detected = CpuFeatures::detect();
+        CpuFeatures::currentLevel() = level < detected ? level : detected;
+    }
+}
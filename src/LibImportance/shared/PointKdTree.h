@@ -30,6 +30,9 @@
 #include "PointKdTreeShared.h"
 #include "BoundingBox.h"
 #include "StaticHeap.h"
+#include "Serialization.h"
+#include "TaskRunner.h"
+#include <vector>
 
 namespace Importance {
 
@@ -70,6 +73,9 @@ namespace Importance {
     };
 
 
+    /// \brief Smallest range of points built by a single task of a parallel build
+    const int PARALLEL_BUILD_MIN_TASK_SIZE = 4096;
+
     /// \brief Static kD-tree data structure for quick querying of point data. Stores 3D point
     ///        data and supports range-limited kNN queries. Uses longest side cut with sliding 
     ///        midpoint, tracking nodes and priority node searching. 
@@ -108,47 +114,57 @@ namespace Importance {
 
 
         /// \brief Creates a leaf node from given range of points and links it to the parent node
+        /// \param outNodes node storage of the (sub)tree being built
+        /// \param outLeafBBoxes leaf bounding boxes of the (sub)tree being built
         /// \param parent index of the parent node
         /// \param from first index of point from the data array to be included in this leaf
         /// \param to index past the last point from the data array to be included
-        void createLeafNode(const unsigned int parent, const unsigned int from, const unsigned int to) {
+        void createLeafNode(IStack<Node>& outNodes, IStack<BBox>& outLeafBBoxes, 
+            const unsigned int parent, const unsigned int from, const unsigned int to) const {
             IMPORTANCE_ASSERT((to-from > 0 || this->data.size() == 0) && to-from <= Node::MAXIMUM_LEAF_SIZE);
 
             Node leaf;
             leaf.setIsLeaf();
             leaf.setLeafStart(from);
             leaf.setLeafSize(to-from);
-            leaf.setLeafNumber(unsigned int(leafBBoxes.size()));
+            leaf.setLeafNumber(unsigned int(outLeafBBoxes.size()));
 
             BBox tightBbox;
             for(unsigned int i = from; i < to; ++i) {
                 tightBbox += this->data[i].position;
             }
-            leafBBoxes.push(tightBbox);
+            outLeafBBoxes.push(tightBbox);
 
-            unsigned int index = unsigned int(nodes.size());
-            nodes.push(leaf);
+            unsigned int index = unsigned int(outNodes.size());
+            outNodes.push(leaf);
 
             if(index - parent == 1 || parent == -1) {
                 // left child is implicit
                 return;
             } else {
-                IMPORTANCE_ASSERT(!nodes[parent].hasRightChild());
-                nodes[parent].setRightChild(index);
+                IMPORTANCE_ASSERT(!outNodes[parent].hasRightChild());
+                outNodes[parent].setRightChild(index);
             }
         }
 
-        /// \brief Recursively creates a subtree from given range of points and links it to the 
-        ///        parent node
-        /// \param parent parent node of this subtree
+        /// \brief Chooses the split of given range of points and partitions the points. Ranges 
+        ///        handled by different calls must not overlap, so that subtrees can be split 
+        ///        concurrently.
         /// \param from first index of point from the data array to be included in this subtree
         /// \param to index past the last point from the data array to be included
         /// \param box Bounding box associated with this subtree
-        void iterate(const unsigned int parent, const int from, const int to, const BBox& box) {
+        /// \param splitDim returns the split axis
+        /// \param split returns the split position
+        /// \param middle returns the index of the first point in the right child
+        /// \param bboxL returns the bounding box of the left child
+        /// \param bboxR returns the bounding box of the right child
+        /// \return false if the range has to become a leaf, the points are left untouched then
+        bool partition(const int from, const int to, const BBox& box, int& splitDim, Float& split, 
+            int& middle, BBox& bboxL, BBox& bboxR) {
             for(int i = from; i < to; ++i) {
                 IMPORTANCE_ASSERT(box.contains(data[i].position));
             }
-            int splitDim = -1;
+            splitDim = -1;
             bool terminate = false;
             Point cellSize = box.size();
 
@@ -178,16 +194,15 @@ namespace Importance {
             }
 
             if(terminate && (to-from) < Node::MAXIMUM_LEAF_SIZE) {
-                createLeafNode(parent, from, to);
-                return;
+                return false;
             }
 
-            Float split = box.getCenter()[splitDim];
+            split = box.getCenter()[splitDim];
             int leftPtr = from;
             int rightPtr = to-1;
 
-            BBox bboxL = box;
-            BBox bboxR = box;
+            bboxL = box;
+            bboxR = box;
 
 
             // partition the data
@@ -246,19 +261,133 @@ namespace Importance {
             for(int i = leftPtr; i < to; ++i) {
                 IMPORTANCE_ASSERT(bboxR.contains(data[i].position));
             }
+            middle = leftPtr;
+            return true;
+        }
+
+        /// \brief Recursively creates a subtree from given range of points and links it to the 
+        ///        parent node
+        /// \param outNodes node storage of the (sub)tree being built
+        /// \param outLeafBBoxes leaf bounding boxes of the (sub)tree being built
+        /// \param parent parent node of this subtree
+        /// \param from first index of point from the data array to be included in this subtree
+        /// \param to index past the last point from the data array to be included
+        /// \param box Bounding box associated with this subtree
+        void iterate(IStack<Node>& outNodes, IStack<BBox>& outLeafBBoxes, 
+            const unsigned int parent, const int from, const int to, const BBox& box) {
+            int splitDim, middle;
+            Float split;
+            BBox bboxL, bboxR;
+            if(!partition(from, to, box, splitDim, split, middle, bboxL, bboxR)) {
+                createLeafNode(outNodes, outLeafBBoxes, parent, from, to);
+                return;
+            }
 
             Node node;
             node.setSplitAxis(splitDim);
             node.setSplitPosition(float(split));
-            unsigned int index = int(nodes.size());
-            nodes.push(node);
+            unsigned int index = int(outNodes.size());
+            outNodes.push(node);
+            if(index - parent != 1) { // left is implicit
+                IMPORTANCE_ASSERT(!outNodes[parent].hasRightChild());
+                outNodes[parent].setRightChild(index);
+            }
+
+            iterate (outNodes, outLeafBBoxes, index, from,   middle, bboxL);
+            iterate (outNodes, outLeafBBoxes, index, middle, to,     bboxR);
+        }
+
+        /// \brief Node of the top levels of a parallel build, either an inner node or a subtree 
+        ///        built by a single task
+        struct TopNode {
+            Node node;
+            int task;
+        };
+
+        /// \brief Subtree built by a single task of a parallel build, with node indices and leaf 
+        ///        numbers local to the subtree
+        struct SubtreeTask {
+            int from, to;
+            BBox box;
+            IStack<Node> nodes;
+            IStack<BBox> leafBBoxes;
+        };
+
+        /// \brief Splits the top levels of the tree serially until the ranges are small enough 
+        ///        to be handed to tasks. Nodes are recorded in the same (depth-first) order as 
+        ///        \ref iterate creates them.
+        void splitTopLevels(const int from, const int to, const BBox& box, const int minTaskSize, 
+            std::vector<TopNode>& top, std::vector<SubtreeTask>& tasks) {
+            TopNode t;
+            int splitDim, middle;
+            Float split;
+            BBox bboxL, bboxR;
+            if(to - from <= minTaskSize || !partition(from, to, box, splitDim, split, middle, bboxL, bboxR)) {
+                t.task = int(tasks.size());
+                top.push_back(t);
+                tasks.push_back(SubtreeTask());
+                tasks.back().from = from;
+                tasks.back().to   = to;
+                tasks.back().box  = box;
+                return;
+            }
+            t.task = -1;
+            t.node.setSplitAxis(splitDim);
+            t.node.setSplitPosition(float(split));
+            top.push_back(t);
+            splitTopLevels(from,   middle, bboxL, minTaskSize, top, tasks);
+            splitTopLevels(middle, to,     bboxR, minTaskSize, top, tasks);
+        }
+
+        /// \brief Appends the top levels and the subtrees in depth-first order, which gives the 
+        ///        same node layout as a serial build
+        void assemble(const std::vector<TopNode>& top, const std::vector<SubtreeTask>& tasks, 
+            int& position, const unsigned int parent) {
+            const TopNode& t = top[position++];
+            const unsigned int index = unsigned int(nodes.size());
+            if(t.task >= 0) {
+                const SubtreeTask& task = tasks[t.task];
+                const unsigned int leafOffset = unsigned int(leafBBoxes.size());
+                for(size_t i = 0; i < task.nodes.size(); ++i) {
+                    Node node = task.nodes[i];
+                    if(node.isLeaf()) {
+                        node.setLeafNumber(node.getLeafNumber() + leafOffset);
+                    } else {
+                        node.setRightChild(node.getRightChild() + index);
+                    }
+                    nodes.push(node);
+                }
+                for(size_t i = 0; i < task.leafBBoxes.size(); ++i) {
+                    leafBBoxes.push(task.leafBBoxes[i]);
+                }
+            } else {
+                nodes.push(t.node);
+                assemble(top, tasks, position, index);
+                assemble(top, tasks, position, index);
+            }
             if(index - parent != 1) { // left is implicit
                 IMPORTANCE_ASSERT(!nodes[parent].hasRightChild());
                 nodes[parent].setRightChild(index);
             }
+        }
 
-            iterate (index, from,    leftPtr, bboxL);
-            iterate (index, leftPtr, to,      bboxR);
+        /// \brief Copies the input points into the tree storage
+        template<class TDataIterator>
+        void prepareData(const TDataIterator begin, const TDataIterator end, const int leafSize) {
+            this->leafSize = leafSize;
+            this->nodes.clear();
+            this->leafBBoxes.clear();
+            this->data.resize(int(end-begin));
+            entireBBox.setEmpty();
+
+        
+            int ptr = 0;
+            for(auto it = begin; it != end; it++) {
+                this->data[ptr].data = ptr;
+                this->data[ptr].position = Traits::extractPosition(*it);
+                entireBBox += this->data[ptr].position;
+                ptr++;
+            }
         }
 
 
@@ -286,21 +415,36 @@ namespace Importance {
         /// \param leafSize Maximum number of elements to be stored in single leaf
         template<class TDataIterator>
         void build(const TDataIterator begin, const TDataIterator end, const int leafSize) {
-            this->leafSize = leafSize;
-            this->nodes.clear();
-            this->leafBBoxes.clear();
-            this->data.resize(int(end-begin));
-            entireBBox.setEmpty();
+            prepareData(begin, end, leafSize);
+            iterate(this->nodes, this->leafBBoxes, unsigned(-1), 0, int(data.size()), entireBBox);
+        }
 
-        
-            int ptr = 0;
-            for(auto it = begin; it != end; it++) {
-                this->data[ptr].data = ptr;
-                this->data[ptr].position = Traits::extractPosition(*it);
-                entireBBox += this->data[ptr].position;
-                ptr++;
+        /// \brief Builds the tree like \ref build, but the subtrees below the top levels are 
+        ///        built by parallel tasks. The resulting tree is identical to the one built 
+        ///        serially, regardless of the number of threads.
+        template<class TDataIterator>
+        void build(const TDataIterator begin, const TDataIterator end, const int leafSize, 
+            TaskRunner& runner) {
+            prepareData(begin, end, leafSize);
+            /* Several subtrees per thread balance the uneven subtree sizes */
+            const int minTaskSize = std::max(PARALLEL_BUILD_MIN_TASK_SIZE, 
+                int(data.size()) / (8 * std::max(1, runner.getThreadCount())));
+            if(runner.getThreadCount() <= 1 || int(data.size()) <= minTaskSize) {
+                iterate(this->nodes, this->leafBBoxes, unsigned(-1), 0, int(data.size()), entireBBox);
+                return;
             }
-            iterate(unsigned(-1), 0, int(data.size()), entireBBox);
+
+            std::vector<TopNode> top;
+            std::vector<SubtreeTask> tasks;
+            splitTopLevels(0, int(data.size()), entireBBox, minTaskSize, top, tasks);
+            runner.run(int(tasks.size()), [&](int i) {
+                SubtreeTask& task = tasks[i];
+                iterate(task.nodes, task.leafBBoxes, unsigned(-1), task.from, task.to, task.box);
+            });
+
+            int position = 0;
+            assemble(top, tasks, position, unsigned(-1));
+            IMPORTANCE_ASSERT(position == int(top.size()));
         }
 
         /// \brief Performs range limited kNN query in the tree and reports indices of found 
@@ -390,6 +534,24 @@ namespace Importance {
         IMPORTANCE_INLINE int rangeQuery(const Point origin, const Float range, KdQueryResult* _results, const int maxCount, int _found=0) const {
             return rangeQuery(origin, range, _results, maxCount, AlwaysTruePredicate(), _found );
         }
+
+        /// \brief Writes the built tree, so that it can be restored without building it again
+        void serialize( std::ostream & output ) const {
+            serializePod( output, leafSize );
+            serializePod( output, entireBBox );
+            serializeStack( output, data );
+            serializeStack( output, nodes );
+            serializeStack( output, leafBBoxes );
+        }
+
+        /// \brief Restores a tree written by \ref serialize
+        void deserialize( std::istream & input ) {
+            deserializePod( input, leafSize );
+            deserializePod( input, entireBBox );
+            deserializeStack( input, data );
+            deserializeStack( input, nodes );
+            deserializeStack( input, leafBBoxes );
+        }
     };
 }
 #pragma warning(pop)
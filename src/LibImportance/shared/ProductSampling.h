@@ -0,0 +1,245 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <limits>
+
+#include "Config.h"
+#include "Vector2.h"
+#include "Vector3.h"
+#include "../caching/ReaderWriterLock.h"
+
+namespace Importance {
+
+    /************************************************************************/
+    /*  Product of a mixture with a Gaussian approximation of a bsdf lobe   */
+    /************************************************************************/
+
+    /** 
+       One Gaussian of the product of a mixture model with a bsdf lobe. It lives in the square 
+       parametrization of the model (cache record) it was computed from.
+    */
+    struct ProductComponent {
+        /// Mean
+        Float meanX, meanY;
+        /// Precision matrix (i.e. inverse of covariance) [ p00, p01 | p01, p11 ]
+        Float p00, p01, p11;
+        /// Lower triangular factor of the covariance matrix, used for sampling
+        Float l00, l10, l11;
+        /// Normalization of the Gaussian
+        Float normalization;
+        /// Weight, changed to the normalized CDF of the components by ProductBuffer::finish()
+        Float weight;
+        /// Index of the model in the distribution
+        int model;
+
+        /**
+           Multiplies a weighted Gaussian with an isotropic Gaussian of the bsdf lobe. The product of two 
+           Gaussians is again a Gaussian: precisions add up and the weight is scaled by the overlap of the 
+           two Gaussians, i.e. by N( mean; bsdfMean, cov + bsdfCov ).
+           Returns false if the product has no weight.
+        */
+        IMPORTANCE_INLINE bool multiply( const Vector2 & mean, Float c00, Float c01, Float c11, Float w, 
+            const Vector2 & bsdfMean, Float bsdfPrecision ) {
+            p00 = c00 + bsdfPrecision;
+            p01 = c01;
+            p11 = c11 + bsdfPrecision;
+            const Float det = p00 * p11 - p01 * p01;
+            const Float detLobe = c00 * c11 - c01 * c01;
+            if ( !( det > 0.f ) || !( detLobe > 0.f ) ) {
+                return false;
+            }
+            const Float invDet = 1.f / det;
+            const Float s00 = p11 * invDet, s01 = -p01 * invDet, s11 = p00 * invDet;
+            
+            /// mean = cov * ( lobePrecision * lobeMean + bsdfPrecision * bsdfMean )
+            const Float bx = c00 * mean.x + c01 * mean.y + bsdfPrecision * bsdfMean.x;
+            const Float by = c01 * mean.x + c11 * mean.y + bsdfPrecision * bsdfMean.y;
+            meanX = s00 * bx + s01 * by;
+            meanY = s01 * bx + s11 * by;
+
+            /// Overlap of the lobe with the bsdf, the covariances of both add up
+            const Float invBsdf = 1.f / bsdfPrecision;
+            const Float invDetLobe = 1.f / detLobe;
+            const Float q00 = c11 * invDetLobe + invBsdf, q01 = -c01 * invDetLobe, q11 = c00 * invDetLobe + invBsdf;
+            const Float detQ = q00 * q11 - q01 * q01;
+            const Float dx = mean.x - bsdfMean.x, dy = mean.y - bsdfMean.y;
+            const Float form = ( q11 * dx * dx - 2.f * q01 * dx * dy + q00 * dy * dy ) / detQ;
+            weight = w * std::exp( -0.5f * form ) / ( 2.f * IMP_PI * std::sqrt( detQ ) );
+
+            normalization = std::sqrt( det ) / ( 2.f * IMP_PI );
+            l00 = std::sqrt( s00 );
+            l10 = s01 / l00;
+            l11 = std::sqrt( std::max( s11 - l10 * l10, 0.f ) );
+            return weight > 0.f && isReal( weight ) && isReal( meanX ) && isReal( meanY );
+        }
+
+        /// Density of the Gaussian at a point of the square parametrization
+        IMPORTANCE_INLINE Float pdf( const Vector2 & point ) const {
+            const Float dx = point.x - meanX, dy = point.y - meanY;
+            return normalization * std::exp( -0.5f * ( p00 * dx * dx + 2.f * p01 * dx * dy + p11 * dy * dy ) );
+        }
+
+        /// Samples the Gaussian with the Box-Muller method
+        IMPORTANCE_INLINE Vector2 sample( Vector2 random ) const {
+            random.x = std::max( random.x, std::numeric_limits<Float>::min() );
+            const Float mult = std::sqrt( -2.0f * std::log( random.x ) );
+            const Float angle = 2.f * IMP_PI * random.y;
+            const Float x = mult * std::cos( angle ), y = mult * std::sin( angle );
+            return Vector2( meanX + l00 * x, meanY + l10 * x + l11 * y );
+        }
+    };
+
+    const int MAX_PRODUCT_COMPONENTS = MAX_CACHE_KNN * MAX_FITTED_LOBES;
+
+    /// Product of a distribution with a bsdf lobe, see Distribution::initProduct()
+    struct ProductBuffer {
+        ProductComponent components[ MAX_PRODUCT_COMPONENTS ];
+        int count;
+        /// Sum of the weights of the components
+        Float totalWeight;
+        /// Jacobian of the square parametrization of the models
+        Float jacobian;
+
+        /// Turns the weights of the components into a CDF, returns false if there is nothing to sample
+        IMPORTANCE_INLINE bool finish() {
+            totalWeight = 0.f;
+            for ( int i = 0; i < count; ++i ) {
+                totalWeight += components[ i ].weight;
+                components[ i ].weight = totalWeight;
+            }
+            if ( !( totalWeight > 0.f ) ) {
+                return false;
+            }
+            const Float invTotal = 1.f / totalWeight;
+            for ( int i = 0; i < count; ++i ) {
+                components[ i ].weight *= invTotal;
+            }
+            return true;
+        }
+
+        /// Selects a component and rescales the random number for sampling it
+        IMPORTANCE_INLINE const ProductComponent & select( Float & random ) const {
+            int i = 0;
+            while ( i < count - 1 && components[ i ].weight < random ) {
+                ++i;
+            }
+            const Float prev = ( i == 0 ) ? 0.f : components[ i - 1 ].weight;
+            random = std::min( 1.f - FLT_EPSILON, ( random - prev ) / ( components[ i ].weight - prev ) );
+            return components[ i ];
+        }
+
+        /// Probability of a component
+        IMPORTANCE_INLINE Float probability( int i ) const {
+            return ( i == 0 ) ? components[ 0 ].weight : ( components[ i ].weight - components[ i - 1 ].weight );
+        }
+    };
+
+
+    /************************************************************************/
+    /*  Learned probability of sampling the bsdf                            */
+    /************************************************************************/
+
+    /**
+       Probability of sampling the bsdf instead of the distribution in the one-sample MIS of both 
+       strategies. It is learned by stochastic gradient descent (Adam) on the logit of the probability,
+       minimizing the second moment of the estimator. The probability is kept in [ 0.05, 0.95 ] so that
+       both strategies stay available.
+
+       Updates are skipped when another thread holds the lock, the probability is read without it.
+    */
+    class BsdfSelectionLearner {
+    public:
+        BsdfSelectionLearner() : m_logit( 0.f ), m_m( 0.f ), m_v( 0.f ), m_beta1t( 1.f ), m_beta2t( 1.f ), m_steps( 0 ) { }
+
+        /// Learned probability of sampling the bsdf, defaultValue if nothing was learned yet
+        IMPORTANCE_INLINE Float probability( Float defaultValue ) const {
+            if ( m_steps == 0 ) {
+                return defaultValue;
+            }
+            return 1.f / ( 1.f + std::exp( -m_logit ) );
+        }
+
+        /// Makes one step with the derivative of the second moment with respect to the logit
+        void update( Float gradient, Float defaultValue ) {
+            static const Float LEARNING_RATE = 0.01f, BETA1 = 0.9f, BETA2 = 0.999f, EPSILON = 1e-8f, MAX_LOGIT = 2.944f;
+            if ( !isReal( gradient ) || !m_lock.tryLockWrite() ) {
+                return;
+            }
+            if ( m_steps == 0 ) {
+                const Float p = std::min( std::max( defaultValue, 0.05f ), 0.95f );
+                m_logit = std::log( p / ( 1.f - p ) );
+            }
+            ++m_steps;
+            m_beta1t *= BETA1;
+            m_beta2t *= BETA2;
+            m_m = BETA1 * m_m + ( 1.f - BETA1 ) * gradient;
+            m_v = BETA2 * m_v + ( 1.f - BETA2 ) * gradient * gradient;
+            const Float mHat = m_m / ( 1.f - m_beta1t );
+            const Float vHat = m_v / ( 1.f - m_beta2t );
+            m_logit -= LEARNING_RATE * mHat / ( std::sqrt( vHat ) + EPSILON );
+            m_logit = std::min( std::max( m_logit, -MAX_LOGIT ), MAX_LOGIT );
+            m_lock.unlockWrite();
+        }
+
+    private:
+        Float m_logit;
+        /// Adam moments and the powers of their decay rates
+        Float m_m, m_v, m_beta1t, m_beta2t;
+        size_t m_steps;
+        ReaderWriterLock m_lock;
+    };
+
+    /// The learners that provided the bsdf sampling probability of one scattering event
+    struct BsdfSelectionRecord {
+        BsdfSelectionLearner * learners[ MAX_CACHE_KNN ];
+        Float weights[ MAX_CACHE_KNN ];
+        int count;
+        Float defaultValue;
+        /// The bsdf sampling probability and pdfs of both strategies in the sampled direction
+        Float probability, bsdfPdf, guidePdf;
+
+        BsdfSelectionRecord() : count( 0 ) { }
+
+        /** 
+           Trains the learners with the value of the estimator ( f / pdf ) in the sampled direction.
+           The derivative of the second moment of the one-sample MIS estimator with respect to the bsdf 
+           sampling probability is estimated as -value^2 * ( bsdfPdf - guidePdf ) / pdf.
+        */
+        void train( Float value ) const {
+            const Float pdf = probability * bsdfPdf + ( 1.f - probability ) * guidePdf;
+            if ( count == 0 || value == 0.f || !( pdf > 0.f ) ) {
+                return;
+            }
+            const Float dProbability = -value * value * ( bsdfPdf - guidePdf ) / pdf;
+            for ( int i = 0; i < count; ++i ) {
+                const Float p = learners[ i ]->probability( defaultValue );
+                learners[ i ]->update( dProbability * weights[ i ] * p * ( 1.f - p ), defaultValue );
+            }
+        }
+    };
+}
@@ -0,0 +1,121 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+#include "Config.h"
+#include "Vector2.h"
+
+namespace Importance {
+
+    /************************************************************************/
+    /*  Restricted (gather area) sampling of a mixture                      */
+    /************************************************************************/
+
+    /** 
+       One Gaussian lobe of a mixture with the factors of its covariance, so that bounded-domain queries 
+       against many gather disks do not factorize the lobe again. It lives in the square parametrization 
+       of the model (cache record) it was computed from.
+
+       The factorization follows GaussianSamplingLobes::toLobe() and sampleGatherArea(), i.e. a point of 
+       the square is mean + M * x where x is the standardized point.
+    */
+    struct RestrictedLobe {
+        /// Mean
+        Float meanX, meanY;
+        /// Maps standardized points to the square [ m00, m01 | m10, m11 ]
+        Float m00, m01, m10, m11;
+        /// Inverse of M, maps points of the square to the standardized space
+        Float n00, n01, n10, n11;
+        /// Weight of the lobe multiplied by the weight of its model in the distribution
+        Float weight;
+        /// Index of the model in the distribution
+        int model;
+
+        /// Factorizes the covariance [ c0, c1 | c1, c2 ], returns false if the lobe is degenerate
+        IMPORTANCE_INLINE bool init( const Vector2 & mean, Float c0, Float c1, Float c2, Float w, int m ) {
+            const Float c1Sqr = c1 * c1;
+            const Float det = c0 * c2 - c1Sqr;
+            if ( !( det > 0.f ) || !( w > 0.f ) ) {
+                return false;
+            }
+            const Float invDetSqrt = 1.0f / std::sqrt( det );
+            if ( c0 > c2 ) {
+                const Float a22 = std::sqrt( c0 );
+                const Float a12 = -c1 / a22;
+                const Float a11 = std::sqrt( c2 - c1Sqr / c0 );
+                m00 = invDetSqrt * a11;
+                m01 = invDetSqrt * a12;
+                m10 = 0.f;
+                m11 = invDetSqrt * a22;
+            } else {
+                const Float a11 = std::sqrt( c2 );
+                const Float a21 = -c1 / a11;
+                const Float a22 = std::sqrt( c0 - c1Sqr / c2 );
+                m00 = invDetSqrt * a11;
+                m01 = 0.f;
+                m10 = invDetSqrt * a21;
+                m11 = invDetSqrt * a22;
+            }
+            /// M is triangular, so is its inverse
+            n00 = 1.f / m00;
+            n11 = 1.f / m11;
+            n01 = -m01 * n00 * n11;
+            n10 = -m10 * n00 * n11;
+            meanX = mean.x;
+            meanY = mean.y;
+            weight = w;
+            model = m;
+            return isReal( n00 ) && isReal( n11 ) && isReal( n01 ) && isReal( n10 );
+        }
+
+        /// Maps a point of the square to the standardized space of the lobe
+        IMPORTANCE_INLINE Vector2 toStandard( Float x, Float y ) const {
+            const Float dx = x - meanX, dy = y - meanY;
+            return Vector2( n00 * dx + n01 * dy, n10 * dx + n11 * dy );
+        }
+
+        /// Maps a standardized point to the square
+        IMPORTANCE_INLINE Vector2 fromStandard( const Vector2 & x ) const {
+            return Vector2( meanX + m00 * x.x + m01 * x.y, meanY + m10 * x.x + m11 * x.y );
+        }
+    };
+
+    const int MAX_RESTRICTED_LOBES = MAX_CACHE_KNN * MAX_FITTED_LOBES;
+
+    /** 
+       Lobes of a distribution prepared for restricted sampling towards many gather disks from the same
+       vertex, see Distribution::initRestricted(). The lobes of every model are stored together.
+    */
+    struct RestrictedMixture {
+        RestrictedLobe lobes[ MAX_RESTRICTED_LOBES ];
+        int count;
+        /// First lobe of every model, modelStart[ models ] == count
+        int modelStart[ MAX_CACHE_KNN + 1 ];
+        int models;
+    };
+}
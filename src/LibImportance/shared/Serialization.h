@@ -0,0 +1,81 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "Config.h"
+#include "Stack.h"
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <stdexcept>
+
+namespace Importance {
+
+    /// \brief Binary serialization of plain data (i.e. without pointers and virtual methods) 
+    ///        in the native layout. Files written by one build are meant to be read by the same 
+    ///        build only, the caller is responsible for checking this (e.g. by a header).
+
+    template<class T>
+    IMPORTANCE_INLINE void serializePod( std::ostream & output, const T & value ) {
+        output.write( (const char *) &value, sizeof( T ) );
+    }
+
+    template<class T>
+    IMPORTANCE_INLINE void deserializePod( std::istream & input, T & value ) {
+        if ( !input.read( (char *) &value, sizeof( T ) ) ) {
+            throw std::runtime_error( "Unexpected end of serialized data" );
+        }
+    }
+
+    /// \brief Writes the number of elements and the elements of a stack of plain data
+    template<class T, typename TInt>
+    void serializeStack( std::ostream & output, const IStack<T, TInt> & stack ) {
+        const unsigned int count = (unsigned int) stack.size();
+        serializePod( output, count );
+        if ( count > 0 ) {
+            output.write( (const char *) &stack[ 0 ], sizeof( T ) * count );
+        }
+    }
+
+    /// \brief Reads a stack written by \ref serializeStack, overwrites previous content of the stack
+    template<class T, typename TInt>
+    void deserializeStack( std::istream & input, IStack<T, TInt> & stack ) {
+        unsigned int count = 0;
+        deserializePod( input, count );
+        stack.clear();
+        stack.resize( count );
+        if ( count > 0 && !input.read( (char *) &stack[ 0 ], sizeof( T ) * count ) ) {
+            throw std::runtime_error( "Unexpected end of serialized data" );
+        }
+    }
+
+    /// \brief Stream buffer reading directly from a block of memory (e.g. a memory mapped file) 
+    ///        without copying it
+    class MemoryInputBuffer : public std::streambuf {
+    public:
+        MemoryInputBuffer( const void * data, const size_t size ) {
+            char * begin = const_cast<char *>( (const char *) data );
+            setg( begin, begin, begin + size );
+        }
+    };
+}
@@ -0,0 +1,66 @@
+/*
+    This file is part of LibImportance library that provides a technique for guiding
+    transport paths towards the important places in the scene. This is a direct implementation
+    of the method described in the paper "On-line Learning of Parametric Mixture 
+    Models for Light Transport Simulation", ACM Trans. Graph. (SIGGRAPH 2014) 33, 4 (2014).
+   
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+
+    LibImportance library is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    LibImportance library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include <functional>
+
+namespace Importance {
+
+    /// \brief Runs the independent tasks of a parallel loop. LibImportance does not own any 
+    ///        threads, the host application implements this on top of its own thread pool 
+    ///        (see \ref Sampler::setTaskRunner).
+    ///
+    ///        Results must not depend on which thread runs a task or in which order the tasks 
+    ///        run, so that the samplers stay reproducible for any number of threads.
+    class TaskRunner {
+    public:
+        typedef std::function<void (int)> Task;
+
+        virtual ~TaskRunner() {}
+
+        /// \brief Calls task( i ) for every i in [0, count) and returns once all calls have 
+        ///        finished. The calls may run concurrently and in any order.
+        virtual void run( int count, const Task & task ) = 0;
+
+        /// \brief Number of threads that run the tasks, used to choose the task granularity
+        virtual int getThreadCount() const = 0;
+    };
+
+    /// \brief Runs all tasks in the calling thread, used when no runner was set
+    class SerialTaskRunner : public TaskRunner {
+    public:
+        virtual void run( int count, const Task & task ) {
+            for ( int i = 0; i < count; ++i ) {
+                task( i );
+            }
+        }
+
+        virtual int getThreadCount() const { return 1; }
+
+        static SerialTaskRunner & getInstance() {
+            static SerialTaskRunner instance;
+            return instance;
+        }
+    };
+}
@@ -24,6 +24,7 @@
 
 #include "..\LibImportanceTypes.h"
 #include "..\distributionmodels.h"
+#include "..\sdtree\SDTreeSampler.h"
 
 namespace Importance {
     struct ResultBuffer : public IResultBuffer {
@@ -38,6 +39,7 @@ namespace Importance {
             __declspec(align(16)) char x3[sizeof(ImmediateDistribution<Pharr>)];
             __declspec(align(16)) char x4[sizeof(ImmediateDistribution<Hey>)];
             __declspec(align(16)) char x5[sizeof(ImmediateDistribution<Jensen>)];            
+            __declspec(align(16)) char x6[sizeof(SDTreeDistribution)];
         } dummy;
     };
 }
\ No newline at end of file
@@ -219,6 +219,25 @@ namespace Importance {
 #endif
         }
 
+        /// \brief Restores the particles and their kd-tree, the tree is not built again
+        virtual void loadImpl(std::istream& input, const Config& config, const Camera* camera, Stats* stats) {
+            IMPORTANCE_ASSERT(config.particles.knn <= MAX_KNN_PARTICLES);
+            this->stats = stats;
+            this->config = config;
+            this->camera = camera;
+            deserializeStack( input, particles );
+#ifdef LIBIMP_STATS
+            computeSampleStatistics( particles, m_particleStats );
+#endif
+            distFactory->init(particles, &this->config);
+            tree.deserialize( input );
+        }
+
+        virtual void save( std::ostream & output ) const {
+            serializeStack( output, particles );
+            tree.serialize( output );
+        }
+
         virtual Distribution* getDistributionImpl(const Hit& hit, IResultBuffer& buffer) {            
             ImStaticArray<KdQueryResult, MAX_KNN_PARTICLES> searchResults;
             const int found = nnquery( hit, searchResults );
@@ -20,6 +20,7 @@
 #include <mitsuba/render/texture.h>
 #include <mitsuba/hw/basicshader.h>
 #include <mitsuba/core/warp.h>
+#include "gatherarea.h"
 
 MTS_NAMESPACE_BEGIN
 
@@ -183,225 +184,53 @@ public:
 
 	Shader *createShader(Renderer *renderer) const;
 
-	Float gatherAreaPdf(Vector wi, Vector wo, Float gatherRadius,
-		std::vector<Float > &componentProbs, std::vector<Vector4> &componentBounds) const{
-		if (Frame::cosTheta(wi) <= 0) return 0.f;
-		Vector4 bbox = Vector4(0.f, 0.5f * M_PI, 0.f, 2.f * M_PI);		
-		Vector dir = wo;
-		Float dis = dir.length();
-		if (dis < gatherRadius){
-			componentBounds.push_back(bbox);
-			return 1.f;
+	Float gatherAreaPdf(const Vector &wi, const Vector &wo, Float gatherRadius,
+		GatherDomain &domain) const{
+		if (Frame::cosTheta(wi) <= 0) return 0.f;
+		Vector4 bbox;
+		Float prob = CosineLobeGatherArea::eval(wo, gatherRadius, bbox);
+		if (prob > 0.f){
+			domain.appendLeaf(prob);
+			domain.appendBounds(bbox);
 		}
-		dir /= dis;
-		Float dTheta = acos(sqrt(dis * dis - gatherRadius * gatherRadius) / dis);
-		Float theta = acos(dir.z);
-		Float theta0 = theta - dTheta;
-		Float theta1 = std::min(0.5f * M_PI, theta + dTheta);		
-		Float prob = 0.f;
-		if (theta0 < 0.f){
-			// sample the full sphere cap of polar
-			Float cos1 = cos(2.f * theta1);
-			prob = 0.5f * (1.f - cos1);
-			bbox.x = theta0; bbox.y = theta1;
-		}
-		else{
-			// sample the bbox of the cone
-			Vector dirProj = Vector(wo.x, wo.y, 0.f);
-			Float disProj = dirProj.length();
-			Float dPhi = acos(sqrt(disProj * disProj - gatherRadius * gatherRadius) / disProj);
-			Float phi = atan2(dirProj.y, dirProj.x);
-			Float cos0 = cos(2.f * theta0);
-			Float cos1 = cos(2.f * theta1);
-			prob = 0.5f * dPhi * (cos0 - cos1) / M_PI;		
-			bbox.x = theta0; bbox.y = theta1;
-			bbox.z = phi - dPhi; bbox.w = phi + dPhi;
-		}
-		componentBounds.push_back(bbox);
-		return prob;		
-	}
-	
-	Vector sampleGatherArea(Vector wi, Vector wo, Float gatherRadius, Point2 sample, 
-		std::vector<Float> componentProbs, std::vector<Vector4> componentBounds) const{
-		if (Frame::cosTheta(wi) <= 0) return Vector(0.f);		
-		uniformShootRatio.incrementBase();
-		thetaShootRatio.incrementBase();
-		phiShootRatio.incrementBase();
+		return prob;
+	}
 
-		Vector4 bbox = componentBounds[0];
-		Vector dir;
-		if (bbox.x == 0.f && bbox.y == 0.5f * M_PI && bbox.z == 0.f && bbox.w == 2.f * M_PI){
-			// uniform sampling
-			dir = Warp::squareToCosineHemisphere(sample);
-			++uniformShootRatio;
+	void gatherAreaPdfBatch(const Vector &wi, const Vector *wo, size_t count, Float gatherRadius,
+		GatherDomain * const *domains, Float *probs) const{
+		if (Frame::cosTheta(wi) <= 0){
+			for (size_t i = 0; i < count; ++i)
+				probs[i] = 0.f;
+			return;
 		}
-		else if (bbox.z == 0.f && bbox.w == 2.f * M_PI){
-			// Sampling the whole sphere cap
-			Point2 smp = sample;
-			Float r0 = sin(std::max((Float)0.0, bbox.x));
-			Float r1 = sin(bbox.y);
-			smp.x = smp.x * 2.f - 1.f;
-			smp.y = smp.y * 2.f - 1.f;
-			Float baser = r0;
-			if (smp.x * smp.x > smp.y * smp.y){
-				Float r2r1 = smp.y / smp.x;
-				if (smp.x < 0.f) baser = -baser;
-				smp.x = smp.x * (r1 - r0) + baser;
-				smp.y = r2r1 * smp.x;
+		Vector4 bbox[4];
+		for (size_t i = 0; i < count; i += 4){
+			size_t n = std::min(count - i, (size_t) 4);
+			CosineLobeGatherArea::eval4(wo + i, n, gatherRadius, bbox, probs + i);
+			for (size_t j = 0; j < n; ++j){
+				if (probs[i + j] == 0.f) continue;
+				domains[i + j]->appendLeaf(probs[i + j]);
+				domains[i + j]->appendBounds(bbox[j]);
 			}
-			else{
-				Float r1r2 = smp.x / smp.y;
-				if (smp.y < 0.f) baser = -baser;
-				smp.y = smp.y * (r1 - r0) + baser;
-				smp.x = r1r2 * smp.y;
-			}
-			smp.x = (smp.x + 1.f) * 0.5f;
-			smp.y = (smp.y + 1.f) * 0.5f;			
-			dir = Warp::squareToCosineHemisphere(smp);
-			++thetaShootRatio;
-		}
-		else{
-			// sampling a bbox in theta-phi space
-			Float sin0 = sin(std::max((Float)0.0, bbox.x));
-			Float sin1 = sin(bbox.y);
-			Float phi0 = bbox.z;
-			Float phi1 = bbox.w;
-			Point2 smp = sample;
-			Float isin = smp.x * (sin1 - sin0) + sin0;
-			Float iphi = smp.y * (phi1 - phi0) + phi0;
-			Float r = isin;
-			Float z = sqrt(1.f - isin * isin);
-			Float cosPhi, sinPhi;
-			math::sincos(iphi, &sinPhi, &cosPhi);
-			if (EXPECT_NOT_TAKEN(z == 0))
-				z = 1e-10f;
-			dir = Vector(r * cosPhi, r* sinPhi, z);
-			++phiShootRatio;
-		}
-		return dir;
-	}	
-
-	// for guided UPM
-	Float gatherAreaPdf(Vector wi, Vector wo, Float gatherRadius,
-		Vector2* componentCDFs, Vector2* componentBounds,
-		int &topComponentCDFs, int &topComponentBounds) const{
-		if (Frame::cosTheta(wi) <= 0) return 0.f;
-		Vector4 bbox = Vector4(0.f, 0.5f * M_PI, 0.f, 2.f * M_PI);
-		Vector dir = wo;
-		Float dis = dir.length();
-		if (dis < gatherRadius){
-			int numNode = 1;
-			int ptrBound = -topComponentBounds;
-			componentCDFs[topComponentCDFs] = Vector2(1.f, *(float*)&ptrBound);
-			topComponentCDFs++;
-			Vector2 xmin = Vector2(bbox.x, bbox.z);
-			Vector2 xmax = Vector2(bbox.y, bbox.w);
-			componentBounds[topComponentBounds] = xmin;
-			componentBounds[topComponentBounds + 1] = xmax;
-			topComponentBounds += 2;
-			return 1.f;
 		}
-		dir /= dis;
-		Float dTheta = acos(sqrt(dis * dis - gatherRadius * gatherRadius) / dis);
-		Float theta = acos(dir.z);
-		Float theta0 = theta - dTheta;
-		Float theta1 = std::min(0.5f * M_PI, theta + dTheta);
-		Float prob = 0.f;
-		if (theta0 < 0.f){
-			// sample the full sphere cap of polar
-			Float cos1 = cos(2.f * theta1);
-			prob = 0.5f * (1.f - cos1);
-			bbox.x = theta0; bbox.y = theta1;
-		}
-		else{
-			// sample the bbox of the cone
-			Vector dirProj = Vector(wo.x, wo.y, 0.f);
-			Float disProj = dirProj.length();
-			Float dPhi = acos(sqrt(disProj * disProj - gatherRadius * gatherRadius) / disProj);
-			Float phi = atan2(dirProj.y, dirProj.x);
-			Float cos0 = cos(2.f * theta0);
-			Float cos1 = cos(2.f * theta1);
-			prob = 0.5f * dPhi * (cos0 - cos1) / M_PI;
-			bbox.x = theta0; bbox.y = theta1;
-			bbox.z = phi - dPhi; bbox.w = phi + dPhi;
-		}
-		int numNode = 1;
-		int ptrBound = -topComponentBounds;
-		componentCDFs[topComponentCDFs] = Vector2(prob, *(float*)&ptrBound);
-		topComponentCDFs++;
-		Vector2 xmin = Vector2(bbox.x, bbox.z);
-		Vector2 xmax = Vector2(bbox.y, bbox.w);
-		componentBounds[topComponentBounds] = xmin;
-		componentBounds[topComponentBounds + 1] = xmax;
-		topComponentBounds += 2;
-		return prob;
-	}
-	Vector sampleGatherArea(Vector wi, Vector wo, Float gatherRadius, Point2 sample,
-		int ptrTree, Vector2* componentCDFs, Vector2* componentBounds) const{
-		if (Frame::cosTheta(wi) <= 0) return Vector(0.f);
+	}
+
+	Vector sampleGatherArea(const Vector &wi, const Vector &wo, Float gatherRadius, Point2 sample, 
+		const GatherDomain &domain, int node) const{
+		if (Frame::cosTheta(wi) <= 0) return Vector(0.f);		
 		uniformShootRatio.incrementBase();
 		thetaShootRatio.incrementBase();
 		phiShootRatio.incrementBase();
 
-		// sample CDF tree
-		Vector2 nodei = componentCDFs[ptrTree];
-		int ptrBound = -*(int*)&nodei.y;
-		Vector2 xmin = componentBounds[ptrBound];
-		Vector2 xmax = componentBounds[ptrBound + 1];
-		Vector4 bbox = Vector4(xmin.x, xmax.x, xmin.y, xmax.y);
-
-		Vector dir;
-		if (bbox.x == 0.f && bbox.y == 0.5f * M_PI && bbox.z == 0.f && bbox.w == 2.f * M_PI){
-			// uniform sampling
-			dir = Warp::squareToCosineHemisphere(sample);
-			++uniformShootRatio;
-		}
-		else if (bbox.z == 0.f && bbox.w == 2.f * M_PI){
-			// Sampling the whole sphere cap
-			Point2 smp = sample;
-			Float r0 = sin(std::max((Float)0.0, bbox.x));
-			Float r1 = sin(bbox.y);
-			smp.x = smp.x * 2.f - 1.f;
-			smp.y = smp.y * 2.f - 1.f;
-			Float baser = r0;
-			if (smp.x * smp.x > smp.y * smp.y){
-				Float r2r1 = smp.y / smp.x;
-				if (smp.x < 0.f) baser = -baser;
-				smp.x = smp.x * (r1 - r0) + baser;
-				smp.y = r2r1 * smp.x;
-			}
-			else{
-				Float r1r2 = smp.x / smp.y;
-				if (smp.y < 0.f) baser = -baser;
-				smp.y = smp.y * (r1 - r0) + baser;
-				smp.x = r1r2 * smp.y;
-			}
-			smp.x = (smp.x + 1.f) * 0.5f;
-			smp.y = (smp.y + 1.f) * 0.5f;
-			dir = Warp::squareToCosineHemisphere(smp);
-			++thetaShootRatio;
-		}
-		else{
-			// sampling a bbox in theta-phi space
-			Float sin0 = sin(std::max((Float)0.0, bbox.x));
-			Float sin1 = sin(bbox.y);
-			Float phi0 = bbox.z;
-			Float phi1 = bbox.w;
-			Point2 smp = sample;
-			Float isin = smp.x * (sin1 - sin0) + sin0;
-			Float iphi = smp.y * (phi1 - phi0) + phi0;
-			Float r = isin;
-			Float z = sqrt(1.f - isin * isin);
-			Float cosPhi, sinPhi;
-			math::sincos(iphi, &sinPhi, &cosPhi);
-			if (EXPECT_NOT_TAKEN(z == 0))
-				z = 1e-10f;
-			dir = Vector(r * cosPhi, r* sinPhi, z);
-			++phiShootRatio;
+		Vector4 bbox = domain.getLeafBounds(node);
+		switch (CosineLobeGatherArea::getType(bbox)){
+		case CosineLobeGatherArea::EUniform: ++uniformShootRatio; break;
+		case CosineLobeGatherArea::ECap: ++thetaShootRatio; break;
+		default: ++phiShootRatio; break;
 		}
-		return dir;
-	}
-
+		return CosineLobeGatherArea::sample(bbox, sample);
+	}
+
 	Float getBandwidth() const{
 		return 0.f;
 	}
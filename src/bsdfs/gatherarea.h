@@ -0,0 +1,211 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__GATHERAREA_H)
+#define __GATHERAREA_H
+
+#include <mitsuba/core/warp.h>
+#if defined(MTS_SSE)
+#include <mitsuba/core/sse.h>
+#endif
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * Restricted (gather area) sampling of a cosine-weighted lobe around the
+ * local z axis, used by the diffuse and phong plugins for UPM.
+ *
+ * The directions that can reach a gather disk of radius \c r around \c wo
+ * lie in a cone of half-angle dTheta = asin(r/|wo|) around \c wo. The
+ * domain is the (theta, phi) box that bounds this cone, or the full polar
+ * cap when the cone contains the pole. Bounds are stored as
+ * <tt>(sin theta0, sin theta1, phi0, phi1)</tt>; the whole hemisphere is
+ * <tt>(0, 1, 0, 2pi)</tt>.
+ *
+ * The bounds of the cone are derived from the sines and cosines of theta
+ * and dTheta with the angle sum identities, so only the box case needs
+ * two transcendental functions (asin and atan2) per disk. \ref eval4()
+ * evaluates up to four disks at once with SSE.
+ */
+class CosineLobeGatherArea {
+public:
+	/// Shape of a restricted domain
+	enum EBoundsType {
+		/// The whole hemisphere
+		EUniform = 0,
+		/// A polar cap
+		ECap,
+		/// A box in (theta, phi) space
+		EBox
+	};
+
+	/**
+	 * \brief Compute the restricted domain towards a gather disk
+	 *
+	 * \param wo
+	 *     Unnormalized direction to the center of the disk
+	 * \param bbox
+	 *     Returns the bounds of the domain
+	 * \return
+	 *     The cosine-weighted probability of the domain
+	 */
+	static inline Float eval(const Vector &wo, Float gatherRadius, Vector4 &bbox) {
+		Float dist = wo.length();
+		if (dist < gatherRadius)
+			return finish(wo, true, 0, 0, 0, 0, bbox);
+
+		Float invDist = 1.0f / dist;
+		Float sinDTheta = gatherRadius * invDist;
+		Float cosDTheta = math::safe_sqrt(1.0f - sinDTheta * sinDTheta);
+		Float cosTheta = wo.z * invDist;
+		Float sinTheta = math::safe_sqrt(1.0f - cosTheta * cosTheta);
+		Float distProj = std::sqrt(wo.x * wo.x + wo.y * wo.y);
+
+		return finish(wo, false,
+			sinTheta * cosDTheta - cosTheta * sinDTheta,
+			cosTheta * cosDTheta + sinTheta * sinDTheta,
+			cosTheta * cosDTheta - sinTheta * sinDTheta,
+			sinTheta * cosDTheta + cosTheta * sinDTheta,
+			bbox, distProj > gatherRadius ? gatherRadius / distProj : 1.0f);
+	}
+
+	/**
+	 * \brief Compute the restricted domains towards up to four gather disks
+	 *
+	 * Equivalent to calling \ref eval() for <tt>wo[0..count-1]</tt>.
+	 */
+	static inline void eval4(const Vector *wo, size_t count, Float gatherRadius,
+			Vector4 *bbox, Float *prob) {
+#if defined(MTS_SSE)
+		SSEVector x, y, z;
+		for (int i = 0; i < 4; ++i) {
+			const Vector &w = wo[i < (int) count ? i : 0];
+			x.f[i] = w.x; y.f[i] = w.y; z.f[i] = w.z;
+		}
+		const __m128 one = SSEConstants::one.ps, radius = _mm_set1_ps(gatherRadius);
+		const __m128
+			distProj2 = _mm_add_ps(_mm_mul_ps(x.ps, x.ps), _mm_mul_ps(y.ps, y.ps)),
+			dist = _mm_sqrt_ps(_mm_add_ps(distProj2, _mm_mul_ps(z.ps, z.ps))),
+			distProj = _mm_sqrt_ps(distProj2),
+			sinDTheta = _mm_div_ps(radius, dist),
+			cosDTheta = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(one,
+				_mm_mul_ps(sinDTheta, sinDTheta)), _mm_setzero_ps())),
+			cosTheta = _mm_div_ps(z.ps, dist),
+			sinTheta = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(one,
+				_mm_mul_ps(cosTheta, cosTheta)), _mm_setzero_ps()));
+		SSEVector inside, sin0, cos0, cos1, sin1, sinDPhi;
+		inside.ps = _mm_cmplt_ps(dist, radius);
+		sin0.ps = _mm_sub_ps(_mm_mul_ps(sinTheta, cosDTheta), _mm_mul_ps(cosTheta, sinDTheta));
+		cos0.ps = _mm_add_ps(_mm_mul_ps(cosTheta, cosDTheta), _mm_mul_ps(sinTheta, sinDTheta));
+		cos1.ps = _mm_sub_ps(_mm_mul_ps(cosTheta, cosDTheta), _mm_mul_ps(sinTheta, sinDTheta));
+		sin1.ps = _mm_add_ps(_mm_mul_ps(sinTheta, cosDTheta), _mm_mul_ps(cosTheta, sinDTheta));
+		sinDPhi.ps = _mm_min_ps(_mm_div_ps(radius, distProj), one);
+		for (size_t i = 0; i < count; ++i)
+			prob[i] = finish(wo[i], inside.i[i] != 0, sin0.f[i], cos0.f[i],
+				cos1.f[i], sin1.f[i], bbox[i], sinDPhi.f[i]);
+#else
+		for (size_t i = 0; i < count; ++i)
+			prob[i] = eval(wo[i], gatherRadius, bbox[i]);
+#endif
+	}
+
+	/// Classify the bounds of a domain
+	static inline EBoundsType getType(const Vector4 &bbox) {
+		if (bbox.z == 0 && bbox.w == 2 * M_PI)
+			return (bbox.x == 0 && bbox.y == 1) ? EUniform : ECap;
+		return EBox;
+	}
+
+	/// Sample a direction from a domain created by \ref eval()
+	static inline Vector sample(const Vector4 &bbox, const Point2 &sample) {
+		switch (getType(bbox)) {
+			case EUniform:
+				return Warp::squareToCosineHemisphere(sample);
+
+			case ECap: {
+					/* Map the square to the square annulus of the
+					   projected cap, keeping the concentric mapping */
+					Point2 smp(sample.x * 2.0f - 1.0f, sample.y * 2.0f - 1.0f);
+					Float r0 = bbox.x, r1 = bbox.y, baser = r0;
+					if (smp.x * smp.x > smp.y * smp.y) {
+						Float r2r1 = smp.y / smp.x;
+						if (smp.x < 0.0f) baser = -baser;
+						smp.x = smp.x * (r1 - r0) + baser;
+						smp.y = r2r1 * smp.x;
+					} else {
+						Float r1r2 = smp.x / smp.y;
+						if (smp.y < 0.0f) baser = -baser;
+						smp.y = smp.y * (r1 - r0) + baser;
+						smp.x = r1r2 * smp.y;
+					}
+					smp.x = (smp.x + 1.0f) * 0.5f;
+					smp.y = (smp.y + 1.0f) * 0.5f;
+					return Warp::squareToCosineHemisphere(smp);
+				}
+
+			default: {
+					/* Sample sin(theta) uniformly, which is cosine-weighted
+					   in the projected solid angle */
+					Float r = sample.x * (bbox.y - bbox.x) + bbox.x;
+					Float phi = sample.y * (bbox.w - bbox.z) + bbox.z;
+					Float z = math::safe_sqrt(1.0f - r * r);
+					Float sinPhi, cosPhi;
+					math::sincos(phi, &sinPhi, &cosPhi);
+					if (EXPECT_NOT_TAKEN(z == 0))
+						z = 1e-10f;
+					return Vector(r * cosPhi, r * sinPhi, z);
+				}
+		}
+	}
+
+private:
+	/**
+	 * Turn the sines and cosines of theta0 = theta - dTheta and
+	 * theta1 = theta + dTheta into the bounds of the domain
+	 */
+	static inline Float finish(const Vector &wo, bool inside, Float sin0, Float cos0,
+			Float cos1, Float sin1, Vector4 &bbox, Float sinDPhi = 1.0f) {
+		bbox = Vector4(0.0f, 1.0f, 0.0f, 2 * M_PI);
+		if (inside)
+			return 1.0f;
+
+		/* The whole cone lies below the horizon */
+		if (cos0 <= 0 && sin0 >= 0)
+			return 0.0f;
+
+		/* theta1 is clamped to the horizon */
+		if (cos1 <= 0)
+			sin1 = 1.0f;
+
+		if (sin0 < 0) {
+			/* The cone contains the pole, sample the full polar cap */
+			bbox.y = sin1;
+			return sin1 * sin1;
+		}
+
+		/* Sample the (theta, phi) box of the cone */
+		Float dPhi = std::asin(sinDPhi);
+		Float phi = std::atan2(wo.y, wo.x);
+		bbox = Vector4(sin0, sin1, phi - dPhi, phi + dPhi);
+		return dPhi * (sin1 * sin1 - sin0 * sin0) * INV_PI;
+	}
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __GATHERAREA_H */
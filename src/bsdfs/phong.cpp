@@ -19,6 +19,7 @@
 #include <mitsuba/render/bsdf.h>
 #include <mitsuba/hw/basicshader.h>
 #include <mitsuba/core/warp.h>
+#include "gatherarea.h"
 
 MTS_NAMESPACE_BEGIN
 
@@ -305,425 +306,169 @@ public:
 
 	Shader *createShader(Renderer *renderer) const;
 
-	Float gatherAreaPdf(Vector wi, Vector wo, Float gatherRadius, 
-		std::vector<Float> &componentProbs, std::vector<Vector4> &componentBounds) const{
-		if (Frame::cosTheta(wi) <= 0)
-			return 0.f;		
-
-		// initial spec component
-		Vector4 bbox = Vector4(1.f, 0.f, 0.f, 1.f);		
-		Vector4 bboxd = Vector4(0.f, 0.5f * M_PI, 0.f, 2.f * M_PI);		
-		
+	/// Parameters of the restricted sampling that only depend on wi
+	struct GatherAreaCache {
+		Frame reflectFrame;
+		Float exponent;
+	};
+
+	inline void initGatherAreaCache(const Vector &wi, GatherAreaCache &cache) const {
+		cache.reflectFrame = Frame(reflect(wi));
+		cache.exponent = m_exponent->getAverage().average();
+	}
+
+	/**
+	 * Append the restricted domain of both lobes towards the disk around wo.
+	 * The domain of the diffuse lobe was computed by \ref CosineLobeGatherArea.
+	 */
+	Float appendGatherArea(const GatherAreaCache &cache, const Vector &wo, Float gatherRadius,
+		Float probDiff, const Vector4 &bboxd, GatherDomain &domain) const{
+		// initial spec component
+		Vector4 bbox = Vector4(1.f, 0.f, 0.f, 1.f);
+
 		Float dis = wo.length();
 		if (dis < gatherRadius){
-			componentProbs.push_back(m_specularSamplingWeight);			
-			componentBounds.push_back(bbox);			
-			componentBounds.push_back(bboxd);
-			return 1.f;
-		}
-		
-		Float dTheta = acos(sqrt(dis * dis - gatherRadius * gatherRadius) / dis);		
-
-		// specular component
-		Vector wir = reflect(wi);
-		Vector dir = Frame(wir).toLocal(wo / dis);		
-		Float exponent = m_exponent->getAverage().average();		
-		Float theta = acos(dir.z);
-		Float theta0 = theta - dTheta;
-		Float theta1 = theta + dTheta;		
-		theta0 = std::max(theta0, (Float)0.0);
-		theta1 = std::min(theta1, (Float)(0.5 * M_PI));
-		Float cos0 = std::max((Float)0.0, std::min((Float)1.0, pow(cos(theta0), exponent + 1.f)));
-		Float cos1 = std::max((Float)0.0, std::min((Float)1.0, pow(cos(theta1), exponent + 1.f)));
-		Vector dirProj = Vector(dir.x, dir.y, 0.f);
-		Float disProj = dirProj.length() * dis;
-		Float sqrDisTangent = disProj * disProj - gatherRadius * gatherRadius;
-		Float probSpec = 1.f;	
+			domain.appendLeaf(m_specularSamplingWeight);
+			domain.appendBounds(bbox);
+			domain.appendBounds(bboxd);
+			return 1.f;
+		}
+
+		// specular component, the cone bounds follow from the angle sum identities
+		Vector dir = cache.reflectFrame.toLocal(wo) / dis;
+		Float sinDTheta = gatherRadius / dis;
+		Float cosDTheta = math::safe_sqrt(1.f - sinDTheta * sinDTheta);
+		Float cosTheta = dir.z;
+		Float sinTheta = math::safe_sqrt(1.f - cosTheta * cosTheta);
+		Float cosTheta0 = (sinTheta * cosDTheta < cosTheta * sinDTheta) ? 1.f
+			: std::max((Float) 0.f, cosTheta * cosDTheta + sinTheta * sinDTheta);
+		Float cosTheta1 = std::max((Float) 0.f, cosTheta * cosDTheta - sinTheta * sinDTheta);
+		Float cos0 = std::min((Float) 1.f, std::pow(cosTheta0, cache.exponent + 1.f));
+		Float cos1 = std::min((Float) 1.f, std::pow(cosTheta1, cache.exponent + 1.f));
+		Float disProj = std::sqrt(dir.x * dir.x + dir.y * dir.y) * dis;
+		Float probSpec = 1.f;
 		bbox.x = cos0; bbox.y = cos1;
-		if (sqrDisTangent >= 0.f){
-			// sample the bbox of the cone				
-			Float cosdPhi = sqrt(sqrDisTangent) / disProj;
-			Float dPhi = acos(cosdPhi);
-			Float phi = atan2(dirProj.y, dirProj.x);
-			Float inv2Pi = 0.5f / M_PI;
-			bbox.z = (phi - dPhi) * inv2Pi;
-			bbox.w = (phi + dPhi) * inv2Pi;
-			probSpec = dPhi / M_PI * (cos0 - cos1);
-			if (probSpec < 0.f){
-				float fuck = 1.f;
-			}
+		if (disProj >= gatherRadius && disProj > 0.f){
+			// sample the bbox of the cone
+			Float dPhi = std::asin(std::min((Float) 1.f, gatherRadius / disProj));
+			Float phi = std::atan2(dir.y, dir.x);
+			bbox.z = (phi - dPhi) * INV_TWOPI;
+			bbox.w = (phi + dPhi) * INV_TWOPI;
+			probSpec = dPhi * INV_PI * (cos0 - cos1);
 		}
 		else{
-			// sample the full sphere cap of polar			
-			probSpec = 1.f - cos1;
-		}
-
-		// diffuse component
-		dir = wo / dis;
-		theta = acos(dir.z);
-		theta0 = theta - dTheta;
-		theta1 = theta + dTheta;
-		theta0 = std::max(theta0, (Float)0.0);
-		theta1 = std::min(theta1, (Float)(0.5 * M_PI));
-		dirProj = Vector(dir.x, dir.y, 0.f);
-		disProj = dirProj.length() * dis;
-		sqrDisTangent = disProj * disProj - gatherRadius * gatherRadius;
-		Float probDiff = 1.f;		
-		bboxd.x = theta0; bboxd.y = theta1;
-		if (sqrDisTangent >= 0.f){
-			// sample the bbox of the cone			
-			Float cosdPhi = sqrt(sqrDisTangent) / disProj;
-			Float dPhi = acos(cosdPhi);
-			Float phi = atan2(dirProj.y, dirProj.x);
-			cos0 = cos(2.f * theta0);
-			cos1 = cos(2.f * theta1);
-			probDiff = 0.5f * dPhi * (cos0 - cos1) / M_PI;
-			bboxd.z = phi - dPhi; bboxd.w = phi + dPhi;
-		} else {
 			// sample the full sphere cap of polar
-			cos1 = cos(2.f * theta1);
-			probDiff = 0.5f * (1.f - cos1);
+			probSpec = 1.f - cos1;
 		}
+
 		Float prob = probSpec * m_specularSamplingWeight + probDiff * (1.f - m_specularSamplingWeight);
+		if (prob <= 0.f)
+			return 0.f;
 
-		componentProbs.push_back(probSpec * m_specularSamplingWeight / prob);
-		componentBounds.push_back(bbox);
-		componentBounds.push_back(bboxd);
-		
-		return prob;
-	}
-	
-	Vector sampleGatherArea(Vector wi, Vector wo, Float gatherRadius, Point2 sample, 
-		std::vector<Float> componentProbs, std::vector<Vector4> componentBounds) const{
-		if (Frame::cosTheta(wi) <= 0)
-			return Vector(0.f);
-
-		uniformShootRatio.incrementBase();
-		thetaShootRatio.incrementBase();
-		phiShootRatio.incrementBase();
-
-		// sample CDF tree
-		bool sampleSpecular = false;
-		Float tSpec = componentProbs[0];
-		Vector4 bbox;
-		if (sample.x < tSpec){
-			sampleSpecular = true;
-			sample.x = sample.x / tSpec;
-			bbox = componentBounds[0];
-		}
-		else{
-			sample.x = (sample.x - tSpec) / (1.f - tSpec);
-			bbox = componentBounds[1];
-		}
-		
-
-		Vector dir;
-		if (sampleSpecular){
-			/* Update statistics */			
-			if (bbox.x == 1.f && bbox.y == 0.f && bbox.z == 0.f && bbox.w == 1.f)
-				++uniformShootRatio;
-			else if (bbox.z == 0.f && bbox.w == 1.f)
-				++thetaShootRatio;
-			else
-				++phiShootRatio;
-			/* Sample from a Phong lobe centered around (0, 0, 1) */
-			Float exponent = m_exponent->getAverage().average();
-			sample.y = sample.y * (bbox.x - bbox.y) + bbox.y;
-			sample.x = sample.x * (bbox.w - bbox.z) + bbox.z;
-			Vector R = reflect(wi);
-			Float sinAlpha = std::sqrt(1 - std::pow(sample.y, 2 / (exponent + 1)));
-			Float cosAlpha = std::pow(sample.y, 1 / (exponent + 1));
-			Float phi = (2.0f * M_PI) * sample.x;
-			Vector localDir = Vector(
-				sinAlpha * std::cos(phi),
-				sinAlpha * std::sin(phi),
-				cosAlpha
-				);
-			/* Rotate into the correct coordinate system */
-			dir = Frame(R).toWorld(localDir);
-			if (Frame::cosTheta(dir) <= 0)
-				return Vector(0.0f);
-		}
-		else{			
-			if (bbox.x == 0.f && bbox.y == 0.5f * M_PI && bbox.z == 0.f && bbox.w == 2.f * M_PI){
-				// uniform sampling
-				dir = Warp::squareToCosineHemisphere(sample);
-				++uniformShootRatio;
-			}
-			else if (bbox.z == 0.f && bbox.w == 2.f * M_PI){
-				// Sampling the whole sphere cap
-				Point2 smp = sample;
-				Float r0 = sin(std::max((Float)0.0, bbox.x));
-				Float r1 = sin(bbox.y);
-				smp.x = smp.x * 2.f - 1.f;
-				smp.y = smp.y * 2.f - 1.f;
-				Float baser = r0;
-				if (smp.x * smp.x > smp.y * smp.y){
-					Float r2r1 = smp.y / smp.x;
-					if (smp.x < 0.f) baser = -baser;
-					smp.x = smp.x * (r1 - r0) + baser;
-					smp.y = r2r1 * smp.x;
-				}
-				else{
-					Float r1r2 = smp.x / smp.y;
-					if (smp.y < 0.f) baser = -baser;
-					smp.y = smp.y * (r1 - r0) + baser;
-					smp.x = r1r2 * smp.y;
-				}
-				smp.x = (smp.x + 1.f) * 0.5f;
-				smp.y = (smp.y + 1.f) * 0.5f;
-				dir = Warp::squareToCosineHemisphere(smp);
-				++thetaShootRatio;
-			}
-			else{
-				// sampling a bbox in theta-phi space
-				Float sin0 = sin(std::max((Float)0.0, bbox.x));
-				Float sin1 = sin(bbox.y);
-				Float phi0 = bbox.z;
-				Float phi1 = bbox.w;
-				Point2 smp = sample;
-				Float isin = smp.x * (sin1 - sin0) + sin0;
-				Float iphi = smp.y * (phi1 - phi0) + phi0;
-				Float r = isin;
-				Float z = sqrt(1.f - isin * isin);
-				Float cosPhi, sinPhi;
-				math::sincos(iphi, &sinPhi, &cosPhi);
-				if (EXPECT_NOT_TAKEN(z == 0))
-					z = 1e-10f;
-				dir = Vector(r * cosPhi, r* sinPhi, z);
-				++phiShootRatio;
-			}
-		}
-		return dir;
-	}
-
-	// for guided UPM
-	Float gatherAreaPdf(Vector wi, Vector wo, Float gatherRadius,
-		Vector2* componentCDFs, Vector2* componentBounds,
-		int &topComponentCDFs, int &topComponentBounds) const{
-		if (Frame::cosTheta(wi) <= 0)
-			return 0.f;
-
-		// initial spec component
-		Vector4 bbox = Vector4(1.f, 0.f, 0.f, 1.f);
-		Vector4 bboxd = Vector4(0.f, 0.5f * M_PI, 0.f, 2.f * M_PI);
+		/* One leaf: the probability of the specular lobe, followed by the
+		   bounds of the specular and the diffuse lobe */
+		domain.appendLeaf(probSpec * m_specularSamplingWeight / prob);
+		domain.appendBounds(bbox);
+		domain.appendBounds(bboxd);
 
-		Float dis = wo.length();
-		if (dis < gatherRadius){
-			int ptrBound = -topComponentBounds;										// specular node
-			//componentCDFs.push_back(Vector2(m_specularSamplingWeight, *(float*)&ptrBound));
-			componentCDFs[topComponentCDFs] = Vector2(m_specularSamplingWeight, *(float*)&ptrBound);
-			Vector2 xmin = Vector2(bbox.x, bbox.z);
-			Vector2 xmax = Vector2(bbox.y, bbox.w);
-// 			componentBounds.push_back(xmin);
-// 			componentBounds.push_back(xmax);
-			componentBounds[topComponentBounds] = xmin;
-			componentBounds[topComponentBounds + 1] = xmax;
-// 			ptrBound = -componentBounds.size();											// diffuse node
-// 			componentCDFs.push_back(Vector2(1.f - m_specularSamplingWeight, *(float*)&ptrBound));
-			xmin = Vector2(bboxd.x, bboxd.z);
-			xmax = Vector2(bboxd.y, bboxd.w);
-// 			componentBounds.push_back(xmin);
-// 			componentBounds.push_back(xmax);
-			componentBounds[topComponentBounds + 2] = xmin;
-			componentBounds[topComponentBounds + 3] = xmax;
-			topComponentBounds += 4;
-			return 1.f;
-		}
-
-		Float dTheta = acos(sqrt(dis * dis - gatherRadius * gatherRadius) / dis);
-
-		// specular component
-		Vector wir = reflect(wi);
-		Vector dir = Frame(wir).toLocal(wo / dis);
-		Float exponent = m_exponent->getAverage().average();
-		Float theta = acos(dir.z);
-		Float theta0 = theta - dTheta;
-		Float theta1 = theta + dTheta;
-		theta0 = std::max(theta0, (Float)0.0);
-		theta1 = std::min(theta1, (Float)(0.5 * M_PI));
-		Float cos0 = std::max((Float)0.0, std::min((Float)1.0, pow(cos(theta0), exponent + 1.f)));
-		Float cos1 = std::max((Float)0.0, std::min((Float)1.0, pow(cos(theta1), exponent + 1.f)));
-		Vector dirProj = Vector(dir.x, dir.y, 0.f);
-		Float disProj = dirProj.length() * dis;
-		Float sqrDisTangent = disProj * disProj - gatherRadius * gatherRadius;
-		Float probSpec = 1.f;
-		bbox.x = cos0; bbox.y = cos1;
-		if (sqrDisTangent >= 0.f){
-			// sample the bbox of the cone				
-			Float cosdPhi = sqrt(sqrDisTangent) / disProj;
-			Float dPhi = acos(cosdPhi);
-			Float phi = atan2(dirProj.y, dirProj.x);
-			Float inv2Pi = 0.5f / M_PI;
-			bbox.z = (phi - dPhi) * inv2Pi;
-			bbox.w = (phi + dPhi) * inv2Pi;
-			probSpec = dPhi / M_PI * (cos0 - cos1);
-			if (probSpec < 0.f){
-				float fuck = 1.f;
-			}
-		}
-		else{
-			// sample the full sphere cap of polar			
-			probSpec = 1.f - cos1;
-		}
-
-		// diffuse component
-		dir = wo / dis;
-		theta = acos(dir.z);
-		theta0 = theta - dTheta;
-		theta1 = theta + dTheta;
-		theta0 = std::max(theta0, (Float)0.0);
-		theta1 = std::min(theta1, (Float)(0.5 * M_PI));
-		dirProj = Vector(dir.x, dir.y, 0.f);
-		disProj = dirProj.length() * dis;
-		sqrDisTangent = disProj * disProj - gatherRadius * gatherRadius;
-		Float probDiff = 1.f;
-		bboxd.x = theta0; bboxd.y = theta1;
-		if (sqrDisTangent >= 0.f){
-			// sample the bbox of the cone			
-			Float cosdPhi = sqrt(sqrDisTangent) / disProj;
-			Float dPhi = acos(cosdPhi);
-			Float phi = atan2(dirProj.y, dirProj.x);
-			cos0 = cos(2.f * theta0);
-			cos1 = cos(2.f * theta1);
-			probDiff = 0.5f * dPhi * (cos0 - cos1) / M_PI;
-			bboxd.z = phi - dPhi; bboxd.w = phi + dPhi;
+		return prob;
+	}
+
+	Float gatherAreaPdf(const Vector &wi, const Vector &wo, Float gatherRadius, 
+		GatherDomain &domain) const{
+		if (Frame::cosTheta(wi) <= 0)
+			return 0.f;
+
+		GatherAreaCache cache;
+		initGatherAreaCache(wi, cache);
+		Vector4 bboxd;
+		Float probDiff = CosineLobeGatherArea::eval(wo, gatherRadius, bboxd);
+		return appendGatherArea(cache, wo, gatherRadius, probDiff, bboxd, domain);
+	}
+
+	void gatherAreaPdfBatch(const Vector &wi, const Vector *wo, size_t count, Float gatherRadius,
+		GatherDomain * const *domains, Float *probs) const{
+		if (Frame::cosTheta(wi) <= 0){
+			for (size_t i = 0; i < count; ++i)
+				probs[i] = 0.f;
+			return;
 		}
-		else {
-			// sample the full sphere cap of polar
-			cos1 = cos(2.f * theta1);
-			probDiff = 0.5f * (1.f - cos1);
+
+		GatherAreaCache cache;
+		initGatherAreaCache(wi, cache);
+		Vector4 bboxd[4];
+		Float probDiff[4];
+		for (size_t i = 0; i < count; i += 4){
+			size_t n = std::min(count - i, (size_t) 4);
+			CosineLobeGatherArea::eval4(wo + i, n, gatherRadius, bboxd, probDiff);
+			for (size_t j = 0; j < n; ++j)
+				probs[i + j] = appendGatherArea(cache, wo[i + j], gatherRadius,
+					probDiff[j], bboxd[j], *domains[i + j]);
 		}
-		Float prob = probSpec * m_specularSamplingWeight + probDiff * (1.f - m_specularSamplingWeight);
+	}
+	
+	Vector sampleGatherArea(const Vector &wi, const Vector &wo, Float gatherRadius, Point2 sample, 
+		const GatherDomain &domain, int node) const{
+		if (Frame::cosTheta(wi) <= 0)
+			return Vector(0.f);
 
-		//int numNode = 2;
-		//componentCDFs.push_back(Vector2(prob, *(float*)&numNode));		// level root node
-		int ptrBound = -topComponentBounds;										// specular node
-		//componentCDFs.push_back(Vector2(probSpec * m_specularSamplingWeight, *(float*)&ptrBound));
-		componentCDFs[topComponentCDFs] = Vector2(probSpec * m_specularSamplingWeight / prob, *(float*)&ptrBound);
-		Vector2 xmin = Vector2(bbox.x, bbox.z);
-		Vector2 xmax = Vector2(bbox.y, bbox.w);
-// 		componentBounds.push_back(xmin);
-// 		componentBounds.push_back(xmax);
-		componentBounds[topComponentBounds] = xmin;
-		componentBounds[topComponentBounds + 1] = xmax;
-// 		ptrBound = -componentBounds.size();											// diffuse node
-// 		componentCDFs.push_back(Vector2(probDiff * (1.f - m_specularSamplingWeight), *(float*)&ptrBound));
-		xmin = Vector2(bboxd.x, bboxd.z);
-		xmax = Vector2(bboxd.y, bboxd.w);
-		//componentBounds.push_back(xmin);
-		//componentBounds.push_back(xmax);
-		componentBounds[topComponentBounds + 2] = xmin;
-		componentBounds[topComponentBounds + 3] = xmax;
-		topComponentBounds += 4;
-
-		return prob;
-	}
-	Vector sampleGatherArea(Vector wi, Vector wo, Float gatherRadius, Point2 sample,
-		int ptrTree, Vector2* componentCDFs, Vector2* componentBounds) const{
-		if (Frame::cosTheta(wi) <= 0)
-			return Vector(0.f);
-
 		uniformShootRatio.incrementBase();
 		thetaShootRatio.incrementBase();
-		phiShootRatio.incrementBase();
-
-		// sample CDF tree
-		Vector2 rootnode = componentCDFs[ptrTree];
-		Float cdfSpec = rootnode.x;
-		int ptrBound = -*(int*)&rootnode.y;
-		int chosenLobe = -1;		
-		if (sample.x < cdfSpec){
-			chosenLobe = 0;
+		phiShootRatio.incrementBase();
+
+		// sample CDF tree
+		bool sampleSpecular = false;
+		Float tSpec = domain.getProb(node);
+		Vector4 bbox;
+		if (sample.x < tSpec){
+			sampleSpecular = true;
+			sample.x = sample.x / tSpec;
+			bbox = domain.getLeafBounds(node, 0);
 		}
 		else{
-			chosenLobe = 1;
-			ptrBound += 2;
+			sample.x = (sample.x - tSpec) / (1.f - tSpec);
+			bbox = domain.getLeafBounds(node, 1);
 		}
-		Vector2 xmin = componentBounds[ptrBound];
-		Vector2 xmax = componentBounds[ptrBound + 1];
-		Vector4 bbox = Vector4(xmin.x, xmax.x, xmin.y, xmax.y);
+		
 
-		Vector dir;
-		if (chosenLobe == 0){
-			/* Update statistics */
-			if (bbox.x == 1.f && bbox.y == 0.f && bbox.z == 0.f && bbox.w == 1.f)
-				++uniformShootRatio;
-			else if (bbox.z == 0.f && bbox.w == 1.f)
-				++thetaShootRatio;
-			else
-				++phiShootRatio;
-			/* Sample from a Phong lobe centered around (0, 0, 1) */
-			Float exponent = m_exponent->getAverage().average();
-			sample.y = sample.y * (bbox.x - bbox.y) + bbox.y;
-			sample.x = sample.x * (bbox.w - bbox.z) + bbox.z;
-			Vector R = reflect(wi);
-			Float sinAlpha = std::sqrt(1 - std::pow(sample.y, 2 / (exponent + 1)));
-			Float cosAlpha = std::pow(sample.y, 1 / (exponent + 1));
-			Float phi = (2.0f * M_PI) * sample.x;
-			Vector localDir = Vector(
-				sinAlpha * std::cos(phi),
-				sinAlpha * std::sin(phi),
-				cosAlpha
-				);
-			/* Rotate into the correct coordinate system */
-			dir = Frame(R).toWorld(localDir);
-			if (Frame::cosTheta(dir) <= 0)
-				return Vector(0.0f);
-		}
-		else{
-			if (bbox.x == 0.f && bbox.y == 0.5f * M_PI && bbox.z == 0.f && bbox.w == 2.f * M_PI){
-				// uniform sampling
-				dir = Warp::squareToCosineHemisphere(sample);
+		Vector dir;
+		if (sampleSpecular){
+			/* Update statistics */			
+			if (bbox.x == 1.f && bbox.y == 0.f && bbox.z == 0.f && bbox.w == 1.f)
 				++uniformShootRatio;
-			}
-			else if (bbox.z == 0.f && bbox.w == 2.f * M_PI){
-				// Sampling the whole sphere cap
-				Point2 smp = sample;
-				Float r0 = sin(std::max((Float)0.0, bbox.x));
-				Float r1 = sin(bbox.y);
-				smp.x = smp.x * 2.f - 1.f;
-				smp.y = smp.y * 2.f - 1.f;
-				Float baser = r0;
-				if (smp.x * smp.x > smp.y * smp.y){
-					Float r2r1 = smp.y / smp.x;
-					if (smp.x < 0.f) baser = -baser;
-					smp.x = smp.x * (r1 - r0) + baser;
-					smp.y = r2r1 * smp.x;
-				}
-				else{
-					Float r1r2 = smp.x / smp.y;
-					if (smp.y < 0.f) baser = -baser;
-					smp.y = smp.y * (r1 - r0) + baser;
-					smp.x = r1r2 * smp.y;
-				}
-				smp.x = (smp.x + 1.f) * 0.5f;
-				smp.y = (smp.y + 1.f) * 0.5f;
-				dir = Warp::squareToCosineHemisphere(smp);
+			else if (bbox.z == 0.f && bbox.w == 1.f)
 				++thetaShootRatio;
-			}
-			else{
-				// sampling a bbox in theta-phi space
-				Float sin0 = sin(std::max((Float)0.0, bbox.x));
-				Float sin1 = sin(bbox.y);
-				Float phi0 = bbox.z;
-				Float phi1 = bbox.w;
-				Point2 smp = sample;
-				Float isin = smp.x * (sin1 - sin0) + sin0;
-				Float iphi = smp.y * (phi1 - phi0) + phi0;
-				Float r = isin;
-				Float z = sqrt(1.f - isin * isin);
-				Float cosPhi, sinPhi;
-				math::sincos(iphi, &sinPhi, &cosPhi);
-				if (EXPECT_NOT_TAKEN(z == 0))
-					z = 1e-10f;
-				dir = Vector(r * cosPhi, r* sinPhi, z);
+			else
 				++phiShootRatio;
-			}
+			/* Sample from a Phong lobe centered around (0, 0, 1) */
+			Float exponent = m_exponent->getAverage().average();
+			sample.y = sample.y * (bbox.x - bbox.y) + bbox.y;
+			sample.x = sample.x * (bbox.w - bbox.z) + bbox.z;
+			Vector R = reflect(wi);
+			Float sinAlpha = std::sqrt(1 - std::pow(sample.y, 2 / (exponent + 1)));
+			Float cosAlpha = std::pow(sample.y, 1 / (exponent + 1));
+			Float phi = (2.0f * M_PI) * sample.x;
+			Vector localDir = Vector(
+				sinAlpha * std::cos(phi),
+				sinAlpha * std::sin(phi),
+				cosAlpha
+				);
+			/* Rotate into the correct coordinate system */
+			dir = Frame(R).toWorld(localDir);
+			if (Frame::cosTheta(dir) <= 0)
+				return Vector(0.0f);
 		}
-		return dir;
-	}
-
+		else{
+			switch (CosineLobeGatherArea::getType(bbox)){
+			case CosineLobeGatherArea::EUniform: ++uniformShootRatio; break;
+			case CosineLobeGatherArea::ECap: ++thetaShootRatio; break;
+			default: ++phiShootRatio; break;
+			}
+			dir = CosineLobeGatherArea::sample(bbox, sample);
+		}
+		return dir;
+	}
+
 	Float getBandwidth() const{
 		if (m_specularSamplingWeight == 0.f)
 			return 0.f;
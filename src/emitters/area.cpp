@@ -227,7 +227,7 @@ public:
 // 		return 0.f;
 // 	}
 
-	Float gatherAreaPdf(PositionSamplingRecord pRec, Point gatherPosition, Float gatherRadius, std::vector<Float> &componentProbs, std::vector<Vector4> &componentBounds) const{
+	Float gatherAreaPdf(const PositionSamplingRecord &pRec, const Point &gatherPosition, Float gatherRadius, GatherDomain &domain) const{
 // 		Vector local = Warp::squareToCosineHemisphere(sample);
 // 		dRec.d = Frame(pRec.n).toWorld(local);
 // 		dRec.pdf = Warp::squareToCosineHemispherePdf(local);
@@ -235,13 +235,15 @@ public:
 // 		return Spectrum(1.0f);
 
 		Vector4 bbox = Vector4(0.f, 0.5f * M_PI, 0.f, 2.f * M_PI);
-		componentProbs.push_back(1.f);
-		componentBounds.push_back(bbox);
 
 		Vector wo = Frame(pRec.n).toLocal(gatherPosition - pRec.p);		
-		Vector dir = wo;
-		Float dis = dir.length();
-		if (dis < gatherRadius) return 1.f;
+		Vector dir = wo;
+		Float dis = dir.length();
+		if (dis < gatherRadius) {
+			domain.appendLeaf(1.f);
+			domain.appendBounds(bbox);
+			return 1.f;
+		}
 		dir /= dis;
 		Float dTheta = acos(sqrt(dis * dis - gatherRadius * gatherRadius) / dis);
 		Float theta = acos(dir.z);
@@ -267,13 +269,13 @@ public:
 			bbox.x = theta0; bbox.y = theta1;
 			bbox.z = phi - dPhi; bbox.w = phi + dPhi;
 		}
-		componentProbs[0] = prob;
-		componentBounds[0] = bbox;
+		domain.appendLeaf(prob);
+		domain.appendBounds(bbox);
 		return prob;
 	}
-	Vector sampleGatherArea(DirectionSamplingRecord &dRec, PositionSamplingRecord pRec, Point gatherPosition, Float gatherRadius, Point2 sample, std::vector<Float> componentProbs, std::vector<Vector4> componentBounds) const{
+	Vector sampleGatherArea(DirectionSamplingRecord &dRec, PositionSamplingRecord pRec, const Point &gatherPosition, Float gatherRadius, Point2 sample, const GatherDomain &domain, int node) const{
 		Vector dir;
-		Vector4 bbox = componentBounds[0];
+		Vector4 bbox = domain.getLeafBounds(node);
 		if (bbox.x == 0.f && bbox.y == 0.5f * M_PI && bbox.z == 0.f && bbox.w == 2.f * M_PI){
 			// uniform sampling
 			dir = Warp::squareToCosineHemisphere(sample);
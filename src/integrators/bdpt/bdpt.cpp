@@ -139,6 +139,7 @@ public:
 		m_config.lightImage = props.getBoolean("lightImage", true);
 		m_config.sampleDirect = props.getBoolean("sampleDirect", true);
 		m_config.showWeighted = props.getBoolean("showWeighted", true);
+		m_config.deterministic = false;
 
 		#if BDPT_DEBUG == 1
 		if (m_config.maxDepth == -1 || m_config.maxDepth > 6) {
@@ -209,6 +210,9 @@ public:
 		m_config.blockSize = scene->getBlockSize();
 		m_config.cropSize = film->getCropSize();
 		m_config.sampleCount = sampleCount;
+		/* With per-sample streams, only the order in which the blocks are
+		   merged is left to make the image depend on the scheduling */
+		m_config.deterministic = scene->getSampler()->getClass()->getName() == "PhiloxSampler";
 		m_config.dump();
 
 		ref<BDPTProcess> process = new BDPTProcess(job, queue, m_config);
@@ -221,6 +225,7 @@ public:
 
 		scheduler->wait(process);
 		m_process = NULL;
+		process->flushResults();
 		process->develop();
 
 		#if BDPT_DEBUG == 1
@@ -45,6 +45,7 @@ struct BDPTConfiguration {
 	bool lightImage;
 	bool sampleDirect;
 	bool showWeighted;
+	bool deterministic;
 	size_t sampleCount;
 	Vector2i cropSize;
 	int rrDepth;
@@ -57,6 +58,7 @@ struct BDPTConfiguration {
 		lightImage = stream->readBool();
 		sampleDirect = stream->readBool();
 		showWeighted = stream->readBool();
+		deterministic = stream->readBool();
 		sampleCount = stream->readSize();
 		cropSize = Vector2i(stream);
 		rrDepth = stream->readInt();
@@ -68,6 +70,7 @@ struct BDPTConfiguration {
 		stream->writeBool(lightImage);
 		stream->writeBool(sampleDirect);
 		stream->writeBool(showWeighted);
+		stream->writeBool(deterministic);
 		stream->writeSize(sampleCount);
 		cropSize.serialize(stream);
 		stream->writeInt(rrDepth);
@@ -85,6 +88,8 @@ struct BDPTConfiguration {
 		SLog(EDebug, "   Russian roulette depth      : %i", rrDepth);
 		SLog(EDebug, "   Block size                  : %i", blockSize);
 		SLog(EDebug, "   Number of samples           : " SIZE_T_FMT, sampleCount);
+		SLog(EDebug, "   Deterministic merging       : %s",
+			deterministic ? "yes" : "no");
 		#if BDPT_DEBUG == 1
 			SLog(EDebug, "   Show weighted contributions : %s", showWeighted ? "yes" : "no");
 		#endif
@@ -19,6 +19,7 @@
 #include <mitsuba/core/statistics.h>
 #include <mitsuba/core/sfcurve.h>
 #include <mitsuba/bidir/util.h>
+#include <mitsuba/render/shadowqueue.h>
 #include "bdpt_proc.h"
 
 MTS_NAMESPACE_BEGIN
@@ -29,10 +30,12 @@ MTS_NAMESPACE_BEGIN
 
 class BDPTRenderer : public WorkProcessor {
 public:
-	BDPTRenderer(const BDPTConfiguration &config) : m_config(config) { }
+	BDPTRenderer(const BDPTConfiguration &config) : m_config(config),
+		m_deferVisibility(false) { }
 
 	BDPTRenderer(Stream *stream, InstanceManager *manager)
-		: WorkProcessor(stream, manager), m_config(stream) { }
+		: WorkProcessor(stream, manager), m_config(stream),
+		m_deferVisibility(false) { }
 
 	virtual ~BDPTRenderer() { }
 
@@ -61,6 +64,14 @@ public:
 		m_scene->setSampler(m_sampler);
 		m_scene->wakeup(NULL, m_resources);
 		m_scene->initializeBidirectional();
+
+		/* Trace the shadow rays of a sample in one batch when a single ray decides
+		   visibility (the debug images need every connection as soon as it is made) */
+		#if BDPT_DEBUG == 1
+			m_deferVisibility = false;
+		#else
+			m_deferVisibility = m_scene->hasOpaqueVisibility();
+		#endif
 	}
 
 	void process(const WorkUnit *workUnit, WorkResult *workResult, const bool &stop) {
@@ -258,9 +269,18 @@ public:
 				/* Attempt to connect the two endpoints, which could result in
 				   the creation of additional vertices (index-matched boundaries etc.) */
 				int interactions = remaining; // backup
-				if (value.isZero() || !connectionEdge.pathConnectAndCollapse(
-						scene, vsEdge, vs, vt, vtEdge, interactions))
+				if (value.isZero())
 					continue;
+				Ray shadowRay;
+				bool deferred = m_deferVisibility && !vs->isEmitterSupernode()
+					&& !vt->isSensorSupernode();
+				if (deferred) {
+					if (!connectionEdge.connectDeferred(vs, vt, shadowRay))
+						continue;
+				} else if (!connectionEdge.pathConnectAndCollapse(
+						scene, vsEdge, vs, vt, vtEdge, interactions)) {
+					continue;
+				}
 
 				/* Determine the pixel sample position when necessary */
 				if (vt->isSensorSample() && !vt->getSamplePosition(vs, samplePos))
@@ -312,11 +332,34 @@ public:
 				#endif			
 
 				value *= miWeight;
-				if (t >= 2)
+				if (deferred) {
+					DeferredConnection connection;
+					connection.samplePos = samplePos;
+					connection.value = value;
+					connection.t = t;
+					m_shadowQueue.enqueue(shadowRay, (uint32_t) m_deferred.size());
+					m_deferred.push_back(connection);
+				} else if (t >= 2) {
 					sampleValue += value;
-				else
+				} else {
 					wr->putLightSample(samplePos, value);
+				}
+			}
+		}
+
+		if (!m_shadowQueue.isEmpty()) {
+			scene->resolveShadowRays(m_shadowQueue);
+			for (size_t i=0; i<m_shadowQueue.size(); ++i) {
+				if (!m_shadowQueue.isVisible(i))
+					continue;
+				const DeferredConnection &connection = m_deferred[m_shadowQueue.getPayload(i)];
+				if (connection.t >= 2)
+					sampleValue += connection.value;
+				else
+					wr->putLightSample(connection.samplePos, connection.value);
 			}
+			m_shadowQueue.clear();
+			m_deferred.clear();
 		}
 		wr->putSample(initialSamplePos, sampleValue);
 	}
@@ -327,6 +370,13 @@ public:
 
 	MTS_DECLARE_CLASS()
 private:
+	/// Connection of a sample that waits for its shadow ray
+	struct DeferredConnection {
+		Point2 samplePos;
+		Spectrum value;
+		int t;
+	};
+
 	ref<Scene> m_scene;
 	ref<Sensor> m_sensor;
 	ref<Sampler> m_sampler;
@@ -334,6 +384,9 @@ private:
 	MemoryPool m_pool;
 	BDPTConfiguration m_config;
 	HilbertCurve2D<uint8_t> m_hilbertCurve;
+	ShadowRayQueue m_shadowQueue;
+	std::vector<DeferredConnection> m_deferred;
+	bool m_deferVisibility;
 };
 
 
@@ -343,8 +396,11 @@ private:
 
 BDPTProcess::BDPTProcess(const RenderJob *parent, RenderQueue *queue,
 		const BDPTConfiguration &config) :
-	BlockedRenderProcess(parent, queue, config.blockSize), m_config(config) {
+	BlockedRenderProcess(parent, queue, config.blockSize), m_config(config),
+	m_sequencer(this) {
 	m_refreshTimer = new Timer();
+	/* Bound the number of results that the deterministic mode holds back */
+	m_sequencer.setWindow(2 * std::max((size_t) 1, Scheduler::getInstance()->getWorkerCount()));
 }
 
 ref<WorkProcessor> BDPTProcess::createWorkProcessor() const {
@@ -355,22 +411,22 @@ void BDPTProcess::develop() {
 	if (!m_config.lightImage)
 		return;
 	LockGuard lock(m_resultMutex);
-	const ImageBlock *lightImage = m_result->getLightImage();
+	m_result->getLightImage()->develop(m_lightBuffer);
 	m_film->setBitmap(m_result->getImageBlock()->getBitmap());
-	m_film->addBitmap(lightImage->getBitmap(), 1.0f / m_config.sampleCount);
+	m_film->addBitmap(m_lightBuffer, 1.0f / m_config.sampleCount);
 	m_refreshTimer->reset();
 	m_queue->signalRefresh(m_parent);
 }
 
-void BDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
-	if (cancelled)
-		return;
-	const BDPTWorkResult *result = static_cast<const BDPTWorkResult *>(wr);
-	ImageBlock *block = const_cast<ImageBlock *>(result->getImageBlock());
+void BDPTProcess::flushResults() {
 	LockGuard lock(m_resultMutex);
-	m_progress->update(++m_resultCount);
+	m_sequencer.flush();
+}
+
+void BDPTProcess::accumulate(const BDPTWorkResult *result) {
+	ImageBlock *block = const_cast<ImageBlock *>(result->getImageBlock());
 	if (m_config.lightImage) {
-		const ImageBlock *lightImage = m_result->getLightImage();
+		const TiledImageBlock *lightImage = m_result->getLightImage();
 		m_result->put(result);
 		if (m_parent->isInteractive()) {
 			/* Modify the finished image block so that it includes the light image contributions,
@@ -379,15 +435,16 @@ void BDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
 			   every 2 seconds and once more when the rendering process finishes */
 
 			Float invSampleCount = 1.0f / m_config.sampleCount;
-			const Bitmap *sourceBitmap = lightImage->getBitmap();
 			Bitmap *destBitmap = block->getBitmap();
 			int borderSize = block->getBorderSize();
 			Point2i offset = block->getOffset();
 			Vector2i size = block->getSize();
+			ref<Bitmap> sourceBitmap = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, size);
+			lightImage->develop(sourceBitmap, offset);
 
 			for (int y=0; y<size.y; ++y) {
 				const Float *source = sourceBitmap->getFloatData()
-					+ (offset.x + (y+offset.y) * sourceBitmap->getWidth()) * SPECTRUM_SAMPLES;
+					+ y * sourceBitmap->getWidth() * SPECTRUM_SAMPLES;
 				Float *dest = destBitmap->getFloatData()
 					+ (borderSize + (y + borderSize) * destBitmap->getWidth()) * (SPECTRUM_SAMPLES + 2);
 
@@ -402,6 +459,22 @@ void BDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
 	}
 
 	m_film->put(block);
+}
+
+void BDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
+	if (cancelled)
+		return;
+	const BDPTWorkResult *result = static_cast<const BDPTWorkResult *>(wr);
+	UniqueLock lock(m_resultMutex);
+	m_progress->update(++m_resultCount);
+	bool resume = false;
+	if (m_config.deterministic) {
+		/* The sums must not depend on the order in which the blocks complete */
+		size_t sequence = m_blockSequence[blockIndex(result->getImageBlock()->getOffset())];
+		resume = m_sequencer.put(sequence, result, false);
+	} else {
+		accumulate(result);
+	}
 
 	/* Re-develop the entire image every two seconds if partial results are
 	   visible (e.g. in a graphical user interface). This only applies when
@@ -413,6 +486,38 @@ void BDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
 
 	if (developFilm)
 		develop();
+	lock.unlock();
+
+	/* The scheduler calls generateWork() with its own lock held */
+	if (resume)
+		Scheduler::getInstance()->schedule(this);
+}
+
+ParallelProcess::EStatus BDPTProcess::generateWork(WorkUnit *unit, int worker) {
+	if (!m_config.deterministic)
+		return BlockedRenderProcess::generateWork(unit, worker);
+
+	/* Wait until the results that are held back have been merged */
+	LockGuard lock(m_resultMutex);
+	size_t sequence = (size_t) m_numBlocksGenerated;
+	if (m_numBlocksGenerated < m_numBlocksTotal && m_sequencer.pause(sequence))
+		return EPause;
+
+	EStatus status = BlockedRenderProcess::generateWork(unit, worker);
+	if (status == ESuccess)
+		m_blockSequence[blockIndex(static_cast<RectangularWorkUnit *>(unit)->getOffset())] = sequence;
+	return status;
+}
+
+ref<BDPTWorkResult> BDPTProcess::Sequencer::copy(const BDPTWorkResult *wr) {
+	ref<BDPTWorkResult> copy = new BDPTWorkResult(m_process->m_config,
+		m_process->m_film->getReconstructionFilter(), Vector2i(m_process->m_config.blockSize));
+	wr->copyTo(copy);
+	return copy;
+}
+
+void BDPTProcess::Sequencer::merge(const BDPTWorkResult *wr) {
+	m_process->accumulate(wr);
 }
 
 void BDPTProcess::bindResource(const std::string &name, int id) {
@@ -421,7 +526,10 @@ void BDPTProcess::bindResource(const std::string &name, int id) {
 		/* If needed, allocate memory for the light image */
 		m_result = new BDPTWorkResult(m_config, NULL, m_film->getCropSize());
 		m_result->clear();
+		m_lightBuffer = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, m_film->getCropSize());
 	}
+	if (name == "sensor" && m_config.deterministic)
+		m_blockSequence.resize((size_t) m_numBlocksTotal);
 }
 
 MTS_IMPLEMENT_CLASS_S(BDPTRenderer, false, WorkProcessor)
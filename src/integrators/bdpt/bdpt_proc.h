@@ -21,6 +21,7 @@
 
 #include <mitsuba/render/renderproc.h>
 #include <mitsuba/render/renderjob.h>
+#include <mitsuba/render/sequencer.h>
 #include <mitsuba/core/bitmap.h>
 #include "bdpt_wr.h"
 
@@ -44,19 +45,51 @@ public:
 	/// Develop the image
 	void develop();
 
+	/// Merge the results that the deterministic mode still holds back (e.g. after a cancellation)
+	void flushResults();
+
 	/* ParallelProcess impl. */
 	void processResult(const WorkResult *wr, bool cancelled);
 	ref<WorkProcessor> createWorkProcessor() const;
 	void bindResource(const std::string &name, int id);
+	EStatus generateWork(WorkUnit *unit, int worker);
 
 	MTS_DECLARE_CLASS()
 protected:
 	/// Virtual destructor
 	virtual ~BDPTProcess() { }
+
+	/// Accumulate a work result into the film and the light image
+	void accumulate(const BDPTWorkResult *result);
+
+	/// Index of the block that starts at \c offset
+	inline size_t blockIndex(const Point2i &offset) const {
+		Vector2i block = (offset - m_offset) / m_blockSize;
+		return (size_t) (block.x + block.y * m_numBlocks.x);
+	}
 private:
+	/**
+	 * In deterministic mode, the overlapping borders of the blocks and
+	 * the light images are merged in the order in which the blocks
+	 * were handed out
+	 */
+	class Sequencer : public ResultSequencer<BDPTWorkResult> {
+	public:
+		inline Sequencer(BDPTProcess *process) : m_process(process) { }
+	protected:
+		ref<BDPTWorkResult> copy(const BDPTWorkResult *wr);
+		void merge(const BDPTWorkResult *wr);
+	private:
+		BDPTProcess *m_process;
+	};
+
 	ref<BDPTWorkResult> m_result;
+	ref<Bitmap> m_lightBuffer;
 	ref<Timer> m_refreshTimer;
 	BDPTConfiguration m_config;
+	Sequencer m_sequencer;
+	/// Sequence numbers of the blocks (deterministic mode)
+	std::vector<size_t> m_blockSequence;
 };
 
 MTS_NAMESPACE_END
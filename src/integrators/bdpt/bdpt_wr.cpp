@@ -38,13 +38,11 @@ BDPTWorkResult::BDPTWorkResult(const BDPTConfiguration &conf,
 	m_block->setSize(blockSize);
 
 	if (conf.lightImage) {
-		/* Stores the 'light image' -- every worker requires a
-		   full-resolution version, since contributions of s==0
-		   and s==1 paths can affect any pixel of this bitmap */
-		m_lightImage = new ImageBlock(Bitmap::ESpectrum,
+		/* Stores the 'light image' -- contributions of s==0 and
+		   s==1 paths can affect any pixel of this bitmap, so its
+		   tiles are only allocated where they actually land */
+		m_lightImage = new TiledImageBlock(Bitmap::ESpectrum,
 				conf.cropSize, rfilter);
-		m_lightImage->setSize(conf.cropSize);
-		m_lightImage->setOffset(Point2i(0, 0));
 	}
 
 	/* When debug mode is active, we additionally create
@@ -85,6 +83,21 @@ void BDPTWorkResult::put(const BDPTWorkResult *workResult) {
 		m_lightImage->put(workResult->m_lightImage.get());
 }
 
+void BDPTWorkResult::copyTo(BDPTWorkResult *copy) const {
+#if BDPT_DEBUG == 1
+	for (size_t i=0; i<m_debugBlocks.size(); ++i)
+		m_debugBlocks[i]->copyTo(copy->m_debugBlocks[i]);
+	for (size_t i = 0; i < m_debugBlocksM.size(); ++i)
+		m_debugBlocksM[i]->copyTo(copy->m_debugBlocksM[i]);
+#endif
+	m_block->copyTo(copy->m_block);
+	if (m_lightImage.get()) {
+		/* Only the tiles that received samples are copied */
+		copy->m_lightImage->clear();
+		copy->m_lightImage->put(m_lightImage.get());
+	}
+}
+
 void BDPTWorkResult::clear() {
 #if BDPT_DEBUG == 1
 	for (size_t i=0; i<m_debugBlocks.size(); ++i)
@@ -19,7 +19,7 @@
 #if !defined(__BDPT_WR_H)
 #define __BDPT_WR_H
 
-#include <mitsuba/render/imageblock.h>
+#include <mitsuba/render/tiledblock.h>
 #include <mitsuba/core/fresolver.h>
 #include "bdpt.h"
 
@@ -51,6 +51,9 @@ public:
 	/// Aaccumulate another work result into this one
 	void put(const BDPTWorkResult *workResult);
 
+	/// Copy the contents of this work result to another one with the same configuration
+	void copyTo(BDPTWorkResult *copy) const;
+
 #if BDPT_DEBUG == 1
 	/* In debug mode, this function allows to dump the contributions of
 	   the individual sampling strategies to a series of images */
@@ -80,7 +83,7 @@ public:
 		return m_block.get();
 	}
 
-	inline const ImageBlock *getLightImage() const {
+	inline const TiledImageBlock *getLightImage() const {
 		return m_lightImage.get();
 	}
 
@@ -109,7 +112,8 @@ protected:
 	ref_vector<ImageBlock> m_debugBlocks;
 	ref_vector<ImageBlock> m_debugBlocksM;
 #endif
-	ref<ImageBlock> m_block, m_lightImage;
+	ref<ImageBlock> m_block;
+	ref<TiledImageBlock> m_lightImage;
 };
 
 MTS_NAMESPACE_END
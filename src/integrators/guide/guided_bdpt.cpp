@@ -223,6 +223,8 @@ public:
 		m_gs->trainingPhase(job, sceneResID, sensorResID);
 		//m_gs->getWeightWindow().pathTracing();
 		m_gs->getWeightWindow().lightTracing();
+		/* Keep refining the distributions by the paths of the rendering phase (if enabled) */
+		m_gs->beginRefinement();
 
 		ref<GuidedBDPTProcess> process = new GuidedBDPTProcess(job, queue, m_config);
 		m_process = process;
@@ -231,14 +233,16 @@ public:
 		process->bindResource("sensor", sensorResID);
 		process->bindResource("sampler", samplerResID);
 
- 		int guidingSamplerResID = scheduler->registerResource(m_gs);
- 		process->bindResource("guidingSampler", guidingSamplerResID);
+		/* The trained distributions are shared by all workers (and sent to remote ones) */
+		int guidingResID = scheduler->registerResource(m_gs->createResource());
+		process->bindResource("guidingResource", guidingResID);
 
 		scheduler->schedule(process);
 
 		scheduler->wait(process);
+		m_gs->endRefinement();
 		m_process = NULL;
-		scheduler->unregisterResource(guidingSamplerResID);
+		scheduler->unregisterResource(guidingResID);
 		process->develop();
 
 		#if GBDPT_DEBUG == 1
@@ -65,8 +65,9 @@ public:
 		m_scene->wakeup(NULL, m_resources);
 		m_scene->initializeBidirectional();
 
-		m_guidingSampler = static_cast<GuidingSamplers *>(getResource("guidingSampler"))->clone();
-		SLog(EInfo, "clone %d", (void*)m_guidingSampler);
+		GuidingResource *guidingResource = static_cast<GuidingResource *>(getResource("guidingResource"));
+		guidingResource->wakeup(scene);
+		m_guidingSampler = new GuidingContext(guidingResource);
 	}
 
 	void process(const WorkUnit *workUnit, WorkResult *workResult, const bool &stop) {
@@ -100,6 +101,9 @@ public:
 		if (!m_scene->hasDegenerateEmitters() && sensorDepth != -1)
 			++sensorDepth;
 
+		/* Render the block with the most recently refined guiding distributions */
+		m_guidingSampler->beginIteration();
+
 		for (size_t i=0; i<m_hilbertCurve.getPointCount(); ++i) {
 			Point2i offset = Point2i(m_hilbertCurve[i]) + Vector2i(rect->getOffset());
 			m_sampler->generate(offset);
@@ -129,6 +133,8 @@ public:
 			}
 		}
 
+		m_guidingSampler->endIteration();
+
 		#if defined(MTS_DEBUG_FP)
 			disableFPExceptions();
 		#endif		
@@ -267,6 +273,7 @@ public:
 			if (!gsampler.isValid()) {
 				m_guidingSampler->distributionConstructionFailed(its);
 			}
+			gsampler.enableProductSampling(m_guidingSampler->getConfig().m_mitsuba.productSampling, false);
 
 			/* Sample the BSDF */
 			BSDFSamplingRecord bRec(its, sampler, mode);
@@ -304,6 +311,7 @@ public:
 				m_guidingSampler->getWeightWindow().lightTracing();
 			GuidedBRDF gsampler_inv(its_inv, (mode == ERadiance) ? m_guidingSampler->getImportanceSampler() : m_guidingSampler->getRadianceSampler(),
 				m_guidingSampler->getConfig().m_mitsuba.bsdfSamplingProbability);
+			gsampler_inv.enableProductSampling(m_guidingSampler->getConfig().m_mitsuba.productSampling, false);
 			current->pdf[1 - mode] = gsampler_inv.pdf(its.toWorld(bRec.wo));
 			//current->pdf[1 - mode] = bsdf->pdf(bRec, (EMeasure)(current->measure));
 			if (current->pdf[1 - mode] == 0) {
@@ -546,6 +554,10 @@ public:
 				sensorSubpath.vertex(i-1)->rrWeight *
 				sensorSubpath.edge(i-1)->weight[ERadiance];
 
+		/* Observe both subpaths for refining the guiding distributions */
+		m_guidingSampler->observeSubpath(emitterSubpath, importanceWeights, EImportance);
+		m_guidingSampler->observeSubpath(sensorSubpath, radianceWeights, ERadiance);
+
 		Spectrum sampleValue(0.0f);
 		for (int s = (int) emitterSubpath.vertexCount()-1; s >= 0; --s) {
 			/* Determine the range of sensor vertices to be traversed,
@@ -778,6 +790,7 @@ public:
 				m_guidingSampler->getWeightWindow().lightTracing();
 			GuidedBRDF gsampler(itsi, (mode == ERadiance) ? m_guidingSampler->getRadianceSampler() : m_guidingSampler->getImportanceSampler(),
 				m_guidingSampler->getConfig().m_mitsuba.bsdfSamplingProbability);
+			gsampler.enableProductSampling(m_guidingSampler->getConfig().m_mitsuba.productSampling, false);
 
 			BSDFSamplingRecord bRec(its, its.toLocal(wi), its.toLocal(wo), mode);
 			//result = bsdf->pdf(bRec, measure == EArea ? ESolidAngle : measure);			
@@ -1087,7 +1100,7 @@ private:
 	MemoryPool m_pool;
 	GuidedBDPTConfiguration m_config;
 	HilbertCurve2D<uint8_t> m_hilbertCurve;
-	ref<GuidingSamplers> m_guidingSampler;
+	ref<GuidingContext> m_guidingSampler;
 };
 
 
@@ -1109,9 +1122,9 @@ void GuidedBDPTProcess::develop() {
 	if (!m_config.lightImage)
 		return;
 	LockGuard lock(m_resultMutex);
-	const ImageBlock *lightImage = m_result->getLightImage();
+	m_result->getLightImage()->develop(m_lightBuffer);
 	m_film->setBitmap(m_result->getImageBlock()->getBitmap());
-	m_film->addBitmap(lightImage->getBitmap(), 1.0f / m_config.sampleCount);
+	m_film->addBitmap(m_lightBuffer, 1.0f / m_config.sampleCount);
 	m_refreshTimer->reset();
 	m_queue->signalRefresh(m_parent);
 }
@@ -1124,7 +1137,7 @@ void GuidedBDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
 	LockGuard lock(m_resultMutex);
 	m_progress->update(++m_resultCount);
 	if (m_config.lightImage) {
-		const ImageBlock *lightImage = m_result->getLightImage();
+		const TiledImageBlock *lightImage = m_result->getLightImage();
 		m_result->put(result);
 		if (m_parent->isInteractive()) {
 			/* Modify the finished image block so that it includes the light image contributions,
@@ -1133,15 +1146,16 @@ void GuidedBDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
 			   every 2 seconds and once more when the rendering process finishes */
 
 			Float invSampleCount = 1.0f / m_config.sampleCount;
-			const Bitmap *sourceBitmap = lightImage->getBitmap();
 			Bitmap *destBitmap = block->getBitmap();
 			int borderSize = block->getBorderSize();
 			Point2i offset = block->getOffset();
 			Vector2i size = block->getSize();
+			ref<Bitmap> sourceBitmap = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, size);
+			lightImage->develop(sourceBitmap, offset);
 
 			for (int y=0; y<size.y; ++y) {
 				const Float *source = sourceBitmap->getFloatData()
-					+ (offset.x + (y+offset.y) * sourceBitmap->getWidth()) * SPECTRUM_SAMPLES;
+					+ y * sourceBitmap->getWidth() * SPECTRUM_SAMPLES;
 				Float *dest = destBitmap->getFloatData()
 					+ (borderSize + (y + borderSize) * destBitmap->getWidth()) * (SPECTRUM_SAMPLES + 2);
 
@@ -1175,6 +1189,7 @@ void GuidedBDPTProcess::bindResource(const std::string &name, int id) {
 		/* If needed, allocate memory for the light image */
 		m_result = new GuidedBDPTWorkResult(m_config, NULL, m_film->getCropSize());
 		m_result->clear();
+		m_lightBuffer = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, m_film->getCropSize());
 	}
 }
 
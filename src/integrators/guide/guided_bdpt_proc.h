@@ -55,6 +55,7 @@ protected:
 	virtual ~GuidedBDPTProcess() { }
 private:
 	ref<GuidedBDPTWorkResult> m_result;
+	ref<Bitmap> m_lightBuffer;
 	ref<Timer> m_refreshTimer;
 	GuidedBDPTConfiguration m_config;
 };
@@ -38,13 +38,11 @@ GuidedBDPTWorkResult::GuidedBDPTWorkResult(const GuidedBDPTConfiguration &conf,
 	m_block->setSize(blockSize);
 
 	if (conf.lightImage) {
-		/* Stores the 'light image' -- every worker requires a
-		   full-resolution version, since contributions of s==0
-		   and s==1 paths can affect any pixel of this bitmap */
-		m_lightImage = new ImageBlock(Bitmap::ESpectrum,
+		/* Stores the 'light image' -- contributions of s==0 and
+		   s==1 paths can affect any pixel of this bitmap, so its
+		   tiles are only allocated where they actually land */
+		m_lightImage = new TiledImageBlock(Bitmap::ESpectrum,
 				conf.cropSize, rfilter);
-		m_lightImage->setSize(conf.cropSize);
-		m_lightImage->setOffset(Point2i(0, 0));
 	}
 
 	/* When debug mode is active, we additionally create
@@ -19,7 +19,7 @@
 #if !defined(__GBDPT_WR_H)
 #define __GBDPT_WR_H
 
-#include <mitsuba/render/imageblock.h>
+#include <mitsuba/render/tiledblock.h>
 #include <mitsuba/core/fresolver.h>
 #include "guided_bdpt.h"
 
@@ -80,7 +80,7 @@ public:
 		return m_block.get();
 	}
 
-	inline const ImageBlock *getLightImage() const {
+	inline const TiledImageBlock *getLightImage() const {
 		return m_lightImage.get();
 	}
 
@@ -109,7 +109,8 @@ protected:
 	ref_vector<ImageBlock> m_debugBlocks;
 	ref_vector<ImageBlock> m_debugBlocksM;
 #endif
-	ref<ImageBlock> m_block, m_lightImage;
+	ref<ImageBlock> m_block;
+	ref<TiledImageBlock> m_lightImage;
 };
 
 MTS_NAMESPACE_END
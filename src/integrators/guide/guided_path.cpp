@@ -28,6 +28,9 @@ MTS_NAMESPACE_BEGIN
 
 static StatsCounter avgPathLength("Path tracer", "Average path length", EAverage);
 
+/// Maximum number of scattering events per path that train the learned bsdf sampling probability
+#define GUIDED_PATH_MAX_SELECTIONS 32
+
 /*! \plugin{path}{Path tracer}
  * \order{2}
  * \parameters{
@@ -208,6 +211,13 @@ public:
 		Spectrum throughput(1.0f);
 		Float eta = 1.0f;
 
+		/* Scattering events that train the learned bsdf sampling probability once
+		   the radiance arriving from their sampled directions is known */
+		const GuidingConfig::MitsubaConfig &cfg = m_gs->getConfig().m_mitsuba;
+		Importance::BsdfSelectionRecord selections[GUIDED_PATH_MAX_SELECTIONS];
+		Spectrum selectionLi[GUIDED_PATH_MAX_SELECTIONS], selectionThroughput[GUIDED_PATH_MAX_SELECTIONS];
+		int selectionCount = 0;
+
 		while (rRec.depth <= m_maxDepth || m_maxDepth < 0) {
 			if (!its.isValid()) {
 				/* If no intersection could be found, potentially return
@@ -245,10 +255,11 @@ public:
 			(if guided path-tracing is set off than it falls back to regular BSDF sampling distribution)
 			*/
 			GuidedBRDF gsampler(its, ray, m_gs->getRadianceSampler(),
-				m_gs->getConfig().m_mitsuba.bsdfSamplingProbability);
-			if (!gsampler.isValid()) {
+				cfg.bsdfSamplingProbability);
+			if (!gsampler.isValid()) {
 				m_gs->distributionConstructionFailed(its);
 			}
+			gsampler.enableProductSampling(cfg.productSampling, cfg.learnBsdfSamplingProbability);
 
 			/* ==================================================================== */
 			/*                     Direct illumination sampling                     */
@@ -303,6 +314,12 @@ public:
 			if (bsdfWeight.isZero())
 				break;
 
+			if (selectionCount < GUIDED_PATH_MAX_SELECTIONS
+				&& gsampler.getSelectionRecord(selections[selectionCount])) {
+				selectionLi[selectionCount] = Li;
+				selectionThroughput[selectionCount++] = throughput;
+			}
+
 			//scattered |= bRec.sampledType != BSDF::ENull;
 
 			/* Prevent light leaks due to the use of shading normals */
@@ -385,6 +402,17 @@ public:
 			}
 		}
 
+		/* Everything that was added to Li after a scattering event arrived
+		   from its sampled direction */
+		for (int i = 0; i < selectionCount; ++i) {
+			Float value = 0.0f;
+			for (int k = 0; k < SPECTRUM_SAMPLES; ++k) {
+				if (selectionThroughput[i][k] > 0)
+					value += (Li[k] - selectionLi[i][k]) / selectionThroughput[i][k];
+			}
+			selections[i].train(value / SPECTRUM_SAMPLES);
+		}
+
 		/* Store statistics */
 		avgPathLength.incrementBase();
 		avgPathLength += rRec.depth;
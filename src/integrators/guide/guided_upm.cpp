@@ -251,6 +251,8 @@ public:
 		m_gs->trainingPhase(job, sceneResID, sensorResID);
 		//m_gs->getWeightWindow().pathTracing();
 		m_gs->getWeightWindow().lightTracing();
+		/* Keep refining the distributions by the paths of the rendering phase (if enabled) */
+		m_gs->beginRefinement();
 
 		ref<GuidedUPMProcess> process = new GuidedUPMProcess(job, queue, m_config);
 		m_process = process;
@@ -258,12 +260,14 @@ public:
 		process->bindResource("scene", sceneResID);
 		process->bindResource("sensor", sensorResID);
 		process->bindResource("sampler", samplerResID);
-		int guidingSamplerResID = scheduler->registerResource(m_gs);
-		process->bindResource("guidingSampler", guidingSamplerResID);
+		/* The trained distributions are shared by all workers (and sent to remote ones) */
+		int guidingResID = scheduler->registerResource(m_gs->createResource());
+		process->bindResource("guidingResource", guidingResID);
 
 		scheduler->schedule(process);
 		scheduler->wait(process);
-		scheduler->unregisterResource(guidingSamplerResID);
+		m_gs->endRefinement();
+		scheduler->unregisterResource(guidingResID);
 		m_process = NULL;
 		process->develop();
 
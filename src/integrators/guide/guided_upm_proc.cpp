@@ -53,16 +53,15 @@ StatsCounter maxGMMShoots("Unbiased photon mapping", "Max number of a single GMM
 
 const bool EnableCovAwareMis = true;
 const bool MaxClampedConnectionPdf = false;
-const int MaxCDFNode = 3 * 64 /*lobes*/ + 3/*brdf*/ + 5/*GMMs*/ + 3/*root*/;	
 
-void copyBoundInfo(Vector2* componentCDFs, Vector2* componentBounds, int topComponentCDFs, int topComponentBounds, Importance::Vector2* &componentCDFsImp, Importance::Vector2* &componentBoundsImp){	
-	for (int i = 0; i < topComponentCDFs; i++){
-		Vector2 v = componentCDFs[i];
+void copyBoundInfo(const GatherDomain &domain, Importance::Vector2* componentCDFsImp, Importance::Vector2* componentBoundsImp){	
+	for (int i = 0; i < domain.nodeCount; i++){
+		Vector2 v = domain.nodes[i];
 		Importance::Vector2 vi = Importance::Vector2(v.x, v.y);
 		componentCDFsImp[i] = vi;
 	}
-	for (int i = 0; i < topComponentBounds; i++){
-		Vector2 v = componentBounds[i];
+	for (int i = 0; i < domain.boundCount; i++){
+		Vector2 v = domain.bounds[i];
 		Importance::Vector2 vi = Importance::Vector2(v.x, v.y);
 		componentBoundsImp[i] = vi;
 	}
@@ -110,8 +109,9 @@ public:
 			m_config.rrDepth, false /*m_config.separateDirect*/, true /*m_config.directSampling*/,
 			true, m_sampler);
 
-		m_guidingSampler = static_cast<GuidingSamplers *>(getResource("guidingSampler"))->clone();
-		SLog(EInfo, "clone %d", (void*)m_guidingSampler);		
+		GuidingResource *guidingResource = static_cast<GuidingResource *>(getResource("guidingResource"));
+		guidingResource->wakeup(scene);
+		m_guidingSampler = new GuidingContext(guidingResource);
 	}
 
 	void process(const WorkUnit *workUnit, WorkResult *workResult, const bool &stop) {
@@ -142,6 +142,9 @@ public:
 				iteration += numWork;
 			}
 
+			/* Render with the most recently refined guiding distributions */
+			m_guidingSampler->beginIteration();
+
 			gatherLightPathsUPM(m_config.useVC, m_config.useVM, radius, hilbertCurve.getPointCount(), wr, m_config.rejectionProb);
 
 			for (size_t i = 0; i < hilbertCurve.getPointCount(); ++i) {
@@ -157,6 +160,8 @@ public:
 					wr->putSample(splats->getPosition(k), &value[0]);
  				}
 			}			
+
+			m_guidingSampler->endIteration();
 		}
 
 		Log(EInfo, "Run %d iterations", actualSampleCount);
@@ -515,7 +520,6 @@ public:
 		const Sensor *sensor = m_scene->getSensor();
 		m_pathSampler->m_lightPathTree.clear();
 		m_pathSampler->m_lightVertices.clear();
-		m_pathSampler->m_lightVerticesExt.clear();
 		m_pathSampler->m_lightPathEnds.clear();		
 
 		PathVertex vtPred, vt;
@@ -541,10 +545,7 @@ public:
 				m_pathSampler->m_rrDepth, EImportance, m_pathSampler->m_pool);
 
 			PathVertex* vs = m_pathSampler->m_emitterSubpath.vertex(0);
-			LightVertex lvertex = LightVertex(vs, NULL, emitterState, Spectrum(1.f));
-			m_pathSampler->m_lightVertices.push_back(lvertex);
-			LightVertexExt lvertexExt = LightVertexExt(vs, NULL, 0);
-			m_pathSampler->m_lightVerticesExt.push_back(lvertexExt);
+			m_pathSampler->m_lightVertices.append(vs, 0, emitterState, Spectrum(1.f));
 			for (int s = 1; s < (int)m_pathSampler->m_emitterSubpath.vertexCount(); ++s) {
 				PathVertex
 					*vsPred3 = m_pathSampler->m_emitterSubpath.vertexOrNull(s - 3),
@@ -561,13 +562,14 @@ public:
 				// update mis helper and path type
 				updateMisHelper(s - 1, m_pathSampler->m_emitterSubpath, emitterState, m_scene, gatherRadius, m_lightPathNum, useVC, useVM, EImportance);
 
+				// observe photons for refining the guiding distributions
+				if (s > 1 && m_guidingSampler->isObservingParticles())
+					m_guidingSampler->observeVertex(vs, es, importanceWeight, s - 1, EImportance);
+
 				// store light paths												
 				//if (s > 1 && vs->measure != EDiscrete && dot(es->d, -vs->getGeometricNormal()) > Epsilon /* don't save backfaced photons */){
 				{
-					LightVertex lvertex = LightVertex(vs, vsPred, emitterState, importanceWeight);
-					m_pathSampler->m_lightVertices.push_back(lvertex);
-					LightVertexExt lvertexExt = LightVertexExt(vs, vsPred, s);
-					m_pathSampler->m_lightVerticesExt.push_back(lvertexExt);
+					m_pathSampler->m_lightVertices.append(vs, s, emitterState, importanceWeight);
 					if (s > 1 && vs->measure != EDiscrete && dot(es->d, -vs->getGeometricNormal()) > Epsilon){
 						LightPathNode lnode(vs->getPosition(), m_pathSampler->m_lightVertices.size() - 1, s);
 						m_pathSampler->m_lightPathTree.push_back(lnode);
@@ -618,6 +620,7 @@ public:
 		}
 
 		// build kdtree
+		setGatherRadius(m_pathSampler->m_lightPathTree, gatherRadius);
 		m_pathSampler->m_lightPathTree.build(true);
 
 		/* Release any used edges and vertices back to the memory pool */
@@ -632,6 +635,10 @@ public:
 		wr->m_timeTraceKernel->start();
 		list.clear();
 
+		/* Scratch memory of the guided sampling is reused for every camera path */
+		GuidingArena *arena = GuidingArena::getThreadArena();
+		arena->reset();
+
 		const Sensor *sensor = m_scene->getSensor();
 		size_t nLightPaths = m_pathSampler->m_lightPathNum;
 		Float invLightPaths = 1.f / (float)nLightPaths;
@@ -668,6 +675,8 @@ public:
 				m_pathSampler->m_sensorSubpath.vertex(i - 1)->rrWeight *
 				m_pathSampler->m_sensorSubpath.edge(i - 1)->weight[ERadiance];
 
+			m_guidingSampler->observeSubpath(m_pathSampler->m_sensorSubpath, radianceWeights, ERadiance);
+
 			bool watchThread = false;
 			Point2 initialSamplePos(0.0f);
 			if (m_pathSampler->m_sensorSubpath.vertexCount() > 2) {
@@ -694,19 +703,17 @@ public:
 				PathVertex *succVertex = m_pathSampler->m_pool.allocVertex();
 				PathEdge *succEdge = m_pathSampler->m_pool.allocEdge();
 				Point2 samplePos(0.0f);
-				std::vector<uint32_t> searchResults;
-				std::vector<Point> searchPosCamera;
-				std::vector<uint32_t> searchPosIndex;
-				std::vector<bool> searchPosDone;
+				std::vector<uint32_t> &searchResults = m_searchResults;
+				std::vector<Point> &searchPosCamera = m_searchPosCamera;
+				std::vector<uint32_t> &searchPosIndex = m_searchPosIndex;
+				std::vector<bool> &searchPosDone = m_searchPosDone;
 				// std::vector<Point> searchPosLight; // can't do shared shoot for inverse connection
-				std::vector<uint32_t> acceptCnt;
-				std::vector<size_t> shootCnt;
+				std::vector<uint32_t> &acceptCnt = m_acceptCnt;
+				std::vector<size_t> &shootCnt = m_shootCnt;
 
-				Vector2* componentCDFs = new Vector2[MaxCDFNode];
-				Vector2* componentBounds = new Vector2[MaxCDFNode * 2];
-				Importance::Vector2* componentCDFsImp = new Importance::Vector2[MaxCDFNode];
-				Importance::Vector2* componentBoundsImp = new Importance::Vector2[MaxCDFNode * 2];
-				int topComponentCDFs = 0, topComponentBounds = 0;
+				GatherDomain &domain = *arena->create<GatherDomain>();
+				Importance::Vector2 *componentCDFsImp = arena->create<Importance::Vector2>(GatherDomain::EMaxNodes);
+				Importance::Vector2 *componentBoundsImp = arena->create<Importance::Vector2>(GatherDomain::EMaxBounds);
 
 				int minT = 2; int minS = 2;
 				int maxT = (int)m_pathSampler->m_sensorSubpath.vertexCount() - 1;
@@ -732,6 +739,7 @@ public:
 						}
 
 						// prepare for shared shoot
+						MisVertex vtPredRecord(vtPred);
 						searchPosCamera.clear();
 						searchPosIndex.clear();
 						searchPosDone.clear();
@@ -743,17 +751,22 @@ public:
 							//
 							LightPathNode node = m_pathSampler->m_lightPathTree[searchResults[i]];
 							size_t vertexIndex = node.data.vertexIndex;
-							vsPred = vsPred_;
-							m_pathSampler->m_lightVerticesExt[vertexIndex - 1].expand(vsPred);
-							bool cameraDirConnection = (connectionDirection(vsPred, vtPred) == ERadiance);
+							bool cameraDirConnection = (connectionDirection(
+								m_pathSampler->m_lightVertices.getMisVertex(vertexIndex - 1), vtPredRecord) == ERadiance);
 							if (cameraDirConnection){
-								LightVertexExt lvertexExt = m_pathSampler->m_lightVerticesExt[vertexIndex];
-								searchPosCamera.push_back(lvertexExt.position);
+								searchPosCamera.push_back(m_pathSampler->m_lightVertices.getPosition(vertexIndex));
 								searchPosIndex.push_back(i);
 								searchPosDone.push_back(false);
 							}
 						}
 
+						// the camera side distribution sampler is shared by all merges of this vertex,
+						// its lobes are factorized once and reused for every gather disk
+						GuidedBRDF cameraSampler(vtPred->getIntersection(), m_guidingSampler->getRadianceSampler(),
+							m_guidingSampler->getConfig().m_mitsuba.bsdfSamplingProbability,
+							vtPred->isSurfaceInteraction() && !searchPosCamera.empty());
+						cameraSampler.enableRestrictedSampling();
+
 						// evaluate sampling domain pdf normalization
 						// camera direction----->
 						Float invBrdfIntegralShare = 1.f;
@@ -761,25 +774,17 @@ public:
 						Float expectShoot = log(1.f - pow(confidence, 1.f / float(searchPosCamera.size()))) / log(0.75f);
 						size_t totalShootShared = 0;						
 						if (searchPosCamera.size() > expectShoot){
-							bool cameraDirConnection = true;
-							// prepare distribution sampler
-							bool gsampler_valid = (cameraDirConnection && vtPred->isSurfaceInteraction() || !cameraDirConnection && vsPred->isSurfaceInteraction());
-							Intersection gits = (cameraDirConnection) ? vtPred->getIntersection() : vsPred->getIntersection();
-							GuidedBRDF gsampler(gits, (cameraDirConnection) ? m_guidingSampler->getRadianceSampler() : m_guidingSampler->getImportanceSampler(),
-								m_guidingSampler->getConfig().m_mitsuba.bsdfSamplingProbability, gsampler_valid);
-
 							// compute bounded pdf
-							topComponentCDFs = 0;
-							topComponentBounds = 0;
+							domain.clear();
 							wr->m_timeBoundProb->start();
-							Float brdfIntegral = gatherAreaPdf(vtPred, vt->getPosition(), gatherRadius * 2.f, vtPred2, &gsampler,
-								componentCDFs, componentBounds, topComponentCDFs, topComponentBounds,
+							Float brdfIntegral = gatherAreaPdf(vtPred, vt->getPosition(), gatherRadius * 2.f, vtPred2, &cameraSampler,
+								domain,
 								componentCDFsImp, componentBoundsImp,
 								wr->m_timeBoundSurfaceProb, wr->m_timeProbDistrib, wr->m_timeProbGMM, wr->m_timeProbLobe);
 							wr->m_timeBoundProb->stop();
 
 							// copy cdfs and bounds to fucking IMP vector types
-							copyBoundInfo(componentCDFs, componentBounds, topComponentCDFs, topComponentBounds, componentCDFsImp, componentBoundsImp);
+							copyBoundInfo(domain, componentCDFsImp, componentBoundsImp);
 
 							// sample shoot to evaluate 1/p against 2 x radius shared area
 							if (brdfIntegral == 0.f) continue;
@@ -792,7 +797,7 @@ public:
 
 								// bounded sampling shoots
 								if (!sampleShoot(vtPred, m_scene, m_pathSampler->m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vt->getPosition(), gatherRadius * 2.f,
-									componentCDFs, componentBounds, topComponentCDFs, topComponentBounds, componentCDFsImp, componentBoundsImp, &gsampler))
+									domain, componentCDFsImp, componentBoundsImp, &cameraSampler))
 									continue;
 
 								// check shoot validation against all shared connections
@@ -828,29 +833,27 @@ public:
 							if (s == 2 && t == 2) continue;
 #endif
 							size_t vertexIndex = node.data.vertexIndex;
-							LightVertex vi = m_pathSampler->m_lightVertices[vertexIndex];
-							LightVertex viPred = m_pathSampler->m_lightVertices[vertexIndex - 1];
-							MisState emitterState = vi.emitterState;
-							MisState emitterStatePred = viPred.emitterState;
-
-							vs = vs_; vsPred = vsPred_; vsPred2 = vsPred2_; vsPred3 = vsPred3_;
-							m_pathSampler->m_lightVerticesExt[vertexIndex].expand(vs);
-							m_pathSampler->m_lightVerticesExt[vertexIndex - 1].expand(vsPred);
-							if (s > 2){
-								m_pathSampler->m_lightVerticesExt[vertexIndex - 2].expand(vsPred2);
-								m_pathSampler->m_lightVerticesExt[vertexIndex - 3].expand(vsPred3);
-							}
-							else if (s == 2){
-								m_pathSampler->m_lightVerticesExt[vertexIndex - 2].expand(vsPred2);
-								vsPred3 = NULL;
+							MisState emitterState = m_pathSampler->m_lightVertices.getMisState(vertexIndex);
+							MisState emitterStatePred = m_pathSampler->m_lightVertices.getMisState(vertexIndex - 1);
+
+							// decide the direction to do connection
+							const LightVertexStore &lightVertices = m_pathSampler->m_lightVertices;
+							bool cameraDirConnection = (connectionDirection(lightVertices.getMisVertex(vertexIndex - 1), vtPredRecord) == ERadiance);
+
+							// only the light vertex whose BSDF is evaluated is expanded in full
+							vs = vs_; vsPred = vsPred_; vsPred2 = vsPred2_; vsPred3 = NULL;
+							if (cameraDirConnection){
+								lightVertices.expand(vertexIndex, vs);
+								lightVertices.expandGeometry(vertexIndex - 1, vsPred);
 							}
 							else{
-								vsPred2 = NULL;
-								vsPred3 = NULL;
+								lightVertices.expandGeometry(vertexIndex, vs);
+								lightVertices.expand(vertexIndex - 1, vsPred);
 							}
-
-							// decide the direction to do connection
-							bool cameraDirConnection = (connectionDirection(vsPred, vtPred) == ERadiance);
+							if (s >= 2)
+								lightVertices.expandGeometry(vertexIndex - 2, vsPred2);
+							else
+								vsPred2 = NULL;
 
 							// get screen space position
 							samplePos = initialSamplePos;
@@ -862,7 +865,7 @@ public:
 							// evaluate contribution
 							Spectrum contrib;
 							if (cameraDirConnection){
-								contrib = radianceWeights[t - 1] * vi.importanceWeight * invLightPaths;
+								contrib = radianceWeights[t - 1] * m_pathSampler->m_lightVertices.getImportanceWeight(vertexIndex) * invLightPaths;
 								contrib *= vs->eval(m_scene, vsPred, vtPred, EImportance) *	vtPred->eval(m_scene, vtPred2, vs, ERadiance);
 								int interactions = m_pathSampler->m_maxDepth - s - t + 1;
 								if (contrib.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vtPred, NULL, interactions))
@@ -870,7 +873,7 @@ public:
 								contrib *= connectionEdge.evalCached(vs, vtPred, PathEdge::EGeneralizedGeometricTerm);
 							}
 							else{
-								contrib = radianceWeights[t] * viPred.importanceWeight * invLightPaths;
+								contrib = radianceWeights[t] * m_pathSampler->m_lightVertices.getImportanceWeight(vertexIndex - 1) * invLightPaths;
 								contrib *= vt->eval(m_scene, vtPred, vsPred, ERadiance) *	vsPred->eval(m_scene, vsPred2, vt, EImportance);
 								int interactions = m_pathSampler->m_maxDepth - s - t + 1;
 								if (contrib.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vt, vsPred, NULL, interactions))
@@ -887,31 +890,32 @@ public:
 							else{
 								// sample shoot to evaluate 1/p against individual area
 								Float brdfIntegral;
-								topComponentCDFs = 0;
-								topComponentBounds = 0;
+								domain.clear();
 								
-								// prepare distribution sampler
-								bool gsampler_valid = (cameraDirConnection && vtPred->isSurfaceInteraction() || !cameraDirConnection && vsPred->isSurfaceInteraction());
-								Intersection gits = (cameraDirConnection) ? vtPred->getIntersection() : vsPred->getIntersection();
-								GuidedBRDF gsampler(gits, (cameraDirConnection) ? m_guidingSampler->getRadianceSampler() : m_guidingSampler->getImportanceSampler(),
-									m_guidingSampler->getConfig().m_mitsuba.bsdfSamplingProbability, gsampler_valid);
+								// prepare distribution sampler, light side samplers only serve this merge
+								GuidedBRDF lightSampler(vsPred->getIntersection(), m_guidingSampler->getImportanceSampler(),
+									m_guidingSampler->getConfig().m_mitsuba.bsdfSamplingProbability,
+									!cameraDirConnection && vsPred->isSurfaceInteraction());
+								if (!cameraDirConnection)
+									lightSampler.enableRestrictedSampling();
+								GuidedBRDF *gsampler = cameraDirConnection ? &cameraSampler : &lightSampler;
 
 								// compute bounded pdf
 								wr->m_timeBoundProb->start();
 								if (cameraDirConnection)
-									brdfIntegral = gatherAreaPdf(vtPred, vs->getPosition(), gatherRadius, vtPred2, &gsampler,
-										componentCDFs, componentBounds, topComponentCDFs, topComponentBounds,
+									brdfIntegral = gatherAreaPdf(vtPred, vs->getPosition(), gatherRadius, vtPred2, gsampler,
+										domain,
 										componentCDFsImp, componentBoundsImp,
 										wr->m_timeBoundSurfaceProb, wr->m_timeProbDistrib, wr->m_timeProbGMM, wr->m_timeProbLobe);
 								else
-									brdfIntegral = gatherAreaPdf(vsPred, vt->getPosition(), gatherRadius, vsPred2, &gsampler, 
-										componentCDFs, componentBounds, topComponentCDFs, topComponentBounds,
+									brdfIntegral = gatherAreaPdf(vsPred, vt->getPosition(), gatherRadius, vsPred2, gsampler, 
+										domain,
 										componentCDFsImp, componentBoundsImp,
 										wr->m_timeBoundSurfaceProb, wr->m_timeProbDistrib, wr->m_timeProbGMM, wr->m_timeProbLobe);
 								wr->m_timeBoundProb->stop();
 
 								// copy cdfs and bounds to fucking IMP vector types
-								copyBoundInfo(componentCDFs, componentBounds, topComponentCDFs, topComponentBounds, componentCDFsImp, componentBoundsImp);	
+								copyBoundInfo(domain, componentCDFsImp, componentBoundsImp);	
 
 								if (brdfIntegral == 0.f) continue;
 								Float invBrdfIntegral = 1.f / brdfIntegral;
@@ -925,13 +929,13 @@ public:
 									Float pointDistSquared;
 									if (cameraDirConnection){
 										if (!sampleShoot(vtPred, m_scene, m_pathSampler->m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vs->getPosition(), gatherRadius, 
-											componentCDFs, componentBounds, topComponentCDFs, topComponentBounds, componentCDFsImp, componentBoundsImp, &gsampler))
+											domain, componentCDFsImp, componentBoundsImp, gsampler))
 											continue;
 										pointDistSquared = (succVertex->getPosition() - vs->getPosition()).lengthSquared();
 									}
 									else{
 										if (!sampleShoot(vsPred, m_scene, m_pathSampler->m_emitterSampler, vsPred2, predEdge, succEdge, succVertex, EImportance, vt->getPosition(), gatherRadius, 
-											componentCDFs, componentBounds, topComponentCDFs, topComponentBounds, componentCDFsImp, componentBoundsImp, &gsampler))
+											domain, componentCDFsImp, componentBoundsImp, gsampler))
 											continue;
 										pointDistSquared = (succVertex->getPosition() - vt->getPosition()).lengthSquared();
 									}
@@ -963,7 +967,7 @@ public:
 							// MIS weighting						
 							Float miWeight = miWeightVM(m_scene, s, t,
 								emitterState, sensorState, emitterStatePred, sensorStatePred,
-								vsPred3, vsPred2, vsPred, vs,
+								lightVertices, vertexIndex, vsPred2, vsPred, vs,
 								vt, vtPred, vtPred2, vtPred3,
 								cameraDirConnection, gatherRadius, m_pathSampler->m_lightPathNum, useVC, useVM);
 
@@ -1003,11 +1007,6 @@ public:
 				m_pathSampler->m_pool.release(vsPred3_);
 				m_pathSampler->m_pool.release(succVertex);
 				m_pathSampler->m_pool.release(succEdge);
-
-				delete(componentCDFs);
-				delete(componentBounds);
-				delete(componentCDFsImp);
-				delete(componentBoundsImp);
 			}
 
 			repeated = false;
@@ -1031,27 +1030,17 @@ public:
 					memset(vsPred, 0, sizeof(PathVertex));
 					memset(vs, 0, sizeof(PathVertex));
 					if (i < lightPathEnd){
-						LightVertex lvertex = m_pathSampler->m_lightVertices[i];
-						s = m_pathSampler->m_lightVerticesExt[i].depth;
+						s = m_pathSampler->m_lightVertices.getDepth(i);
 						if (s <= 1) continue;
 
-						importanceWeight = lvertex.importanceWeight;
-						emitterState = lvertex.emitterState;
+						importanceWeight = m_pathSampler->m_lightVertices.getImportanceWeight(i);
+						emitterState = m_pathSampler->m_lightVertices.getMisState(i);
 
-						m_pathSampler->m_lightVerticesExt[i].expand(vs);
-						m_pathSampler->m_lightVerticesExt[i - 1].expand(vsPred);
-						if (s > 2){
-							m_pathSampler->m_lightVerticesExt[i - 2].expand(vsPred2);
-							m_pathSampler->m_lightVerticesExt[i - 3].expand(vsPred3);
-						}
-						else if (s == 2){
-							m_pathSampler->m_lightVerticesExt[i - 2].expand(vsPred2);
-							vsPred3 = NULL;
-						}
-						else{
-							vsPred2 = NULL;
-							vsPred3 = NULL;
-						}
+						// the BSDF of vs is the only one evaluated, its predecessors enter the MIS weight
+						m_pathSampler->m_lightVertices.expand(i, vs);
+						m_pathSampler->m_lightVertices.expandGeometry(i - 1, vsPred);
+						m_pathSampler->m_lightVertices.expandGeometry(i - 2, vsPred2);
+						vsPred3 = NULL;
 					}
 
 					int minT = 2, maxT = (int)m_pathSampler->m_sensorSubpath.vertexCount() - 1;
@@ -1186,7 +1175,7 @@ public:
 	}
 
 	Float gatherAreaPdf(PathVertex* current, Point p, Float radius, PathVertex* pPred, GuidedBRDF* gsampler,
-		Vector2* componentCDFs, Vector2* componentBounds,  int &topComponentCDFs, int &topComponentBounds,
+		GatherDomain &domain,
 		Importance::Vector2* componentCDFsImp, Importance::Vector2* componentBoundsImp,
 		Timer* timerSurface, Timer* timerDistrib, Timer* timerGMM, Timer* timerLobe){		
 
@@ -1198,14 +1187,8 @@ public:
 			const Sensor *sensor = static_cast<const Sensor *>(pRec.object);
 			Vector4 bbox = sensor->evaluateSphereBounds(p, radius);
 			prob = (bbox.y - bbox.x) * (bbox.w - bbox.z);
-			//componentCDFs.push_back(Vector2(prob, 0.f));
-			componentCDFs[topComponentCDFs] = Vector2(prob, 0.f);
-			topComponentCDFs++;
-			Vector2 xmin = Vector2(bbox.x, bbox.z);
-			Vector2 xmax = Vector2(bbox.y, bbox.w);
-			componentBounds[topComponentBounds] = xmin;
-			componentBounds[topComponentBounds + 1] = xmax;
-			topComponentBounds += 2;
+			domain.appendLeaf(prob);
+			domain.appendBounds(bbox);
 			break;
 		}
 		case PathVertex::ESurfaceInteraction: {			
@@ -1216,27 +1199,24 @@ public:
 			if (gsampler->m_pureSpecularBSDF || gsampler->m_impDistrib == NULL || gsampler->m_pureSpecularBSDF)
 				bsdfSamplingWeight = 1.f;
 
-			Vector2 rootnode = Vector2();
-			//componentCDFs.push_back(Vector2(0.f/* bsdf pdf, later fill in */, 0.f/* pointer to GMM node, later fill in */));		// level root node			
-			topComponentCDFs++;			
+			// level root node: bsdf pdf and pointer to GMM node, later fill in
+			int rootNode = domain.appendNode(0.f, 0);
 			
 			const BSDF *bsdf = its.getBSDF();
-			Float probBsdf = bsdf->gatherAreaPdf(its.toLocal(wi), its.toLocal(wo), radius, componentCDFs, componentBounds, topComponentCDFs, topComponentBounds);
+			Float probBsdf = bsdf->gatherAreaPdf(its.toLocal(wi), its.toLocal(wo), radius, domain);
 
 			Float probGMM = 1.f;
-			int ptrNode = topComponentCDFs;
+			int ptrNode = domain.nodeCount;
 			timerSurface->start();
 			if (1.f - bsdfSamplingWeight > 0.f){
-				probGMM = gsampler->gatherAreaPdfGuide(wo, radius, 
-					componentCDFs, componentBounds, topComponentCDFs, topComponentBounds,
+				probGMM = gsampler->gatherAreaPdfGuide(wo, radius, domain,
 					componentCDFsImp, componentBoundsImp,
 					timerDistrib, timerGMM, timerLobe);
 			}
 			timerSurface->stop();
 
 			prob = probBsdf * bsdfSamplingWeight + probGMM * (1.f - bsdfSamplingWeight);
-			componentCDFs[0].x = probBsdf * bsdfSamplingWeight / prob;
-			componentCDFs[0].y = *(float*)&ptrNode;		
+			domain.nodes[rootNode] = Vector2(probBsdf * bsdfSamplingWeight / prob, GatherDomain::encodePointer(ptrNode));
 			break;
 		}
 		case PathVertex::EEmitterSample: {
@@ -1258,7 +1238,7 @@ public:
 		const PathVertex *pred, const PathEdge *predEdge,
 		PathEdge *succEdge, PathVertex *succ,
 		ETransportMode mode, Point gatherPosition, Float gatherRadius,
-		Vector2* componentCDFs, Vector2* componentBounds, int topComponentCDFs, int topComponentBounds,		
+		const GatherDomain &domain,
 		Importance::Vector2* componentCDFsImp, Importance::Vector2* componentBoundsImp,
 		GuidedBRDF* gsampler) {
 		Ray ray;
@@ -1277,9 +1257,7 @@ public:
 
 			/* Sample the image plane */
 			Point2 smp = sampler->next2D();
-			Vector2 xmin = componentBounds[0];
-			Vector2 xmax = componentBounds[1];
-			Vector4 bbox = Vector4(xmin.x, xmax.x, xmin.y, xmax.y);
+			Vector4 bbox = domain.getLeafBounds(0);
 			smp.x = (bbox.y - bbox.x) * smp.x + bbox.x;
 			smp.y = (bbox.w - bbox.z) * smp.y + bbox.z;
 			Spectrum result = sensor->sampleDirection(dRec, pRec, smp);
@@ -1294,11 +1272,11 @@ public:
 			const Intersection &its = current->getIntersection();
 			const BSDF *bsdf = its.getBSDF();
 			Vector wi = normalize(pred->getPosition() - its.p);
-			Vector wo = gatherPosition - its.p;			Vector2 rootnode = componentCDFs[0];			Float cdf0 = rootnode.x;			int chosenLobe = -1;			int ptrNode = -1;			Float rndsmp = sampler->next1D();			if (rndsmp < cdf0){				chosenLobe = 0;				ptrNode = 1;			}			else{				chosenLobe = 1;				ptrNode = *(int*)&rootnode.y;			}
+			Vector wo = gatherPosition - its.p;			Vector2 rootnode = domain.nodes[0];			Float cdf0 = rootnode.x;			int chosenLobe = -1;			int ptrNode = -1;			Float rndsmp = sampler->next1D();			if (rndsmp < cdf0){				chosenLobe = 0;				ptrNode = 1;			}			else{				chosenLobe = 1;				ptrNode = GatherDomain::decodePointer(rootnode.y);			}
 			if (chosenLobe == 0){
 				/* Sample the BSDF */
 				Vector dir = bsdf->sampleGatherArea(its.toLocal(wi), its.toLocal(wo), gatherRadius, sampler->next2D(),
-					ptrNode, componentCDFs, componentBounds);
+					domain, ptrNode);
 				if (dir == Vector(0.f)) return false;
 				wo = its.toWorld(dir);				
 			}
@@ -1453,32 +1431,19 @@ public:
 	inline Float MisHeuristic(Float pdf) {
 		return pdf * pdf;
 	}
-	ETransportMode connectionDirection(const PathVertex* vsPred, const PathVertex* vtPred){
+	ETransportMode connectionDirection(const MisVertex &vsPred, const MisVertex &vtPred){
 		// true for camera direction and false for light direction
 		bool cameraDirConnection = true;
 		Float sBandwidth = 0.f, tBandwidth = 0.f;
-		if (vtPred->isSensorSample()){
+		if (vtPred.type == PathVertex::ESensorSample)
 			tBandwidth = 10000.f;
-		}
-		else if (vtPred->isSurfaceInteraction()){
-			const Intersection &its = vtPred->getIntersection();
-			const BSDF *bsdf = its.getBSDF();
-			tBandwidth = bsdf->getBandwidth();
-		}
+		else if (vtPred.type == PathVertex::ESurfaceInteraction)
+			tBandwidth = vtPred.bandwidth;
 		else
 			return ETransportModes;
 
-		if (vsPred->isEmitterSample()){
-			const PositionSamplingRecord &pRec = vsPred->getPositionSamplingRecord();
-			const Emitter *emitter = static_cast<const Emitter *>(pRec.object);
-
-			sBandwidth = emitter->getBandwidth();
-		}
-		else if (vsPred->isSurfaceInteraction()){
-			const Intersection &its = vsPred->getIntersection();
-			const BSDF *bsdf = its.getBSDF();
-			sBandwidth = bsdf->getBandwidth();
-		}
+		if (vsPred.type == PathVertex::EEmitterSample || vsPred.type == PathVertex::ESurfaceInteraction)
+			sBandwidth = vsPred.bandwidth;
 		else
 			return ETransportModes;
 
@@ -1487,9 +1452,19 @@ public:
 
 		return cameraDirConnection ? ERadiance : EImportance;
 	}
-	
+	ETransportMode connectionDirection(const PathVertex* vsPred, const PathVertex* vtPred){
+		return connectionDirection(MisVertex(vsPred), MisVertex(vtPred));
+	}
+
 	Float misEffectiveEta(int i, Float pi, Float pir, const PathVertex* vPred, const PathVertex* vNext,
 		Float gatherRadius, size_t numLightPath, ETransportMode mode, int j = 999){
+		if (i < 1 || j < 1)
+			return 0.f;
+		return misEffectiveEta(i, pi, pir, MisVertex(vPred), MisVertex(vNext),
+			gatherRadius, numLightPath, mode, j);
+	}
+	Float misEffectiveEta(int i, Float pi, Float pir, const MisVertex &vPred, const MisVertex &vNext,
+		Float gatherRadius, size_t numLightPath, ETransportMode mode, int j = 999){
 
 		if (i < 1 || j < 1) return 0.f;
 #ifdef EXCLUDE_DIRECT_LIGHTING
@@ -1596,7 +1571,7 @@ public:
 	}
 	Float misWeightPM(int i, int j, MisState statei,
 		Float pi, Float piPred, Float pir, Float pir1,
-		const PathVertex* vNext, const PathVertex* v, const PathVertex* vPred, const PathVertex* vPred2,
+		const MisVertex &vNext, const MisVertex &v, const MisVertex &vPred, const MisVertex &vPred2,
 		Float gatherRadius, size_t numLightPath, ETransportMode mode,
 		bool useVC, bool useVM){
 
@@ -1613,7 +1588,7 @@ public:
 	}
 	Float misWeightPM_pred(int i, int j, MisState state, MisState statePred,
 		Float pi, Float piPred, Float piPred2, Float pir, Float pir1, Float pir2,
-		const PathVertex* vNext, const PathVertex* v, const PathVertex* vPred, const PathVertex* vPred2, const PathVertex* vPred3,
+		const MisVertex &vNext, const MisVertex &v, const MisVertex &vPred, const MisVertex &vPred2, const MisVertex &vPred3,
 		Float gatherRadius, size_t numLightPath, ETransportMode mode,
 		bool useVC, bool useVM){
 
@@ -1777,17 +1752,56 @@ public:
 		const PathVertex *vsPred3, const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
 		const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,
 		bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM){
+		MisVertex lightRecords[4] = { MisVertex(vs), MisVertex(vsPred), MisVertex(vsPred2), MisVertex(vsPred3) };
+		Float lightPdfs[4] = { vs->pdf[EImportance], vsPred->pdf[EImportance],
+			(vsPred2 != NULL) ? vsPred2->pdf[EImportance] : 0.f,
+			(vsPred3 != NULL) ? vsPred3->pdf[EImportance] : 0.f };
+		return miWeightVM(scene, s, t, emitterState, sensorState, emitterStatePred, sensorStatePred,
+			lightRecords, lightPdfs, vsPred2, vsPred, vs, vt, vtPred, vtPred2, vtPred3,
+			cameraDirConnection, gatherRadius, numLightPath, useVC, useVM);
+	}
+
+	/* Variant for the light vertices of the path sampler's LightVertexStore: only the
+	   vertex whose BSDF is evaluated (vs for camera direction connections, vsPred
+	   otherwise) needs a full expand(), its neighbors only need expandGeometry() */
+	Float miWeightVM(const Scene *scene, int s, int t,
+		MisState emitterState, MisState sensorState, MisState emitterStatePred, MisState sensorStatePred,
+		const LightVertexStore &lightVertices, size_t vertexIndex,
+		const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
+		const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,
+		bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM){
+		MisVertex lightRecords[4];
+		Float lightPdfs[4] = { 0.f, 0.f, 0.f, 0.f };
+		size_t count = (s > 2) ? 4 : ((s == 2) ? 3 : 2);
+		for (size_t k = 0; k < count; ++k){
+			lightRecords[k] = lightVertices.getMisVertex(vertexIndex - k);
+			lightPdfs[k] = lightVertices.getPdf(vertexIndex - k, EImportance);
+		}
+		return miWeightVM(scene, s, t, emitterState, sensorState, emitterStatePred, sensorStatePred,
+			lightRecords, lightPdfs, vsPred2, vsPred, vs, vt, vtPred, vtPred2, vtPred3,
+			cameraDirConnection, gatherRadius, numLightPath, useVC, useVM);
+	}
 
+	/* The light subpath enters through the records and importance pdfs of vs, vsPred,
+	   vsPred2 and vsPred3, its vertices are only used for the pdfs evaluated on them */
+	Float miWeightVM(const Scene *scene, int s, int t,
+		MisState emitterState, MisState sensorState, MisState emitterStatePred, MisState sensorStatePred,
+		const MisVertex *lightRecords, const Float *lightPdfs,
+		const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
+		const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,
+		bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM){
+
+		MisVertex rt(vt), rtPred(vtPred), rtPred2(vtPred2), rtPred3(vtPred3);
 		Float wLight = 0.f, wCamera = 0.f;
 		if (cameraDirConnection){
 			Float pt = evalPdf(vtPred, scene, vtPred2, vs, ERadiance, EArea);
-			Float ps = vsPred->pdf[EImportance];
+			Float ps = lightPdfs[1];
 
-			Float psPred = vsPred2->pdf[EImportance];
+			Float psPred = lightPdfs[2];
 			Float psr1 = evalPdf(vs, scene, vtPred, vsPred, ERadiance, EArea);
 			wLight += misWeightPM(s - 1, t - 1, emitterState,
 				ps, psPred, pt, psr1,
-				vtPred, vs, vsPred, vsPred2,
+				rtPred, lightRecords[0], lightRecords[1], lightRecords[2],
 				gatherRadius, numLightPath, EImportance, useVC, useVM);
 
 			Float ptr1 = evalPdf(vs, scene, vsPred, vtPred, EImportance, EArea);
@@ -1796,7 +1810,7 @@ public:
 			Float ptPred2 = (vtPred3 != NULL) ? vtPred3->pdf[ERadiance] : 0.f;
 			wCamera += misWeightPM_pred(t - 1, s - 1, sensorState, sensorStatePred,
 				pt, ptPred, ptPred2, ps, ptr1, ptr2,
-				vsPred, vs, vtPred, vtPred2, vtPred3,
+				lightRecords[1], lightRecords[0], rtPred, rtPred2, rtPred3,
 				gatherRadius, numLightPath, ERadiance, useVC, useVM);
 			// 		wCamera += misWeightPM(t - 1, s - 1, sensorState,
 			// 			pt, ptPred, ps, ptr1,
@@ -1809,11 +1823,11 @@ public:
 
 			Float psr1 = evalPdf(vt, scene, vtPred, vsPred, ERadiance, EArea);
 			Float psr2 = evalPdf(vsPred, scene, vt, vsPred2, ERadiance, EArea);
-			Float psPred = vsPred2->pdf[EImportance];
-			Float psPred2 = (vsPred3 != NULL) ? vsPred3->pdf[EImportance] : 0.f;
+			Float psPred = lightPdfs[2];
+			Float psPred2 = lightPdfs[3];
 			wLight += misWeightPM_pred(s - 1, t - 1, emitterState, emitterStatePred,
 				ps, psPred, psPred2, pt, psr1, psr2,
-				vtPred, vt, vsPred, vsPred2, vsPred3,
+				rtPred, rt, lightRecords[1], lightRecords[2], lightRecords[3],
 				gatherRadius, numLightPath, EImportance, useVC, useVM);
 			// 		wLight += misWeightPM(s - 1, t - 1, emitterState,
 			// 			ps, psPred, pt, psr1,
@@ -1825,7 +1839,7 @@ public:
 			Float ptPred = vtPred2->pdf[ERadiance];
 			wCamera += misWeightPM(t - 1, s - 1, sensorState,
 				pt, ptPred, ps, ptr1,
-				vsPred, vt, vtPred, vtPred2,
+				lightRecords[1], rt, rtPred, rtPred2,
 				gatherRadius, numLightPath, ERadiance, useVC, useVM);
 		}
 
@@ -1848,7 +1862,12 @@ private:
 	ref<Film> m_film;
 	ref<PathSampler> m_pathSampler;
 	ref<Sampler> m_sampler;
-	ref<GuidingSamplers> m_guidingSampler;	
+	ref<GuidingContext> m_guidingSampler;	
+	/* Merge candidates of a camera vertex, kept between paths to avoid reallocations */
+	std::vector<uint32_t> m_searchResults, m_searchPosIndex, m_acceptCnt;
+	std::vector<Point> m_searchPosCamera;
+	std::vector<bool> m_searchPosDone;
+	std::vector<size_t> m_shootCnt;
 };
 
 /* ==================================================================== */
@@ -1872,13 +1891,7 @@ ref<WorkProcessor> GuidedUPMProcess::createWorkProcessor() const {
 
 void GuidedUPMProcess::develop() {
 	LockGuard lock(m_resultMutex);
-	size_t pixelCount = m_result->getImageBlock()->getBitmap()->getPixelCount();
-	const Spectrum *accum = (Spectrum *)(m_result->getImageBlock()->getBitmap()->getData());
-	Spectrum *target = (Spectrum *) m_developBuffer->getData();
- 	Float invFactor = 1.f / Float(m_result->getSampleCount());
-	for (size_t i=0; i<pixelCount; ++i) {
-		target[i] = accum[i] * invFactor;
-	}	
+	m_result->getImageBlock()->develop(m_developBuffer, Point2i(0), 1.f / Float(m_result->getSampleCount()));
 	m_film->setBitmap(m_developBuffer);
 	m_refreshTimer->reset();
 	m_queue->signalRefresh(m_job);
@@ -1886,9 +1899,11 @@ void GuidedUPMProcess::develop() {
 
 void GuidedUPMProcess::processResult(const WorkResult *workResult, bool cancelled) {
 	const UPMWorkResult *wr = static_cast<const UPMWorkResult *>(workResult);
+	/* The accumulated result is dense and locks its tiles individually, so
+	   the images of several workers can be merged at the same time */
+	m_result->putImages(wr);
 	LockGuard lock(m_resultMutex);
-	if (m_resultCounter == 0) m_result->clear();	
-	m_result->put(wr);
+	m_result->putCounters(wr);
 	m_progress->update(++m_resultCounter);
 	m_refreshTimeout = std::min(2000U, m_refreshTimeout * 2);
 
@@ -1930,7 +1945,8 @@ void GuidedUPMProcess::bindResource(const std::string &name, int id) {
 		if (m_progress)
 			delete m_progress;
 		m_progress = new ProgressReporter("Rendering", m_config.workUnits, m_job);
-		m_result = new UPMWorkResult(m_film->getCropSize().x, m_film->getCropSize().y, m_config.maxDepth, NULL, true);
+		m_result = new UPMWorkResult(m_film->getCropSize().x, m_film->getCropSize().y, m_config.maxDepth,
+			m_film->getReconstructionFilter(), true, true);
 		m_result->clear();		
 		m_developBuffer = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, m_film->getCropSize());
 	}
@@ -166,6 +166,81 @@ public:
 
 		// for rebuttal experiment
 		m_config.useVCMPdf = props.getBoolean("useVCMPdf", false);
+
+		/* trace the 1/p geometric trials of all merge candidates as SSE ray packets */
+		m_config.batchedShoot = props.getBoolean("batchedShoot", false);
+
+		/* share one stream of 1/p trials among the camera direction merges of a
+		   gather point, once it has at least 'shareShootThreshold' of them */
+		m_config.shareShoot = props.getBoolean("shareShoot", false);
+		m_config.shareShootThreshold = props.getSize("shareShootThreshold", 32);
+
+		/* build the per-iteration light path tree with all cores, which pays
+		   off when there are fewer work units than cores */
+		m_config.parallelTreeBuild = props.getBoolean("parallelTreeBuild", false);
+
+		/* send the accumulated image back every 'checkpointInterval' iterations
+		   instead of once per work unit (0: disabled), for live previews */
+		m_config.checkpointInterval = props.getSize("checkpointInterval", 0);
+
+		/* scale the 1/p clamp threshold of each merge by its expected contribution
+		   relative to the other merges of its (s, t) strategy and material class */
+		m_config.adaptiveClamp = props.getBoolean("adaptiveClamp", false);
+		/* Russian roulette on the 1/p trials of dim merges in expensive strategies */
+		m_config.shootRR = props.getBoolean("shootRR", false);
+
+		/* trace the light paths of an iteration together with the other workers
+		   of the machine and merge against all of them: every worker traces an
+		   equal share of the light paths of the iteration into one shared tree,
+		   so each light path is traced once but merged with all camera paths */
+		m_config.shareLightPaths = props.getBoolean("shareLightPaths", false);
+
+		/* number of light paths per iteration, either relative to the number of
+		   pixels ('lightPathRatio', default: one per pixel) or as an absolute
+		   count ('lightPathCount'). When both are given, the ratio wins. */
+		if (props.hasProperty("lightPathRatio") || !props.hasProperty("lightPathCount")) {
+			m_config.lightPathRatio = props.getFloat("lightPathRatio", 1.0f);
+			m_config.lightPathCount = 0;
+			if (m_config.lightPathRatio <= 0)
+				Log(EError, "'lightPathRatio' must be positive!");
+			if (props.hasProperty("lightPathCount")) {
+				Log(EWarn, "Both 'lightPathRatio' and 'lightPathCount' were specified, ignoring 'lightPathCount'");
+				props.getSize("lightPathCount");
+			}
+		} else {
+			m_config.lightPathRatio = 0;
+			m_config.lightPathCount = props.getSize("lightPathCount");
+			if (m_config.lightPathCount == 0)
+				Log(EError, "'lightPathCount' must be positive!");
+		}
+		/* adjust the number of light paths after every iteration, so that
+		   tracing them takes about as long as the camera paths */
+		m_config.autoTuneLightPaths = props.getBoolean("autoTuneLightPaths", false);
+		if (m_config.autoTuneLightPaths && m_config.shareLightPaths) {
+			/* All slices of a shared round need the same number of light paths */
+			Log(EWarn, "'autoTuneLightPaths' is not supported with 'shareLightPaths', disabling it");
+			m_config.autoTuneLightPaths = false;
+		}
+
+		/* keep the merges of the camera paths of an iteration in flight and run
+		   the 1/p trials of 'mergeQueueSize' of them at once in coherent ray
+		   packets (0: resolve the merges of every gather point right away).
+		   Only the trials are queued, the camera paths and their shadow rays
+		   are still traced one path at a time. Merges that 'shareShoot'
+		   resolves from a shared stream of trials are not queued. */
+		m_config.mergeQueueSize = props.getSize("mergeQueueSize", 0);
+		if (m_config.mergeQueueSize > 0 && m_config.useVCMPdf) {
+			/* The VCM pdf replaces the 1/p trials altogether */
+			Log(EWarn, "'mergeQueueSize' has no effect with 'useVCMPdf', disabling it");
+			m_config.mergeQueueSize = 0;
+		}
+
+		/* draw the light paths, camera paths and 1/p trials of every iteration
+		   from counter-based streams ('philox' sampler) keyed by the iteration
+		   and the pixel or light path, and merge the work results in a fixed
+		   order, so that the image does not depend on the number of cores.
+		   Always enabled when the scene uses the 'philox' sampler. */
+		m_config.deterministic = props.getBoolean("deterministic", false);
 	}
 
 	/// Unserialize from a binary data stream
@@ -193,9 +268,27 @@ public:
 		if (scene->getSubsurfaceIntegrators().size() > 0)
 			Log(EError, "Subsurface integrators are not supported by MLT!");
 
-		if (sensor->getSampler()->getClass()->getName() != "IndependentSampler")
+		const std::string samplerName = sensor->getSampler()->getClass()->getName();
+		if (samplerName == "PhiloxSampler")
+			m_config.deterministic = true;
+		else if (samplerName != "IndependentSampler")
 			Log(EError, "Metropolis light transport requires the independent sampler");
 
+		if (m_config.deterministic) {
+			/* Both depend on timings or on the number of workers */
+			if (m_config.autoTuneLightPaths) {
+				Log(EWarn, "'autoTuneLightPaths' is not supported in deterministic mode, disabling it");
+				m_config.autoTuneLightPaths = false;
+			}
+			if (m_config.shareLightPaths) {
+				Log(EWarn, "'shareLightPaths' is not supported in deterministic mode, disabling it");
+				m_config.shareLightPaths = false;
+			}
+			if (m_config.timeout > 0)
+				Log(EWarn, "The number of iterations of a render with a 'timeout' "
+					"depends on the machine, it is only reproducible with a fixed sample count");
+		}
+
 		/* Guess an initial radius if not provided
 		(use scene width / horizontal or vertical pixel count) * 5 */
 		Float rad = scene->getBSphere().radius;
@@ -252,9 +345,20 @@ public:
 		process->bindResource("scene", sceneResID);
 		process->bindResource("sensor", sensorResID);
 		process->bindResource("sampler", samplerResID);
+
+		int lightPathsResID = -1;
+		if (m_config.shareLightPaths) {
+			lightPathsResID = scheduler->registerResource(
+				new SharedLightPathStore(m_config.parallelTreeBuild));
+			process->bindResource("lightPaths", lightPathsResID);
+		}
+
 		scheduler->schedule(process);
 		scheduler->wait(process);
 		m_process = NULL;
+		if (lightPathsResID != -1)
+			scheduler->unregisterResource(lightPathsResID);
+		process->flushResults();
 		process->develop();
 
 #if UPM_DEBUG == 1
@@ -58,6 +58,27 @@ struct UPMConfiguration {
 	// for rebuttal experiment
 	bool useVCMPdf;
 
+	bool batchedShoot;
+	bool shareShoot;
+	size_t shareShootThreshold;
+
+	bool parallelTreeBuild;
+
+	size_t checkpointInterval;
+
+	bool adaptiveClamp;
+	bool shootRR;
+
+	bool shareLightPaths;
+
+	Float lightPathRatio;
+	size_t lightPathCount;
+	bool autoTuneLightPaths;
+
+	size_t mergeQueueSize;
+
+	bool deterministic;
+
 	inline UPMConfiguration() { }
 
 	inline UPMConfiguration(Stream *stream) {
@@ -81,6 +102,19 @@ struct UPMConfiguration {
 		enableSeparateDump = stream->readBool();
 		enableProgressiveDump = stream->readBool();
 		useVCMPdf = stream->readBool();
+		batchedShoot = stream->readBool();
+		shareShoot = stream->readBool();
+		shareShootThreshold = stream->readSize();
+		parallelTreeBuild = stream->readBool();
+		checkpointInterval = stream->readSize();
+		adaptiveClamp = stream->readBool();
+		shootRR = stream->readBool();
+		shareLightPaths = stream->readBool();
+		lightPathRatio = stream->readFloat();
+		lightPathCount = stream->readSize();
+		autoTuneLightPaths = stream->readBool();
+		mergeQueueSize = stream->readSize();
+		deterministic = stream->readBool();
 	}
 
 	inline void serialize(Stream *stream) const {
@@ -104,6 +138,19 @@ struct UPMConfiguration {
 		stream->writeBool(enableSeparateDump);
 		stream->writeBool(enableProgressiveDump);
 		stream->writeBool(useVCMPdf);
+		stream->writeBool(batchedShoot);
+		stream->writeBool(shareShoot);
+		stream->writeSize(shareShootThreshold);
+		stream->writeBool(parallelTreeBuild);
+		stream->writeSize(checkpointInterval);
+		stream->writeBool(adaptiveClamp);
+		stream->writeBool(shootRR);
+		stream->writeBool(shareLightPaths);
+		stream->writeFloat(lightPathRatio);
+		stream->writeSize(lightPathCount);
+		stream->writeBool(autoTuneLightPaths);
+		stream->writeSize(mergeQueueSize);
+		stream->writeBool(deterministic);
 	}
 
 	void dump() const {
@@ -128,6 +175,21 @@ struct UPMConfiguration {
 		SLog(EDebug, "   Enable separate dump   : %s", enableSeparateDump ? "yes" : "no");
 		SLog(EDebug, "   Enable progressive dump   : %s", enableProgressiveDump ? "yes" : "no");
 		SLog(EDebug, "   Use VCM connection PDF   : %s", useVCMPdf ? "yes" : "no");
+		SLog(EDebug, "   Batched 1/p trials   : %s", batchedShoot ? "yes" : "no");
+		SLog(EDebug, "   Shared 1/p trials   : %s", shareShoot ? "yes" : "no");
+		SLog(EDebug, "   Shared 1/p trial threshold   : " SIZE_T_FMT, shareShootThreshold);
+		SLog(EDebug, "   Parallel light path tree build   : %s", parallelTreeBuild ? "yes" : "no");
+		SLog(EDebug, "   Checkpoint interval (iterations)   : " SIZE_T_FMT, checkpointInterval);
+		SLog(EDebug, "   Adaptive 1/p clamp threshold   : %s", adaptiveClamp ? "yes" : "no");
+		SLog(EDebug, "   Russian roulette on 1/p trials   : %s", shootRR ? "yes" : "no");
+		SLog(EDebug, "   Shared light paths   : %s", shareLightPaths ? "yes" : "no");
+		if (lightPathRatio > 0)
+			SLog(EDebug, "   Light paths per pixel   : %f", lightPathRatio);
+		else
+			SLog(EDebug, "   Light paths per iteration   : " SIZE_T_FMT, lightPathCount);
+		SLog(EDebug, "   Auto-tuned light path count   : %s", autoTuneLightPaths ? "yes" : "no");
+		SLog(EDebug, "   Merge queue size   : " SIZE_T_FMT, mergeQueueSize);
+		SLog(EDebug, "   Deterministic sample streams   : %s", deterministic ? "yes" : "no");
 	}
 };
 
@@ -18,8 +18,10 @@
 
 #include <mitsuba/core/sfcurve.h>
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/plugin.h>
 #include <mitsuba/bidir/util.h>
 #include <mitsuba/bidir/path.h>
+#include <mitsuba/bidir/lightpathbudget.h>
 #include "upm_proc.h"
 
 #include <mitsuba/core/bitmap.h>
@@ -58,6 +60,14 @@ public:
 	void prepare() {
 		Scene *scene = static_cast<Scene *>(getResource("scene"));
 		m_sampler = static_cast<Sampler *>(getResource("sampler"));
+		if (m_config.deterministic && m_sampler->getClass()->getName() != "PhiloxSampler") {
+			/* The streams of the independent sampler belong to the workers */
+			Properties props("philox");
+			props.setSize("sampleCount", m_sampler->getSampleCount());
+			m_sampler = static_cast<Sampler *>(PluginManager::getInstance()->
+				createObject(MTS_CLASS(Sampler), props));
+			m_sampler->configure();
+		}
 		m_sensor = static_cast<Sensor *>(getResource("sensor"));
 		m_scene = new Scene(scene);
 		m_film = m_sensor->getFilm();
@@ -73,16 +83,37 @@ public:
 			m_sampler, m_sampler, m_sampler, m_config.maxDepth,
 			m_config.rrDepth, false /*m_config.separateDirect*/, true /*m_config.directSampling*/,
 			true, m_sampler);
+		m_pathSampler->setParallelTreeBuild(m_config.parallelTreeBuild);
+		m_pathSampler->setTrialPolicy(m_config.adaptiveClamp, m_config.shootRR);
+		m_pathSampler->setMergeQueue(m_config.mergeQueueSize);
+		m_pathSampler->setLightPathStreams(m_config.deterministic);
+
+		if (m_config.shareLightPaths)
+			m_lightPaths = static_cast<SharedLightPathStore *>(getResource("lightPaths"));
+
+		/* Kept across work units, so that the auto-tuner continues where it stopped */
+		Vector2i cropSize = m_film->getCropSize();
+		m_lightPathBudget.configure(m_config.lightPathRatio, m_config.lightPathCount,
+			(size_t) cropSize.x * cropSize.y, m_config.autoTuneLightPaths);
+	}
+
+	/// Does the work unit run another iteration after 'count' of them?
+	inline bool moreIterations(const SeedWorkUnit *wu, size_t count, const Timer *timer) const {
+		if (wu->getIterationCount() > 0)
+			return count < wu->getIterationCount();
+		return count < m_config.sampleCount || (wu->getTimeout() > 0 && timer->getSeconds() < wu->getTimeout());
 	}
 
 	void process(const WorkUnit *workUnit, WorkResult *workResult, const bool &stop) {
 		UPMWorkResult *wr = static_cast<UPMWorkResult *>(workResult);
 		wr->clear();
-		ImageBlock *midres = new ImageBlock(Bitmap::ESpectrum, m_film->getCropSize(), m_film->getReconstructionFilter());
-		midres->clear();
 		const SeedWorkUnit *wu = static_cast<const SeedWorkUnit *>(workUnit);
 		const int workID = wu->getID();
 		const int numWork = wu->getTotalWorkNum();
+		wr->setSequence(wu->getSequence());
+		/* Otherwise the trial budgets would depend on the work units that ran here before */
+		if (m_config.deterministic)
+			m_pathSampler->resetTrialPolicy();
 		SplatList *splats = new SplatList();
 		splats->clear();
 		ImageBlock *batres = NULL;
@@ -111,29 +142,56 @@ public:
 		HilbertCurve2D<int> hilbertCurve;
 		TVector2<int> filmSize(m_film->getCropSize());
 		hilbertCurve.initialize(filmSize);
-		uint64_t iteration = workID;
+		/* Checkpointed work units continue the chain 'workID' at a later iteration */
+		const size_t iterationCount = wu->getIterationCount();
+		uint64_t iteration = workID + (uint64_t) wu->getIterationOffset() * numWork;
 
 		int splatcnt = 0;
 
 		size_t actualSampleCount;
 		float radius = m_config.initialRadius;
 		ref<Timer> timer = new Timer();		
-		for (actualSampleCount = 0; actualSampleCount < m_config.sampleCount || (wu->getTimeout() > 0 && timer->getSeconds() < wu->getTimeout()); actualSampleCount++) {
+		ref<Timer> phaseTimer = new Timer(false);
+		/* With shared light paths, the decision to run another iteration is
+		   made once per round, since the other workers wait for this one */
+		bool more = moreIterations(wu, 0, timer);
+		SharedLightPaths::Round round;
+		if (m_lightPaths && more)
+			m_lightPaths->join(round);
+
+		for (actualSampleCount = 0; more; actualSampleCount++) {
 			if (m_config.initialRadius > 0.0f){
-				Float reduceFactor = 1.0 / std::pow((Float)(iteration + 1), (Float)(0.5 * (1 - m_config.radiusAlpha/*radiusAlpha*/)));
+				/* A round continues the schedule after the slices of all earlier rounds */
+				uint64_t index = m_lightPaths ? round.firstSlice : iteration;
+				Float reduceFactor = 1.0 / std::pow((Float)(index + 1), (Float)(0.5 * (1 - m_config.radiusAlpha/*radiusAlpha*/)));
 				radius = std::max(reduceFactor * m_config.initialRadius, (Float)1e-7);
 				iteration += numWork;
 			}
 
-			m_pathSampler->gatherLightPathsUPM(m_config.useVC, m_config.useVM, radius, hilbertCurve.getPointCount(), wr, batres, m_config.rejectionProb);
+			if (m_lightPaths)
+				m_pathSampler->setSharedLightPaths(m_lightPaths, round);
+
+			/* In deterministic mode, iteration n of the chain 'workID' uses the
+			   sample index workID + n * numWork in the streams of all pixels and
+			   light paths, regardless of the worker that runs it */
+			size_t streamIndex = (size_t) workID + (wu->getIterationOffset() + actualSampleCount) * (size_t) numWork;
+			if (m_config.deterministic)
+				m_sampler->setSampleIndex(streamIndex);
+			phaseTimer->reset();
+			m_pathSampler->gatherLightPathsUPM(m_config.useVC, m_config.useVM, radius, m_lightPathBudget.getLightPathCount(),
+				wr, batres, m_config.rejectionProb, hilbertCurve.getPointCount());
+			Float traceTime = phaseTimer->lap();
 
 			for (size_t i = 0; i < hilbertCurve.getPointCount(); ++i) {
 				if (stop) break;
 
 				Point2i offset = Point2i(hilbertCurve[i]);
 				m_sampler->generate(offset);
+				if (m_config.deterministic)
+					m_sampler->setSampleIndex(streamIndex);
 				m_pathSampler->sampleSplatsUPM(wr, radius, offset, i, *splats, 
-					m_config.useVC, m_config.useVM, m_config.rejectionProb, m_config.clampThreshold, m_config.useVCMPdf);
+					m_config.useVC, m_config.useVM, m_config.rejectionProb, m_config.clampThreshold, m_config.useVCMPdf,
+					m_config.batchedShoot, m_config.shareShoot, m_config.shareShootThreshold);
 
 				for (size_t k = 0; k < splats->size(); ++k) {
  					Spectrum value = splats->getValue(k);
@@ -144,6 +202,23 @@ public:
  				}				
 			}			
 
+			/* The merges still in flight were made with the radius of this iteration */
+			if (m_config.mergeQueueSize > 0) {
+				m_pathSampler->flushUPM(wr, radius, *splats, m_config.clampThreshold);
+				for (size_t k = 0; k < splats->size(); ++k) {
+					Spectrum value = splats->getValue(k);
+					wr->putSample(splats->getPosition(k), &value[0]);
+					if (batres != NULL)
+						batres->put(splats->getPosition(k), &value[0]);
+				}
+			}
+			if (!stop)
+				m_lightPathBudget.update(traceTime, phaseTimer->lap());
+
+			more = moreIterations(wu, actualSampleCount + 1, timer);
+			if (m_lightPaths)
+				m_lightPaths->finish(round, more);
+
 #if UPM_DEBUG == 1
 			// [UC] for unbiased check
 			if (m_config.enableSeparateDump){
@@ -182,7 +257,8 @@ public:
 		}
 #endif
 
-		Log(EInfo, "Run %d iterations", actualSampleCount);
+		if (iterationCount == 0)
+			Log(EInfo, "Run %d iterations", actualSampleCount);
 		wr->accumSampleCount(actualSampleCount);
 		
 		delete splats;
@@ -200,6 +276,8 @@ private:
 	ref<Film> m_film;
 	ref<PathSampler> m_pathSampler;
 	ref<Sampler> m_sampler;
+	ref<SharedLightPathStore> m_lightPaths;
+	LightPathBudget m_lightPathBudget;
 };
 
 /* ==================================================================== */
@@ -215,6 +293,8 @@ UPMProcess::UPMProcess(const RenderJob *parent, RenderQueue *queue,
 	m_resultCounter = 0;
 	m_workCounter = 0;
 	m_refreshTimeout = 1;
+	/* Bound the number of results that the deterministic mode holds back */
+	m_sequencer.setWindow(2 * std::max((size_t) 1, Scheduler::getInstance()->getWorkerCount()));
 }
 
 ref<WorkProcessor> UPMProcess::createWorkProcessor() const {
@@ -223,30 +303,47 @@ ref<WorkProcessor> UPMProcess::createWorkProcessor() const {
 
 void UPMProcess::develop() {
 	LockGuard lock(m_resultMutex);
-	size_t pixelCount = m_result->getImageBlock()->getBitmap()->getPixelCount();
-	const Spectrum *accum = (Spectrum *)(m_result->getImageBlock()->getBitmap()->getData());
-	Spectrum *target = (Spectrum *) m_developBuffer->getData();
- 	Float invFactor = 1.f / Float(m_result->getSampleCount());
-	for (size_t i=0; i<pixelCount; ++i) {
-		target[i] = accum[i] * invFactor;
-	}	
+	m_result->getImageBlock()->develop(m_developBuffer, Point2i(0), 1.f / Float(m_result->getSampleCount()));
 	m_film->setBitmap(m_developBuffer);
 	m_refreshTimer->reset();
 	m_queue->signalRefresh(m_job);
 }
 
+void UPMProcess::flushResults() {
+	LockGuard lock(m_resultMutex);
+	m_sequencer.flush();
+}
+
 void UPMProcess::processResult(const WorkResult *workResult, bool cancelled) {	
 	const UPMWorkResult *wr = static_cast<const UPMWorkResult *>(workResult);
-	LockGuard lock(m_resultMutex);
-	if (m_resultCounter == 0) m_result->clear();	
-	m_result->put(wr);
-	m_progress->update(++m_resultCounter);
+	/* The accumulated result is dense and locks its tiles individually, so
+	   the images of several workers can be merged at the same time */
+	if (!m_config.deterministic)
+		m_result->putImages(wr);
+	UniqueLock lock(m_resultMutex);
+	bool resume = false;
+	if (m_config.deterministic) {
+		/* The sums must not depend on the order in which the results complete */
+		resume = m_sequencer.put(wr->getSequence(), wr, cancelled);
+	} else {
+		m_result->putCounters(wr);
+	}
+	++m_resultCounter;
+	if (m_config.checkpointInterval > 0 && m_config.timeout > 0)
+		m_progress->update(std::min((size_t) m_timeoutTimer->getSeconds(), m_config.timeout));
+	else
+		m_progress->update(m_resultCounter);
 	m_refreshTimeout = std::min(2000U, m_refreshTimeout * 2);
 
 	/* Re-develop the entire image every two seconds if partial results are
 	   visible (e.g. in a graphical user interface). */
 	if (m_job->isInteractive() && m_refreshTimer->getMilliseconds() > m_refreshTimeout)
 		develop();
+	lock.unlock();
+
+	/* The scheduler calls generateWork() with its own lock held */
+	if (resume)
+		Scheduler::getInstance()->schedule(this);
 }
 
 ParallelProcess::EStatus UPMProcess::generateWork(WorkUnit *unit, int worker) {
@@ -255,10 +352,38 @@ ParallelProcess::EStatus UPMProcess::generateWork(WorkUnit *unit, int worker) {
 		timeout = static_cast<int64_t>(m_config.timeout) - static_cast<int64_t>(m_timeoutTimer->getSeconds());
 	}
 
+	if (m_config.deterministic) {
+		/* Wait until the results that are held back have been merged */
+		LockGuard lock(m_resultMutex);
+		if (m_sequencer.pause((size_t) m_workCounter))
+			return EPause;
+	}
+
+	SeedWorkUnit *workUnit = static_cast<SeedWorkUnit *>(unit);
+	if (m_config.checkpointInterval > 0) {
+		/* Hand out the iterations of the 'workUnits' progressive chains in slices of
+		   'checkpointInterval' iterations (round robin over the chains), so that the
+		   image is sent back incrementally. Each slice continues the radius schedule
+		   of its chain where the previous slice stopped. */
+		size_t firstIteration = (size_t) (m_workCounter / m_config.workUnits) * m_config.checkpointInterval;
+		bool moreSamples = firstIteration < m_config.sampleCount;
+		if (timeout < 0 || (!moreSamples && timeout == 0))
+			return EFailure;
+
+		workUnit->setSequence(m_workCounter);
+		workUnit->setID(m_workCounter++ % m_config.workUnits);
+		workUnit->setTotalWorkNum(m_config.workUnits);
+		workUnit->setTimeout(0);
+		workUnit->setIterationOffset(firstIteration);
+		workUnit->setIterationCount(moreSamples ? std::min(m_config.checkpointInterval,
+			m_config.sampleCount - firstIteration) : m_config.checkpointInterval);
+		return ESuccess;
+	}
+
 	if (m_workCounter >= m_config.workUnits || timeout < 0)
 		return EFailure;
 
-	SeedWorkUnit *workUnit = static_cast<SeedWorkUnit *>(unit);
+	workUnit->setSequence(m_workCounter);
 	workUnit->setID(m_workCounter++);
 	workUnit->setTotalWorkNum(m_config.workUnits);
 	workUnit->setTimeout(timeout);
@@ -271,9 +396,20 @@ void UPMProcess::bindResource(const std::string &name, int id) {
 		m_film = static_cast<Sensor *>(Scheduler::getInstance()->getResource(id))->getFilm();
 		if (m_progress)
 			delete m_progress;
-		m_progress = new ProgressReporter("Rendering", m_config.workUnits, m_job);
-		m_result = new UPMWorkResult(m_film->getCropSize().x, m_film->getCropSize().y, m_config.maxDepth, NULL);
+		size_t progressTotal = m_config.workUnits;
+		if (m_config.checkpointInterval > 0) {
+			/* Checkpointed renders report the elapsed time or the number of slices */
+			if (m_config.timeout > 0)
+				progressTotal = m_config.timeout;
+			else
+				progressTotal *= (m_config.sampleCount + m_config.checkpointInterval - 1) / m_config.checkpointInterval;
+		}
+		m_progress = new ProgressReporter("Rendering", progressTotal, m_job);
+		m_result = new UPMWorkResult(m_film->getCropSize().x, m_film->getCropSize().y, m_config.maxDepth,
+			m_film->getReconstructionFilter(), false, true);
 		m_result->clear();		
+		m_sequencer.setTarget(m_result, m_film->getCropSize().x, m_film->getCropSize().y,
+			m_config.maxDepth, m_film->getReconstructionFilter());
 		m_developBuffer = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, m_film->getCropSize());
 	}
 }
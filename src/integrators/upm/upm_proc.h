@@ -39,6 +39,9 @@ public:
 
 	void develop();
 
+	/// Merge the results that the deterministic mode still holds back (e.g. after a cancellation)
+	void flushResults();
+
 	/* ParallelProcess impl. */
 	void processResult(const WorkResult *wr, bool cancelled);
 	ref<WorkProcessor> createWorkProcessor() const;
@@ -61,6 +64,7 @@ private:
 	unsigned int m_refreshTimeout;
 	ref<Timer> m_timeoutTimer, m_refreshTimer;
 	ref<UPMWorkResult> m_result;	
+	UPMResultSequencer m_sequencer;
 };
 
 MTS_NAMESPACE_END
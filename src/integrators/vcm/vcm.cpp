@@ -158,6 +158,44 @@ public:
 
 		m_config.enableSeparateDump = props.getBoolean("enableSeparateDump", false);
 		m_config.enableProgressiveDump = props.getBoolean("enableProgressiveDump", false);
+
+		/* trace the light paths of an iteration together with the other workers
+		   of the machine and merge against all of them: every worker traces an
+		   equal share of the light paths of the iteration */
+		m_config.shareLightPaths = props.getBoolean("shareLightPaths", false);
+
+		/* number of light paths per iteration, either relative to the number of
+		   pixels ('lightPathRatio', default: one per pixel) or as an absolute
+		   count ('lightPathCount'). When both are given, the ratio wins. */
+		if (props.hasProperty("lightPathRatio") || !props.hasProperty("lightPathCount")) {
+			m_config.lightPathRatio = props.getFloat("lightPathRatio", 1.0f);
+			m_config.lightPathCount = 0;
+			if (m_config.lightPathRatio <= 0)
+				Log(EError, "'lightPathRatio' must be positive!");
+			if (props.hasProperty("lightPathCount")) {
+				Log(EWarn, "Both 'lightPathRatio' and 'lightPathCount' were specified, ignoring 'lightPathCount'");
+				props.getSize("lightPathCount");
+			}
+		} else {
+			m_config.lightPathRatio = 0;
+			m_config.lightPathCount = props.getSize("lightPathCount");
+			if (m_config.lightPathCount == 0)
+				Log(EError, "'lightPathCount' must be positive!");
+		}
+		/* adjust the number of light paths after every iteration, so that
+		   tracing them takes about as long as the camera paths */
+		m_config.autoTuneLightPaths = props.getBoolean("autoTuneLightPaths", false);
+		if (m_config.autoTuneLightPaths && m_config.shareLightPaths) {
+			/* All slices of a shared round need the same number of light paths */
+			Log(EWarn, "'autoTuneLightPaths' is not supported with 'shareLightPaths', disabling it");
+			m_config.autoTuneLightPaths = false;
+		}
+
+		/* draw the light and camera paths of every iteration from counter-based
+		   streams ('philox' sampler) and merge the work results in a fixed order,
+		   so that the image does not depend on the number of cores. Always
+		   enabled when the scene uses the 'philox' sampler. */
+		m_config.deterministic = props.getBoolean("deterministic", false);
 	}
 
 	/// Unserialize from a binary data stream
@@ -185,9 +223,27 @@ public:
 		if (scene->getSubsurfaceIntegrators().size() > 0)
 			Log(EError, "Subsurface integrators are not supported by MLT!");
 
-		if (sensor->getSampler()->getClass()->getName() != "IndependentSampler")
+		const std::string samplerName = sensor->getSampler()->getClass()->getName();
+		if (samplerName == "PhiloxSampler")
+			m_config.deterministic = true;
+		else if (samplerName != "IndependentSampler")
 			Log(EError, "Metropolis light transport requires the independent sampler");
 
+		if (m_config.deterministic) {
+			/* Both depend on timings or on the number of workers */
+			if (m_config.autoTuneLightPaths) {
+				Log(EWarn, "'autoTuneLightPaths' is not supported in deterministic mode, disabling it");
+				m_config.autoTuneLightPaths = false;
+			}
+			if (m_config.shareLightPaths) {
+				Log(EWarn, "'shareLightPaths' is not supported in deterministic mode, disabling it");
+				m_config.shareLightPaths = false;
+			}
+			if (m_config.timeout > 0)
+				Log(EWarn, "The number of iterations of a render with a 'timeout' "
+					"depends on the machine, it is only reproducible with a fixed sample count");
+		}
+
 		if (m_config.initialRadius == 0) {
 			/* Guess an initial radius if not provided
 			(use scene width / horizontal or vertical pixel count) * 5 */
@@ -246,9 +302,19 @@ public:
 		process->bindResource("scene", sceneResID);
 		process->bindResource("sensor", sensorResID);
 		process->bindResource("sampler", samplerResID);
+
+		int lightPathsResID = -1;
+		if (m_config.shareLightPaths) {
+			lightPathsResID = scheduler->registerResource(VCMProcess::createSharedLightPaths());
+			process->bindResource("lightPaths", lightPathsResID);
+		}
+
 		scheduler->schedule(process);
 		scheduler->wait(process);
 		m_process = NULL;
+		if (lightPathsResID != -1)
+			scheduler->unregisterResource(lightPathsResID);
+		process->flushResults();
 		process->develop();
 
 		return process->getReturnStatus() == ParallelProcess::ESuccess;
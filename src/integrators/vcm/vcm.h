@@ -52,6 +52,14 @@ struct VCMConfiguration {
 	bool enableSeparateDump;
 	bool enableProgressiveDump;
 
+	bool shareLightPaths;
+
+	Float lightPathRatio;
+	size_t lightPathCount;
+	bool autoTuneLightPaths;
+
+	bool deterministic;
+
 	inline VCMConfiguration() { }
 
 	inline VCMConfiguration(Stream *stream) {
@@ -71,6 +79,11 @@ struct VCMConfiguration {
 		useVM = stream->readBool();
 		enableSeparateDump = stream->readBool();
 		enableProgressiveDump = stream->readBool();
+		shareLightPaths = stream->readBool();
+		lightPathRatio = stream->readFloat();
+		lightPathCount = stream->readSize();
+		autoTuneLightPaths = stream->readBool();
+		deterministic = stream->readBool();
 	}
 
 	inline void serialize(Stream *stream) const {
@@ -90,6 +103,11 @@ struct VCMConfiguration {
 		stream->writeBool(useVM);
 		stream->writeBool(enableSeparateDump);
 		stream->writeBool(enableProgressiveDump);
+		stream->writeBool(shareLightPaths);
+		stream->writeFloat(lightPathRatio);
+		stream->writeSize(lightPathCount);
+		stream->writeBool(autoTuneLightPaths);
+		stream->writeBool(deterministic);
 	}
 
 	void dump() const {
@@ -110,6 +128,13 @@ struct VCMConfiguration {
 		SLog(EDebug, "   Timeout                     : " SIZE_T_FMT, timeout);
 		SLog(EDebug, "   Enable separate dump   : %s", enableSeparateDump ? "yes" : "no");
 		SLog(EDebug, "   Enable progressive dump   : %s", enableProgressiveDump ? "yes" : "no");
+		SLog(EDebug, "   Shared light paths   : %s", shareLightPaths ? "yes" : "no");
+		if (lightPathRatio > 0)
+			SLog(EDebug, "   Light paths per pixel   : %f", lightPathRatio);
+		else
+			SLog(EDebug, "   Light paths per iteration   : " SIZE_T_FMT, lightPathCount);
+		SLog(EDebug, "   Auto-tuned light path count   : %s", autoTuneLightPaths ? "yes" : "no");
+		SLog(EDebug, "   Deterministic sample streams   : %s", deterministic ? "yes" : "no");
 	}
 };
 
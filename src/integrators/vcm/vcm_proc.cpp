@@ -18,8 +18,10 @@
 
 #include <mitsuba/core/sfcurve.h>
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/plugin.h>
 #include <mitsuba/bidir/util.h>
 #include <mitsuba/bidir/path.h>
+#include <mitsuba/bidir/lightpathbudget.h>
 #include "vcm_proc.h"
 
 
@@ -109,6 +111,8 @@ struct LightVertexExtV{
 };
 struct LightPathNodeDataV{
 	int depth;
+	/// Slice of a SharedLightPathsV that holds the vertex
+	int slice;
 	size_t vertexIndex;
 };
 struct LightPathNodeV : public SimpleKDNode < Point, LightPathNodeDataV > {
@@ -119,6 +123,7 @@ struct LightPathNodeV : public SimpleKDNode < Point, LightPathNodeDataV > {
 		position = p;
 		data.vertexIndex = vertexIndex;
 		data.depth = depth;
+		data.slice = 0;
 	}
 	inline LightPathNodeV(Stream *stream) {
 		// TODO
@@ -131,24 +136,82 @@ typedef PointKDTree<LightPathNodeV>		LightPathTreeV;
 typedef LightPathTreeV::IndexType     IndexTypeV;
 typedef LightPathTreeV::SearchResult SearchResultV;
 
+/// Light vertices of a VCM iteration shared by all workers of a machine (see SharedLightPaths)
+class SharedLightPathsV : public SharedLightPaths {
+public:
+	SharedLightPathsV() {
+		m_tree.setRetainStorage(true);
+	}
+
+	SharedLightPathsV(Stream *stream, InstanceManager *manager)
+		: SharedLightPaths(stream, manager) {
+		m_tree.setRetainStorage(true);
+	}
+
+	/// Publish the vertices and merge candidates of a worker and wait for the tree of the round
+	void publish(const Round &round, const std::vector<LightVertexV> *vertices, const LightPathTreeV *nodes) {
+		m_vertices[round.slice] = vertices;
+		m_nodes[round.slice] = nodes;
+		SharedLightPaths::publish(round);
+	}
+
+	inline const LightPathTreeV &getTree() const { return m_tree; }
+
+	inline const std::vector<LightVertexV> &getVertices(int slice) const { return *m_vertices[slice]; }
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Virtual destructor
+	virtual ~SharedLightPathsV() { }
+
+	void beginRound(int sliceCount) {
+		m_vertices.resize(sliceCount);
+		m_nodes.resize(sliceCount);
+	}
+
+	void build(int sliceCount) {
+		size_t nodeCount = 0;
+		for (int i = 0; i < sliceCount; ++i)
+			nodeCount += m_nodes[i]->size();
+
+		m_tree.clear();
+		m_tree.reserve(nodeCount);
+		for (int i = 0; i < sliceCount; ++i) {
+			const LightPathTreeV &nodes = *m_nodes[i];
+			for (size_t j = 0; j < nodes.size(); ++j) {
+				LightPathNodeV node = nodes[j];
+				node.data.slice = i;
+				m_tree.push_back(node);
+			}
+		}
+		m_tree.build(true);
+	}
+private:
+	LightPathTreeV m_tree;
+	std::vector<const std::vector<LightVertexV> *> m_vertices;
+	std::vector<const LightPathTreeV *> m_nodes;
+};
+
 struct VertexMergingQuery {
 	VertexMergingQuery(const Scene *_scene,
 		const PathVertex *_vt, const PathVertex *_vtPred, const Vector _wi, const Vector _wiPred,
 		const Spectrum &_radianceWeight, const std::vector<LightVertexV> &lightVertices,
+		const SharedLightPathsV *sharedLightPaths,
 		int _t, int _maxDepth, Float _misVcWeightFactor, Float _vmNormalization,
 		const MisStateV &_sensorState)
 		: scene(_scene), radianceWeight(_radianceWeight), t(_t), maxDepth(_maxDepth),
 		vt(_vt), vtPred(_vtPred), wiPred(_wiPred), wi(_wi),
 		misVcWeightFactor(_misVcWeightFactor), vmNormalization(_vmNormalization),
 		sensorState(_sensorState), m_lightVertices(lightVertices),
-		result(0.f){}
+		m_sharedLightPaths(sharedLightPaths), result(0.f){}
 
 	inline void operator()(const LightPathNodeV &path) {
 		int s = path.data.depth;
 		if (maxDepth != -1 && s + t > maxDepth + 2) return;
 
 		size_t vertexIndex = path.data.vertexIndex;
-		LightVertexV v = m_lightVertices[vertexIndex];
+		const LightVertexV &v = m_sharedLightPaths ?
+			m_sharedLightPaths->getVertices(path.data.slice)[vertexIndex] : m_lightVertices[vertexIndex];
 		Vector wo = v.wo;
 		MisStateV emitterState = v.emitterState;
 		Spectrum bsdfFactor = vt->eval(scene, wi, wo, ERadiance);
@@ -174,6 +237,7 @@ struct VertexMergingQuery {
 	const PathVertex *vt, *vtPred;
 	const Spectrum &radianceWeight;
 	const std::vector<LightVertexV> &m_lightVertices;
+	const SharedLightPathsV *m_sharedLightPaths;
 	Spectrum result;
 };
 
@@ -204,6 +268,14 @@ public:
 	void prepare() {
 		Scene *scene = static_cast<Scene *>(getResource("scene"));
 		m_sampler = static_cast<Sampler *>(getResource("sampler"));
+		if (m_config.deterministic && m_sampler->getClass()->getName() != "PhiloxSampler") {
+			/* The streams of the independent sampler belong to the workers */
+			Properties props("philox");
+			props.setSize("sampleCount", m_sampler->getSampleCount());
+			m_sampler = static_cast<Sampler *>(PluginManager::getInstance()->
+				createObject(MTS_CLASS(Sampler), props));
+			m_sampler->configure();
+		}
 		m_sensor = static_cast<Sensor *>(getResource("sensor"));
 		m_scene = new Scene(scene);
 		m_film = m_sensor->getFilm();
@@ -219,6 +291,21 @@ public:
 			m_sampler, m_sampler, m_sampler, m_config.maxDepth,
 			m_config.rrDepth, false /*m_config.separateDirect*/, true /*m_config.directSampling*/,
 			true, m_sampler);
+		m_lightPathTree.setRetainStorage(true);
+
+		if (m_config.shareLightPaths)
+			m_sharedLightPaths = static_cast<SharedLightPathsV *>(getResource("lightPaths"));
+
+		/* Kept across work units, so that the auto-tuner continues where it stopped */
+		Vector2i cropSize = m_film->getCropSize();
+		m_lightPathBudget.configure(m_config.lightPathRatio, m_config.lightPathCount,
+			(size_t) cropSize.x * cropSize.y, m_config.autoTuneLightPaths);
+		m_lightTracingRatio = 1.f;
+	}
+
+	/// Does the work unit run another iteration after 'count' of them?
+	inline bool moreIterations(const SeedWorkUnit *wu, size_t count, const Timer *timer) const {
+		return count < m_config.sampleCount || (wu->getTimeout() > 0 && (int) timer->getMilliseconds() < wu->getTimeout());
 	}
 
 	void updateMisHelper(int i, const Path &path, MisStateV &state, const Scene* scene,
@@ -242,7 +329,8 @@ public:
 			if (mode == ERadiance){
 				// 			if (measure == EDiscrete)
 				// 				p1 *= (e->length * e->length) / (vNext->isOnSurface() ? std::abs(dot(e->d, vNext->getGeometricNormal())) : 1.f);
-				state[EVCMV] = MisHeuristic(pconnect / (ptrace * p1));
+				/* The light image has one sample per light path */
+				state[EVCMV] = MisHeuristic(pconnect * m_lightTracingRatio / (ptrace * p1));
 				state[EVCV] = 0.f;
 				state[EVMV] = 0.f;
 			}
@@ -325,7 +413,7 @@ public:
 			Float psr2_w = vs->evalPdf(scene, vt, vsPred, ERadiance, ESolidAngle);
 			Float psr1 = vt->evalPdf(scene, vtPred, vs, ERadiance, EArea);
 
-			Float wLight = MisHeuristic(ptrace * psr1 / pconnect) * (MisHeuristic(misVmWeightFactor) + emitterdVCM + MisHeuristic(psr2_w) * emitterdVC);
+			Float wLight = MisHeuristic(ptrace * psr1 / (pconnect * m_lightTracingRatio)) * (MisHeuristic(misVmWeightFactor) + emitterdVCM + MisHeuristic(psr2_w) * emitterdVC);
 			weight = 1.f / (1.f + wLight);
 		}
 		else if (s == 1){
@@ -346,6 +434,8 @@ public:
 			Float psr1 = (!emitter->needsDirectionSample() || !emitter->needsPositionSample()) ? 0.f : vt->evalPdf(scene, vtPred, vs, ERadiance, EArea);
 			Float ptr1 = vs->evalPdf(scene, vsPred, vt, EImportance, vsMeasure);
 			Float wLight = MisHeuristic(ratioEmitterDirect * (psr1 / ptrace));
+			if (t == 1)
+				wLight *= MisHeuristic(1.f / m_lightTracingRatio);
 			Float wCamera = (t == 1) ? 0.f : MisHeuristic(ratioEmitterDirect * ptr1) * (MisHeuristic(misVmWeightFactor) + sensordVCM + MisHeuristic(ptr2_w) * sensordVC);
 			weight = 1.f / (1.f + wLight + wCamera);
 		}
@@ -357,7 +447,7 @@ public:
 
 	void gatherLightPaths(ref<PathSampler> pathSampler,
 		const bool useVC, const bool useVM,
-		const float gatherRadius, const int nsample, 
+		const float gatherRadius, const int nsample, const size_t cameraPathCount,
 		UPMWorkResult *wr, ImageBlock *batres){
 		const Sensor *sensor = m_scene->getSensor();
 		m_lightPathTree.clear();
@@ -370,12 +460,29 @@ public:
 
 		Float time = sensor->getShutterOpen();
 		Vector2i filmSize = sensor->getFilm()->getSize();
-		m_lightPathNum = nsample;
+		/* A shared set splits the budget \c nsample into one slice per worker
+		   of the round and merges against all of them */
+		int slice = nsample, firstPath = 0;
+		if (m_sharedLightPaths) {
+			slice = (nsample + m_round.sliceCount - 1) / m_round.sliceCount;
+			firstPath = m_round.slice * slice;
+		}
+		m_lightPathNum = m_sharedLightPaths ? (size_t) slice * m_round.sliceCount : nsample;
 		Float etaVCM = (M_PI * gatherRadius * gatherRadius) * m_lightPathNum;
 		Float invLightPathNum = 1.f / m_lightPathNum;
 		Float misVmWeightFactor = useVM ? etaVCM : 0.f;
 		Float misVcWeightFactor = useVC ? 1.f / etaVCM : 0.f;
-		for (size_t k = 0; k < m_lightPathNum; k++){
+		/* The light image is normalized for one light path per camera path */
+		m_lightTracingRatio = (Float) slice / cameraPathCount;
+		Float lightImageScale = 1.f / m_lightTracingRatio;
+		size_t streamIndex = m_sampler->getSampleIndex();
+		for (int k = 0; k < slice; k++){
+			if (m_config.deterministic) {
+				/* Key the path by its index (see PathSampler::setLightPathStreams()) */
+				m_sampler->generate(Point2i(firstPath + k, -1));
+				m_sampler->setSampleIndex(streamIndex);
+			}
+
 			/* Initialize the path endpoints */
 			pathSampler->m_emitterSubpath.initialize(m_scene, time, EImportance, pathSampler->m_pool);
 
@@ -428,7 +535,7 @@ public:
 						emitterState[EVCMV], emitterState[EVCV],
 						sensorState[EVCMV], sensorState[EVCV],
 						misVmWeightFactor, m_lightPathNum);
-					value *= weight;
+					value *= weight * lightImageScale;
 					if (value.isZero()) continue;
 
 					Point2 samplePos(0.0f);
@@ -444,10 +551,16 @@ public:
 			}
 			m_lightPathEnds.push_back(m_lightVertices.size());
 		}
-		// build kdtree
-		m_lightPathTree.build(true);
 		/* Release any used edges and vertices back to the memory pool */
 		pathSampler->m_emitterSubpath.release(pathSampler->m_pool);
+
+		if (m_sharedLightPaths) {
+			/* The merge candidates stay unbuilt, they are copied into the tree of the round */
+			m_sharedLightPaths->publish(m_round, &m_lightVertices, &m_lightPathTree);
+			return;
+		}
+		// build kdtree
+		m_lightPathTree.build(true);
 	}
 	void sampleCameraPath(ref<PathSampler> pathSampler, UPMWorkResult *wr, 
 		const bool useVC, const bool useVM,
@@ -527,9 +640,13 @@ public:
 						Vector wi = normalize(vtPred->getPosition() - vt->getPosition());
 						Vector wiPred = (t == 2) ? Vector(-1.f, -1.f, -1.f) : normalize(vtPred2->getPosition() - vtPred->getPosition());
 						VertexMergingQuery query(m_scene, vt, vtPred, wi, wiPred, radianceWeights[t], m_lightVertices,
-							t, pathSampler->m_maxDepth, misVcWeightFactor, vmNormalization, sensorStates[t - 1]);
+							m_sharedLightPaths, t, pathSampler->m_maxDepth, misVcWeightFactor, vmNormalization, sensorStates[t - 1]);
 
-						m_lightPathTree.executeQuery(vt->getPosition(), gatherRadius, query);
+						/* Merges gather from the tree of the round when the light paths are shared */
+						if (m_sharedLightPaths)
+							m_sharedLightPaths->getTree().executeQuery(vt->getPosition(), gatherRadius, query);
+						else
+							m_lightPathTree.executeQuery(vt->getPosition(), gatherRadius, query);
 
 #if UPM_DEBUG == 1
 						wr->putDebugSampleVM(initialSamplePos, query.result);
@@ -546,8 +663,14 @@ public:
 				PathVertex *vs0 = pathSampler->m_pool.allocVertex();
 				PathVertex *vsPred0 = pathSampler->m_pool.allocVertex();
 				PathEdge *vsEdge0 = pathSampler->m_pool.allocEdge();
-				size_t lightPathBegin = (cameraPathIndex == 0) ? 0 : m_lightPathEnds[cameraPathIndex - 1];
-				size_t lightPathEnd = m_lightPathEnds[cameraPathIndex];
+				/* Camera paths take turns on the light paths when there are fewer of them */
+				size_t lightPathIndex = cameraPathIndex % m_lightPathEnds.size();
+				size_t lightPathBegin = (lightPathIndex == 0) ? 0 : m_lightPathEnds[lightPathIndex - 1];
+				size_t lightPathEnd = m_lightPathEnds[lightPathIndex];
+				/* Trace the shadow rays of the connections in one batch when a single ray decides visibility */
+				bool deferVisibility = pathSampler->m_opaqueVisibility;
+				pathSampler->m_shadowQueue.clear();
+				pathSampler->m_deferredValues.clear();
 				for (size_t i = lightPathBegin; i < lightPathEnd + 2; i++){
 					int s = lightPathEnd + 1 - i;
 					PathVertex* vsPred = NULL, *vs = NULL;
@@ -681,7 +804,16 @@ public:
 						the creation of additional vertices (index-matched boundaries etc.) */
 						int interactions = remaining;
 
-						if (value.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vt, vtEdge, interactions))
+						if (value.isZero())
+							continue;
+						Ray shadowRay;
+						bool deferred = deferVisibility && s > 0 && t >= 2;
+						if (deferred){
+							if (!connectionEdge.connectDeferred(vs, vt, shadowRay))
+								continue;
+							interactions = 0;
+						}
+						else if (!connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vt, vtEdge, interactions))
 							continue;
 
 						depth += interactions;
@@ -707,7 +839,12 @@ public:
 
 						if (weight == 0.0f) continue;
 
-						if (t < 2) {
+						if (deferred) {
+							/* Accumulated once the shadow rays of all light vertices are traced */
+							pathSampler->m_shadowQueue.enqueue(shadowRay, (uint32_t) pathSampler->m_deferredValues.size());
+							pathSampler->m_deferredValues.push_back(value);
+						}
+						else if (t < 2) {
 							list.append(samplePos, value);
 #if UPM_DEBUG == 1
 							wr->putDebugSampleVC(samplePos, value);
@@ -722,6 +859,21 @@ public:
 						}
 					}
 				}
+				ShadowRayQueue &shadowQueue = pathSampler->m_shadowQueue;
+				if (!shadowQueue.isEmpty()){
+					m_scene->resolveShadowRays(shadowQueue);
+					for (size_t k = 0; k < shadowQueue.size(); k++){
+						if (!shadowQueue.isVisible(k))
+							continue;
+						const Spectrum &value = pathSampler->m_deferredValues[shadowQueue.getPayload(k)];
+						list.accum(0, value);
+#if UPM_DEBUG == 1
+						wr->putDebugSampleVC(initialSamplePos, value);
+#endif
+					}
+					shadowQueue.clear();
+					pathSampler->m_deferredValues.clear();
+				}
 				pathSampler->m_pool.release(vs0);
 				pathSampler->m_pool.release(vsPred0);
 				pathSampler->m_pool.release(vsEdge0);
@@ -796,6 +948,7 @@ public:
 		UPMWorkResult *result = static_cast<UPMWorkResult *>(workResult);		
 		const SeedWorkUnit *wu = static_cast<const SeedWorkUnit *>(workUnit);
 		const int workID = wu->getID();
+		result->setSequence(wu->getSequence());
 		SplatList *splats = new SplatList();		
 
 		HilbertCurve2D<int> hilbertCurve;
@@ -828,19 +981,40 @@ public:
 
 		float radius = m_config.initialRadius;
 		ref<Timer> timer = new Timer();
-		for (size_t j = 0; j < m_config.sampleCount || (wu->getTimeout() > 0 && (int)timer->getMilliseconds() < wu->getTimeout()); j++) {
+		ref<Timer> phaseTimer = new Timer(false);
+		/* With shared light paths, the decision to run another iteration is
+		   made once per round, since the other workers wait for this one */
+		bool more = moreIterations(wu, 0, timer);
+		if (m_sharedLightPaths && more)
+			m_sharedLightPaths->join(m_round);
+
+		while (more) {
 			if (m_config.initialRadius > 0.0f){
-				Float reduceFactor = 1.f / std::pow(Float(iteration + 1), (Float)(0.5 * (1 - 0.75/*radiusAlpha*/)));
+				/* A round continues the schedule after the slices of all earlier rounds */
+				uint64_t index = m_sharedLightPaths ? m_round.firstSlice : iteration;
+				Float reduceFactor = 1.f / std::pow(Float(index + 1), (Float)(0.5 * (1 - 0.75/*radiusAlpha*/)));
 				radius = std::max(reduceFactor * m_config.initialRadius, (Float)1e-7);
 				iteration += 8;
 			}
-			gatherLightPaths(m_pathSampler, m_config.useVC, m_config.useVM, radius, hilbertCurve.getPointCount(), result, batres);
+
+			/* In deterministic mode, iteration n of work unit 'workID' uses the
+			   sample index workID + n * workUnits in the streams of all pixels
+			   and light paths, regardless of the worker that runs it */
+			size_t streamIndex = (size_t) workID + actualSampleCount * (size_t) m_config.workUnits;
+			if (m_config.deterministic)
+				m_sampler->setSampleIndex(streamIndex);
+			phaseTimer->reset();
+			gatherLightPaths(m_pathSampler, m_config.useVC, m_config.useVM, radius, m_lightPathBudget.getLightPathCount(),
+				hilbertCurve.getPointCount(), result, batres);
+			Float traceTime = phaseTimer->lap();
 
 			for (size_t i = 0; i < hilbertCurve.getPointCount(); ++i) {
 				if (stop) break;
 
 				Point2i offset = Point2i(hilbertCurve[i]);
 				m_sampler->generate(offset);
+				if (m_config.deterministic)
+					m_sampler->setSampleIndex(streamIndex);
 				sampleCameraPath(m_pathSampler, result, m_config.useVC, m_config.useVM, radius, offset, i, *splats);
 
 				for (size_t k = 0; k < splats->size(); ++k) {
@@ -851,8 +1025,14 @@ public:
 						batres->put(splats->getPosition(k), &value[0]);
 				}
 			}
+			if (!stop)
+				m_lightPathBudget.update(traceTime, phaseTimer->lap());
 			actualSampleCount++;
 
+			more = moreIterations(wu, actualSampleCount, timer);
+			if (m_sharedLightPaths)
+				m_sharedLightPaths->finish(m_round, more);
+
 #if UPM_DEBUG == 1
 			// [UC] for unbiased check
 			if (m_config.enableSeparateDump){
@@ -915,6 +1095,11 @@ private:
 	std::vector<LightVertexV> m_lightVertices;
 	std::vector<LightVertexExtV> m_lightVerticesExt;
 	std::vector<size_t> m_lightPathEnds;
+	ref<SharedLightPathsV> m_sharedLightPaths;
+	SharedLightPaths::Round m_round;
+	LightPathBudget m_lightPathBudget;
+	/// Light paths per camera path of the current iteration
+	Float m_lightTracingRatio;
 };
 
 /* ==================================================================== */
@@ -930,32 +1115,46 @@ VCMProcess::VCMProcess(const RenderJob *parent, RenderQueue *queue,
 	m_resultCounter = 0;
 	m_workCounter = 0;
 	m_refreshTimeout = 1;
+	/* Bound the number of results that the deterministic mode holds back */
+	m_sequencer.setWindow(2 * std::max((size_t) 1, Scheduler::getInstance()->getWorkerCount()));
 }
 
+ref<SharedLightPaths> VCMProcess::createSharedLightPaths() {
+	return new SharedLightPathsV();
+}
+
 ref<WorkProcessor> VCMProcess::createWorkProcessor() const {
 	return new VCMRenderer(m_config);
 }
 
 void VCMProcess::develop() {
 	LockGuard lock(m_resultMutex);
-	size_t pixelCount = m_result->getImageBlock()->getBitmap()->getPixelCount();
-	const Spectrum *accum = (Spectrum *)(m_result->getImageBlock()->getBitmap()->getData());
-	Spectrum *target = (Spectrum *) m_developBuffer->getData();
-	Float invFactor = 1.f / Float(m_result->getSampleCount());
-	for (size_t i=0; i<pixelCount; ++i) {
-		target[i] = accum[i] * invFactor;
-	}
+	m_result->getImageBlock()->develop(m_developBuffer, Point2i(0), 1.f / Float(m_result->getSampleCount()));
 	m_film->setBitmap(m_developBuffer);
 	m_refreshTimer->reset();
 
 	m_queue->signalRefresh(m_job);
 }
 
+void VCMProcess::flushResults() {
+	LockGuard lock(m_resultMutex);
+	m_sequencer.flush();
+}
+
 void VCMProcess::processResult(const WorkResult *workResult, bool cancelled) {
 	const UPMWorkResult *wr = static_cast<const UPMWorkResult *>(workResult);
-	LockGuard lock(m_resultMutex);	
-	//m_accum->put(result);
-	m_result->put(wr);
+	/* The accumulated result is dense and locks its tiles individually, so
+	   the images of several workers can be merged at the same time */
+	if (!m_config.deterministic)
+		m_result->putImages(wr);
+	UniqueLock lock(m_resultMutex);
+	bool resume = false;
+	if (m_config.deterministic) {
+		/* The sums must not depend on the order in which the results complete */
+		resume = m_sequencer.put(wr->getSequence(), wr, cancelled);
+	} else {
+		m_result->putCounters(wr);
+	}
 	m_progress->update(++m_resultCounter);
 	m_refreshTimeout = std::min(2000U, m_refreshTimeout * 2);
 
@@ -963,6 +1162,11 @@ void VCMProcess::processResult(const WorkResult *workResult, bool cancelled) {
 	   visible (e.g. in a graphical user interface). */
 	if (m_job->isInteractive() && m_refreshTimer->getMilliseconds() > m_refreshTimeout)
 		develop();
+	lock.unlock();
+
+	/* The scheduler calls generateWork() with its own lock held */
+	if (resume)
+		Scheduler::getInstance()->schedule(this);
 }
 
 ParallelProcess::EStatus VCMProcess::generateWork(WorkUnit *unit, int worker) {
@@ -975,7 +1179,15 @@ ParallelProcess::EStatus VCMProcess::generateWork(WorkUnit *unit, int worker) {
 	if (m_workCounter >= m_config.workUnits || timeout < 0)
 		return EFailure;
 
+	if (m_config.deterministic) {
+		/* Wait until the results that are held back have been merged */
+		LockGuard lock(m_resultMutex);
+		if (m_sequencer.pause((size_t) m_workCounter))
+			return EPause;
+	}
+
 	SeedWorkUnit *workUnit = static_cast<SeedWorkUnit *>(unit);
+	workUnit->setSequence(m_workCounter);
 	workUnit->setID(m_workCounter++);
 	workUnit->setTimeout(timeout);
 	return ESuccess;
@@ -990,13 +1202,17 @@ void VCMProcess::bindResource(const std::string &name, int id) {
 		m_progress = new ProgressReporter("Rendering", m_config.workUnits, m_job);
 // 		m_accum = new ImageBlock(Bitmap::ESpectrum, m_film->getCropSize());
 // 		m_accum->clear();
-		m_result = new UPMWorkResult(m_film->getCropSize().x, m_film->getCropSize().y, m_config.maxDepth, NULL);
+		m_result = new UPMWorkResult(m_film->getCropSize().x, m_film->getCropSize().y, m_config.maxDepth,
+			m_film->getReconstructionFilter(), false, true);
 		m_result->clear();
+		m_sequencer.setTarget(m_result, m_film->getCropSize().x, m_film->getCropSize().y,
+			m_config.maxDepth, m_film->getReconstructionFilter());
 		m_developBuffer = new Bitmap(Bitmap::ESpectrum, Bitmap::EFloat, m_film->getCropSize());
 	}
 }
 
 MTS_IMPLEMENT_CLASS_S(VCMRenderer, false, WorkProcessor)
+MTS_IMPLEMENT_CLASS_S(SharedLightPathsV, false, SharedLightPaths)
 MTS_IMPLEMENT_CLASS(VCMProcess, false, ParallelProcess)
 MTS_IMPLEMENT_CLASS(SeedWorkUnit, false, WorkUnit)
 MTS_IMPLEMENT_CLASS(UPMWorkResult, false, WorkResult)
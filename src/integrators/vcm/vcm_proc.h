@@ -23,6 +23,7 @@
 #include <mitsuba/render/renderjob.h>
 #include <mitsuba/core/statistics.h>
 #include <mitsuba/core/bitmap.h>
+#include <mitsuba/bidir/sharedpaths.h>
 #include "vcm.h"
 
 MTS_NAMESPACE_BEGIN
@@ -37,6 +38,12 @@ public:
 
 	void develop();
 
+	/// Merge the results that the deterministic mode still holds back (e.g. after a cancellation)
+	void flushResults();
+
+	/// Create the light paths that the workers share when 'shareLightPaths' is set
+	static ref<SharedLightPaths> createSharedLightPaths();
+
 	/* ParallelProcess impl. */
 	void processResult(const WorkResult *wr, bool cancelled);
 	ref<WorkProcessor> createWorkProcessor() const;
@@ -61,6 +68,7 @@ private:
 	unsigned int m_refreshTimeout;
 	ref<Timer> m_timeoutTimer, m_refreshTimer;
 	ref<UPMWorkResult> m_result;
+	UPMResultSequencer m_sequencer;
 };
 
 MTS_NAMESPACE_END
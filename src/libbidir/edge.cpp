@@ -561,6 +561,29 @@ bool PathEdge::pathConnectAndCollapse(const Scene *scene, const PathEdge *predEd
 	return true;
 }
 
+bool PathEdge::connectDeferred(const PathVertex *vs, const PathVertex *vt, Ray &shadowRay) {
+	if (vs->isEmitterSupernode() || vt->isSensorSupernode())
+		return false;
+
+	Point vsp = vs->getPosition(), vtp = vt->getPosition();
+	d = vsp-vtp;
+	length = d.length();
+	if (length == 0)
+		return false;
+	d /= length;
+
+	medium = NULL;
+	weight[ERadiance] = Spectrum(1.0f);
+	weight[EImportance] = Spectrum(1.0f);
+	pdf[ERadiance] = 1.0f;
+	pdf[EImportance] = 1.0f;
+
+	/* Same segment as the first ray of pathConnectAndCollapse() */
+	shadowRay = Ray(vtp, d, vt->isOnSurface() ? Epsilon : 0,
+		length * (vs->isOnSurface() ? (1-ShadowEpsilon) : 1), vs->getTime());
+	return true;
+}
+
 PathEdge *PathEdge::clone(MemoryPool &pool) const {
 	PathEdge *result = pool.allocEdge();
 	*result = *this;
@@ -0,0 +1,353 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/bidir/gathertrial.h>
+#include <mitsuba/core/statistics.h>
+#if defined(MTS_SSE)
+#include <mitsuba/core/sse.h>
+#endif
+
+MTS_NAMESPACE_BEGIN
+
+static StatsCounter batchedTrialPackets("Unbiased photon mapping", "Batched 1/p trial packets");
+static StatsCounter batchedTrialLanes("Unbiased photon mapping", "Average lane occupancy of 1/p trial packets", EPercentage);
+static StatsCounter avgQueueMerges("Unbiased photon mapping", "Average merges per merge queue drain", EAverage);
+
+GatherTrialBatch::Candidate &GatherTrialBatch::append() {
+	if (m_count == m_candidates.size())
+		m_candidates.push_back(Candidate());
+	Candidate &c = m_candidates[m_count++];
+	c.sampler = NULL;
+	c.domain.clear();
+	c.mode = ERadiance;
+	c.budget = 0;
+	c.totalShoot = c.acceptedShoot = 0;
+	c.finished = false;
+	c.m_vertex = c.m_pred = NULL;
+	c.m_copy = -1;
+	c.m_pending = 0;
+	return c;
+}
+
+uint32_t GatherTrialBatch::copyVertices(const PathVertex *vertex, const PathVertex *pred) {
+	if (m_copyCount == m_copies.size())
+		m_copies.push_back(VertexCopy());
+	VertexCopy &copy = m_copies[m_copyCount];
+	copy.vertex = *vertex;
+	copy.hasPred = pred != NULL;
+	if (pred)
+		copy.pred = *pred;
+	return (uint32_t) m_copyCount++;
+}
+
+/// Spread the lower 10 bits of a number to every third bit
+static inline uint32_t spreadBits(uint32_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+void GatherTrialBatch::sortActive() {
+	AABB aabb;
+	for (size_t j = 0; j < m_active.size(); ++j)
+		aabb.expandBy(getVertex(m_candidates[m_active[j]])->getPosition());
+	Vector extents = aabb.getExtents();
+	Vector scale;
+	for (int i = 0; i < 3; ++i)
+		scale[i] = extents[i] > 0 ? 1023.0f / extents[i] : 0.0f;
+
+	m_keys.resize(m_active.size());
+	for (size_t j = 0; j < m_active.size(); ++j) {
+		Vector rel = getVertex(m_candidates[m_active[j]])->getPosition() - aabb.min;
+		uint32_t code = (spreadBits((uint32_t) (rel.x * scale.x)) << 2)
+			| (spreadBits((uint32_t) (rel.y * scale.y)) << 1)
+			| spreadBits((uint32_t) (rel.z * scale.z));
+		m_keys[j] = std::make_pair(code, m_active[j]);
+	}
+	std::sort(m_keys.begin(), m_keys.end());
+	for (size_t j = 0; j < m_active.size(); ++j)
+		m_active[j] = m_keys[j].second;
+}
+
+void GatherTrialBatch::estimate(const Scene *scene, Float gatherRadius, size_t clampThreshold, bool coherent) {
+	const Float distSquared = gatherRadius * gatherRadius;
+	Ray rays[4];
+	Point targets[4];
+	Float t[4];
+	bool accepted[4];
+
+	m_active.clear();
+	for (size_t i = 0; i < m_count; ++i) {
+		if (m_candidates[i].budget == 0)
+			m_candidates[i].budget = clampThreshold;
+		if (m_candidates[i].totalShoot >= m_candidates[i].budget)
+			m_candidates[i].finished = true;
+		if (!m_candidates[i].finished)
+			m_active.push_back((uint32_t) i);
+	}
+	if (coherent)
+		sortActive();
+
+	while (!m_active.empty()) {
+		/* Issue trials of the active candidates in a round-robin fashion
+		   until the packet is full or every candidate reached its budget */
+		size_t nLanes = 0;
+		bool progress = true;
+		m_trials.clear();
+		while (nLanes < 4 && progress) {
+			progress = false;
+			for (size_t j = 0; j < m_active.size() && nLanes < 4; ++j) {
+				Candidate &c = m_candidates[m_active[j]];
+				if (c.totalShoot + c.m_pending >= c.budget)
+					continue;
+				c.m_pending++;
+				progress = true;
+
+				Trial trial;
+				trial.candidate = m_active[j];
+				trial.lane = -1;
+				const PathVertex *vertex = getVertex(c);
+				if (vertex->sampleShootRay(c.sampler, getPred(c), c.target, gatherRadius,
+						c.domain, rays[nLanes])) {
+					targets[nLanes] = c.target;
+					trial.lane = (int) nLanes++;
+				}
+				m_trials.push_back(trial);
+			}
+		}
+
+		if (nLanes > 0) {
+			++batchedTrialPackets;
+			batchedTrialLanes.incrementBase(4);
+			batchedTrialLanes += nLanes;
+
+			scene->rayIntersectAllPacket(rays, nLanes, t);
+
+			/* Disk acceptance test for all lanes at once (like PathEdge::sampleNext(),
+			   this rejects lanes without a hit and zero-length edges) */
+#if defined(MTS_SSE)
+			SSEVector hx, hy, hz, dx, dy, dz, tt, mask;
+			for (int i = 0; i < 4; ++i) {
+				int k = i < (int) nLanes ? i : 0;
+				tt.f[i] = i < (int) nLanes ? t[k] : 0.0f;
+				hx.f[i] = rays[k].o.x - targets[k].x;
+				hy.f[i] = rays[k].o.y - targets[k].y;
+				hz.f[i] = rays[k].o.z - targets[k].z;
+				dx.f[i] = rays[k].d.x;
+				dy.f[i] = rays[k].d.y;
+				dz.f[i] = rays[k].d.z;
+			}
+			/* Lanes without a hit (t=inf) are rejected by the mask below */
+			hx.ps = _mm_add_ps(hx.ps, _mm_mul_ps(tt.ps, dx.ps));
+			hy.ps = _mm_add_ps(hy.ps, _mm_mul_ps(tt.ps, dy.ps));
+			hz.ps = _mm_add_ps(hz.ps, _mm_mul_ps(tt.ps, dz.ps));
+			const __m128 dist2 = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(hx.ps, hx.ps), _mm_mul_ps(hy.ps, hy.ps)),
+				_mm_mul_ps(hz.ps, hz.ps));
+			mask.ps = _mm_and_ps(
+				_mm_cmplt_ps(dist2, _mm_set1_ps(distSquared)),
+				_mm_and_ps(_mm_cmpgt_ps(tt.ps, _mm_setzero_ps()),
+					_mm_cmplt_ps(tt.ps, SSEConstants::p_inf.ps)));
+			for (size_t i = 0; i < nLanes; ++i)
+				accepted[i] = mask.i[i] != 0;
+#else
+			for (size_t i = 0; i < nLanes; ++i) {
+				accepted[i] = t[i] > 0 && t[i] < std::numeric_limits<Float>::infinity()
+					&& (rays[i](t[i]) - targets[i]).lengthSquared() < distSquared;
+			}
+#endif
+		}
+
+		/* Consume the trials in the order in which they were issued */
+		for (size_t i = 0; i < m_trials.size(); ++i) {
+			Candidate &c = m_candidates[m_trials[i].candidate];
+			c.m_pending = 0;
+			if (c.finished)
+				continue;
+			c.totalShoot++;
+			if (m_trials[i].lane >= 0 && accepted[m_trials[i].lane]) {
+				c.acceptedShoot++;
+				c.finished = true;
+			} else if (c.totalShoot >= c.budget) {
+				c.finished = true;
+			}
+		}
+
+		size_t nActive = 0;
+		for (size_t j = 0; j < m_active.size(); ++j) {
+			if (!m_candidates[m_active[j]].finished)
+				m_active[nActive++] = m_active[j];
+		}
+		m_active.resize(nActive);
+	}
+}
+
+size_t GatherTrialBatch::estimateShared(const Scene *scene, const PathVertex *vertex, const PathVertex *pred,
+		Sampler *sampler, ETransportMode mode, const Point &domainCenter, Float domainRadius,
+		const GatherDomain &domain,
+		Float gatherRadius, size_t clampThreshold) {
+	const Float distSquared = gatherRadius * gatherRadius;
+	Ray rays[4];
+	Float t[4];
+	bool valid[4];
+	size_t totalShoot = 0;
+
+	m_active.clear();
+	for (size_t i = 0; i < m_count; ++i) {
+		Candidate &c = m_candidates[i];
+		c.totalShoot = c.acceptedShoot = 0;
+		c.finished = false;
+		m_active.push_back((uint32_t) i);
+	}
+
+	while (!m_active.empty() && totalShoot < clampThreshold) {
+		/* All trials start at the same vertex -- trace them as a coherent packet */
+		size_t nTrials = std::min(clampThreshold - totalShoot, (size_t) 4);
+		size_t nLanes = 0;
+		for (size_t i = 0; i < nTrials; ++i) {
+			valid[i] = vertex->sampleShootRay(sampler, pred, domainCenter, domainRadius,
+				domain, rays[nLanes]);
+			if (valid[i])
+				++nLanes;
+		}
+
+		if (nLanes > 0) {
+			++batchedTrialPackets;
+			batchedTrialLanes.incrementBase(4);
+			batchedTrialLanes += nLanes;
+			scene->rayIntersectAllPacket(rays, nLanes, t);
+		}
+
+		/* Test the trials in order against every unfinished candidate */
+		size_t lane = 0;
+		for (size_t i = 0; i < nTrials && !m_active.empty(); ++i) {
+			++totalShoot;
+			if (!valid[i])
+				continue;
+			const Ray &ray = rays[lane];
+			Float hitT = t[lane++];
+			if (!(hitT > 0 && hitT < std::numeric_limits<Float>::infinity()))
+				continue;
+			const Point hit = ray(hitT);
+
+			size_t nActive = 0;
+			for (size_t j = 0; j < m_active.size(); ++j) {
+				Candidate &c = m_candidates[m_active[j]];
+				if ((hit - c.target).lengthSquared() < distSquared) {
+					c.totalShoot = totalShoot;
+					c.acceptedShoot = 1;
+					c.finished = true;
+				} else {
+					m_active[nActive++] = m_active[j];
+				}
+			}
+			m_active.resize(nActive);
+		}
+	}
+
+	/* Candidates without a hit were clamped */
+	for (size_t j = 0; j < m_active.size(); ++j) {
+		Candidate &c = m_candidates[m_active[j]];
+		c.totalShoot = totalShoot;
+		c.finished = true;
+	}
+
+	return totalShoot;
+}
+
+void MergeQueue::drain(const Scene *scene, Float gatherRadius, size_t clampThreshold) {
+	if (m_trials.size() == 0)
+		return;
+	avgQueueMerges.incrementBase();
+	avgQueueMerges += m_trials.size();
+	m_trials.estimate(scene, gatherRadius, clampThreshold, true);
+}
+
+/* Number of merges of a group before its statistics are used */
+#define MTS_TRIAL_POLICY_WARMUP 64
+/* Range of the scale factor of the clamping threshold */
+#define MTS_TRIAL_POLICY_MIN_SCALE 0.25f
+#define MTS_TRIAL_POLICY_MAX_SCALE 2.0f
+/* Lower bound of the survival probability, which bounds the added variance */
+#define MTS_TRIAL_POLICY_MIN_SURVIVAL 0.1f
+/* Groups that need fewer trials per estimate on average are never rouletted */
+#define MTS_TRIAL_POLICY_MIN_TRIALS 8
+
+GatherTrialPolicy::GatherTrialPolicy() : m_adaptiveBudget(false), m_roulette(false) {
+	m_slots.resize(MTS_TRIAL_POLICY_DEPTH * MTS_TRIAL_POLICY_DEPTH * 2);
+	reset();
+}
+
+void GatherTrialPolicy::configure(bool adaptiveBudget, bool roulette) {
+	m_adaptiveBudget = adaptiveBudget;
+	m_roulette = roulette;
+}
+
+void GatherTrialPolicy::reset() {
+	memset(&m_slots[0], 0, m_slots.size() * sizeof(Slot));
+}
+
+GatherTrialPolicy::Decision GatherTrialPolicy::decide(int slot, Float contribution,
+		size_t clampThreshold, Float sample) {
+	Decision decision;
+	decision.budget = clampThreshold;
+	decision.weight = 1.0f;
+	if (!isEnabled())
+		return decision;
+
+	Slot &st = m_slots[slot];
+	Float mean = st.contributionCount > 0 ? st.contributionSum / st.contributionCount : 0.0f;
+	st.contributionSum += contribution;
+	st.contributionCount++;
+	if (st.contributionCount <= MTS_TRIAL_POLICY_WARMUP || !(mean > 0))
+		return decision;
+
+	Float ratio = contribution / mean;
+	if (m_adaptiveBudget) {
+		Float scale = clamp(std::sqrt(ratio), (Float) MTS_TRIAL_POLICY_MIN_SCALE,
+			(Float) MTS_TRIAL_POLICY_MAX_SCALE);
+		decision.budget = std::max((size_t) 1, (size_t) (clampThreshold * scale + 0.5f));
+	}
+
+	if (m_roulette && st.estimateCount > 0) {
+		/* Only roulette groups that clamp often or need many trials per
+		   accepted estimate; cheap estimates are not worth the variance */
+		bool expensive = st.acceptCount == 0 || st.clampCount * 4 > st.estimateCount ||
+			st.trialSum >= st.acceptCount * MTS_TRIAL_POLICY_MIN_TRIALS;
+		Float survival = std::max(std::min(ratio, (Float) 1.0f), (Float) MTS_TRIAL_POLICY_MIN_SURVIVAL);
+		if (expensive && survival < 1.0f)
+			decision.weight = sample < survival ? 1.0f / survival : 0.0f;
+	}
+
+	return decision;
+}
+
+void GatherTrialPolicy::record(int slot, size_t totalShoot, bool accepted, size_t budget) {
+	Slot &st = m_slots[slot];
+	st.estimateCount++;
+	st.trialSum += totalShoot;
+	if (accepted)
+		st.acceptCount++;
+	else if (totalShoot >= budget)
+		st.clampCount++;
+}
+
+MTS_NAMESPACE_END
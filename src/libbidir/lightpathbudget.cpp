@@ -0,0 +1,82 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/bidir/lightpathbudget.h>
+#include <mitsuba/core/statistics.h>
+
+MTS_NAMESPACE_BEGIN
+
+static StatsCounter avgLightPathCount("Vertex merging", "Average light paths per auto-tuned iteration", EAverage);
+
+const Float LightPathBudget::maxRatio = 16;
+
+LightPathBudget::LightPathBudget()
+	: m_cameraPathCount(0), m_lightPathCount(0), m_minCount(1), m_maxCount(1),
+	  m_traceCost(0), m_gatherTime(0), m_updates(0), m_autoTune(false) { }
+
+void LightPathBudget::configure(Float ratio, size_t count, size_t cameraPathCount, bool autoTune) {
+	if (ratio < 0 || (ratio == 0 && count == 0))
+		SLog(EError, "The number of light paths per iteration must be positive!");
+
+	Float total = ratio > 0 ? ratio * cameraPathCount : (Float) count;
+	m_cameraPathCount = cameraPathCount;
+	m_lightPathCount = std::max(1, (int) std::min(total + (Float) 0.5f, (Float) INT_MAX));
+	m_minCount = std::max(1, (int) (cameraPathCount / maxRatio));
+	m_maxCount = (int) std::min(cameraPathCount * maxRatio, (Float) INT_MAX);
+	m_traceCost = m_gatherTime = 0;
+	m_updates = 0;
+	m_autoTune = autoTune;
+}
+
+void LightPathBudget::update(Float traceTime, Float gatherTime) {
+	if (!m_autoTune || !(traceTime > 0) || !(gatherTime > 0))
+		return;
+
+	/* Average the timings over the iterations, single ones are noisy */
+	Float traceCost = traceTime / m_lightPathCount;
+	if (m_updates++ == 0) {
+		m_traceCost = traceCost;
+		m_gatherTime = gatherTime;
+	} else {
+		m_traceCost = (Float) 0.75f * m_traceCost + (Float) 0.25f * traceCost;
+		m_gatherTime = (Float) 0.75f * m_gatherTime + (Float) 0.25f * gatherTime;
+	}
+
+	/* The gather time grows with the number of light paths as well (more
+	   merges), so only move half way (geometrically) towards the count that
+	   would balance the last timings, and at most by a factor of two */
+	Float target = m_gatherTime / m_traceCost;
+	Float count = std::sqrt(target * m_lightPathCount);
+	count = clamp(count, (Float) 0.5f * m_lightPathCount, (Float) 2 * m_lightPathCount);
+	m_lightPathCount = clamp((int) (count + (Float) 0.5f), m_minCount, m_maxCount);
+
+	avgLightPathCount.incrementBase();
+	avgLightPathCount += m_lightPathCount;
+}
+
+std::string LightPathBudget::toString() const {
+	std::ostringstream oss;
+	oss << "LightPathBudget[" << endl
+		<< "  cameraPathCount = " << m_cameraPathCount << "," << endl
+		<< "  lightPathCount = " << m_lightPathCount << "," << endl
+		<< "  autoTune = " << (m_autoTune ? "true" : "false") << endl
+		<< "]";
+	return oss.str();
+}
+
+MTS_NAMESPACE_END
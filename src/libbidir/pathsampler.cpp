@@ -37,7 +37,10 @@ StatsCounter numZeroGatherPoints("Unbiased photon mapping", "Percentage of zero
 StatsCounter maxInvpShoots("Unbiased photon mapping", "Max. number of 1/p shoots", EMaximumValue);
 StatsCounter numInvpShoots("Unbiased photon mapping", "Total number of 1/p shoots");
 StatsCounter avgInvpShoots("Unbiased photon mapping", "Avg. number of 1/p shoots", EAverage);
+StatsCounter avgMergeShoots("Unbiased photon mapping", "Effective 1/p shoots per merge", EAverage);
+StatsCounter numSharedShoots("Unbiased photon mapping", "Percentage of gather points with shared 1/p shoots", EPercentage);
 
+StatsCounter numRouletteShoots("Unbiased photon mapping", "Merges whose 1/p trials were skipped by Russian roulette", EPercentage);
 StatsCounter numClampShoots("Unbiased photon mapping", "Percentage of clamped invp evaluations(bias)", EPercentage);
 
 PathSampler::PathSampler(ETechnique technique, const Scene *scene, Sampler *sensorSampler,
@@ -48,7 +51,8 @@ PathSampler::PathSampler(ETechnique technique, const Scene *scene, Sampler *sens
 	  m_sensorSampler(sensorSampler), m_directSampler(directSampler), m_maxDepth(maxDepth),
 	  m_rrDepth(rrDepth), m_excludeDirectIllum(excludeDirectIllum), m_sampleDirect(sampleDirect),
       m_lightImage(lightImage),
-	  m_lightPathSampler(lightPathSampler){
+	  m_lightPathSampler(lightPathSampler), m_lightPathStreams(false), m_lightTracingRatio(1.f),
+	  m_opaqueVisibility(scene->hasOpaqueVisibility()){
 
 	if (technique == EUnidirectional) {
 		/* Instantiate a volumetric path tracer */
@@ -69,6 +73,11 @@ PathSampler::PathSampler(ETechnique technique, const Scene *scene, Sampler *sens
 	/* Go one extra step if there are emitters that can be intersected */
 	if (!m_scene->hasDegenerateEmitters() && m_sensorDepth != -1)
 		++m_sensorDepth;
+
+	/* The light/camera path trees are cleared and rebuilt in every
+	   iteration -- keep their build storage around */
+	m_lightPathTree.setRetainStorage(true);
+	m_cameraPathTree.setRetainStorage(true);
 }
 
 PathSampler::~PathSampler() {
@@ -1206,34 +1215,31 @@ Float PathSampler::generateSeedsConnection(size_t sampleCount, size_t seedCount,
 inline Float MisHeuristic(Float pdf) {
 	return pdf * pdf;
 }
-ETransportMode connectionDirection(const PathVertex* vsPred, const PathVertex* vtPred){
-	// true for camera direction and false for light direction
-	bool cameraDirConnection = true;
-	Float sBandwidth = 0.f, tBandwidth = 0.f;
-	if (vtPred->isSensorSample()){
-		tBandwidth = 99999.f;
+MisVertex::MisVertex(const PathVertex *v) : type(PathVertex::EInvalid), connectable(false), bandwidth(0.0f) {
+	if (v == NULL)
+		return;
+	type = v->type;
+	connectable = v->isConnectable();
+	if (v->isSensorSample()){
+		bandwidth = 99999.f;
 	}
-	else if (vtPred->isSurfaceInteraction()){
-		const Intersection &its = vtPred->getIntersection();
-		const BSDF *bsdf = its.getBSDF();
-		tBandwidth = bsdf->getBandwidth();
+	else if (v->isEmitterSample()){
+		const PositionSamplingRecord &pRec = v->getPositionSamplingRecord();
+		bandwidth = static_cast<const Emitter *>(pRec.object)->getBandwidth();
 	}
-	else
-		return ETransportModes;
-
-	if (vsPred->isEmitterSample()){
-		const PositionSamplingRecord &pRec = vsPred->getPositionSamplingRecord();
-		const Emitter *emitter = static_cast<const Emitter *>(pRec.object);
-
-		sBandwidth = emitter->getBandwidth();		
+	else if (v->isSurfaceInteraction()){
+		bandwidth = v->getIntersection().getBSDF()->getBandwidth();
 	}
-	else if (vsPred->isSurfaceInteraction()){
-		const Intersection &its = vsPred->getIntersection();
-		const BSDF *bsdf = its.getBSDF();
-		sBandwidth = bsdf->getBandwidth();
-	}
-	else
+}
+
+ETransportMode connectionDirection(const MisVertex &vsPred, const MisVertex &vtPred){
+	// true for camera direction and false for light direction
+	bool cameraDirConnection = true;
+	if (vtPred.type != PathVertex::ESensorSample && vtPred.type != PathVertex::ESurfaceInteraction)
 		return ETransportModes;
+	if (vsPred.type != PathVertex::EEmitterSample && vsPred.type != PathVertex::ESurfaceInteraction)
+		return ETransportModes;
+	Float sBandwidth = vsPred.bandwidth, tBandwidth = vtPred.bandwidth;
 
 	if (sBandwidth == 99999.f && tBandwidth == 99999.f)
 		return ETransportModes; // return a invalid connection direction to prevent handle gathering between two speculars
@@ -1243,13 +1249,16 @@ ETransportMode connectionDirection(const PathVertex* vsPred, const PathVertex* v
 
 	return cameraDirConnection ? ERadiance : EImportance;
 }
+ETransportMode connectionDirection(const PathVertex* vsPred, const PathVertex* vtPred){
+	return connectionDirection(MisVertex(vsPred), MisVertex(vtPred));
+}
 
 const bool EnableCovAwareMis = true;
 const bool MaxClampedConnectionPdf = false;
-Float misEffectiveEta(int i, Float pi, Float pir, const PathVertex* vPred, const PathVertex* v, const PathVertex* vNext,
+Float misEffectiveEta(int i, Float pi, Float pir, const MisVertex &vPred, const MisVertex &v, const MisVertex &vNext,
 	Float gatherRadius, size_t numLightPath, ETransportMode mode, int j = 999){
 
-	if (!v->isConnectable()) return 0.f;
+	if (!v.connectable) return 0.f;
 	if (i < 1 || j < 1) return 0.f;
 #ifdef EXCLUDE_DIRECT_LIGHTING
 	if (i + j <= 2) return 0.f; // exclude (2,2) photon mapping
@@ -1274,6 +1283,13 @@ Float misEffectiveEta(int i, Float pi, Float pir, const PathVertex* vPred, const
 		eta = M_PI * gatherRadius * gatherRadius * (Float)numLightPath;
 	return eta;
 }
+Float misEffectiveEta(int i, Float pi, Float pir, const PathVertex* vPred, const PathVertex* v, const PathVertex* vNext,
+	Float gatherRadius, size_t numLightPath, ETransportMode mode, int j = 999){
+	if (!v->isConnectable() || i < 1 || j < 1)
+		return 0.f;
+	return misEffectiveEta(i, pi, pir, MisVertex(vPred), MisVertex(v), MisVertex(vNext),
+		gatherRadius, numLightPath, mode, j);
+}
 
 bool connectable(const PathVertex* v, const PathVertex* vNext = NULL){
 	if (v->isEmitterSupernode() || v->isSensorSupernode()){
@@ -1364,7 +1380,7 @@ Float misWeightVC_pm(int i, int j, MisState statei,
 
 Float misWeightPM(int i, int j, MisState statei,
 	Float pi, Float piPred, Float pir, Float pir1,
-	const PathVertex* vNext, const PathVertex* v, const PathVertex* vPred, const PathVertex* vPred2,
+	const MisVertex &vNext, const MisVertex &v, const MisVertex &vPred, const MisVertex &vPred2,
 	Float gatherRadius, size_t numLightPath, ETransportMode mode,
 	bool useVC, bool useVM){
 
@@ -1382,7 +1398,7 @@ Float misWeightPM(int i, int j, MisState statei,
 
 Float misWeightPM_pred(int i, int j, MisState state, MisState statePred,
 	Float pi, Float piPred, Float piPred2, Float pir, Float pir1, Float pir2,
-	const PathVertex* vNext, const PathVertex* v, const PathVertex* vPred, const PathVertex* vPred2, const PathVertex* vPred3,
+	const MisVertex &vNext, const MisVertex &v, const MisVertex &vPred, const MisVertex &vPred2, const MisVertex &vPred3,
 	Float gatherRadius, size_t numLightPath, ETransportMode mode,
 	bool useVC, bool useVM){
 
@@ -1408,8 +1424,12 @@ Float misWeightPM_pred(int i, int j, MisState state, MisState statePred,
 }
 
 /*new*/
+/* 'lightTracingRatio' is the number of light paths per camera path: on the
+   sensor side, the direct strategy is the light image, which gets one sample
+   per light path instead of one per camera path */
 void updateMisHelper(int i, const Path &path, MisState &state, const Scene* scene,
-	Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, ETransportMode mode){
+	Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, ETransportMode mode,
+	Float lightTracingRatio = 1.f){
 
 	if (i == 0){
 		state[EDIR] = 1.f;
@@ -1420,6 +1440,8 @@ void updateMisHelper(int i, const Path &path, MisState &state, const Scene* scen
 		EMeasure measure = v0->getAbstractEmitter()->getDirectMeasure();
 		Float p0dir = v1->evalPdfDirect(scene, v0, mode, measure == ESolidAngle ? EArea : measure);
 		Float p0 = path.vertex(0)->pdf[mode];
+		if (mode == ERadiance)
+			p0dir *= lightTracingRatio;
 		state[EDIR] = MisHeuristic(p0dir / p0);
 	}
 
@@ -1448,10 +1470,10 @@ void updateMisHelper(int i, const Path &path, MisState &state, const Scene* scen
 }
 void initializeMisHelper(const Path &path, MisState *states, const Scene* scene,
 	Float gatherRadius, size_t nLightPaths, bool useVC, bool useVM,
-	ETransportMode mode){
+	ETransportMode mode, Float lightTracingRatio = 1.f){
 	for (int i = 0; i < (int)path.vertexCount() - 1; ++i) {
 		if (i > 0) states[i] = states[i - 1];		
-		updateMisHelper(i, path, states[i], scene, gatherRadius, nLightPaths, useVC, useVM, mode);
+		updateMisHelper(i, path, states[i], scene, gatherRadius, nLightPaths, useVC, useVM, mode, lightTracingRatio);
 	}
 }
 
@@ -1478,7 +1500,7 @@ Float miWeightVC(const Scene *scene,
 Float miWeightVC(const Scene *scene, int s, int t, MisState emitterState, MisState sensorState,
 	const PathVertex *vsPred3, const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
 	const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,	
-	Float gatherRadius, size_t numLightPath, bool useVC, bool useVM){
+	Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, Float lightTracingRatio = 1.f){
 
 	Float wLight = 0.f, wCamera = 0.f;
 	if (s == 0){		
@@ -1529,6 +1551,8 @@ Float miWeightVC(const Scene *scene, int s, int t, MisState emitterState, MisSta
 
 		// MIS weight for camera sub path
 		if (t == 1){
+			/* The other strategies have one sample per camera path */
+			wLight *= MisHeuristic(1.f / lightTracingRatio);
 			wCamera = 0.f;
 		}
 		else{
@@ -1564,23 +1588,28 @@ Float miWeightVM(const Scene *scene, int s, int t,
 }
 
 
-Float miWeightVM(const Scene *scene, int s, int t, 
+/* The light subpath enters through the records and importance pdfs of
+   vs, vsPred, vsPred2 and vsPred3 (lightRecords, lightPdfs) -- the pointers
+   of the light vertices are only used for the pdfs evaluated on them */
+static Float miWeightVM(const Scene *scene, int s, int t,
 	MisState emitterState, MisState sensorState, MisState emitterStatePred, MisState sensorStatePred,
-	const PathVertex *vsPred3, const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
+	const MisVertex *lightRecords, const Float *lightPdfs,
+	const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
 	const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,
-	bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, bool useVCMPdf = false){
+	bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, bool useVCMPdf){
 
+	MisVertex rt(vt), rtPred(vtPred), rtPred2(vtPred2), rtPred3(vtPred3);
 	Float miWeight = 0.f;
 	Float wLight = 0.f, wCamera = 0.f;
 	if (cameraDirConnection){
 		Float pt = (useVCMPdf) ? vtPred->evalPdf(scene, vtPred2, vt, ERadiance, EArea) : vtPred->evalPdf(scene, vtPred2, vs, ERadiance, EArea);
-		Float ps = vsPred->pdf[EImportance];
+		Float ps = lightPdfs[1];
 
-		Float psPred = vsPred2->pdf[EImportance];
+		Float psPred = lightPdfs[2];
 		Float psr1 = vs->evalPdf(scene, vtPred, vsPred, ERadiance, EArea);
 		wLight += misWeightPM(s - 1, t - 1, emitterState,
 			ps, psPred, pt, psr1,
-			vtPred, vs, vsPred, vsPred2,
+			rtPred, lightRecords[0], lightRecords[1], lightRecords[2],
 			gatherRadius, numLightPath, EImportance, useVC, useVM);
 
 		Float ptr1 = vs->evalPdf(scene, vsPred, vtPred, EImportance, EArea);
@@ -1589,7 +1618,7 @@ Float miWeightVM(const Scene *scene, int s, int t,
 		Float ptPred2 = (vtPred3 != NULL) ? vtPred3->pdf[ERadiance] : 0.f;
 		wCamera += misWeightPM_pred(t - 1, s - 1, sensorState, sensorStatePred,
 			pt, ptPred, ptPred2, ps, ptr1, ptr2,
-			vsPred, vs, vtPred, vtPred2, vtPred3,
+			lightRecords[1], lightRecords[0], rtPred, rtPred2, rtPred3,
 			gatherRadius, numLightPath, ERadiance, useVC, useVM);
 
 		miWeight = 1.f / (1.f + wLight + wCamera);
@@ -1603,11 +1632,11 @@ Float miWeightVM(const Scene *scene, int s, int t,
 
 		Float psr1 = vt->evalPdf(scene, vtPred, vsPred, ERadiance, EArea);
 		Float psr2 = (useVCMPdf) ? vsPred->evalPdf(scene, vs, vsPred2, ERadiance, EArea) : vsPred->evalPdf(scene, vt, vsPred2, ERadiance, EArea);
-		Float psPred = vsPred2->pdf[EImportance];
-		Float psPred2 = (vsPred3 != NULL) ? vsPred3->pdf[EImportance] : 0.f;
+		Float psPred = lightPdfs[2];
+		Float psPred2 = lightPdfs[3];
 		wLight += misWeightPM_pred(s - 1, t - 1, emitterState, emitterStatePred,
 			ps, psPred, psPred2, pt, psr1, psr2,
-			vtPred, vt, vsPred, vsPred2, vsPred3,
+			rtPred, rt, lightRecords[1], lightRecords[2], lightRecords[3],
 			gatherRadius, numLightPath, EImportance, useVC, useVM);
 
 		Float ptr1 = vt->evalPdf(scene, vsPred, vtPred, EImportance, EArea);
@@ -1615,7 +1644,7 @@ Float miWeightVM(const Scene *scene, int s, int t,
 		Float ptPred = vtPred2->pdf[ERadiance];
 		wCamera += misWeightPM(t - 1, s - 1, sensorState,
 			pt, ptPred, ps, ptr1,
-			vsPred, vt, vtPred, vtPred2,
+			lightRecords[1], rt, rtPred, rtPred2,
 			gatherRadius, numLightPath, ERadiance, useVC, useVM);
 
 		miWeight = 1.f / (1.f + wLight + wCamera);
@@ -1627,12 +1656,243 @@ Float miWeightVM(const Scene *scene, int s, int t,
 	return miWeight;
 }
 
+Float miWeightVM(const Scene *scene, int s, int t, 
+	MisState emitterState, MisState sensorState, MisState emitterStatePred, MisState sensorStatePred,
+	const PathVertex *vsPred3, const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
+	const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,
+	bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, bool useVCMPdf = false){
+	MisVertex lightRecords[4] = { MisVertex(vs), MisVertex(vsPred), MisVertex(vsPred2), MisVertex(vsPred3) };
+	Float lightPdfs[4] = { vs->pdf[EImportance], vsPred->pdf[EImportance],
+		(vsPred2 != NULL) ? vsPred2->pdf[EImportance] : 0.f,
+		(vsPred3 != NULL) ? vsPred3->pdf[EImportance] : 0.f };
+	return miWeightVM(scene, s, t, emitterState, sensorState, emitterStatePred, sensorStatePred,
+		lightRecords, lightPdfs, vsPred2, vsPred, vs, vt, vtPred, vtPred2, vtPred3,
+		cameraDirConnection, gatherRadius, numLightPath, useVC, useVM, useVCMPdf);
+}
+
+/* Variant for light vertices that stay in a LightVertexStore: their records
+   and pdfs are read from the store, so the vertex whose BSDF is evaluated
+   (vs for camera direction connections, vsPred otherwise) is the only one
+   that needs a full LightVertexStore::expand() -- LightVertexStore::expandGeometry()
+   suffices for its neighbors, and vsPred3 is not needed at all */
+Float miWeightVM(const Scene *scene, int s, int t,
+	MisState emitterState, MisState sensorState, MisState emitterStatePred, MisState sensorStatePred,
+	const LightVertexStore &lightVertices, size_t vertexIndex,
+	const PathVertex *vsPred2, const PathVertex *vsPred, const PathVertex *vs,
+	const PathVertex *vt, const PathVertex *vtPred, const PathVertex *vtPred2, const PathVertex *vtPred3,
+	bool cameraDirConnection, Float gatherRadius, size_t numLightPath, bool useVC, bool useVM, bool useVCMPdf = false){
+	MisVertex lightRecords[4];
+	Float lightPdfs[4] = { 0.f, 0.f, 0.f, 0.f };
+	size_t count = (s > 2) ? 4 : ((s == 2) ? 3 : 2);
+	for (size_t k = 0; k < count; ++k){
+		lightRecords[k] = lightVertices.getMisVertex(vertexIndex - k);
+		lightPdfs[k] = lightVertices.getPdf(vertexIndex - k, EImportance);
+	}
+	return miWeightVM(scene, s, t, emitterState, sensorState, emitterStatePred, sensorStatePred,
+		lightRecords, lightPdfs, vsPred2, vsPred, vs, vt, vtPred, vtPred2, vtPred3,
+		cameraDirConnection, gatherRadius, numLightPath, useVC, useVM, useVCMPdf);
+}
+
+void LightVertexStore::clear() {
+	m_position.clear();
+	m_importanceWeight.clear();
+	m_misState.clear();
+	m_shFrameN.clear();
+	m_shFrameS.clear();
+	m_geoFrameN.clear();
+	m_shape.clear();
+	m_pdfImp.clear();
+	m_pdfRad.clear();
+	m_bandwidth.clear();
+	m_flags.clear();
+}
+
+void LightVertexStore::reserve(size_t size) {
+	m_position.reserve(size);
+	m_importanceWeight.reserve(size);
+	m_misState.reserve(size);
+	m_shFrameN.reserve(size);
+	m_shFrameS.reserve(size);
+	m_geoFrameN.reserve(size);
+	m_shape.reserve(size);
+	m_pdfImp.reserve(size);
+	m_pdfRad.reserve(size);
+	m_bandwidth.reserve(size);
+	m_flags.reserve(size);
+}
+
+void LightVertexStore::append(const PathVertex *vs, int depth, const MisState &state,
+		const Spectrum &importanceWeight) {
+	Point position(0.0f);
+	Vector shFrameN(0.0f), shFrameS(0.0f), geoFrameN(0.0f);
+	const Shape *shape = NULL;
+	if (vs->isEmitterSample() || vs->isSensorSample()) {
+		const PositionSamplingRecord &pRec = vs->getPositionSamplingRecord();
+		shape = (const Shape *) pRec.object;
+		position = pRec.p;
+		geoFrameN = pRec.n;
+	} else if (vs->isSurfaceInteraction()) {
+		const Intersection &its = vs->getIntersection();
+		shape = its.shape;
+		position = its.p;
+		shFrameN = its.shFrame.n;
+		shFrameS = its.shFrame.s;
+		geoFrameN = its.geoFrame.n;
+	}
+
+	m_position.push_back(position);
+	m_importanceWeight.push_back(importanceWeight);
+	m_misState.push_back(state);
+	m_shFrameN.push_back(encodeDirection(shFrameN));
+	m_shFrameS.push_back(encodeDirection(shFrameS));
+	m_geoFrameN.push_back(encodeDirection(geoFrameN));
+	m_shape.push_back(shape);
+	m_pdfImp.push_back(vs->pdf[EImportance]);
+	m_pdfRad.push_back(vs->pdf[ERadiance]);
+	m_bandwidth.push_back(MisVertex(vs).bandwidth);
+	m_flags.push_back(((uint32_t) depth & 0xFFFF)
+		| ((uint32_t) vs->type << 16)
+		| (((uint32_t) vs->measure & 0xF) << 24)
+		| (vs->degenerate ? (1u << 28) : 0u));
+}
+
+void LightVertexStore::expand(size_t i, PathVertex *vs) const {
+	uint32_t flags = m_flags[i];
+	memset(vs, 0, sizeof(PathVertex));
+	vs->type = (uint8_t) ((flags >> 16) & 0xFF);
+	vs->measure = (uint8_t) ((flags >> 24) & 0xF);
+	vs->degenerate = (flags & (1u << 28)) != 0;
+	vs->pdf[EImportance] = m_pdfImp[i];
+	vs->pdf[ERadiance] = m_pdfRad[i];
+	if (vs->isEmitterSample() || vs->isSensorSample()) {
+		PositionSamplingRecord &pRec = vs->getPositionSamplingRecord();
+		pRec.object = (const ConfigurableObject *) m_shape[i];
+		pRec.p = m_position[i];
+		pRec.n = decodeDirection(m_geoFrameN[i]);
+	} else if (vs->isSurfaceInteraction()) {
+		Intersection &its = vs->getIntersection();
+		its.p = m_position[i];
+		/* Re-orthogonalize the tangent, the two codes are quantized independently */
+		Vector n = decodeDirection(m_shFrameN[i]);
+		Vector s = decodeDirection(m_shFrameS[i]);
+		s -= n * dot(n, s);
+		Float sLength = s.length();
+		its.shFrame.n = n;
+		its.shFrame.s = sLength > 0 ? s / sLength : s;
+		its.shFrame.t = cross(its.shFrame.n, its.shFrame.s);
+		its.geoFrame = Frame(decodeDirection(m_geoFrameN[i]));
+		its.setShapePointer(m_shape[i]);
+	}
+}
+
+void LightVertexStore::expandGeometry(size_t i, PathVertex *vs) const {
+	uint32_t flags = m_flags[i];
+	vs->type = (uint8_t) ((flags >> 16) & 0xFF);
+	vs->measure = (uint8_t) ((flags >> 24) & 0xF);
+	vs->degenerate = (flags & (1u << 28)) != 0;
+	vs->pdf[EImportance] = m_pdfImp[i];
+	vs->pdf[ERadiance] = m_pdfRad[i];
+	if (vs->isEmitterSample() || vs->isSensorSample()) {
+		PositionSamplingRecord &pRec = vs->getPositionSamplingRecord();
+		pRec.object = (const ConfigurableObject *) m_shape[i];
+		pRec.p = m_position[i];
+		pRec.n = decodeDirection(m_geoFrameN[i]);
+	} else if (vs->isSurfaceInteraction()) {
+		Intersection &its = vs->getIntersection();
+		its.p = m_position[i];
+		its.geoFrame.n = decodeDirection(m_geoFrameN[i]);
+		its.setShapePointer(m_shape[i]);
+	}
+}
+
+uint32_t LightVertexStore::encodeDirection(const Vector &d) {
+	Float l1 = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+	if (l1 == 0)
+		return 0x80008000u; /* -32768 is never produced below and marks the zero vector */
+
+	/* Project onto the octahedron and fold the lower hemisphere */
+	Float x = d.x / l1, y = d.y / l1;
+	if (d.z < 0) {
+		Float tmp = (1 - std::abs(y)) * math::signum(x);
+		y = (1 - std::abs(x)) * math::signum(y);
+		x = tmp;
+	}
+
+	int qx = (int) std::floor(clamp(x, (Float) -1, (Float) 1) * 32767 + (Float) 0.5f);
+	int qy = (int) std::floor(clamp(y, (Float) -1, (Float) 1) * 32767 + (Float) 0.5f);
+	return (uint32_t) (uint16_t) (int16_t) qx
+		| ((uint32_t) (uint16_t) (int16_t) qy << 16);
+}
+
+Vector LightVertexStore::decodeDirection(uint32_t code) {
+	if (code == 0x80008000u)
+		return Vector(0.0f);
+
+	Float x = (int16_t) (code & 0xFFFF) * (1 / (Float) 32767);
+	Float y = (int16_t) (code >> 16) * (1 / (Float) 32767);
+	Float z = 1 - std::abs(x) - std::abs(y);
+	if (z < 0) {
+		Float tmp = (1 - std::abs(y)) * math::signum(x);
+		y = (1 - std::abs(x)) * math::signum(y);
+		x = tmp;
+	}
+	return normalize(Vector(x, y, z));
+}
+
+SharedLightPathStore::SharedLightPathStore(bool parallelBuild) {
+	m_tree.setParallelBuild(parallelBuild);
+	m_tree.setRetainStorage(true);
+}
+
+SharedLightPathStore::SharedLightPathStore(Stream *stream, InstanceManager *manager)
+	: SharedLightPaths(stream, manager) {
+	m_tree.setParallelBuild(stream->readBool());
+	m_tree.setRetainStorage(true);
+}
+
+void SharedLightPathStore::serialize(Stream *stream, InstanceManager *manager) const {
+	SharedLightPaths::serialize(stream, manager);
+	stream->writeBool(m_tree.getParallelBuild());
+}
+
+void SharedLightPathStore::publish(const Round &round, const LightVertexStore *vertices,
+		const LightPathTree *nodes, Float gatherRadius) {
+	Slice &slice = m_slices[round.slice];
+	slice.vertices = vertices;
+	slice.nodes = nodes;
+	slice.gatherRadius = gatherRadius;
+	SharedLightPaths::publish(round);
+}
+
+void SharedLightPathStore::beginRound(int sliceCount) {
+	m_slices.resize(sliceCount);
+}
+
+void SharedLightPathStore::build(int sliceCount) {
+	size_t nodeCount = 0;
+	for (int i = 0; i < sliceCount; ++i)
+		nodeCount += m_slices[i].nodes->size();
+
+	m_tree.clear();
+	m_tree.reserve(nodeCount);
+	for (int i = 0; i < sliceCount; ++i) {
+		const LightPathTree &nodes = *m_slices[i].nodes;
+		for (size_t j = 0; j < nodes.size(); ++j) {
+			LightPathNode node = nodes[j];
+			node.data.slice = i;
+			m_tree.push_back(node);
+		}
+	}
+
+	setGatherRadius(m_tree, m_slices[0].gatherRadius);
+	m_tree.build(true);
+}
+
 void PathSampler::gatherLightPaths(const bool useVC, const bool useVM,
 	const float gatherRadius, const int nsample, ImageBlock* lightImage){
 	const Sensor *sensor = m_scene->getSensor();
 	m_lightPathTree.clear();
 	m_lightVertices.clear();
-	m_lightVerticesExt.clear();
 	m_lightPathEnds.clear();
 
 	PathVertex vtPred, vt;
@@ -1671,10 +1931,7 @@ void PathSampler::gatherLightPaths(const bool useVC, const bool useVM,
 			updateMisHelper(s - 1, m_emitterSubpath, emitterState, m_scene, m_lightPathNum, misVcWeightFactor, misVmWeightFactor, EImportance);
 
 			// store light paths												
-			LightVertex lvertex = LightVertex(vs, vsPred, emitterState, importanceWeight);
-			m_lightVertices.push_back(lvertex);
-			LightVertexExt lvertexExt = LightVertexExt(vs, vsPred, s);
-			m_lightVerticesExt.push_back(lvertexExt);
+			m_lightVertices.append(vs, s, emitterState, importanceWeight);
 			if (s > 1 && vs->measure != EDiscrete && dot(es->d, -vs->getGeometricNormal()) > Epsilon){
 				LightPathNode lnode(vs->getPosition(), m_lightVertices.size() - 1, s);
 				m_lightPathTree.push_back(lnode);
@@ -1709,6 +1966,7 @@ void PathSampler::gatherLightPaths(const bool useVC, const bool useVM,
 	}
 
 	// build kdtree
+	setGatherRadius(m_lightPathTree, gatherRadius);
 	m_lightPathTree.build(true);
 
 	/* Release any used edges and vertices back to the memory pool */
@@ -1717,7 +1975,7 @@ void PathSampler::gatherLightPaths(const bool useVC, const bool useVM,
 struct VertexMergingQuery {
 	VertexMergingQuery(const Scene *_scene,
 		const PathVertex *_vt, const PathVertex *_vtPred, const Vector _wi, const Vector _wiPred,
-		const Spectrum &_radianceWeight, const std::vector<LightVertex> &lightVertices,
+		const Spectrum &_radianceWeight, const LightVertexStore &lightVertices,
 		int _t, int _maxDepth, Float _misVcWeightFactor, Float _vmNormalization,
 		const MisState &_sensorState)
 		: scene(_scene), radianceWeight(_radianceWeight), t(_t), maxDepth(_maxDepth),
@@ -1731,11 +1989,10 @@ struct VertexMergingQuery {
 		if (maxDepth != -1 && s + t > maxDepth + 2) return;
 
 		size_t vertexIndex = path.data.vertexIndex;
-		LightVertex v = m_lightVertices[vertexIndex];
-		Vector wo = v.wo;
-		MisState emitterState = v.emitterState;
+		Vector wo = m_lightVertices.getWo(vertexIndex);
+		MisState emitterState = m_lightVertices.getMisState(vertexIndex);
 		Spectrum bsdfFactor = vt->eval(scene, wi, wo, ERadiance);
-		Spectrum val = v.importanceWeight * radianceWeight * bsdfFactor;
+		Spectrum val = m_lightVertices.getImportanceWeight(vertexIndex) * radianceWeight * bsdfFactor;
 
 		if (val.isZero()) return;
 
@@ -1756,7 +2013,7 @@ struct VertexMergingQuery {
 	const Scene *scene;
 	const PathVertex *vt, *vtPred;
 	const Spectrum &radianceWeight;
-	const std::vector<LightVertex> &m_lightVertices;
+	const LightVertexStore &m_lightVertices;
 	Spectrum result;
 };
 void PathSampler::sampleSplatsVCM(const bool useVC, const bool useVM, 
@@ -1860,14 +2117,13 @@ void PathSampler::sampleSplatsVCM(const bool useVC, const bool useVM,
 				memset(vsPred, 0, sizeof(PathVertex));
 				memset(vs, 0, sizeof(PathVertex));
 				if (i < lightPathEnd){
-					LightVertex lvertex = m_lightVertices[i];
-					importanceWeight = lvertex.importanceWeight;
-					emitterState = lvertex.emitterState;
-					s = m_lightVerticesExt[i].depth;
+					importanceWeight = m_lightVertices.getImportanceWeight(i);
+					emitterState = m_lightVertices.getMisState(i);
+					s = m_lightVertices.getDepth(i);
 					if (s == 1) continue;
 
-					m_lightVerticesExt[i].expand(vs);
-					m_lightVerticesExt[i - 1].expand(vsPred);
+					m_lightVertices.expand(i, vs);
+					m_lightVertices.expandGeometry(i - 1, vsPred);
 				}
 
 				int minT = 2, maxT = (int)m_sensorSubpath.vertexCount() - 1;
@@ -1987,27 +2243,44 @@ void PathSampler::sampleSplatsVCM(const bool useVC, const bool useVM,
 }
 
 void PathSampler::gatherLightPathsUPM(const bool useVC, const bool useVM,
-	const float gatherRadius, const int nsample, UPMWorkResult *wr, ImageBlock *batres, Float rejectionProb){
+	const float gatherRadius, const int nsample, UPMWorkResult *wr, ImageBlock *batres, Float rejectionProb,
+	size_t cameraPathCount){
 	const Sensor *sensor = m_scene->getSensor();
 	m_lightPathTree.clear();
 	m_lightVertices.clear();
-	m_lightVerticesExt.clear();
 	m_lightPathEnds.clear();
 
 	PathVertex vtPred, vt;
 	PathEdge vtEdge, connectionEdge;
 
 	Float time = sensor->getShutterOpen();
-	m_lightPathNum = nsample;
+	/* A shared set splits the budget \c nsample into one slice per worker
+	   of the round and merges against all of them */
+	int slice = nsample, firstPath = 0;
+	if (m_sharedLightPaths) {
+		slice = (nsample + m_lightPathRound.sliceCount - 1) / m_lightPathRound.sliceCount;
+		firstPath = m_lightPathRound.slice * slice;
+	}
+	m_lightPathNum = m_sharedLightPaths ? (size_t) slice * m_lightPathRound.sliceCount : nsample;
 	Float etaVCM = (M_PI * gatherRadius * gatherRadius) * m_lightPathNum * (1.f - rejectionProb);
 	Float invLightPathNum = 1.f / m_lightPathNum;
 	Float misVmWeightFactor = useVM ? MisHeuristic(etaVCM) : 0.f;
 	Float misVcWeightFactor = useVC ? MisHeuristic(1.f / etaVCM) : 0.f;
-	for (size_t k = 0; k < m_lightPathNum; k++){
+	/* The light image is normalized for one light path per camera path */
+	m_lightTracingRatio = (cameraPathCount == 0) ? 1.f : (Float) slice / cameraPathCount;
+	Float lightImageScale = 1.f / m_lightTracingRatio;
+	size_t streamIndex = m_lightPathSampler->getSampleIndex();
+	for (int k = 0; k < slice; k++){
 		// emitter states
 		MisState emitterState, sensorState;
 		Spectrum importanceWeight = Spectrum(1.0f);
 
+		if (m_lightPathStreams) {
+			/* Key the path by its index, see setLightPathStreams() */
+			m_lightPathSampler->generate(Point2i(firstPath + k, -1));
+			m_lightPathSampler->setSampleIndex(streamIndex);
+		}
+
 		/* Initialize the path endpoints */
 		m_emitterSubpath.initialize(m_scene, time, EImportance, m_pool);
 
@@ -2016,10 +2289,7 @@ void PathSampler::gatherLightPathsUPM(const bool useVC, const bool useVM,
 			m_rrDepth, EImportance, m_pool);
 
 		PathVertex* vs = m_emitterSubpath.vertex(0);
-		LightVertex lvertex = LightVertex(vs, NULL, emitterState, Spectrum(1.f));
-		m_lightVertices.push_back(lvertex);
-		LightVertexExt lvertexExt = LightVertexExt(vs, NULL, 0);
-		m_lightVerticesExt.push_back(lvertexExt);		
+		m_lightVertices.append(vs, 0, emitterState, Spectrum(1.f));
 		for (int s = 1; s < (int)m_emitterSubpath.vertexCount(); ++s) {
 			PathVertex
 				*vsPred3 = m_emitterSubpath.vertexOrNull(s - 3),
@@ -2039,10 +2309,7 @@ void PathSampler::gatherLightPathsUPM(const bool useVC, const bool useVM,
 			// store light paths												
 			//if (s > 1 && vs->measure != EDiscrete && dot(es->d, -vs->getGeometricNormal()) > Epsilon /* don't save backfaced photons */){
 			{
-				LightVertex lvertex = LightVertex(vs, vsPred, emitterState, importanceWeight);
-				m_lightVertices.push_back(lvertex);
-				LightVertexExt lvertexExt = LightVertexExt(vs, vsPred, s);
-				m_lightVerticesExt.push_back(lvertexExt);
+				m_lightVertices.append(vs, s, emitterState, importanceWeight);
 				if (s > 1 && vs->measure != EDiscrete && dot(es->d, -vs->getGeometricNormal()) > Epsilon){
 					LightPathNode lnode(vs->getPosition(), m_lightVertices.size() - 1, s);
 					m_lightPathTree.push_back(lnode);
@@ -2066,7 +2333,8 @@ void PathSampler::gatherLightPathsUPM(const bool useVC, const bool useVM,
 				Float miWeight = miWeightVC(m_scene, s, 1, emitterState, sensorState,
 					vsPred3, vsPred2, vsPred, vs,
 					&vt, &vtPred, NULL, NULL,
-					gatherRadius, m_lightPathNum, true, useVM);
+					gatherRadius, m_lightPathNum, true, useVM, m_lightTracingRatio);
+				value *= lightImageScale;
 
 #if UPM_DEBUG == 1
 				wr->putDebugSample(s, 1, samplePos, value * miWeight);
@@ -2085,25 +2353,140 @@ void PathSampler::gatherLightPathsUPM(const bool useVC, const bool useVM,
 		m_lightPathEnds.push_back(m_lightVertices.size());
 	}
 
+	/* Release any used edges and vertices back to the memory pool */
+	m_emitterSubpath.release(m_pool);
+
+	if (m_sharedLightPaths) {
+		/* The merge candidates stay unbuilt, they are copied into the tree of the round */
+		m_sharedLightPaths->publish(m_lightPathRound, &m_lightVertices, &m_lightPathTree, gatherRadius);
+		return;
+	}
+
 	// build kdtree
+	setGatherRadius(m_lightPathTree, gatherRadius);
 	m_lightPathTree.build(true);
+}
 
-	/* Release any used edges and vertices back to the memory pool */
-	m_emitterSubpath.release(m_pool);
+
+
+/// Statistics group of a merge for the adaptive trial policy
+static inline int trialPolicySlot(int s, int t, const PathVertex *shooter){
+	bool glossy = false;
+	if (shooter->isSurfaceInteraction()){
+		const BSDF *bsdf = shooter->getIntersection().getBSDF();
+		glossy = bsdf != NULL && (bsdf->getType() & BSDF::EGlossy);
+	}
+	return GatherTrialPolicy::getSlot(s, t, glossy);
 }
 
+/// Record the number of geometric trials that a single 1/p estimate waited for
+static inline void recordInvpShoots(UPMWorkResult *wr, size_t totalShoot, size_t clampThreshold){
+	avgInvpShoots.incrementBase();
+	avgInvpShoots += totalShoot;
+	maxInvpShoots.recordMaximum(totalShoot);
+
+	numClampShoots.incrementBase();
+	if (totalShoot >= clampThreshold)
+		++numClampShoots;
+
+#if UPM_DEBUG == 1
+	wr->putTentativeSample(totalShoot);
+#endif
+}
 
+/// Record the number of traced trials and the number of merges that shared them
+static inline void recordShootCost(size_t totalShoot, size_t mergeCount){
+	numInvpShoots += totalShoot;
+	avgMergeShoots.incrementBase(mergeCount);
+	avgMergeShoots += totalShoot;
+}
+
+/**
+ * MIS-weight a vertex merge and accumulate it into the splat list.
+ * Merges with \c t > 2 land on the pixel of the current camera path
+ * (the first entry of \c list), unless they were \a queued: these can
+ * belong to an earlier camera path, and the list may be empty by the
+ * time they are resolved, so they are always appended at \c samplePos.
+ */
+static inline void splatMerge(UPMWorkResult *wr, SplatList &list, Spectrum contrib, Float miWeight,
+	const Point2 &samplePos, int s, int t, bool cameraDirConnection, bool queued = false){
+#if UPM_DEBUG == 1
+	if (cameraDirConnection){
+		wr->putDebugSample(s, t - 1, samplePos, contrib * miWeight);
+		wr->putDebugSampleM(s, t - 1, samplePos, contrib);
+	}
+	else{
+		wr->putDebugSample(s - 1, t, samplePos, contrib * miWeight);
+		wr->putDebugSampleM(s - 1, t, samplePos, contrib);
+	}
+	wr->putDebugSampleVM(samplePos, contrib * miWeight);
+#endif
+
+	contrib *= miWeight;
+
+#ifdef UPM_DEBUG_HARD
+	if (contrib[0] < 0.f || _isnan(contrib[0]) || contrib[0] > 100000000.f){
+		SLog(EWarn, "Invalid sample value[UPM]: %f %f %f, miWeight = %f",
+			contrib[0], contrib[1], contrib[2], miWeight);
+		return;
+	}
+#endif
+
+	if (t == 2 || queued) {
+		list.append(samplePos, contrib);
+	}
+	else {
+		list.accum(0, contrib);
+	}
+}
 
+void PathSampler::drainMergeQueue(UPMWorkResult *wr, SplatList &list, Float gatherRadius, size_t clampThreshold) {
+	m_mergeQueue.drain(m_scene, gatherRadius, clampThreshold);
+	for (size_t k = 0; k < m_mergeQueue.size(); k++){
+		const GatherTrialBatch::Candidate &cand = m_mergeQueue.getCandidate(k);
+		const PendingMerge &merge = m_mergeQueue.getMerge(k);
+		recordInvpShoots(wr, cand.totalShoot, cand.budget);
+		recordShootCost(cand.totalShoot, 1);
+		if (merge.trialSlot >= 0)
+			m_trialPolicy.record(merge.trialSlot, cand.totalShoot, cand.acceptedShoot > 0, cand.budget);
+		Float invp = (cand.acceptedShoot > 0) ? (Float)(cand.totalShoot) / (Float)(cand.acceptedShoot) * merge.invBrdfIntegral : 0;
+		Spectrum contrib = merge.contrib * invp;
+		if (contrib.isZero()) continue;
+		splatMerge(wr, list, contrib, merge.miWeight, merge.samplePos, merge.s, merge.t, merge.cameraDirConnection, true);
+	}
+	m_mergeQueue.clear();
+}
+
+void PathSampler::flushUPM(UPMWorkResult *wr, const float gatherRadius, SplatList &list, size_t clampThreshold) {
+	list.clear();
+	if (m_mergeQueue.size() > 0)
+		drainMergeQueue(wr, list, gatherRadius, clampThreshold);
+}
+
 void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 	const float gatherRadius, const Point2i &offset, 
 	const size_t cameraPathIndex, SplatList &list, bool useVC, bool useVM, 
-	Float rejectionProb, size_t clampThreshold, bool useVCMPdf) {
+	Float rejectionProb, size_t clampThreshold, bool useVCMPdf, bool batchedShoot,
+	bool shareShoot, size_t shareShootThreshold) {
 	list.clear();
 
 	const Sensor *sensor = m_scene->getSensor();
 	size_t nLightPaths = m_lightPathNum;
 	Float invLightPaths = 1.f / (float)nLightPaths;
 
+	/* Merges gather from the tree of the round when the light paths are shared */
+	const LightPathTree &lightPathTree = m_sharedLightPaths ? m_sharedLightPaths->getTree() : m_lightPathTree;
+
+	/* Trace the shadow rays of the connections and of the merges of a gather
+	   point in batches when a single ray decides visibility (the debug images
+	   need the unweighted value of every connection, so they trace them one
+	   at a time) */
+#if UPM_DEBUG == 1
+	const bool deferVisibility = false;
+#else
+	const bool deferVisibility = m_opaqueVisibility;
+#endif
+
 	bool repeated = false;
 
 	PathVertex tempSample, tempEndpoint;
@@ -2147,7 +2530,7 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 	// VCM tech report Eq. 31 - 33		
 	MisState *sensorStates = (MisState *)alloca(m_sensorSubpath.vertexCount() * sizeof(MisState));
 	initializeMisHelper(m_sensorSubpath, sensorStates, m_scene, 
-		gatherRadius, nLightPaths, useVC, useVM, ERadiance);
+		gatherRadius, nLightPaths, useVC, useVM, ERadiance, m_lightTracingRatio);
 
 	// massive vertex merging
 	if (useVM){
@@ -2161,9 +2544,13 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 		PathEdge *succEdge = m_pool.allocEdge();
 		Point2 samplePos(0.0f);
 		std::vector<uint32_t> searchResults;
-		//std::vector<Point> searchPos;
-		std::vector<uint32_t> acceptCnt;
-		std::vector<size_t> shootCnt;
+		std::vector<PendingMerge> pendingMerges, sharedMerges;
+		GatherDomain mergeDomain, sharedDomain;
+		std::vector<Point> batchTargets;
+		std::vector<GatherDomain *> batchDomains;
+		std::vector<Float> batchProbs;
+		std::vector<int> mergeSlots;
+		std::vector<Float> mergeProbs;
 
 		int minT = 2; int minS = 2;
 
@@ -2183,7 +2570,7 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 				BDAssert(vt->type == PathVertex::ESurfaceInteraction);
 
 				searchResults.clear();
-				m_lightPathTree.search(vt->getPosition(), gatherRadius, searchResults);
+				lightPathTree.search(vt->getPosition(), gatherRadius, searchResults);
 				avgGatherPoints.incrementBase();
 				avgGatherPoints += searchResults.size();
 				maxGatherPoints.recordMaximum(searchResults.size());
@@ -2193,67 +2580,58 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 					continue;
 				}
 
-				//searchPos.resize(searchResults.size());
-				acceptCnt.resize(searchResults.size());
-				shootCnt.resize(searchResults.size());
-				for (int i = 0; i < searchResults.size(); i++){
-					acceptCnt[i] = 0;
-					shootCnt[i] = 0;
-// 						LightPathNode node = m_lightPathTree[searchResults[i]];
-// 						size_t vertexIndex = node.data.vertexIndex;
-// 						LightVertexExt lvertexExt = m_lightVerticesExt[vertexIndex];
-// 						searchPos[i] = lvertexExt.position;
-				}
-
-				// evaluate sampling domain pdf normalization
-				int shareShootThreshold = 32;
-				Float invBrdfIntegral = 1.f;
-				bool shareShoot = false;
-// 					if (searchPos.size() > shareShootThreshold){
-// 						Vector4 smplBBox = Vector4(0.f);
-// 						Vector4 smplBBoxDiff = Vector4(0.f);
-// 						Float brdfIntegral = vtPred->gatherAreaPdf(vt->getPosition(), gatherRadius * 2.f, vtPred2, smplBBox, &smplBBoxDiff);
-// 						if (brdfIntegral > 0.f){
-// 							shareShoot = true;
-// 							invBrdfIntegral = 1.f / brdfIntegral;
-// 							size_t totalShoot = 0, targetShoot = 1;
-// 							uint32_t finishCnt = 0;
-// 							Float distSquared = gatherRadius * gatherRadius;
-// 							while (finishCnt < searchResults.size() && totalShoot < clampThreshold){
-// 								totalShoot++;
-// 
-// 								// restricted sampling evaluation shoots
-// 								if (!vtPred->sampleShoot(m_scene, m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vt->getPosition(), gatherRadius * 2.f, smplBBox, smplBBoxDiff))
-// 									continue;
-// 
-// 								Point pshoot = succVertex->getPosition();
-// 								for (int i = 0; i < searchPos.size(); i++){
-// 									if (shootCnt[i] > 0) continue;
-// 									Float pointDistSquared = (succVertex->getPosition() - searchPos[i]).lengthSquared();
-// 									if (pointDistSquared < distSquared){
-// 										acceptCnt[i]++;
-// 										if (acceptCnt[i] == targetShoot){
-// 											shootCnt[i] = totalShoot;
-// 											finishCnt++;
-// 										}
-// 									}
-// 								}
-// 							}
-// 							avgInvpShoots.incrementBase();
-//							avgInvpShoots += totalShoot;
-// 							maxInvpShoots.recordMaximum(totalShoot);
-// 							numInvpShoots += totalShoot;
-// 							numClampShoots.incrementBase(searchResults.size());
-// 							if (finishCnt < searchResults.size()){
-// 								numClampShoots += searchResults.size() - finishCnt;
-// 							}
-// 						}
-// 					}					
-
 				MisState sensorState = sensorStates[t - 1];
 				MisState sensorStatePred = sensorStates[t - 2];
-				for (int k = 0; k < searchResults.size(); k++){
-					LightPathNode node = m_lightPathTree[searchResults[k]];
+				MisVertex vtPredRecord(vtPred);
+				m_gatherTrials.clear();
+				m_sharedTrials.clear();
+				pendingMerges.clear();
+				sharedMerges.clear();
+				m_shadowQueue.clear();
+				m_deferredMerges.clear();
+				int queuedCopy = -1;
+
+				// the camera direction merges all shoot from vtPred, so their restricted domains
+				// are computed in one batch up front (shared candidates get theirs further below)
+				mergeSlots.assign(searchResults.size(), -1);
+				if (!useVCMPdf && !shareShoot){
+					batchTargets.clear();
+					for (size_t k = 0; k < searchResults.size(); k++){
+						const LightPathNode &node = lightPathTree[searchResults[k]];
+						int s = node.data.depth;
+						if ((m_maxDepth != -1 && s + t > m_maxDepth + 2) || s < minS) continue;
+						const LightVertexStore &lightVertices = m_sharedLightPaths ?
+							m_sharedLightPaths->getVertices(node.data.slice) : m_lightVertices;
+						if (connectionDirection(lightVertices.getMisVertex(node.data.vertexIndex - 1), vtPredRecord) != ERadiance)
+							continue;
+						mergeSlots[k] = (int) batchTargets.size();
+						batchTargets.push_back(lightVertices.getPosition(node.data.vertexIndex));
+					}
+					size_t batchSize = batchTargets.size();
+					if (batchSize > 0){
+						if (m_mergeDomains.size() < batchSize)
+							m_mergeDomains.resize(batchSize);
+						batchDomains.resize(batchSize);
+						mergeProbs.resize(batchSize);
+						for (size_t k = 0; k < batchSize; k++)
+							batchDomains[k] = &m_mergeDomains[k];
+						vtPred->gatherAreaPdfBatch(&batchTargets[0], batchSize, gatherRadius, vtPred2,
+							&batchDomains[0], &mergeProbs[0]);
+					}
+				}
+				for (size_t j = 0; j < searchResults.size() + m_deferredMerges.size(); j++){
+					// deferred merges resume here once the shadow rays of all of them are traced
+					const DeferredMerge *deferred = NULL;
+					if (j >= searchResults.size()){
+						size_t queryIndex = j - searchResults.size();
+						if (queryIndex == 0)
+							m_scene->resolveShadowRays(m_shadowQueue);
+						if (!m_shadowQueue.isVisible(queryIndex))
+							continue;
+						deferred = &m_deferredMerges[m_shadowQueue.getPayload(queryIndex)];
+					}
+					size_t k = deferred ? deferred->k : j;
+					const LightPathNode &node = lightPathTree[searchResults[k]];
 					int s = node.data.depth;
 					if (m_maxDepth != -1 && s + t > m_maxDepth + 2 || s < minS) continue;
 
@@ -2261,35 +2639,34 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 					if (s == 2 && t == 2 && useVC) continue;
 #endif
 
-					if (m_sensorSampler->next1D() < rejectionProb) continue;					
-
-					size_t vertexIndex = node.data.vertexIndex;
-					LightVertex vi = m_lightVertices[vertexIndex];
-					LightVertex viPred = m_lightVertices[vertexIndex - 1];
-					MisState emitterState = vi.emitterState;
-					MisState emitterStatePred = viPred.emitterState;
+					if (!deferred && m_sensorSampler->next1D() < rejectionProb) continue;					
 
-					vs = vs_; vsPred = vsPred_; vsPred2 = vsPred2_; vsPred3 = vsPred3_;
-					m_lightVerticesExt[vertexIndex].expand(vs);
-					m_lightVerticesExt[vertexIndex - 1].expand(vsPred);
-					if (s > 2){
-						m_lightVerticesExt[vertexIndex - 2].expand(vsPred2);
-						m_lightVerticesExt[vertexIndex - 3].expand(vsPred3);
-					}
-					else if (s == 2){
-						m_lightVerticesExt[vertexIndex - 2].expand(vsPred2);
-						vsPred3 = NULL;
-					}
-					else{
-						vsPred2 = NULL;
-						vsPred3 = NULL;
-					}
+					size_t vertexIndex = node.data.vertexIndex;
+					const LightVertexStore &lightVertices = m_sharedLightPaths ?
+						m_sharedLightPaths->getVertices(node.data.slice) : m_lightVertices;
+					MisState emitterState = lightVertices.getMisState(vertexIndex);
+					MisState emitterStatePred = lightVertices.getMisState(vertexIndex - 1);
 
 					// decide the direction to do connection
-					ETransportMode condir = connectionDirection(vsPred, vtPred);
+					ETransportMode condir = connectionDirection(lightVertices.getMisVertex(vertexIndex - 1), vtPredRecord);
 					if (condir == ETransportModes)
 						continue; // skip gathering between two speculars
 					bool cameraDirConnection = (condir == ERadiance);
+
+					// only the light vertex whose BSDF is evaluated is expanded in full
+					vs = vs_; vsPred = vsPred_; vsPred2 = vsPred2_; vsPred3 = NULL;
+					if (cameraDirConnection){
+						lightVertices.expand(vertexIndex, vs);
+						lightVertices.expandGeometry(vertexIndex - 1, vsPred);
+					}
+					else{
+						lightVertices.expandGeometry(vertexIndex, vs);
+						lightVertices.expand(vertexIndex - 1, vsPred);
+					}
+					if (s >= 2)
+						lightVertices.expandGeometry(vertexIndex - 2, vsPred2);
+					else
+						vsPred2 = NULL;
 							
 					samplePos = initialSamplePos;
 					if (vtPred->isSensorSample()){
@@ -2299,11 +2676,21 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 
 					// evaluate contribution					
 					Spectrum contrib;
-					if (cameraDirConnection){
-						contrib = radianceWeights[t - 1] * vi.importanceWeight * invLightPaths;
+					Ray shadowRay;
+					if (deferred){
+						contrib = deferred->contrib;
+					}
+					else if (cameraDirConnection){
+						contrib = radianceWeights[t - 1] * lightVertices.getImportanceWeight(vertexIndex) * invLightPaths;
 						contrib *= vs->eval(m_scene, vsPred, vtPred, EImportance) *	vtPred->eval(m_scene, vtPred2, vs, ERadiance);
 						int interactions = m_maxDepth - s - t + 1;
-						if (contrib.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vtPred, NULL, interactions))
+						if (contrib.isZero())
+							continue;
+						if (deferVisibility){
+							if (!connectionEdge.connectDeferred(vs, vtPred, shadowRay))
+								continue;
+						}
+						else if (!connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vtPred, NULL, interactions))
 							continue;
 						contrib *= connectionEdge.evalCached(vs, vtPred, PathEdge::EGeneralizedGeometricTerm);
 
@@ -2317,10 +2704,16 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 						}
 					}
 					else{
-						contrib = radianceWeights[t] * viPred.importanceWeight * invLightPaths;
+						contrib = radianceWeights[t] * lightVertices.getImportanceWeight(vertexIndex - 1) * invLightPaths;
 						contrib *= vt->eval(m_scene, vtPred, vsPred, ERadiance) *	vsPred->eval(m_scene, vsPred2, vt, EImportance);
 						int interactions = m_maxDepth - s - t + 1;
-						if (contrib.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vt, vsPred, NULL, interactions))
+						if (contrib.isZero())
+							continue;
+						if (deferVisibility){
+							if (!connectionEdge.connectDeferred(vt, vsPred, shadowRay))
+								continue;
+						}
+						else if (!connectionEdge.pathConnectAndCollapse(m_scene, NULL, vt, vsPred, NULL, interactions))
 							continue;
 						contrib *= connectionEdge.evalCached(vt, vsPred, PathEdge::EGeneralizedGeometricTerm);
 
@@ -2333,105 +2726,254 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 							}
 						}
 					}
-					contrib /= (1.f - rejectionProb);
+					if (!deferred){
+						contrib /= (1.f - rejectionProb);
+						if (deferVisibility){
+							// trace the shadow rays of all merges of vt before any of their trials
+							m_shadowQueue.enqueue(shadowRay, (uint32_t) m_deferredMerges.size());
+							m_deferredMerges.push_back(DeferredMerge(k, contrib));
+							continue;
+						}
+					}
+
+					// defer the geometric trials to the batched or shared estimator, or to the merge queue
+					bool sharedCandidate = shareShoot && cameraDirConnection;
+					bool queued = !sharedCandidate && m_mergeQueue.isEnabled();
+					if (!useVCMPdf && (batchedShoot || sharedCandidate || queued)){
+						GatherTrialBatch &trials = sharedCandidate ? m_sharedTrials : m_gatherTrials;
+						GatherTrialBatch::Candidate &cand = queued ? m_mergeQueue.append() : trials.append();
+						Float brdfIntegral = 1.f;
+						if (cameraDirConnection){
+							// the domain of shared candidates is decided once all of them are known
+							if (!sharedCandidate){
+								int slot = mergeSlots[k];
+								BDAssert(slot >= 0);
+								brdfIntegral = mergeProbs[slot];
+								cand.domain.assign(m_mergeDomains[slot]);
+							}
+							// the camera path is released before the merge queue is drained, so the
+							// queued merges of vt shoot from one copy of its predecessors
+							if (queued){
+								if (queuedCopy < 0)
+									queuedCopy = (int) m_mergeQueue.copyVertices(vtPred, vtPred2);
+								m_mergeQueue.setVertices(cand, (uint32_t) queuedCopy);
+							}
+							else
+								trials.setVertices(cand, vtPred, vtPred2);
+							cand.sampler = m_sensorSampler;
+							cand.mode = ERadiance;
+							cand.target = vs->getPosition();
+						}
+						else{
+							brdfIntegral = vsPred->gatherAreaPdf(vt->getPosition(), gatherRadius, vsPred2, cand.domain);
+							// the expanded light vertices are overwritten by the next candidate
+							if (queued)
+								m_mergeQueue.setVertices(cand, m_mergeQueue.copyVertices(vsPred, vsPred2));
+							else
+								trials.setVertices(cand, trials.copyVertices(vsPred, vsPred2));
+							cand.sampler = m_emitterSampler;
+							cand.mode = EImportance;
+							cand.target = vt->getPosition();
+						}
+						if (brdfIntegral == 0.f){
+							if (queued)
+								m_mergeQueue.removeLast();
+							else
+								trials.removeLast();
+							continue;
+						}
+
+						PendingMerge merge;
+						merge.contrib = contrib;
+						merge.invBrdfIntegral = 1.f / brdfIntegral;
+						merge.miWeight = miWeightVM(m_scene, s, t,
+							emitterState, sensorState, emitterStatePred, sensorStatePred,
+							lightVertices, vertexIndex, vsPred2, vsPred, vs,
+							vt, vtPred, vtPred2, vtPred3,
+							cameraDirConnection, gatherRadius, m_lightPathNum, useVC, useVM, useVCMPdf);
+						merge.trialSlot = -1;
+						if (m_trialPolicy.isEnabled() && !sharedCandidate){
+							// trials of shared candidates are pooled, so they keep the default budget
+							merge.trialSlot = trialPolicySlot(s, t, cameraDirConnection ? vtPred : vsPred);
+							GatherTrialPolicy::Decision decision = m_trialPolicy.decide(merge.trialSlot,
+								contrib.getLuminance() * merge.miWeight * merge.invBrdfIntegral, clampThreshold, m_sensorSampler->next1D());
+							numRouletteShoots.incrementBase();
+							if (decision.weight == 0.f){
+								++numRouletteShoots;
+								if (queued)
+									m_mergeQueue.removeLast();
+								else
+									trials.removeLast();
+								continue;
+							}
+							cand.budget = decision.budget;
+							merge.contrib *= decision.weight;
+						}
+						merge.samplePos = samplePos;
+						merge.s = s;
+						merge.t = t;
+						merge.cameraDirConnection = cameraDirConnection;
+						if (sharedCandidate)
+							sharedMerges.push_back(merge);
+						else if (queued)
+							m_mergeQueue.getMerge(m_mergeQueue.size() - 1) = merge;
+						else
+							pendingMerges.push_back(merge);
+						continue;
+					}
 
 					// estimate connection probability in unbiased way
+					Float miWeight = -1.f;
 					if (!useVCMPdf){
 						Float invp = 0.f;
-						if (shareShoot){
-							invp = (acceptCnt[k] > 0) ? (Float)(shootCnt[k]) / (Float)(acceptCnt[k]) * invBrdfIntegral : 0;
-							contrib *= invp;
+						Float brdfIntegral;
+						const GatherDomain *domain = &mergeDomain;
+						if (cameraDirConnection){
+							int slot = mergeSlots[k];
+							BDAssert(slot >= 0);
+							brdfIntegral = mergeProbs[slot];
+							domain = &m_mergeDomains[slot];
+						}
+						else
+							brdfIntegral = vsPred->gatherAreaPdf(vt->getPosition(), gatherRadius, vsPred2, mergeDomain);
+
+						if (brdfIntegral == 0.f) continue;
+						Float invBrdfIntegral = 1.f / brdfIntegral;
+
+						// adapt the budget of the trials and play Russian roulette on them
+						size_t budget = clampThreshold;
+						int trialSlot = -1;
+						if (m_trialPolicy.isEnabled()){
+							trialSlot = trialPolicySlot(s, t, cameraDirConnection ? vtPred : vsPred);
+							miWeight = miWeightVM(m_scene, s, t,
+								emitterState, sensorState, emitterStatePred, sensorStatePred,
+								lightVertices, vertexIndex, vsPred2, vsPred, vs,
+								vt, vtPred, vtPred2, vtPred3,
+								cameraDirConnection, gatherRadius, m_lightPathNum, useVC, useVM, useVCMPdf);
+							GatherTrialPolicy::Decision decision = m_trialPolicy.decide(trialSlot,
+								contrib.getLuminance() * miWeight * invBrdfIntegral, clampThreshold, m_sensorSampler->next1D());
+							numRouletteShoots.incrementBase();
+							if (decision.weight == 0.f){
+								++numRouletteShoots;
+								continue;
+							}
+							budget = decision.budget;
+							contrib *= decision.weight;
 						}
-						else{
-							std::vector<Float> componentProbs;
-							std::vector<Vector4> componentBounds;
-							Float brdfIntegral;
-							if (cameraDirConnection)
-								brdfIntegral = vtPred->gatherAreaPdf(vs->getPosition(), gatherRadius, vtPred2, componentProbs, componentBounds);
-							else
-								brdfIntegral = vsPred->gatherAreaPdf(vt->getPosition(), gatherRadius, vsPred2, componentProbs, componentBounds);
 
-							if (brdfIntegral == 0.f) continue;
-							invBrdfIntegral = 1.f / brdfIntegral;
-							size_t totalShoot = 0, acceptedShoot = 0, targetShoot = 1;
-							Float distSquared = gatherRadius * gatherRadius;
-							while (totalShoot < clampThreshold){
-								totalShoot++;
+						size_t totalShoot = 0, acceptedShoot = 0, targetShoot = 1;
+						Float distSquared = gatherRadius * gatherRadius;
+						while (totalShoot < budget){
+							totalShoot++;
 
-								// restricted sampling evaluation shoots
-								Float pointDistSquared;
-								if (cameraDirConnection){
-									if (!vtPred->sampleShoot(m_scene, m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vs->getPosition(), gatherRadius, componentProbs, componentBounds))
-										continue;
-									pointDistSquared = (succVertex->getPosition() - vs->getPosition()).lengthSquared();
-								}
-								else{
-									if (!vsPred->sampleShoot(m_scene, m_emitterSampler, vsPred2, predEdge, succEdge, succVertex, EImportance, vt->getPosition(), gatherRadius, componentProbs, componentBounds))
-										continue;
-									pointDistSquared = (succVertex->getPosition() - vt->getPosition()).lengthSquared();
-								}
+							// restricted sampling evaluation shoots
+							Float pointDistSquared;
+							if (cameraDirConnection){
+								if (!vtPred->sampleShoot(m_scene, m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vs->getPosition(), gatherRadius, *domain))
+									continue;
+								pointDistSquared = (succVertex->getPosition() - vs->getPosition()).lengthSquared();
+							}
+							else{
+								if (!vsPred->sampleShoot(m_scene, m_emitterSampler, vsPred2, predEdge, succEdge, succVertex, EImportance, vt->getPosition(), gatherRadius, *domain))
+									continue;
+								pointDistSquared = (succVertex->getPosition() - vt->getPosition()).lengthSquared();
+							}
 
-								if (pointDistSquared < distSquared){
-									acceptedShoot++;
-									if (acceptedShoot == targetShoot){
-										break;
-									}
+							if (pointDistSquared < distSquared){
+								acceptedShoot++;
+								if (acceptedShoot == targetShoot){
+									break;
 								}
 							}
-							avgInvpShoots.incrementBase();
-							avgInvpShoots += totalShoot;
-							maxInvpShoots.recordMaximum(totalShoot);
-							numInvpShoots += totalShoot;
-
-							numClampShoots.incrementBase();
-							if (totalShoot >= clampThreshold)
-								++numClampShoots;
-
-#if UPM_DEBUG == 1
-							wr->putTentativeSample(totalShoot);
-#endif
-							invp = (acceptedShoot > 0) ? (Float)(totalShoot) / (Float)(acceptedShoot)* invBrdfIntegral : 0;
-							contrib *= invp;
 						}
+						recordInvpShoots(wr, totalShoot, budget);
+						recordShootCost(totalShoot, 1);
+						if (trialSlot >= 0)
+							m_trialPolicy.record(trialSlot, totalShoot, acceptedShoot > 0, budget);
+						invp = (acceptedShoot > 0) ? (Float)(totalShoot) / (Float)(acceptedShoot)* invBrdfIntegral : 0;
+						contrib *= invp;
 					}
 
 					// accumulate to image
 					if (contrib.isZero()) continue;
 
-					// MIS weighting						
-					Float miWeight = miWeightVM(m_scene, s, t,
-						emitterState, sensorState, emitterStatePred, sensorStatePred,
-						vsPred3, vsPred2, vsPred, vs,
-						vt, vtPred, vtPred2, vtPred3,
-						cameraDirConnection, gatherRadius, m_lightPathNum, useVC, useVM, useVCMPdf);
+					// MIS weighting (unless the trial policy already needed it)
+					if (miWeight < 0.f)
+						miWeight = miWeightVM(m_scene, s, t,
+							emitterState, sensorState, emitterStatePred, sensorStatePred,
+							lightVertices, vertexIndex, vsPred2, vsPred, vs,
+							vt, vtPred, vtPred2, vtPred3,
+							cameraDirConnection, gatherRadius, m_lightPathNum, useVC, useVM, useVCMPdf);
 
-#if UPM_DEBUG == 1
-					if (cameraDirConnection){
-						wr->putDebugSample(s, t - 1, samplePos, contrib * miWeight);
-						wr->putDebugSampleM(s, t - 1, samplePos, contrib);
+					splatMerge(wr, list, contrib, miWeight, samplePos, s, t, cameraDirConnection);
+				}
+
+				// resolve the camera direction merges with one shared stream of trials from vtPred
+				if (m_sharedTrials.size() > 0){
+					bool pooled = false;
+					numSharedShoots.incrementBase();
+					if (m_sharedTrials.size() >= shareShootThreshold){
+						// every candidate lies within gatherRadius of vt, so the disk of radius
+						// 2 * gatherRadius around vt covers the union of their gather disks
+						Float brdfIntegral = vtPred->gatherAreaPdf(vt->getPosition(), gatherRadius * 2.f, vtPred2, sharedDomain);
+						if (brdfIntegral > 0.f){
+							pooled = true;
+							++numSharedShoots;
+							size_t totalShoot = m_sharedTrials.estimateShared(m_scene, vtPred, vtPred2, m_sensorSampler, ERadiance,
+								vt->getPosition(), gatherRadius * 2.f, sharedDomain, gatherRadius, clampThreshold);
+							recordShootCost(totalShoot, m_sharedTrials.size());
+							for (size_t k = 0; k < sharedMerges.size(); k++)
+								sharedMerges[k].invBrdfIntegral = 1.f / brdfIntegral;
+						}
 					}
-					else{
-						wr->putDebugSample(s - 1, t, samplePos, contrib * miWeight);
-						wr->putDebugSampleM(s - 1, t, samplePos, contrib);
+					if (!pooled){
+						// too few candidates to amortize the larger domain, shoot them independently
+						// (all domains are computed from vtPred in one batch)
+						batchTargets.resize(sharedMerges.size());
+						batchDomains.resize(sharedMerges.size());
+						batchProbs.resize(sharedMerges.size());
+						for (size_t k = 0; k < sharedMerges.size(); k++){
+							batchTargets[k] = m_sharedTrials[k].target;
+							batchDomains[k] = &m_sharedTrials[k].domain;
+						}
+						vtPred->gatherAreaPdfBatch(&batchTargets[0], sharedMerges.size(), gatherRadius, vtPred2,
+							&batchDomains[0], &batchProbs[0]);
+						for (size_t k = 0; k < sharedMerges.size(); k++){
+							GatherTrialBatch::Candidate &cand = m_sharedTrials[k];
+							Float brdfIntegral = batchProbs[k];
+							sharedMerges[k].invBrdfIntegral = (brdfIntegral > 0.f) ? 1.f / brdfIntegral : 0.f;
+							cand.finished = (brdfIntegral == 0.f);
+						}
+						m_sharedTrials.estimate(m_scene, gatherRadius, clampThreshold);
+						for (size_t k = 0; k < sharedMerges.size(); k++)
+							recordShootCost(m_sharedTrials[k].totalShoot, 1);
 					}
-					wr->putDebugSampleVM(samplePos, contrib * miWeight);
-#endif
-
-					contrib *= miWeight;
-
-#ifdef UPM_DEBUG_HARD
-					if (contrib[0] < 0.f || _isnan(contrib[0]) || contrib[0] > 100000000.f){
-						Log(EWarn, "Invalid sample value[UPM]: %f %f %f, invp = %f, miWeight = %f", 
-							contrib[0], contrib[1], contrib[2], invp, miWeight);
-						continue;
+					for (size_t k = 0; k < sharedMerges.size(); k++){
+						const GatherTrialBatch::Candidate &cand = m_sharedTrials[k];
+						const PendingMerge &merge = sharedMerges[k];
+						if (merge.invBrdfIntegral == 0.f) continue;
+						recordInvpShoots(wr, cand.totalShoot, clampThreshold);
+						Float invp = (cand.acceptedShoot > 0) ? (Float)(cand.totalShoot) / (Float)(cand.acceptedShoot) * merge.invBrdfIntegral : 0;
+						Spectrum contrib = merge.contrib * invp;
+						if (contrib.isZero()) continue;
+						splatMerge(wr, list, contrib, merge.miWeight, merge.samplePos, merge.s, merge.t, merge.cameraDirConnection);
 					}
-#endif
+				}
 
-					if (t == 2) {
-						list.append(samplePos, contrib);
-					}
-					else {
-						list.accum(0, contrib);
+				// resolve the deferred merges with batched geometric trials
+				if (m_gatherTrials.size() > 0){
+					m_gatherTrials.estimate(m_scene, gatherRadius, clampThreshold);
+					for (size_t k = 0; k < pendingMerges.size(); k++){
+						const GatherTrialBatch::Candidate &cand = m_gatherTrials[k];
+						const PendingMerge &merge = pendingMerges[k];
+						recordInvpShoots(wr, cand.totalShoot, cand.budget);
+						recordShootCost(cand.totalShoot, 1);
+						if (merge.trialSlot >= 0)
+							m_trialPolicy.record(merge.trialSlot, cand.totalShoot, cand.acceptedShoot > 0, cand.budget);
+						Float invp = (cand.acceptedShoot > 0) ? (Float)(cand.totalShoot) / (Float)(cand.acceptedShoot) * merge.invBrdfIntegral : 0;
+						Spectrum contrib = merge.contrib * invp;
+						if (contrib.isZero()) continue;
+						splatMerge(wr, list, contrib, merge.miWeight, merge.samplePos, merge.s, merge.t, merge.cameraDirConnection);
 					}
 				}
 			}
@@ -2442,6 +2984,10 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 		m_pool.release(vsPred3_);
 		m_pool.release(succVertex);
 		m_pool.release(succEdge);
+
+		// the merges of earlier camera paths land in this splat list as well
+		if (m_mergeQueue.isEnabled() && m_mergeQueue.isFull())
+			drainMergeQueue(wr, list, gatherRadius, clampThreshold);
 	}
 
 	repeated = false;
@@ -2452,10 +2998,14 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 		PathVertex *vsPred_ = m_pool.allocVertex();
 		PathVertex *vsPred2_ = m_pool.allocVertex();
 		PathVertex *vsPred3_ = m_pool.allocVertex();
-		size_t lightPathBegin = (cameraPathIndex == 0) ? 0 : m_lightPathEnds[cameraPathIndex - 1];
-		size_t lightPathEnd = m_lightPathEnds[cameraPathIndex];
+		/* Camera paths take turns on the light paths when there are fewer of them */
+		size_t lightPathIndex = cameraPathIndex % m_lightPathEnds.size();
+		size_t lightPathBegin = (lightPathIndex == 0) ? 0 : m_lightPathEnds[lightPathIndex - 1];
+		size_t lightPathEnd = m_lightPathEnds[lightPathIndex];
 		Point2 samplePos(0.0f);			
 		PathEdge connectionEdge;
+		m_shadowQueue.clear();
+		m_deferredValues.clear();
 		for (size_t i = lightPathBegin; i < lightPathEnd + 2; i++){
 			int s = lightPathEnd + 1 - i;
 			PathVertex *vsPred3 = vsPred3_, *vsPred2 = vsPred2_, *vsPred = vsPred_, *vs = vs_;
@@ -2465,27 +3015,17 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 			memset(vsPred, 0, sizeof(PathVertex));
 			memset(vs, 0, sizeof(PathVertex));
 			if (i < lightPathEnd){
-				LightVertex lvertex = m_lightVertices[i];
-				s = m_lightVerticesExt[i].depth;
+				s = m_lightVertices.getDepth(i);
 				if (s <= 1) continue;
 
-				importanceWeight = lvertex.importanceWeight;
-				emitterState = lvertex.emitterState;
+				importanceWeight = m_lightVertices.getImportanceWeight(i);
+				emitterState = m_lightVertices.getMisState(i);
 
-				m_lightVerticesExt[i].expand(vs);
-				m_lightVerticesExt[i - 1].expand(vsPred);
-				if (s > 2){
-					m_lightVerticesExt[i - 2].expand(vsPred2);
-					m_lightVerticesExt[i - 3].expand(vsPred3);
-				}
-				else if (s == 2){
-					m_lightVerticesExt[i - 2].expand(vsPred2);
-					vsPred3 = NULL;
-				}
-				else{
-					vsPred2 = NULL;
-					vsPred3 = NULL;
-				}
+				// the BSDF of vs is the only one evaluated, its predecessors enter the MIS weight
+				m_lightVertices.expand(i, vs);
+				m_lightVertices.expandGeometry(i - 1, vsPred);
+				m_lightVertices.expandGeometry(i - 2, vsPred2);
+				vsPred3 = NULL;
 			}
 
 			int minT = 2, maxT = (int)m_sensorSubpath.vertexCount() - 1;
@@ -2556,7 +3096,15 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 				/* Attempt to connect the two endpoints, which could result in
 				the creation of additional vertices (index-matched boundaries etc.) */
 				int interactions = remaining;
-				if (value.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vt, NULL, interactions))
+				if (value.isZero())
+					continue;
+				Ray shadowRay;
+				bool deferred = deferVisibility && s > 0 && t >= 2;
+				if (deferred){
+					if (!connectionEdge.connectDeferred(vs, vt, shadowRay))
+						continue;
+				}
+				else if (!connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vt, NULL, interactions))
 					continue;
 
 				/* Determine the pixel sample position when necessary */
@@ -2595,7 +3143,12 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 				}
 #endif
 
-				if (t < 2) {
+				if (deferred) {
+					/* Accumulated once the shadow rays of all light vertices are traced */
+					m_shadowQueue.enqueue(shadowRay, (uint32_t) m_deferredValues.size());
+					m_deferredValues.push_back(value);
+				}
+				else if (t < 2) {
 					list.append(samplePos, value);
 				}
 				else {
@@ -2603,6 +3156,15 @@ void PathSampler::sampleSplatsUPM(UPMWorkResult *wr,
 				}
 			}
 		}
+		if (!m_shadowQueue.isEmpty()){
+			m_scene->resolveShadowRays(m_shadowQueue);
+			for (size_t k = 0; k < m_shadowQueue.size(); k++){
+				if (m_shadowQueue.isVisible(k))
+					list.accum(0, m_deferredValues[m_shadowQueue.getPayload(k)]);
+			}
+			m_shadowQueue.clear();
+			m_deferredValues.clear();
+		}
 		m_pool.release(vs_);
 		m_pool.release(vsPred_);
 		m_pool.release(vsPred2_);
@@ -2725,6 +3287,7 @@ void PathSampler::gatherCameraPathsUPM(const bool useVC, const bool useVM,
 	}
 
 	// build kdtree
+	setGatherRadius(m_cameraPathTree, gatherRadius);
 	m_cameraPathTree.build(true);
 
 	/* Release any used edges and vertices back to the memory pool */
@@ -2917,15 +3480,14 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 					// select camera direction connection from gather results
 					searchResults.clear();
 					searchPos.clear();
+					MisVertex vtPredRecord(vtPred);
 					for (int i = 0; i < searchResultsAll.size(); i++){
 						LightPathNode node = m_lightPathTree[searchResultsAll[i]];
 						size_t vertexIndex = node.data.vertexIndex;
 						// decide connection direction
-						vsPred = vsPred_;
-						m_lightVerticesExt[vertexIndex - 1].expand(vsPred);
 
 						//bool cameraDirConnection = (connectionDirection(vsPred, vtPred) == ERadiance);
-						ETransportMode condir = connectionDirection(vsPred, vtPred);
+						ETransportMode condir = connectionDirection(m_lightVertices.getMisVertex(vertexIndex - 1), vtPredRecord);
 						if (condir == ETransportModes)
 							continue; // skip gathering between two speculars
 						bool cameraDirConnection = (condir == ERadiance);
@@ -2933,8 +3495,7 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 						//if (!cameraDirConnection) continue;
 
 						searchResults.push_back(searchResultsAll[i]);
-						LightVertexExt lvertexExt = m_lightVerticesExt[vertexIndex];
-						searchPos.push_back(lvertexExt.position);
+						searchPos.push_back(m_lightVertices.getPosition(vertexIndex));
 					}
 					acceptCnt.resize(searchResults.size());
 					shootCnt.resize(searchResults.size());
@@ -2950,9 +3511,8 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 					size_t totalShootShared = 0;
 					Float invBrdfIntegralShared = 1.f;
 					if (searchPos.size() > expectShoot && false){
-						std::vector<Float> componentProbs;
-						std::vector<Vector4> componentBounds;
-						Float brdfIntegral = vtPred->gatherAreaPdf(vt->getPosition(), gatherRadius * 2.f, vtPred2, componentProbs, componentBounds);
+						GatherDomain domain;
+						Float brdfIntegral = vtPred->gatherAreaPdf(vt->getPosition(), gatherRadius * 2.f, vtPred2, domain);
 						if (brdfIntegral > 0.f){
 							shareShoot = true;
 							invBrdfIntegralShared = 1.f / brdfIntegral;
@@ -2962,7 +3522,7 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 								totalShootShared++;
 
 								// restricted sampling evaluation shoots
-								if (!vtPred->sampleShoot(m_scene, m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vt->getPosition(), gatherRadius * 2.f, componentProbs, componentBounds))
+								if (!vtPred->sampleShoot(m_scene, m_sensorSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vt->getPosition(), gatherRadius * 2.f, domain))
 									continue;
 
 								Point pshoot = succVertex->getPosition();
@@ -2997,20 +3557,32 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 						if (s == 2 && t == 2) continue;
 
 						size_t vertexIndex = node.data.vertexIndex;
-						LightVertex vi = m_lightVertices[vertexIndex];
-						LightVertex viPred = m_lightVertices[vertexIndex - 1];
-						MisState emitterState = vi.emitterState;
-						MisState emitterStatePred = viPred.emitterState;
+						MisState emitterState = m_lightVertices.getMisState(vertexIndex);
+						MisState emitterStatePred = m_lightVertices.getMisState(vertexIndex - 1);
 
+						// decide the direction to do connection
+						//bool cameraDirConnection = (connectionDirection(vsPred, vtPred) == ERadiance);
+						ETransportMode condir = connectionDirection(m_lightVertices.getMisVertex(vertexIndex - 1), vtPredRecord);
+						if (condir == ETransportModes)
+							continue; // skip gathering between two speculars
+						bool cameraDirConnection = (condir == ERadiance);
+
+						// only the light vertex whose BSDF is evaluated is expanded in full
 						vs = vs_; vsPred = vsPred_; vsPred2 = vsPred2_; vsPred3 = vsPred3_;
-						m_lightVerticesExt[vertexIndex].expand(vs);
-						m_lightVerticesExt[vertexIndex - 1].expand(vsPred);
+						if (cameraDirConnection){
+							m_lightVertices.expand(vertexIndex, vs);
+							m_lightVertices.expandGeometry(vertexIndex - 1, vsPred);
+						}
+						else{
+							m_lightVertices.expandGeometry(vertexIndex, vs);
+							m_lightVertices.expand(vertexIndex - 1, vsPred);
+						}
 						if (s > 3){
-							m_lightVerticesExt[vertexIndex - 2].expand(vsPred2);
-							m_lightVerticesExt[vertexIndex - 3].expand(vsPred3);
+							m_lightVertices.expandGeometry(vertexIndex - 2, vsPred2);
+							m_lightVertices.expandGeometry(vertexIndex - 3, vsPred3);
 						}
 						else if (s == 3){
-							m_lightVerticesExt[vertexIndex - 2].expand(vsPred2);
+							m_lightVertices.expandGeometry(vertexIndex - 2, vsPred2);
 							vsPred3->makeEndpoint(m_scene, time, EImportance);
 						}
 						else{
@@ -3019,13 +3591,6 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 							vsPred3 = NULL;
 						}
 
-						// decide the direction to do connection
-						//bool cameraDirConnection = (connectionDirection(vsPred, vtPred) == ERadiance);
-						ETransportMode condir = connectionDirection(vsPred, vtPred);
-						if (condir == ETransportModes)
-							continue; // skip gathering between two speculars
-						bool cameraDirConnection = (condir == ERadiance);
-
 						samplePos = initialSamplePos;
 						if (vtPred->isSensorSample()){
 							if (!vtPred->getSamplePosition(cameraDirConnection ? vs : vt, samplePos))
@@ -3035,7 +3600,7 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 						// evaluate contribution
 						Spectrum contrib;
 						if (cameraDirConnection){
-							contrib = radianceWeights[t - 1] * vi.importanceWeight * invLightPaths;
+							contrib = radianceWeights[t - 1] * m_lightVertices.getImportanceWeight(vertexIndex) * invLightPaths;
 							contrib *= vs->eval(m_scene, vsPred, vtPred, EImportance) *	vtPred->eval(m_scene, vtPred2, vs, ERadiance);
 							int interactions = m_maxDepth - s - t + 1;
 							if (contrib.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vs, vtPred, NULL, interactions))
@@ -3043,7 +3608,7 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 							contrib *= connectionEdge.evalCached(vs, vtPred, PathEdge::EGeneralizedGeometricTerm);
 						}
 						else{
-							contrib = radianceWeights[t] * viPred.importanceWeight * invLightPaths;
+							contrib = radianceWeights[t] * m_lightVertices.getImportanceWeight(vertexIndex - 1) * invLightPaths;
 							contrib *= vt->eval(m_scene, vtPred, vsPred, ERadiance) *	vsPred->eval(m_scene, vsPred2, vt, EImportance);
 							int interactions = m_maxDepth - s - t + 1;
 							if (contrib.isZero() || !connectionEdge.pathConnectAndCollapse(m_scene, NULL, vt, vsPred, NULL, interactions))
@@ -3055,13 +3620,12 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 						if (acceptCnt[k] > 0){
 							invp = (Float)(shootCnt[k]) / (Float)(acceptCnt[k])* invBrdfIntegralShared;
 						}else{
-							std::vector<Float> componentProbs;
-							std::vector<Vector4> componentBounds;
+							GatherDomain domain;
 							Float brdfIntegral;
 							if (cameraDirConnection)
-								brdfIntegral = vtPred->gatherAreaPdf(vs->getPosition(), gatherRadius, vtPred2, componentProbs, componentBounds);
+								brdfIntegral = vtPred->gatherAreaPdf(vs->getPosition(), gatherRadius, vtPred2, domain);
 							else
-								brdfIntegral = vsPred->gatherAreaPdf(vt->getPosition(), gatherRadius, vsPred2, componentProbs, componentBounds);
+								brdfIntegral = vsPred->gatherAreaPdf(vt->getPosition(), gatherRadius, vsPred2, domain);
 
 							if (brdfIntegral == 0.f) continue;
 							Float invBrdfIntegral = 1.f / brdfIntegral;
@@ -3073,12 +3637,12 @@ void PathSampler::sampleSplatsExtend(const bool useVC, const bool useVM, const f
 								// restricted sampling evaluation shoots
 								Float pointDistSquared;
 								if (cameraDirConnection){
-									if (!vtPred->sampleShoot(m_scene, m_lightPathSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vs->getPosition(), gatherRadius, componentProbs, componentBounds))
+									if (!vtPred->sampleShoot(m_scene, m_lightPathSampler, vtPred2, predEdge, succEdge, succVertex, ERadiance, vs->getPosition(), gatherRadius, domain))
 										continue;
 									pointDistSquared = (succVertex->getPosition() - vs->getPosition()).lengthSquared();
 								}
 								else{
-									if (!vsPred->sampleShoot(m_scene, m_lightPathSampler, vsPred2, predEdge, succEdge, succVertex, EImportance, vt->getPosition(), gatherRadius, componentProbs, componentBounds))
+									if (!vsPred->sampleShoot(m_scene, m_lightPathSampler, vsPred2, predEdge, succEdge, succVertex, EImportance, vt->getPosition(), gatherRadius, domain))
 										continue;
 									pointDistSquared = (succVertex->getPosition() - vt->getPosition()).lengthSquared();
 								}
@@ -3905,6 +4469,7 @@ std::string SplatList::toString() const {
 }
 
 MTS_IMPLEMENT_CLASS(PathSampler, false, Object)
+MTS_IMPLEMENT_CLASS_S(SharedLightPathStore, false, SharedLightPaths)
 MTS_IMPLEMENT_CLASS(SeedWorkUnit, false, WorkUnit)
 MTS_IMPLEMENT_CLASS(UPMWorkResult, false, WorkResult)
 MTS_NAMESPACE_END
@@ -0,0 +1,120 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/bidir/sharedpaths.h>
+#include <mitsuba/core/statistics.h>
+
+MTS_NAMESPACE_BEGIN
+
+static StatsCounter sharedLightPathRounds("Vertex merging", "Shared light path rounds");
+static StatsCounter avgSharedLightPathSlices("Vertex merging", "Average slices per shared light path round", EAverage);
+
+SharedLightPaths::SharedLightPaths()
+	: m_generation(0), m_tracedSlices(0), m_sliceCount(0), m_registered(0),
+	  m_published(0), m_finished(0), m_active(false), m_built(false) {
+	m_mutex = new Mutex();
+	m_cond = new ConditionVariable(m_mutex);
+}
+
+SharedLightPaths::SharedLightPaths(Stream *stream, InstanceManager *manager)
+	: SerializableObject(stream, manager), m_generation(0), m_tracedSlices(0),
+	  m_sliceCount(0), m_registered(0), m_published(0), m_finished(0),
+	  m_active(false), m_built(false) {
+	m_mutex = new Mutex();
+	m_cond = new ConditionVariable(m_mutex);
+}
+
+SharedLightPaths::~SharedLightPaths() { }
+
+void SharedLightPaths::serialize(Stream *stream, InstanceManager *manager) const {
+	/* Rounds are local to a machine, there is no state to transfer */
+}
+
+void SharedLightPaths::startRound() {
+	m_sliceCount = m_registered;
+	m_registered = 0;
+	m_published = m_finished = 0;
+	m_active = true;
+	m_built = false;
+	++m_generation;
+	beginRound(m_sliceCount);
+
+	++sharedLightPathRounds;
+	avgSharedLightPathSlices.incrementBase();
+	avgSharedLightPathSlices += m_sliceCount;
+}
+
+void SharedLightPaths::enroll(Round &round) {
+	round.slice = m_registered++;
+	uint64_t generation = m_generation + 1;
+	if (!m_active)
+		startRound();
+	while (m_generation < generation)
+		m_cond->wait();
+	round.sliceCount = m_sliceCount;
+	round.firstSlice = m_tracedSlices;
+}
+
+void SharedLightPaths::join(Round &round) {
+	LockGuard lock(m_mutex);
+	enroll(round);
+}
+
+void SharedLightPaths::publish(const Round &round) {
+	LockGuard lock(m_mutex);
+	Assert(m_active && round.sliceCount == m_sliceCount);
+	if (++m_published == m_sliceCount) {
+		/* The other workers of the round are all waiting here */
+		build(m_sliceCount);
+		m_built = true;
+		m_cond->broadcast();
+	} else {
+		while (!m_built)
+			m_cond->wait();
+	}
+}
+
+void SharedLightPaths::finish(Round &round, bool more) {
+	LockGuard lock(m_mutex);
+	uint64_t generation = m_generation;
+	if (more)
+		round.slice = m_registered++;
+
+	if (++m_finished == m_sliceCount) {
+		/* Nobody reads the slices of this round anymore, the workers that
+		   registered in the meantime start the next one right away */
+		m_tracedSlices += m_sliceCount;
+		m_active = false;
+		if (m_registered > 0)
+			startRound();
+		m_cond->broadcast();
+	} else {
+		while (m_generation == generation && m_active)
+			m_cond->wait();
+	}
+
+	if (more) {
+		while (m_generation == generation)
+			m_cond->wait();
+		round.sliceCount = m_sliceCount;
+		round.firstSlice = m_tracedSlices;
+	}
+}
+
+MTS_IMPLEMENT_CLASS(SharedLightPaths, true, SerializableObject)
+MTS_NAMESPACE_END
@@ -1557,7 +1557,8 @@ std::ostream &operator<<(std::ostream &os, PathVertex::EVertexType type) {
 
 
 Float PathVertex::gatherAreaPdf(Point p, Float radius, PathVertex* pPred, 
-	std::vector<Float> &componentProbs, std::vector<Vector4> &componentBounds){
+	GatherDomain &domain){
+	domain.clear();
 	switch (type) {
 	case ESensorSample: {
 		// Assume perspective camera
@@ -1565,7 +1566,8 @@ Float PathVertex::gatherAreaPdf(Point p, Float radius, PathVertex* pPred,
 		const Sensor *sensor = static_cast<const Sensor *>(pRec.object);
 		Vector4 bbox = sensor->evaluateSphereBounds(p, radius);
 		Float prob = (bbox.y - bbox.x) * (bbox.w - bbox.z);
-		componentBounds.push_back(bbox);
+		domain.appendLeaf(prob);
+		domain.appendBounds(bbox);
 		return prob;
 	}
 	case ESurfaceInteraction: {
@@ -1573,13 +1575,13 @@ Float PathVertex::gatherAreaPdf(Point p, Float radius, PathVertex* pPred,
 		Vector wo = p - its.p;
 		Vector wi = normalize(pPred->getPosition() - its.p);
 		const BSDF *bsdf = its.getBSDF();
-		return bsdf->gatherAreaPdf(its.toLocal(wi), its.toLocal(wo), radius, componentProbs, componentBounds);
+		return bsdf->gatherAreaPdf(its.toLocal(wi), its.toLocal(wo), radius, domain);
 	}
 	case EEmitterSample: {
 		// assume no sampling from emitter, bounded CDF and bounded sampling left untouched
 		PositionSamplingRecord &pRec = getPositionSamplingRecord();
 		const Emitter *emitter = static_cast<const Emitter *>(pRec.object);
-		return emitter->gatherAreaPdf(pRec, p, radius, componentProbs, componentBounds);
+		return emitter->gatherAreaPdf(pRec, p, radius, domain);
 	}
 	default:
 		SLog(EError, "PathVertex::sampsamplingProbabilityleNext(): Encountered an "
@@ -1587,28 +1589,63 @@ Float PathVertex::gatherAreaPdf(Point p, Float radius, PathVertex* pPred,
 		return 0.f;
 	}
 }
+void PathVertex::gatherAreaPdfBatch(const Point *p, size_t count, Float radius, const PathVertex *pPred,
+	GatherDomain * const *domains, Float *probs){
+	if (type != ESurfaceInteraction) {
+		for (size_t i = 0; i < count; ++i)
+			probs[i] = gatherAreaPdf(p[i], radius, const_cast<PathVertex *>(pPred), *domains[i]);
+		return;
+	}
+
+	const Intersection &its = getIntersection();
+	const BSDF *bsdf = its.getBSDF();
+	Vector wi = its.toLocal(normalize(pPred->getPosition() - its.p));
+	Vector wo[16];
+	for (size_t i = 0; i < count; i += 16) {
+		size_t n = std::min(count - i, (size_t) 16);
+		for (size_t j = 0; j < n; ++j) {
+			domains[i + j]->clear();
+			wo[j] = its.toLocal(p[i + j] - its.p);
+		}
+		bsdf->gatherAreaPdfBatch(wi, wo, n, radius, domains + i, probs + i);
+	}
+}
+
 bool PathVertex::sampleShoot(const Scene *scene, Sampler *sampler,
 	const PathVertex *pred, const PathEdge *predEdge,
 	PathEdge *succEdge, PathVertex *succ,
 	ETransportMode mode, Point gatherPosition, Float gatherRadius, 
-	std::vector<Float> componentProbs, std::vector<Vector4> componentBounds) {
+	const GatherDomain &domain) {
 	Ray ray;
 
 	memset(succEdge, 0, sizeof(PathEdge));
 	memset(succ, 0, sizeof(PathVertex));
 
-	size_t totalSmpl = 0, clampThreshold = 10000000;
+	BDAssert(type != ESensorSample || (mode == ERadiance && pred->type == ESensorSupernode));
+	if (!sampleShootRay(sampler, pred, gatherPosition, gatherRadius, domain, ray))
+		return false;
+
+	if (!succEdge->sampleNext(scene, sampler, this, ray, succ, mode)) {
+		/* Sampling a successor edge + vertex failed, hence the vertex
+		is not committed to a particular measure yet -- revert. */
+		return false;
+	}	
+
+	return true;
+}
 
+bool PathVertex::sampleShootRay(Sampler *sampler, const PathVertex *pred,
+	Point gatherPosition, Float gatherRadius,
+	const GatherDomain &domain, Ray &ray) const {
 	switch (type) {
 	case ESensorSample: {
-		BDAssert(mode == ERadiance && pred->type == ESensorSupernode);
-		PositionSamplingRecord &pRec = getPositionSamplingRecord();
+		PositionSamplingRecord pRec = getPositionSamplingRecord();
 		const Sensor *sensor = static_cast<const Sensor *>(pRec.object);
 		DirectionSamplingRecord dRec;
 
 		/* Sample the image plane */
 		Point2 smp = sampler->next2D();
-		Vector4 bbox = componentBounds[0];
+		Vector4 bbox = domain.getLeafBounds(0);
 		smp.x = (bbox.y - bbox.x) * smp.x + bbox.x;
 		smp.y = (bbox.w - bbox.z) * smp.y + bbox.z;
 		Spectrum result = sensor->sampleDirection(dRec, pRec, smp);
@@ -1627,7 +1664,7 @@ bool PathVertex::sampleShoot(const Scene *scene, Sampler *sampler,
 
 		/* Sample the BSDF */
 		Vector dir = bsdf->sampleGatherArea(its.toLocal(wi), its.toLocal(wo), gatherRadius, sampler->next2D(), 
-			componentProbs, componentBounds);
+			domain, 0);
 		if (dir == Vector(0.f)) return false;
 		wo = its.toWorld(dir);
 
@@ -1639,11 +1676,11 @@ bool PathVertex::sampleShoot(const Scene *scene, Sampler *sampler,
 
 	case EEmitterSample: {
 		// assume no sampling from emitter, bounded CDF and bounded sampling left untouched
-		PositionSamplingRecord &pRec = getPositionSamplingRecord();
+		const PositionSamplingRecord &pRec = getPositionSamplingRecord();
 		const Emitter *emitter = static_cast<const Emitter *>(pRec.object);
 		DirectionSamplingRecord dRec;
 
-		Vector dir = emitter->sampleGatherArea(dRec, pRec, gatherPosition, gatherRadius, sampler->next2D(), componentProbs, componentBounds);
+		Vector dir = emitter->sampleGatherArea(dRec, pRec, gatherPosition, gatherRadius, sampler->next2D(), domain, 0);
 		if (dir == Vector(0.f)) return false;
 
 		ray.time = pRec.time;
@@ -1653,16 +1690,12 @@ bool PathVertex::sampleShoot(const Scene *scene, Sampler *sampler,
 		break;
 
 	default:
-		SLog(EError, "PathVertex::sampleNext(): Encountered an "
+		SLog(EError, "PathVertex::sampleShootRay(): Encountered an "
 			"unsupported vertex type (%i)!", type);
 		return false;
-	}		
-
-	if (!succEdge->sampleNext(scene, sampler, this, ray, succ, mode)) {
-		/* Sampling a successor edge + vertex failed, hence the vertex
-		is not committed to a particular measure yet -- revert. */
-		return false;
-	}	
+	}
+	ray.mint = Epsilon;
+	ray.maxt = std::numeric_limits<Float>::infinity();
 
 	return true;
 }
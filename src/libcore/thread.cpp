@@ -546,6 +546,8 @@ void Thread::staticInitialization() {
 	mainThread->d->joined = false;
 	mainThread->d->fresolver = new FileResolver();
 	ThreadPrivate::self->set(mainThread);
+
+	ThreadPool::staticInitialization();
 }
 
 Thread *Thread::registerUnmanagedThread(const std::string &name) {
@@ -573,6 +575,7 @@ void Thread::registerCrashHandler(bool (*handler)(void)) {
 }
 
 void Thread::staticShutdown() {
+	ThreadPool::staticShutdown();
 	for (size_t i=0; i<__unmanagedThreads.size(); ++i)
 		__unmanagedThreads[i]->decRef();
 	__unmanagedThreads.clear();
@@ -667,7 +670,134 @@ Thread::~Thread() {
 		Log(EWarn, "Destructor called while thread '%s' was still running", d->name.c_str());
 }
 
+/* ==================================================================== */
+/*                              Thread pool                             */
+/* ==================================================================== */
+
+ref<ThreadPool> ThreadPool::m_instance = NULL;
+
+class ThreadPool::Helper : public Thread {
+public:
+	Helper(ThreadPool *pool, int id)
+		: Thread(formatString("pool%i", id)), m_pool(pool) { }
+
+	void run() {
+		m_pool->work();
+	}
+private:
+	ThreadPool *m_pool;
+};
+
+ThreadPool::ThreadPool(size_t threadCount)
+	: m_threadCount(threadCount), m_running(true) {
+	m_mutex = new Mutex();
+	m_workCond = new ConditionVariable(m_mutex);
+	m_doneCond = new ConditionVariable(m_mutex);
+}
+
+ThreadPool::~ThreadPool() { }
+
+void ThreadPool::run(Loop *loop, size_t count) {
+	if (count == 0)
+		return;
+
+	Job job;
+	job.loop = loop;
+	job.count = count;
+	job.next = job.done = 0;
+
+	UniqueLock lock(m_mutex);
+	if (m_running && m_threads.size() < m_threadCount) {
+		for (size_t i=m_threads.size(); i<m_threadCount; ++i) {
+			ref<Thread> thread = new Helper(this, (int) i);
+			thread->start();
+			m_threads.push_back(thread);
+		}
+	}
+	if (count > 1 && !m_threads.empty()) {
+		m_jobs.push_back(&job);
+		m_workCond->broadcast();
+	}
+
+	/* Work on the own loop until all of its iterations are claimed */
+	while (job.next < job.count) {
+		size_t index = claim(&job);
+		lock.unlock();
+		execute(&job, index);
+		lock.lock();
+		finish(&job);
+	}
+
+	while (job.done < job.count)
+		m_doneCond->wait();
+	lock.unlock();
+
+	if (!job.error.empty())
+		Log(EError, "Caught an exception in a parallel loop: %s", job.error.c_str());
+}
+
+void ThreadPool::execute(Job *job, size_t index) {
+	try {
+		job->loop->run(index);
+	} catch (const std::exception &ex) {
+		LockGuard lock(m_mutex);
+		if (job->error.empty())
+			job->error = ex.what();
+	}
+}
+
+size_t ThreadPool::claim(Job *job) {
+	size_t index = job->next++;
+	if (job->next == job->count) {
+		std::deque<Job *>::iterator it =
+			std::find(m_jobs.begin(), m_jobs.end(), job);
+		if (it != m_jobs.end())
+			m_jobs.erase(it);
+	}
+	return index;
+}
+
+void ThreadPool::finish(Job *job) {
+	if (++job->done == job->count)
+		m_doneCond->broadcast();
+}
+
+void ThreadPool::work() {
+	UniqueLock lock(m_mutex);
+	while (true) {
+		while (m_running && m_jobs.empty())
+			m_workCond->wait();
+		if (!m_running)
+			break;
+
+		Job *job = m_jobs.front();
+		size_t index = claim(job);
+		lock.unlock();
+		execute(job, index);
+		lock.lock();
+		finish(job);
+	}
+}
+
+void ThreadPool::staticInitialization() {
+	m_instance = new ThreadPool((size_t) std::max(getCoreCount() - 1, 0));
+}
+
+void ThreadPool::staticShutdown() {
+	if (!m_instance)
+		return;
+	{
+		LockGuard lock(m_instance->m_mutex);
+		m_instance->m_running = false;
+		m_instance->m_workCond->broadcast();
+	}
+	for (size_t i=0; i<m_instance->m_threads.size(); ++i)
+		m_instance->m_threads[i]->join();
+	m_instance = NULL;
+}
+
 MTS_IMPLEMENT_CLASS(Thread, true, Object)
+MTS_IMPLEMENT_CLASS(ThreadPool, false, Object)
 MTS_IMPLEMENT_CLASS(MainThread, false, Thread)
 MTS_IMPLEMENT_CLASS(UnmanagedThread, false, Thread)
 MTS_NAMESPACE_END
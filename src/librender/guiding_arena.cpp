@@ -0,0 +1,105 @@
+/*
+    This file is part of a demo implementation of an importance sampling technique
+    described in the "On-line Learning of Parametric Mixture Models for Light Transport Simulation"
+    (SIGGRAPH 2014) paper.
+    The implementation is based on Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <mitsuba/render/guiding_arena.h>
+#include <mitsuba/core/statistics.h>
+#include <mitsuba/core/tls.h>
+
+MTS_NAMESPACE_BEGIN
+
+/** Size of the blocks, larger allocations get a block of their own */
+static const size_t GUIDING_ARENA_BLOCK_SIZE = 256 * 1024;
+
+static StatsCounter arenaPeakBytes("Guided sampling", "Scratch arena high-water mark (bytes)", EMaximumValue);
+
+static ThreadLocal<GuidingArena> __arena_tls;
+
+GuidingArena::GuidingArena() 
+    : m_block( 0 ), m_offset( 0 ), m_blockStart( 0 ), m_used( 0 ), m_peak( 0 ), m_reportedPeak( 0 ) {
+}
+
+GuidingArena::~GuidingArena() {
+    reset();
+    for ( size_t i = 0; i < m_blocks.size(); ++i ) {
+        freeAligned( m_blocks[i].data );
+    }
+}
+
+GuidingArena * GuidingArena::getThreadArena() {
+    GuidingArena * arena = __arena_tls.get();
+    if ( EXPECT_NOT_TAKEN( arena == NULL ) ) {
+        arena = new GuidingArena();
+        __arena_tls.set( arena );
+    }
+    return arena;
+}
+
+void * GuidingArena::allocSlow( size_t size ) {
+    /* Skip the current block and the following ones that are too small */
+    if ( m_block < m_blocks.size() ) {
+        m_blockStart += m_blocks[ m_block ].size;
+        m_block++;
+    }
+    while ( m_block < m_blocks.size() && m_blocks[ m_block ].size < size ) {
+        m_blockStart += m_blocks[ m_block ].size;
+        m_block++;
+    }
+
+    if ( m_block == m_blocks.size() ) {
+        Block block;
+        block.size = std::max( size, GUIDING_ARENA_BLOCK_SIZE );
+        block.data = static_cast<uint8_t *>( allocAligned( block.size ) );
+        m_blocks.push_back( block );
+    }
+
+    m_offset = size;
+    m_used = m_blockStart + m_offset;
+    m_peak = std::max( m_peak, m_used );
+    reportPeak();
+    return m_blocks[ m_block ].data;
+}
+
+void GuidingArena::reset() {
+    m_block = m_offset = m_blockStart = m_used = 0;
+    reportPeak();
+}
+
+void GuidingArena::reportPeak() {
+    if ( m_peak > m_reportedPeak ) {
+        arenaPeakBytes.recordMaximum( m_peak );
+        m_reportedPeak = m_peak;
+    }
+}
+
+std::string GuidingArena::toString() const {
+    std::ostringstream oss;
+    oss << "GuidingArena[" << endl
+        << "  blocks = " << m_blocks.size() << "," << endl
+        << "  used = " << memString( m_used ) << "," << endl
+        << "  peak = " << memString( m_peak ) << endl
+        << "]";
+    return oss.str();
+}
+
+MTS_IMPLEMENT_CLASS(GuidingArena, false, Object)
+MTS_NAMESPACE_END
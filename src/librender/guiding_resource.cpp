@@ -0,0 +1,176 @@
+/*
+    This file is part of a demo implementation of an importance sampling technique
+    described in the "On-line Learning of Parametric Mixture Models for Light Transport Simulation"
+    (SIGGRAPH 2014) paper.
+    The implementation is based on Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2014 by Jiri Vorba, Ondrej Karlik, Martin Sik.
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <mitsuba/render/guiding_resource.h>
+#include <mitsuba/render/libImpUtils.h>
+
+MTS_NAMESPACE_BEGIN
+
+/** Writes the properties a guiding configuration is created from, 
+    only the types the configuration reads are kept */
+static void serializeProperties( Stream * stream, const Properties & props ) {
+    std::vector<std::string> names, kept;
+    props.putPropertyNames( names );
+    for ( size_t i = 0; i < names.size(); ++i ) {
+        switch ( props.getType( names[i] ) ) {
+            case Properties::EBoolean:
+            case Properties::EInteger:
+            case Properties::EFloat:
+            case Properties::EString:
+                kept.push_back( names[i] );
+                break;
+            default:
+                break;
+        }
+    }
+
+    stream->writeString( props.getPluginName() );
+    stream->writeSize( kept.size() );
+    for ( size_t i = 0; i < kept.size(); ++i ) {
+        const std::string & name = kept[i];
+        const Properties::EPropertyType type = props.getType( name );
+        stream->writeString( name );
+        stream->writeInt( (int) type );
+        switch ( type ) {
+            case Properties::EBoolean: stream->writeBool( props.getBoolean( name ) ); break;
+            case Properties::EInteger: stream->writeLong( props.getLong( name ) ); break;
+            case Properties::EFloat: stream->writeFloat( props.getFloat( name ) ); break;
+            default: stream->writeString( props.getString( name ) ); break;
+        }
+    }
+}
+
+static Properties unserializeProperties( Stream * stream ) {
+    Properties props( stream->readString() );
+    const size_t count = stream->readSize();
+    for ( size_t i = 0; i < count; ++i ) {
+        const std::string name = stream->readString();
+        switch ( (Properties::EPropertyType) stream->readInt() ) {
+            case Properties::EBoolean: props.setBoolean( name, stream->readBool() ); break;
+            case Properties::EInteger: props.setLong( name, stream->readLong() ); break;
+            case Properties::EFloat: props.setFloat( name, stream->readFloat() ); break;
+            default: props.setString( name, stream->readString() ); break;
+        }
+    }
+    return props;
+}
+
+/** Writes a sampler as a block of the data Importance::Sampler::save produces */
+static void serializeSampler( Stream * stream, const Importance::Sampler * sampler ) {
+    if ( !sampler ) {
+        stream->writeSize( 0 );
+        return;
+    }
+    std::ostringstream output( std::ios::out | std::ios::binary );
+    sampler->save( output );
+    const std::string data = output.str();
+    stream->writeSize( data.size() );
+    stream->write( data.data(), data.size() );
+}
+
+static std::string unserializeSampler( Stream * stream ) {
+    std::string data( stream->readSize(), '\0' );
+    if ( !data.empty() ) {
+        stream->read( &data[0], data.size() );
+    }
+    return data;
+}
+
+/** Creates a sampler from the data written by serializeSampler(), NULL if there is none */
+static Importance::Sampler * loadSampler( const std::string & data, const GuidingConfig & cfg, 
+    const Importance::Camera * camera, Importance::Stats * stats ) {
+    if ( data.empty() ) {
+        return NULL;
+    }
+    Importance::Sampler * sampler = Importance::SamplerFactory::createSampler( cfg.m_importance );
+    SAssert( sampler );
+    Importance::MemoryInputBuffer buffer( data.data(), data.size() );
+    std::istream input( &buffer );
+    sampler->load( input, cfg.m_importance, camera, stats );
+    return sampler;
+}
+
+GuidingResource::GuidingResource( Owner * owner, const Properties & props, const GuidingConfig & cfg, 
+    const WeightWindow & ww ) 
+    : m_owner( owner ), m_props( props ), m_cfg( cfg ), m_ww( ww ), 
+      m_radianceSampler( NULL ), m_importanceSampler( NULL ), m_camera( NULL ), m_awake( true ) {
+    m_mutex = new Mutex();
+}
+
+GuidingResource::GuidingResource( Stream * stream, InstanceManager * manager ) 
+    : SerializableObject( stream, manager ), m_owner( NULL ), 
+      m_radianceSampler( NULL ), m_importanceSampler( NULL ), m_camera( NULL ), m_awake( false ) {
+    m_props = unserializeProperties( stream );
+    m_cfg = GuidingConfig( m_props );
+    m_ww = WeightWindow( stream );
+    m_radianceData = unserializeSampler( stream );
+    m_importanceData = unserializeSampler( stream );
+    m_mutex = new Mutex();
+}
+
+GuidingResource::~GuidingResource() {
+    Importance::SamplerFactory::disposeSampler( m_radianceSampler );
+    Importance::SamplerFactory::disposeSampler( m_importanceSampler );
+    delete m_camera;
+}
+
+void GuidingResource::serialize( Stream * stream, InstanceManager * manager ) const {
+    if ( !m_owner ) {
+        Log( EError, "Guiding distributions can only be sent from the machine that trained them" );
+    }
+    SerializableObject::serialize( stream, manager );
+    serializeProperties( stream, m_props );
+    m_ww.serialize( stream );
+
+    Importance::Sampler * radianceSampler, * importanceSampler;
+    ref<Object> lock = m_owner->acquireSamplers( radianceSampler, importanceSampler );
+    serializeSampler( stream, radianceSampler );
+    serializeSampler( stream, importanceSampler );
+}
+
+void GuidingResource::wakeup( const Scene * scene ) {
+    LockGuard lock( m_mutex );
+    if ( m_awake ) {
+        return;
+    }
+    Importance::initialize();
+    m_cfg.computeBBox( scene );
+    m_camera = new MitsubaImportanceCamera( scene->getSensor() );
+    m_radianceSampler = loadSampler( m_radianceData, m_cfg, m_camera, &m_radianceStats );
+    m_importanceSampler = loadSampler( m_importanceData, m_cfg, m_camera, &m_importanceStats );
+    m_radianceData.clear();
+    m_importanceData.clear();
+    m_awake = true;
+}
+
+std::string GuidingResource::toString() const {
+    std::ostringstream oss;
+    oss << "GuidingResource[" << endl
+        << "  local = " << ( m_owner != NULL ) << "," << endl
+        << "  config = " << m_cfg.samplerTypeStr( m_cfg.m_importance.distType, true ) << endl
+        << "]";
+    return oss.str();
+}
+
+MTS_IMPLEMENT_CLASS_S(GuidingResource, false, SerializableObject)
+MTS_NAMESPACE_END
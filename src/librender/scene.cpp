@@ -22,9 +22,13 @@
 
 
 #include <mitsuba/render/scene.h>
+#include <mitsuba/render/shadowqueue.h>
 #include <mitsuba/render/renderjob.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/statistics.h>
+#if defined(MTS_HAS_COHERENT_RT)
+#include <mitsuba/core/ray_sse.h>
+#endif
 
 #define DEFAULT_BLOCKSIZE 32
 
@@ -747,6 +751,130 @@ bool Scene::rayIntersectAll(const Ray &ray, Float &t,
 	return result;
 }
 
+void Scene::rayIntersectAllPacket(const Ray *rays, size_t count, Float *t) const {
+	Assert(count <= 4);
+	Float mint[4];
+	for (size_t i=0; i<count; ++i) {
+		const Ray &ray = rays[i];
+		mint[i] = ray.mint;
+		if (mint[i] == Epsilon)
+			mint[i] *= std::max(std::max(std::max(std::abs(ray.o.x),
+				std::abs(ray.o.y)), std::abs(ray.o.z)), Epsilon);
+		t[i] = std::numeric_limits<Float>::infinity();
+	}
+
+#if defined(MTS_HAS_COHERENT_RT)
+	RayPacket4 MM_ALIGN16 packet;
+	RayInterval4 MM_ALIGN16 interval;
+	Intersection4 MM_ALIGN16 its4;
+	uint8_t temp[4 * MTS_KD_INTERSECTION_TEMP];
+
+	/* Unused lanes are disabled by giving them an empty interval */
+	bool coherent = true;
+	for (int i=0; i<4; ++i) {
+		const Ray &ray = rays[i < (int) count ? i : 0];
+		for (int axis=0; axis<3; axis++) {
+			packet.o[axis].f[i] = ray.o[axis];
+			packet.d[axis].f[i] = ray.d[axis];
+			packet.dRcp[axis].f[i] = ray.dRcp[axis];
+			packet.signs[axis][i] = ray.d[axis] < 0 ? 1 : 0;
+			if (packet.signs[axis][i] != packet.signs[axis][0])
+				coherent = false;
+		}
+		interval.mint.f[i] = i < (int) count ? mint[i] : 1.0f;
+		interval.maxt.f[i] = i < (int) count ? ray.maxt : 0.0f;
+	}
+
+	if (coherent)
+		m_kdtree->rayIntersectPacket(packet, interval, its4, temp);
+	else
+		m_kdtree->rayIntersectPacketIncoherent(packet, interval, its4, temp);
+
+	for (size_t i=0; i<count; ++i)
+		t[i] = its4.t.f[i];
+#else
+	for (size_t i=0; i<count; ++i) {
+		/* Use the same adaptive epsilon as the packet traversal */
+		Ray ray(rays[i]);
+		ray.mint = mint[i];
+		ConstShapePtr shape;
+		Normal n;
+		Point2 uv;
+		if (!m_kdtree->rayIntersect(ray, t[i], shape, n, uv))
+			t[i] = std::numeric_limits<Float>::infinity();
+	}
+#endif
+
+	for (size_t i=0; i<count; ++i) {
+		const Ray &ray = rays[i];
+		Float maxt = std::min(t[i], ray.maxt), tempT;
+		uint8_t buffer[MTS_KD_INTERSECTION_TEMP];
+
+		for (size_t j=0; j<m_specialShapes.size(); ++j) {
+			if (m_specialShapes[j]->rayIntersect(ray, mint[i], maxt, tempT, buffer))
+				t[i] = maxt = tempT;
+		}
+	}
+}
+
+void Scene::resolveShadowRays(ShadowRayQueue &queue) const {
+	size_t count = queue.m_rays.size();
+	queue.m_visible.resize(count);
+	queue.m_order.resize(count);
+
+	/* Sort the queries by the octant of their direction (counting sort),
+	   rays with the same signs can be traced as a coherent packet */
+	size_t offsets[9];
+	memset(offsets, 0, sizeof(offsets));
+	for (size_t i=0; i<count; ++i) {
+		const Vector &d = queue.m_rays[i].d;
+		int octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+		offsets[octant + 1]++;
+	}
+	for (int i=0; i<8; ++i)
+		offsets[i + 1] += offsets[i];
+	for (size_t i=0; i<count; ++i) {
+		const Vector &d = queue.m_rays[i].d;
+		int octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+		queue.m_order[offsets[octant]++] = (uint32_t) i;
+	}
+
+	Ray rays[4];
+	Float t[4];
+	for (size_t i=0; i<count; i += 4) {
+		size_t nLanes = std::min(count - i, (size_t) 4);
+		for (size_t j=0; j<nLanes; ++j)
+			rays[j] = queue.m_rays[queue.m_order[i + j]];
+
+		rayIntersectAllPacket(rays, nLanes, t);
+
+		for (size_t j=0; j<nLanes; ++j)
+			queue.m_visible[queue.m_order[i + j]] =
+				t[j] == std::numeric_limits<Float>::infinity() ? 1 : 0;
+	}
+
+	queue.m_resolved = true;
+}
+
+bool Scene::hasOpaqueVisibility() const {
+	if (!m_media.empty())
+		return false;
+
+	for (size_t i=0; i<m_shapes.size(); ++i) {
+		const BSDF *bsdf = m_shapes[i]->getBSDF();
+		if (!bsdf || (bsdf->getType() & BSDF::ENull))
+			return false;
+	}
+
+	for (size_t i=0; i<m_specialShapes.size(); ++i) {
+		const BSDF *bsdf = m_specialShapes[i]->getBSDF();
+		if (!bsdf || (bsdf->getType() & BSDF::ENull))
+			return false;
+	}
+
+	return true;
+}
+
 bool Scene::rayIntersectAll(const Ray &ray, Intersection &its) const {
 	bool result = rayIntersect(ray, its);
 	if (m_specialShapes.size() == 0)
@@ -0,0 +1,113 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/taskproc.h>
+#include <mitsuba/render/range.h>
+
+MTS_NAMESPACE_BEGIN
+
+/// Work result of a task, the tasks store their results themselves
+class TaskWorkResult : public WorkResult {
+public:
+	void load(Stream *stream) { }
+	void save(Stream *stream) const { }
+	std::string toString() const { return "TaskWorkResult[]"; }
+
+	MTS_DECLARE_CLASS()
+protected:
+	virtual ~TaskWorkResult() { }
+};
+
+/// Calls the task function of a \ref LocalTaskProcess
+class TaskWorkProcessor : public WorkProcessor {
+public:
+	TaskWorkProcessor(const LocalTaskProcess::Task *task) : m_task(task) { }
+
+	void serialize(Stream *stream, InstanceManager *manager) const {
+		Log(EError, "Tasks of a LocalTaskProcess cannot be serialized!");
+	}
+
+	ref<WorkUnit> createWorkUnit() const {
+		return new RangeWorkUnit();
+	}
+
+	ref<WorkResult> createWorkResult() const {
+		return new TaskWorkResult();
+	}
+
+	ref<WorkProcessor> clone() const {
+		return new TaskWorkProcessor(m_task);
+	}
+
+	void prepare() { }
+
+	void process(const WorkUnit *workUnit, WorkResult *workResult, const bool &stop) {
+		const RangeWorkUnit *range = static_cast<const RangeWorkUnit *>(workUnit);
+		for (size_t i = range->getRangeStart(); i <= range->getRangeEnd() && !stop; ++i)
+			(*m_task)(i);
+	}
+
+	MTS_DECLARE_CLASS()
+protected:
+	virtual ~TaskWorkProcessor() { }
+private:
+	const LocalTaskProcess::Task *m_task;
+};
+
+LocalTaskProcess::LocalTaskProcess(size_t taskCount, const Task &task)
+	: m_task(task), m_taskCount(taskCount), m_nextTask(0) { }
+
+void LocalTaskProcess::run(size_t taskCount, const Task &task) {
+	ref<Scheduler> sched = Scheduler::getInstance();
+	if (taskCount <= 1 || sched->getLocalWorkerCount() <= 1 ||
+		dynamic_cast<Worker *>(Thread::getThread()) != NULL) {
+		for (size_t i = 0; i < taskCount; ++i)
+			task(i);
+		return;
+	}
+
+	ref<LocalTaskProcess> proc = new LocalTaskProcess(taskCount, task);
+	sched->schedule(proc);
+	sched->wait(proc);
+	if (proc->getReturnStatus() != ESuccess)
+		Log(EError, "A task of a LocalTaskProcess failed, see the log for details");
+}
+
+ParallelProcess::EStatus LocalTaskProcess::generateWork(WorkUnit *unit, int worker) {
+	if (m_nextTask == m_taskCount)
+		return EFailure; // There is no more work
+
+	static_cast<RangeWorkUnit *>(unit)->setRange(m_nextTask, m_nextTask);
+	m_nextTask++;
+	return ESuccess;
+}
+
+void LocalTaskProcess::processResult(const WorkResult *result, bool cancelled) { }
+
+ref<WorkProcessor> LocalTaskProcess::createWorkProcessor() const {
+	return new TaskWorkProcessor(&m_task);
+}
+
+bool LocalTaskProcess::isLocal() const {
+	return true;
+}
+
+MTS_IMPLEMENT_CLASS(TaskWorkResult, false, WorkResult)
+MTS_IMPLEMENT_CLASS(TaskWorkProcessor, false, WorkProcessor)
+MTS_IMPLEMENT_CLASS(LocalTaskProcess, false, ParallelProcess)
+MTS_NAMESPACE_END
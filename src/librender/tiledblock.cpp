@@ -0,0 +1,218 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/tiledblock.h>
+
+MTS_NAMESPACE_BEGIN
+
+TiledImageBlock::TiledImageBlock(Bitmap::EPixelFormat fmt, const Vector2i &size,
+		const ReconstructionFilter *filter, bool dense, int tileSize, int channels)
+		: m_pixelFormat(fmt), m_channels(channels), m_size(size), m_tileSize(tileSize),
+		  m_filter(filter), m_dense(dense) {
+	m_borderSize = filter ? filter->getBorderSize() : 0;
+	m_tileCount = Vector2i(
+		std::max(1, (size.x + tileSize - 1) / tileSize),
+		std::max(1, (size.y + tileSize - 1) / tileSize));
+	size_t tileCount = (size_t) m_tileCount.x * (size_t) m_tileCount.y;
+
+	m_tiles.resize(tileCount);
+	m_used.resize(tileCount, false);
+
+	if (m_dense) {
+		/* Dense blocks never change their set of tiles after construction,
+		   which is what allows concurrent merges with per-tile locks */
+		m_locks.resize(tileCount);
+		for (size_t i=0; i<tileCount; ++i) {
+			m_tiles[i] = createTile(i);
+			m_locks[i] = new Mutex();
+			m_used[i] = true;
+		}
+	}
+}
+
+TiledImageBlock::~TiledImageBlock() { }
+
+ref<ImageBlock> TiledImageBlock::createTile(size_t index) const {
+	Point2i tileOffset(
+		(int) (index % m_tileCount.x) * m_tileSize,
+		(int) (index / m_tileCount.x) * m_tileSize);
+
+	/* Pad the tile by one pixel, so that its border covers the complete
+	   footprint of every sample that lies within the tile */
+	Vector2i tileSize(
+		std::min(m_tileSize, m_size.x - tileOffset.x) + 2,
+		std::min(m_tileSize, m_size.y - tileOffset.y) + 2);
+
+	ref<ImageBlock> tile = new ImageBlock(m_pixelFormat, tileSize, m_filter, m_channels);
+	tile->setOffset(tileOffset - Vector2i(1));
+	tile->setSize(tileSize);
+	tile->clear();
+	return tile;
+}
+
+void TiledImageBlock::useTile(size_t index) {
+	if (!m_tiles[index])
+		m_tiles[index] = createTile(index);
+	m_used[index] = true;
+}
+
+size_t TiledImageBlock::getUsedTileCount() const {
+	size_t count = 0;
+	for (size_t i=0; i<m_used.size(); ++i)
+		count += m_used[i] ? 1 : 0;
+	return count;
+}
+
+void TiledImageBlock::clear() {
+	for (size_t i=0; i<m_tiles.size(); ++i) {
+		if (!m_used[i])
+			continue;
+		m_tiles[i]->clear();
+		m_used[i] = m_dense;
+	}
+}
+
+void TiledImageBlock::put(const TiledImageBlock *block) {
+	Assert(block->m_size == m_size && block->m_tileSize == m_tileSize);
+
+	for (size_t i=0; i<m_tiles.size(); ++i) {
+		if (!block->m_used[i])
+			continue;
+		if (block->m_borderSize != m_borderSize) {
+			putTile(block->m_tiles[i].get());
+		} else if (m_dense) {
+			LockGuard lock(m_locks[i]);
+			m_tiles[i]->put(block->m_tiles[i].get());
+		} else {
+			useTile(i);
+			m_tiles[i]->put(block->m_tiles[i].get());
+		}
+	}
+}
+
+void TiledImageBlock::putTile(const ImageBlock *tile) {
+	const Bitmap *bitmap = tile->getBitmap();
+	Point2i sourceMin = tile->getOffset() - Vector2i(tile->getBorderSize()),
+	        sourceMax = sourceMin + bitmap->getSize();
+
+	/* Every pixel goes to the interior of exactly one tile of this block,
+	   pixels outside of the image are dropped */
+	int x0 = std::max(sourceMin.x, 0) / m_tileSize,
+	    y0 = std::max(sourceMin.y, 0) / m_tileSize,
+	    x1 = std::min(sourceMax.x - 1, m_size.x - 1) / m_tileSize,
+	    y1 = std::min(sourceMax.y - 1, m_size.y - 1) / m_tileSize;
+
+	for (int y=y0; y<=y1; ++y) {
+		for (int x=x0; x<=x1; ++x) {
+			size_t index = x + y * (size_t) m_tileCount.x;
+			Point2i interiorMin(x * m_tileSize, y * m_tileSize);
+			Point2i regionMin(
+				std::max(sourceMin.x, interiorMin.x),
+				std::max(sourceMin.y, interiorMin.y));
+			Point2i regionMax(
+				std::min(sourceMax.x, std::min(interiorMin.x + m_tileSize, m_size.x)),
+				std::min(sourceMax.y, std::min(interiorMin.y + m_tileSize, m_size.y)));
+			if (regionMin.x >= regionMax.x || regionMin.y >= regionMax.y)
+				continue;
+
+			if (!m_dense)
+				useTile(index);
+			ImageBlock *target = m_tiles[index].get();
+			Point2i targetMin = target->getOffset() - Vector2i(target->getBorderSize());
+
+			if (m_dense) {
+				LockGuard lock(m_locks[index]);
+				target->getBitmap()->accumulate(bitmap, Point2i(regionMin - sourceMin),
+					Point2i(regionMin - targetMin), regionMax - regionMin);
+			} else {
+				target->getBitmap()->accumulate(bitmap, Point2i(regionMin - sourceMin),
+					Point2i(regionMin - targetMin), regionMax - regionMin);
+			}
+		}
+	}
+}
+
+void TiledImageBlock::develop(Bitmap *target, const Point2i &offset, Float weight) const {
+	Assert(target->getPixelFormat() == m_pixelFormat);
+	target->clear();
+
+	const Vector2i &size = target->getSize();
+	for (size_t i=0; i<m_tiles.size(); ++i) {
+		if (!m_used[i])
+			continue;
+		const ImageBlock *tile = m_tiles[i].get();
+		Point2i tileOffset = tile->getOffset() - Vector2i(tile->getBorderSize()) - Vector2i(offset);
+		Vector2i tileSize = tile->getBitmap()->getSize();
+
+		/* Skip tiles that do not overlap the region */
+		if (tileOffset.x >= size.x || tileOffset.y >= size.y ||
+			tileOffset.x + tileSize.x <= 0 || tileOffset.y + tileSize.y <= 0)
+			continue;
+
+		if (m_dense) {
+			LockGuard lock(m_locks[i]);
+			target->accumulate(tile->getBitmap(), tileOffset);
+		} else {
+			target->accumulate(tile->getBitmap(), tileOffset);
+		}
+	}
+
+	if (weight != 1.0f)
+		target->scale(weight);
+}
+
+ref<Bitmap> TiledImageBlock::toBitmap(Float weight) const {
+	ref<Bitmap> bitmap = new Bitmap(m_pixelFormat, Bitmap::EFloat, m_size, m_channels);
+	develop(bitmap, Point2i(0), weight);
+	return bitmap;
+}
+
+void TiledImageBlock::load(Stream *stream) {
+	clear();
+	uint32_t count = stream->readUInt();
+	for (uint32_t i=0; i<count; ++i) {
+		size_t index = (size_t) stream->readUInt();
+		Assert(index < m_tiles.size());
+		useTile(index);
+		m_tiles[index]->load(stream);
+	}
+}
+
+void TiledImageBlock::save(Stream *stream) const {
+	stream->writeUInt((uint32_t) getUsedTileCount());
+	for (size_t i=0; i<m_tiles.size(); ++i) {
+		if (!m_used[i])
+			continue;
+		stream->writeUInt((uint32_t) i);
+		m_tiles[i]->save(stream);
+	}
+}
+
+std::string TiledImageBlock::toString() const {
+	std::ostringstream oss;
+	oss << "TiledImageBlock[" << endl
+		<< "  size = " << m_size.toString() << "," << endl
+		<< "  tileSize = " << m_tileSize << "," << endl
+		<< "  tiles = " << getUsedTileCount() << "/" << m_tiles.size() << "," << endl
+		<< "  dense = " << m_dense << endl
+		<< "]";
+	return oss.str();
+}
+
+MTS_IMPLEMENT_CLASS(TiledImageBlock, false, WorkResult)
+MTS_NAMESPACE_END
@@ -0,0 +1,153 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/sampler.h>
+#include <mitsuba/core/philox.h>
+
+MTS_NAMESPACE_BEGIN
+
+/*!\plugin{philox}{Counter-based sampler}
+ * \order{7}
+ * \parameters{
+ *     \parameter{sampleCount}{\Integer}{
+ *       Number of samples per pixel \default{4}
+ *     }
+ *     \parameter{seed}{\Integer}{
+ *       Seed offset \default{0}
+ *     }
+ * }
+ *
+ * Like the \pluginref{independent} sampler, this plugin produces independent
+ * and uniformly distributed pseudorandom numbers. They do not come from one
+ * generator per thread though, but from the counter-based Philox4x32-10
+ * generator \cite{Salmon2011Parallel}: every pair of pixel and sample index
+ * has its own stream, which only depends on the seed. Whichever thread or
+ * machine renders a sample, it always sees the same numbers, so renders are
+ * reproducible regardless of the number of cores and the scheduling.
+ *
+ * The integrators may use arbitrary offsets (including negative ones) to key
+ * streams that do not belong to a pixel, and arbitrary sample indices, e.g.
+ * the index of an iteration. The vertex merging integrators (\pluginref{upm},
+ * \pluginref{vcm}) switch to their deterministic mode with this sampler, and
+ * \pluginref{bdpt} merges its image blocks and light images in a fixed order.
+ */
+class PhiloxSampler : public Sampler {
+public:
+	PhiloxSampler() : Sampler(Properties()) { }
+
+	PhiloxSampler(const Properties &props) : Sampler(props) {
+		/* Number of samples per pixel when used with a sampling-based integrator */
+		m_sampleCount = props.getSize("sampleCount", 4);
+		m_seed = (uint64_t) props.getLong("seed", 0);
+		m_offset = Point2i(0);
+		seekStream();
+	}
+
+	PhiloxSampler(Stream *stream, InstanceManager *manager)
+	 : Sampler(stream, manager) {
+		m_seed = stream->readULong();
+		m_offset = Point2i(0);
+		seekStream();
+	}
+
+	void serialize(Stream *stream, InstanceManager *manager) const {
+		Sampler::serialize(stream, manager);
+		stream->writeULong(m_seed);
+	}
+
+	ref<Sampler> clone() {
+		ref<PhiloxSampler> sampler = new PhiloxSampler();
+		sampler->m_sampleCount = m_sampleCount;
+		sampler->m_seed = m_seed;
+		sampler->m_offset = Point2i(0);
+		sampler->seekStream();
+		for (size_t i=0; i<m_req1D.size(); ++i)
+			sampler->request1DArray(m_req1D[i]);
+		for (size_t i=0; i<m_req2D.size(); ++i)
+			sampler->request2DArray(m_req2D[i]);
+		return sampler.get();
+	}
+
+	void generate(const Point2i &offset) {
+		m_offset = offset;
+
+		/* The arrays of all samples of the pixel come from a stream of a separate key */
+		if (!m_req1D.empty() || !m_req2D.empty()) {
+			m_philox.setKey(m_seed ^ 0x8000000000000000ULL);
+			m_philox.seek(0, (uint32_t) offset.x, (uint32_t) offset.y);
+			for (size_t i=0; i<m_req1D.size(); i++)
+				for (size_t j=0; j<m_sampleCount * m_req1D[i]; ++j)
+					m_sampleArrays1D[i][j] = m_philox.nextFloat();
+			for (size_t i=0; i<m_req2D.size(); i++)
+				for (size_t j=0; j<m_sampleCount * m_req2D[i]; ++j)
+					m_sampleArrays2D[i][j] = Point2(
+						m_philox.nextFloat(),
+						m_philox.nextFloat());
+		}
+
+		m_sampleIndex = 0;
+		m_dimension1DArray = m_dimension2DArray = 0;
+		seekStream();
+	}
+
+	void advance() {
+		Sampler::advance();
+		seekStream();
+	}
+
+	void setSampleIndex(size_t sampleIndex) {
+		Sampler::setSampleIndex(sampleIndex);
+		seekStream();
+	}
+
+	Float next1D() {
+		return m_philox.nextFloat();
+	}
+
+	Point2 next2D() {
+		Float value1 = m_philox.nextFloat();
+		Float value2 = m_philox.nextFloat();
+		return Point2(value1, value2);
+	}
+
+	std::string toString() const {
+		std::ostringstream oss;
+		oss << "PhiloxSampler[" << endl
+			<< "  sampleCount = " << m_sampleCount << "," << endl
+			<< "  seed = " << m_seed << endl
+			<< "]";
+		return oss.str();
+	}
+
+	MTS_DECLARE_CLASS()
+private:
+	/// Move to the start of the stream of the current pixel and sample index
+	inline void seekStream() {
+		uint64_t index = (uint64_t) m_sampleIndex;
+		m_philox.setKey(m_seed + ((index >> 32) << 32));
+		m_philox.seek((uint32_t) index, (uint32_t) m_offset.x, (uint32_t) m_offset.y);
+	}
+private:
+	Philox m_philox;
+	uint64_t m_seed;
+	Point2i m_offset;
+};
+
+MTS_IMPLEMENT_CLASS_S(PhiloxSampler, false, Sampler)
+MTS_EXPORT_PLUGIN(PhiloxSampler, "Counter-based sampler");
+MTS_NAMESPACE_END
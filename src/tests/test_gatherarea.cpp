@@ -0,0 +1,221 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/warp.h>
+#include <mitsuba/render/bsdf.h>
+#include <mitsuba/render/gatherdomain.h>
+#include <mitsuba/render/testcase.h>
+
+/* Tolerance for the SSE code paths of the batched evaluation */
+#if defined(SINGLE_PRECISION)
+	#define ERROR_REQ 1e-4f
+#else
+	#define ERROR_REQ 1e-8
+#endif
+
+/* Tolerance for the comparison against the reference formulation */
+#define ERROR_REF 1e-3f
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * This testcase checks that the batched restricted sampling domains of
+ * the BSDFs (\ref BSDF::gatherAreaPdfBatch()) agree with the ones that
+ * \ref BSDF::gatherAreaPdf() computes for every gather disk on its own,
+ * and that the domains of the cosine lobe match an independent reference:
+ * the original acos/atan2 formulation of the domain, and a Monte Carlo
+ * estimate of the directions of the lobe that hit the gather disk
+ */
+class TestGatherArea : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_diffuse)
+	MTS_DECLARE_TEST(test02_phong)
+	MTS_DECLARE_TEST(test03_reference)
+	MTS_END_TESTCASE()
+
+	void test01_diffuse() {
+		checkBatch(Properties("diffuse"));
+	}
+
+	void test02_phong() {
+		Float exponents[] = { 2.0f, 30.0f, 500.0f };
+		for (int i=0; i<3; ++i) {
+			Properties props("phong");
+			props.setFloat("exponent", exponents[i]);
+			checkBatch(props);
+		}
+	}
+
+	void test03_reference() {
+		ref<BSDF> bsdf = static_cast<BSDF *>(
+				PluginManager::getInstance()->createObject(MTS_CLASS(BSDF), Properties("diffuse")));
+		bsdf->configure();
+		ref<Random> random = new Random();
+		Vector wi(0.0f, 0.0f, 1.0f);
+		const int nSamples = 10000;
+
+		for (int i=0; i<200; ++i) {
+			Float radius = 0.01f + random->nextFloat() * 0.5f;
+			Vector wo = Warp::squareToUniformSphere(
+				Point2(random->nextFloat(), random->nextFloat()))
+				* (radius * 0.5f + random->nextFloat() * 4.0f);
+			if (i % 10 == 0) {
+				/* The whole disk lies below the horizon */
+				wo.z = -radius - std::abs(wo.z);
+			}
+
+			GatherDomain domain;
+			domain.clear();
+			Float prob = bsdf->gatherAreaPdf(wi, wo, radius, domain);
+			Vector4 refBounds;
+			Float refProb = referenceDomain(wo, radius, refBounds);
+			assertEqualsEpsilon(prob, refProb, ERROR_REF);
+			if (i % 10 == 0)
+				assertEquals(prob, (Float) 0.0f);
+			if (refProb == 0) {
+				assertEquals(domain.nodeCount, 0);
+			} else {
+				assertEquals(domain.nodeCount, 1);
+				assertEqualsEpsilon(domain.getLeafBounds(0), refBounds, ERROR_REF);
+			}
+
+			/* Every direction of the lobe that hits the disk must lie in the domain */
+			int hits = 0;
+			for (int j=0; j<nSamples; ++j) {
+				Vector d = Warp::squareToCosineHemisphere(
+					Point2(random->nextFloat(), random->nextFloat()));
+				if (!hitsDisk(d, wo, radius))
+					continue;
+				++hits;
+				assertTrue(prob > 0);
+				assertTrue(contains(domain.getLeafBounds(0), d));
+			}
+			/* .. and the domain is not smaller than the hit probability */
+			Float hitProb = (Float) hits / nSamples;
+			assertTrue(hitProb <= prob + 4 * std::sqrt(hitProb / nSamples) + ERROR_REF);
+			if (refProb == 0)
+				assertEquals(hits, 0);
+		}
+	}
+
+	/**
+	 * The restricted domain of the cosine lobe towards a gather disk in the
+	 * original formulation, with theta and phi computed by acos and atan2.
+	 * Returns the bounds in the format of \ref CosineLobeGatherArea.
+	 */
+	static Float referenceDomain(const Vector &wo, Float radius, Vector4 &bounds) {
+		double dist = wo.length(), r = radius;
+		bounds = Vector4(0.0f, 1.0f, 0.0f, 2 * M_PI);
+		if (dist < r)
+			return 1.0f;
+		double dTheta = std::acos(std::sqrt(dist * dist - r * r) / dist);
+		double theta = std::acos(std::min(std::max(wo.z / dist, -1.0), 1.0));
+		double theta0 = theta - dTheta;
+		double theta1 = std::min(0.5 * M_PI, theta + dTheta);
+		if (theta0 >= 0.5 * M_PI)
+			return 0.0f; /* Below the horizon */
+		if (theta0 < 0) {
+			/* The full polar cap */
+			bounds.y = (Float) std::sin(theta1);
+			return (Float) (0.5 * (1.0 - std::cos(2.0 * theta1)));
+		}
+		double distProj = std::sqrt((double) wo.x * wo.x + (double) wo.y * wo.y);
+		double dPhi = distProj > r ? std::acos(std::sqrt(distProj * distProj - r * r) / distProj) : 0.5 * M_PI;
+		double phi = std::atan2((double) wo.y, (double) wo.x);
+		bounds = Vector4((Float) std::sin(theta0), (Float) std::sin(theta1),
+			(Float) (phi - dPhi), (Float) (phi + dPhi));
+		return (Float) (0.5 * dPhi * (std::cos(2.0 * theta0) - std::cos(2.0 * theta1)) * INV_PI);
+	}
+
+	/// Does the ray from the origin along \c d hit the sphere of radius \c r around \c c?
+	static bool hitsDisk(const Vector &d, const Vector &c, Float r) {
+		Float t = dot(d, c);
+		return t > 0 && (c - d * t).lengthSquared() < r * r;
+	}
+
+	/// Is the direction \c d inside the bounds of a domain?
+	static bool contains(const Vector4 &bounds, const Vector &d) {
+		Float sinTheta = std::sqrt(d.x * d.x + d.y * d.y);
+		if (sinTheta < bounds.x - ERROR_REQ || sinTheta > bounds.y + ERROR_REQ)
+			return false;
+		if (bounds.z == 0 && bounds.w == 2 * M_PI)
+			return true;
+		Float phi = std::atan2(d.y, d.x);
+		for (int k=-1; k<=1; ++k) {
+			Float p = phi + k * 2 * M_PI;
+			if (p >= bounds.z - ERROR_REQ && p <= bounds.w + ERROR_REQ)
+				return true;
+		}
+		return false;
+	}
+
+	void checkBatch(const Properties &props) {
+		ref<BSDF> bsdf = static_cast<BSDF *>(
+				PluginManager::getInstance()->createObject(MTS_CLASS(BSDF), props));
+		bsdf->configure();
+		ref<Random> random = new Random();
+		Log(EInfo, "Checking %s", bsdf->toString().c_str());
+
+		/* Not a multiple of the SSE width, so that the tails are covered too */
+		const size_t count = 37;
+		std::vector<Vector> wo(count);
+		std::vector<GatherDomain> scalarDomains(count), batchDomains(count);
+		std::vector<GatherDomain *> domainPtrs(count);
+		std::vector<Float> scalarProbs(count), batchProbs(count);
+
+		for (int i=0; i<100; ++i) {
+			Vector wi = Warp::squareToCosineHemisphere(
+				Point2(random->nextFloat(), random->nextFloat()));
+			if (i % 10 == 0)
+				wi = -wi; /* Below the surface: everything is zero */
+			Float radius = 0.01f + random->nextFloat() * 0.5f;
+
+			for (size_t j=0; j<count; ++j) {
+				/* Disks at various distances, some of them containing the vertex */
+				Vector d = Warp::squareToUniformSphere(
+					Point2(random->nextFloat(), random->nextFloat()));
+				wo[j] = d * (radius * 0.5f + random->nextFloat() * 4.0f);
+				scalarDomains[j].clear();
+				scalarProbs[j] = bsdf->gatherAreaPdf(wi, wo[j], radius, scalarDomains[j]);
+				batchDomains[j].clear();
+				domainPtrs[j] = &batchDomains[j];
+			}
+			bsdf->gatherAreaPdfBatch(wi, &wo[0], count, radius, &domainPtrs[0], &batchProbs[0]);
+
+			for (size_t j=0; j<count; ++j) {
+				assertEqualsEpsilon(batchProbs[j], scalarProbs[j], ERROR_REQ);
+				if (scalarProbs[j] == 0)
+					continue;
+				const GatherDomain &a = scalarDomains[j], &b = batchDomains[j];
+				assertEquals(b.nodeCount, a.nodeCount);
+				assertEquals(b.boundCount, a.boundCount);
+				for (int k=0; k<a.nodeCount; ++k) {
+					assertEqualsEpsilon(b.getProb(k), a.getProb(k), ERROR_REQ);
+					assertEquals(b.getPointer(k), a.getPointer(k));
+				}
+				for (int k=0; k<a.boundCount; ++k)
+					assertEqualsEpsilon(b.bounds[k], a.bounds[k], ERROR_REQ);
+			}
+		}
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestGatherArea, "Testcase for batched gather area domains")
+MTS_NAMESPACE_END
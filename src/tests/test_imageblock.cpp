@@ -0,0 +1,194 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/random.h>
+#include <mitsuba/render/sequencer.h>
+#include <mitsuba/render/testcase.h>
+#include <mitsuba/render/tiledblock.h>
+
+MTS_NAMESPACE_BEGIN
+
+/// Merges light images into a dense block in the order of their sequence numbers
+class TiledBlockSequencer : public ResultSequencer<TiledImageBlock> {
+public:
+	TiledBlockSequencer(TiledImageBlock *target, const ReconstructionFilter *rfilter)
+		: m_target(target), m_rfilter(rfilter), m_copies(0) { }
+
+	inline size_t getCopyCount() const { return m_copies; }
+protected:
+	ref<TiledImageBlock> copy(const TiledImageBlock *wr) {
+		ref<TiledImageBlock> copy = new TiledImageBlock(Bitmap::ESpectrum,
+			wr->getSize(), m_rfilter, false, 32);
+		copy->put(wr);
+		++m_copies;
+		return copy;
+	}
+
+	void merge(const TiledImageBlock *wr) {
+		m_target->put(wr);
+	}
+private:
+	ref<TiledImageBlock> m_target;
+	ref<const ReconstructionFilter> m_rfilter;
+	size_t m_copies;
+};
+
+class TestImageBlock : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_tiledSplats)
+	MTS_DECLARE_TEST(test02_tiledMerge)
+	MTS_DECLARE_TEST(test03_sequencer)
+	MTS_END_TESTCASE()
+
+	ref<ReconstructionFilter> createFilter() {
+		ref<ReconstructionFilter> rfilter = static_cast<ReconstructionFilter *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(ReconstructionFilter), Properties("gaussian")));
+		rfilter->configure();
+		return rfilter;
+	}
+
+	/// Splat random samples into both blocks, including some outside of the image
+	void splat(Random *random, const Vector2i &size, ImageBlock *block,
+			TiledImageBlock *tiled, size_t count) {
+		for (size_t i=0; i<count; ++i) {
+			Point2 pos(
+				random->nextFloat() * (size.x + 4) - 2,
+				random->nextFloat() * (size.y + 4) - 2);
+			Spectrum value(random->nextFloat());
+			block->put(pos, (const Float *) &value);
+			tiled->put(pos, (const Float *) &value);
+		}
+	}
+
+	/// Compare the interior of a full-frame block against a bitmap of the image
+	void compare(const ImageBlock *block, const Bitmap *bitmap) {
+		const Vector2i &size = bitmap->getSize();
+		int border = block->getBorderSize();
+		Float maxError = 0;
+		for (int y=0; y<size.y; ++y) {
+			for (int x=0; x<size.x; ++x) {
+				Spectrum expected = block->getBitmap()->getPixel(Point2i(x + border, y + border));
+				Spectrum actual = bitmap->getPixel(Point2i(x, y));
+				maxError = std::max(maxError, (expected - actual).abs().max());
+			}
+		}
+		assertEqualsEpsilon(maxError, (Float) 0.0f, 1e-4f);
+	}
+
+	void test01_tiledSplats() {
+		ref<ReconstructionFilter> rfilter = createFilter();
+		ref<Random> random = new Random();
+		Vector2i size(150, 90);
+
+		ref<ImageBlock> block = new ImageBlock(Bitmap::ESpectrum, size, rfilter);
+		block->clear();
+		ref<TiledImageBlock> tiled = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, false, 32);
+
+		/* Samples that only land in one corner allocate only one tile */
+		Spectrum value(1.0f);
+		tiled->put(Point2(3.5f, 4.5f), (const Float *) &value);
+		block->put(Point2(3.5f, 4.5f), (const Float *) &value);
+		assertEquals((int) tiled->getUsedTileCount(), 1);
+
+		splat(random, size, block, tiled, 10000);
+		compare(block, tiled->toBitmap());
+
+		tiled->clear();
+		assertEquals((int) tiled->getUsedTileCount(), 0);
+	}
+
+	void test02_tiledMerge() {
+		ref<ReconstructionFilter> rfilter = createFilter();
+		ref<Random> random = new Random();
+		Vector2i size(150, 90);
+
+		ref<ImageBlock> block = new ImageBlock(Bitmap::ESpectrum, size, rfilter);
+		block->clear();
+		ref<TiledImageBlock>
+			tiled1 = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, false, 32),
+			tiled2 = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, false, 32),
+			dense = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, true, 32),
+			denseNoFilter = new TiledImageBlock(Bitmap::ESpectrum, size, NULL, true, 32);
+
+		splat(random, size, block, tiled1, 5000);
+		splat(random, size, block, tiled2, 5000);
+
+		/* Tiles with the same border are added one by one, others are
+		   distributed over the tiles they overlap */
+		dense->put(tiled1);
+		dense->put(tiled2);
+		denseNoFilter->put(tiled1);
+		denseNoFilter->put(tiled2);
+
+		compare(block, dense->toBitmap());
+		compare(block, denseNoFilter->toBitmap());
+	}
+
+	void test03_sequencer() {
+		ref<ReconstructionFilter> rfilter = createFilter();
+		ref<Random> random = new Random();
+		Vector2i size(150, 90);
+		const size_t count = 20, window = 3;
+
+		ref<ImageBlock> block = new ImageBlock(Bitmap::ESpectrum, size, rfilter);
+		ref_vector<TiledImageBlock> results(count);
+		for (size_t i=0; i<count; ++i) {
+			results[i] = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, false, 32);
+			splat(random, size, block, results[i], 1000);
+		}
+
+		ref<TiledImageBlock>
+			expected = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, true, 32),
+			actual = new TiledImageBlock(Bitmap::ESpectrum, size, rfilter, true, 32);
+		for (size_t i=0; i<count; ++i)
+			expected->put(results[i].get());
+
+		/* Hand out units like a scheduler and complete them in random order */
+		TiledBlockSequencer sequencer(actual, rfilter);
+		sequencer.setWindow(window);
+		std::vector<size_t> inflight;
+		size_t generated = 0;
+		bool paused = false;
+		while (generated < count || !inflight.empty()) {
+			while (!paused && generated < count) {
+				if (sequencer.pause(generated))
+					paused = true;
+				else
+					inflight.push_back(generated++);
+			}
+			size_t index = random->nextUInt((uint32_t) inflight.size());
+			size_t sequence = inflight[index];
+			inflight.erase(inflight.begin() + index);
+			if (sequencer.put(sequence, results[sequence].get(), false))
+				paused = false;
+			assertTrue(sequencer.getPendingCount() < window);
+		}
+		assertTrue(!paused);
+		assertEquals((int) sequencer.getPendingCount(), 0);
+
+		/* The sums are the same as when merging in order, bit by bit */
+		ref<Bitmap> expectedBitmap = expected->toBitmap(), actualBitmap = actual->toBitmap();
+		assertTrue(memcmp(expectedBitmap->getFloatData(), actualBitmap->getFloatData(),
+			expectedBitmap->getBufferSize()) == 0);
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestImageBlock, "Testcase for the image blocks")
+MTS_NAMESPACE_END
@@ -18,6 +18,7 @@
 
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/kdtree.h>
+#include <mitsuba/core/hashgrid.h>
 #include <mitsuba/render/testcase.h>
 #include <mitsuba/render/skdtree.h>
 
@@ -29,6 +30,8 @@ public:
 	MTS_DECLARE_TEST(test01_sutherlandHodgman)
 	MTS_DECLARE_TEST(test02_bunnyBenchmark)
 	MTS_DECLARE_TEST(test03_pointKDTree)
+	MTS_DECLARE_TEST(test04_parallelPointKDTree)
+	MTS_DECLARE_TEST(test05_pointHashGrid)
 	MTS_END_TESTCASE()
 
 	void test01_sutherlandHodgman() {
@@ -214,6 +217,95 @@ public:
 		Log(EInfo, "Normal node size = " SIZE_T_FMT " bytes", sizeof(KDTree2::NodeType));
 		Log(EInfo, "Left-balanced node size = " SIZE_T_FMT " bytes", sizeof(KDTree2Left::NodeType));
 	}
+
+	template <typename KDTreeType> void checkParallelBuild(typename KDTreeType::EHeuristic heuristic,
+			size_t nPoints, Random *random) {
+		KDTreeType serial(0, heuristic), parallel(0, heuristic);
+		parallel.setParallelBuild(true);
+		parallel.setRetainStorage(true);
+
+		/* Rebuild twice to exercise the retained build storage */
+		for (int iteration=0; iteration<2; ++iteration) {
+			serial.clear();
+			parallel.clear();
+			for (size_t i=0; i<nPoints; ++i) {
+				typename KDTreeType::NodeType node(random->nextFloat());
+				node.setPosition(Point2(random->nextFloat(), random->nextFloat()));
+				serial.push_back(node);
+				parallel.push_back(node);
+			}
+
+			ref<Timer> timer = new Timer();
+			serial.build(true);
+			int serialTime = timer->getMilliseconds();
+			timer->reset();
+			parallel.build(true);
+			Log(EInfo, "Construction time = %i ms (serial), %i ms (parallel)",
+				serialTime, timer->getMilliseconds());
+
+			/* The parallel build must produce exactly the same tree */
+			assertEquals((int) serial.getDepth(), (int) parallel.getDepth());
+			for (size_t i=0; i<nPoints; ++i) {
+				assertEquals(serial[i].getPosition(), parallel[i].getPosition());
+				assertTrue(serial[i].getData() == parallel[i].getData());
+				assertTrue(serial[i].isLeaf() == parallel[i].isLeaf());
+				assertTrue(serial[i].getAxis() == parallel[i].getAxis());
+			}
+		}
+	}
+
+	void test04_parallelPointKDTree() {
+		typedef PointKDTree< SimpleKDNode<Point2, Float> > KDTree2;
+		typedef PointKDTree< LeftBalancedKDNode<Point2, Float> > KDTree2Left;
+
+		size_t nPoints = 500000;
+		ref<Random> random = new Random();
+
+		Log(EInfo, "Testing the parallel sliding midpoint kd-tree construction");
+		checkParallelBuild<KDTree2>(KDTree2::ESlidingMidpoint, nPoints, random);
+		Log(EInfo, "Testing the parallel balanced kd-tree construction");
+		checkParallelBuild<KDTree2>(KDTree2::EBalanced, nPoints, random);
+		Log(EInfo, "Testing the parallel left-balanced kd-tree construction with left-balanced nodes");
+		checkParallelBuild<KDTree2Left>(KDTree2Left::ELeftBalanced, nPoints, random);
+	}
+
+	void test05_pointHashGrid() {
+		typedef SimpleKDNode<Point, uint32_t> NodeType;
+		size_t nPoints = 100000, nTries = 1000;
+		Float radius = 0.02f;
+		ref<Random> random = new Random();
+
+		PointKDTree<NodeType> kdtree;
+		PointHashGrid<NodeType> grid(0, radius);
+		for (size_t i=0; i<nPoints; ++i) {
+			NodeType node((uint32_t) i);
+			node.setPosition(Point(random->nextFloat(), random->nextFloat(), random->nextFloat()));
+			kdtree.push_back(node);
+			grid.push_back(node);
+		}
+		kdtree.build(true);
+		grid.build(true);
+
+		/* Both structures must find the same points, also for larger radii
+		   and for queries outside of the point set's bounding box */
+		std::vector<uint32_t> kdResults, gridResults, kdData, gridData;
+		for (size_t it=0; it<nTries; ++it) {
+			Point p(random->nextFloat() * 1.2f - 0.1f, random->nextFloat() * 1.2f - 0.1f,
+				random->nextFloat() * 1.2f - 0.1f);
+			Float searchRadius = (it % 4 == 0) ? 3 * radius : radius;
+			kdResults.clear(); gridResults.clear();
+			kdData.clear(); gridData.clear();
+			kdtree.search(p, searchRadius, kdResults);
+			grid.search(p, searchRadius, gridResults);
+			for (size_t j=0; j<kdResults.size(); ++j)
+				kdData.push_back(kdtree[kdResults[j]].getData());
+			for (size_t j=0; j<gridResults.size(); ++j)
+				gridData.push_back(grid[gridResults[j]].getData());
+			std::sort(kdData.begin(), kdData.end());
+			std::sort(gridData.begin(), gridData.end());
+			assertTrue(kdData == gridData);
+		}
+	}
 };
 
 MTS_EXPORT_TESTCASE(TestKDTree, "Testcase for kd-tree related code")
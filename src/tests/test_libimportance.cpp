@@ -0,0 +1,125 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/random.h>
+#include <mitsuba/core/sched.h>
+#include <mitsuba/core/warp.h>
+#include <mitsuba/render/taskproc.h>
+#include <mitsuba/render/testcase.h>
+#include "LibImportance/sdtree/SDTree.h"
+
+MTS_NAMESPACE_BEGIN
+
+/// Runs the tasks of LibImportance on the local workers of the scheduler
+class ParallelTaskRunner : public Importance::TaskRunner {
+public:
+	virtual void run(int count, const Task &task) {
+		LocalTaskProcess::run((size_t) count, [&task](size_t i) { task((int) i); });
+	}
+
+	virtual int getThreadCount() const {
+		return (int) std::max((size_t) 1, Scheduler::getInstance()->getLocalWorkerCount());
+	}
+};
+
+/// Runs the tasks in the calling thread, starting with the last one
+class ReverseTaskRunner : public Importance::TaskRunner {
+public:
+	virtual void run(int count, const Task &task) {
+		for (int i=count-1; i>=0; --i)
+			task(i);
+	}
+
+	virtual int getThreadCount() const { return 1; }
+};
+
+class TestLibImportance : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_sdtreeSplat)
+	MTS_END_TESTCASE()
+
+	/// Particles clustered around a few points, so that the tree gets refined unevenly
+	void createParticles(Random *random, size_t count, Importance::IStack<Importance::Particle> &particles) {
+		particles.clear();
+		for (size_t i=0; i<count; ++i) {
+			Point center((Float) (i % 3) * 0.3f + 0.2f, 0.5f, 0.5f);
+			Point p = center + Warp::squareToUniformSphere(
+				Point2(random->nextFloat(), random->nextFloat())) * (0.2f * random->nextFloat());
+			Vector d = Warp::squareToUniformSphere(
+				Point2(random->nextFloat(), random->nextFloat()));
+			Importance::Particle particle;
+			particle.position = Importance::Vector3(p.x, p.y, p.z);
+			particle.incidentDir = Importance::Vector3(d.x, d.y, d.z);
+			particle.normal = Importance::Vector3(0.f, 0.f, 1.f);
+			/* Weights over several orders of magnitude, some of them are not splatted */
+			particle.weight = (i % 17 == 0) ? 0.0f : std::pow(10.0f, 4.0f * random->nextFloat() - 2.0f);
+			particle.distance = 0.f;
+			particles.push(particle);
+		}
+	}
+
+	std::string serialize(const Importance::SDTree &tree) {
+		std::ostringstream oss;
+		tree.serialize(oss);
+		return oss.str();
+	}
+
+	void test01_sdtreeSplat() {
+		ref<Random> random = new Random();
+		Importance::IStack<Importance::Particle> particles;
+		Importance::Config::SDTree cfg;
+		cfg.spatialThreshold = 1000;
+
+		/* Train a refined topology first */
+		Importance::SDTree tree;
+		tree.reset(Importance::Vector3(0.f, 0.f, 0.f), Importance::Vector3(1.f, 1.f, 1.f));
+		for (int pass=0; pass<3; ++pass) {
+			createParticles(random, 20000, particles);
+			tree.splat(particles, Importance::SerialTaskRunner::getInstance());
+			tree.refine(cfg);
+		}
+		assertTrue(tree.getLeafCount() > 1);
+
+		/* Many more particles than a single task splats */
+		createParticles(random, 10 * Importance::SDTREE_SPLAT_CHUNK_SIZE + 123, particles);
+
+		Importance::SDTree serial(tree), parallel(tree), reverse(tree);
+		ParallelTaskRunner parallelRunner;
+		ReverseTaskRunner reverseRunner;
+		serial.splat(particles, Importance::SerialTaskRunner::getInstance());
+		parallel.splat(particles, parallelRunner);
+		reverse.splat(particles, reverseRunner);
+
+		/* The energies and the particle counts must match bit by bit */
+		std::string expected = serialize(serial);
+		assertTrue(serialize(parallel) == expected);
+		assertTrue(serialize(reverse) == expected);
+
+		/* Every splatted particle can be sampled again */
+		for (size_t i=0; i<particles.size(); ++i) {
+			if (particles[i].weight == 0)
+				continue;
+			const Importance::DTreeRecord &dtree = serial.findLeaf(particles[i].position);
+			assertTrue(serial.pdf(dtree, -particles[i].incidentDir) > 0);
+		}
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestLibImportance, "Testcase for the LibImportance data structures")
+MTS_NAMESPACE_END
@@ -19,6 +19,7 @@
 #include <mitsuba/render/testcase.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/qmc.h>
+#include <mitsuba/core/philox.h>
 
 MTS_NAMESPACE_BEGIN
 
@@ -28,6 +29,7 @@ public:
 	MTS_DECLARE_TEST(test01_Halton)
 	MTS_DECLARE_TEST(test02_Hammersley)
 	MTS_DECLARE_TEST(test03_radicalInverseIncr)
+	MTS_DECLARE_TEST(test04_Philox)
 	MTS_END_TESTCASE()
 
 	void test01_Halton() {
@@ -84,6 +86,42 @@ public:
 			x = radicalInverseIncremental(2, x);
 		}
 	}
+
+	void test04_Philox() {
+		/* Known answer of the Random123 reference implementation */
+		uint32_t counter[4] = { 0x243f6a88U, 0x85a308d3U, 0x13198a2eU, 0x03707344U };
+		uint32_t key[2] = { 0xa4093822U, 0x299f31d0U };
+		uint32_t comparison[4] = { 0xd16cfe09U, 0x94fdccebU, 0x5001e420U, 0x24126ea1U };
+		uint32_t result[4];
+		Philox::bijection(counter, key, result);
+		for (int i=0; i<4; ++i)
+			assertTrue(result[i] == comparison[i]);
+
+		Properties props("philox");
+		props.setLong("seed", 7);
+		ref<Sampler> sampler = static_cast<Sampler *> (PluginManager::getInstance()->
+				createObject(MTS_CLASS(Sampler), props));
+		ref<Sampler> clone = sampler->clone();
+
+		/* The numbers only depend on the pixel and the sample index,
+		   not on what the sampler produced before */
+		Float values[4];
+		sampler->generate(Point2i(3, 5));
+		sampler->setSampleIndex(42);
+		for (int i=0; i<4; ++i)
+			values[i] = sampler->next1D();
+
+		clone->generate(Point2i(-1, 2));
+		clone->next2D();
+		clone->generate(Point2i(3, 5));
+		for (int i=0; i<42; ++i)
+			clone->advance();
+		for (int i=0; i<4; ++i)
+			assertEqualsEpsilon(clone->next1D(), values[i], 0);
+
+		clone->setSampleIndex(43);
+		assertFalse(clone->next1D() == values[0]);
+	}
 };
 
 MTS_EXPORT_TESTCASE(TestSamplers, "Testcase for sampling-related code")
@@ -0,0 +1,160 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2012 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/bitmap.h>
+#include <mitsuba/render/renderjob.h>
+#include <mitsuba/render/renderqueue.h>
+#include <mitsuba/render/scenehandler.h>
+#include <mitsuba/render/testcase.h>
+
+/* Resolution of the test image and size of the tiles that are compared */
+#define IMAGE_RES 32
+#define TILE_RES 8
+
+MTS_NAMESPACE_BEGIN
+
+/* A diffuse box with a small area light and a sphere, so that
+   the merges of most camera paths happen at depths t > 2 */
+static const char *upmScene =
+	"<scene version=\"0.5.0\">"
+	"	<integrator type=\"upm\">"
+	"		<integer name=\"maxDepth\" value=\"6\"/>"
+	"		<integer name=\"mergeQueueSize\" value=\"$mergeQueueSize\"/>"
+	"	</integrator>"
+	"	<sensor type=\"perspective\">"
+	"		<float name=\"fov\" value=\"45\"/>"
+	"		<transform name=\"toWorld\">"
+	"			<lookat origin=\"0, 0, 3.4\" target=\"0, 0, 0\" up=\"0, 1, 0\"/>"
+	"		</transform>"
+	"		<sampler type=\"independent\">"
+	"			<integer name=\"sampleCount\" value=\"128\"/>"
+	"		</sampler>"
+	"		<film type=\"hdrfilm\">"
+	"			<integer name=\"width\" value=\"32\"/>"
+	"			<integer name=\"height\" value=\"32\"/>"
+	"			<rfilter type=\"box\"/>"
+	"		</film>"
+	"	</sensor>"
+	"	<bsdf type=\"diffuse\" id=\"white\"/>"
+	"	<shape type=\"rectangle\">"
+	"		<transform name=\"toWorld\"><translate z=\"-1\"/></transform>"
+	"		<ref id=\"white\"/>"
+	"	</shape>"
+	"	<shape type=\"rectangle\">"
+	"		<transform name=\"toWorld\"><rotate x=\"1\" angle=\"-90\"/><translate y=\"-1\"/></transform>"
+	"		<ref id=\"white\"/>"
+	"	</shape>"
+	"	<shape type=\"rectangle\">"
+	"		<transform name=\"toWorld\"><rotate x=\"1\" angle=\"90\"/><translate y=\"1\"/></transform>"
+	"		<ref id=\"white\"/>"
+	"	</shape>"
+	"	<shape type=\"rectangle\">"
+	"		<transform name=\"toWorld\"><rotate y=\"1\" angle=\"90\"/><translate x=\"-1\"/></transform>"
+	"		<bsdf type=\"diffuse\"><rgb name=\"reflectance\" value=\"0.6, 0.1, 0.1\"/></bsdf>"
+	"	</shape>"
+	"	<shape type=\"rectangle\">"
+	"		<transform name=\"toWorld\"><rotate y=\"1\" angle=\"-90\"/><translate x=\"1\"/></transform>"
+	"		<bsdf type=\"diffuse\"><rgb name=\"reflectance\" value=\"0.1, 0.6, 0.1\"/></bsdf>"
+	"	</shape>"
+	"	<shape type=\"sphere\">"
+	"		<point name=\"center\" x=\"0.3\" y=\"-0.6\" z=\"-0.2\"/>"
+	"		<float name=\"radius\" value=\"0.4\"/>"
+	"		<ref id=\"white\"/>"
+	"	</shape>"
+	"	<shape type=\"rectangle\">"
+	"		<transform name=\"toWorld\">"
+	"			<scale value=\"0.3\"/><rotate x=\"1\" angle=\"90\"/><translate y=\"0.99\"/>"
+	"		</transform>"
+	"		<emitter type=\"area\"><spectrum name=\"radiance\" value=\"20\"/></emitter>"
+	"	</shape>"
+	"</scene>";
+
+/**
+ * This testcase renders a scene with UPM with and without the merge
+ * queue (\ref PathSampler::setMergeQueue()) and checks that the queued
+ * merges land on the same pixels as the ones that are resolved right away
+ */
+class TestUPM : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_mergeQueue)
+	MTS_END_TESTCASE()
+
+	void test01_mergeQueue() {
+		ref<Bitmap> reference = render(0);
+
+		/* A small queue is drained by later camera paths, a large
+		   one only at the end of each iteration (flushUPM()) */
+		size_t queueSizes[] = { 16, 1 << 20 };
+		for (int i=0; i<2; ++i) {
+			Log(EInfo, "Comparing a merge queue of " SIZE_T_FMT " merges", queueSizes[i]);
+			ref<Bitmap> queued = render(queueSizes[i]);
+
+			Float refTotal = 0, queuedTotal = 0;
+			for (int y=0; y<IMAGE_RES; y += TILE_RES) {
+				for (int x=0; x<IMAGE_RES; x += TILE_RES) {
+					Float refTile = tileMean(reference, x, y);
+					Float queuedTile = tileMean(queued, x, y);
+					assertEqualsEpsilon(queuedTile, refTile, 0.15f * refTile + 1e-3f);
+					refTotal += refTile;
+					queuedTotal += queuedTile;
+				}
+			}
+			assertTrue(refTotal > 0);
+			assertEqualsEpsilon(queuedTotal, refTotal, 0.05f * refTotal);
+		}
+	}
+
+	/// Render the test scene and return the developed image
+	ref<Bitmap> render(size_t mergeQueueSize) {
+		ParameterMap params;
+		params["mergeQueueSize"] = formatString(SIZE_T_FMT, mergeQueueSize);
+		ref<Scene> scene = SceneHandler::loadSceneFromString(upmScene, params);
+		scene->initialize();
+
+		fs::path destination = fs::temp_directory_path() / "mitsuba_test_upm.exr";
+		scene->setDestinationFile(destination);
+
+		ref<RenderQueue> queue = new RenderQueue();
+		ref<RenderJob> job = new RenderJob("rend", scene, queue);
+		job->start();
+		assertTrue(job->wait());
+		queue->join();
+		fs::remove(destination);
+
+		ref<Bitmap> bitmap = new Bitmap(Bitmap::ERGB, Bitmap::EFloat32,
+			Vector2i(IMAGE_RES, IMAGE_RES));
+		assertTrue(scene->getFilm()->develop(Point2i(0), bitmap->getSize(),
+			Point2i(0), bitmap));
+		return bitmap;
+	}
+
+	/// Average of all channels of the tile at <tt>(x, y)</tt>
+	static Float tileMean(const Bitmap *bitmap, int x, int y) {
+		const float *data = bitmap->getFloat32Data();
+		double sum = 0;
+		for (int yy=y; yy<y+TILE_RES; ++yy)
+			for (int xx=x; xx<x+TILE_RES; ++xx)
+				for (int c=0; c<3; ++c)
+					sum += data[(yy * IMAGE_RES + xx) * 3 + c];
+		return (Float) (sum / (TILE_RES * TILE_RES * 3));
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestUPM, "Testcase for the UPM merge queue")
+MTS_NAMESPACE_END
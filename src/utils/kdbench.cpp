@@ -20,6 +20,8 @@
 #include <mitsuba/core/timer.h>
 #include <mitsuba/core/fresolver.h>
 #include <mitsuba/core/plugin.h>
+#include <mitsuba/core/kdtree.h>
+#include <mitsuba/core/hashgrid.h>
 #include <boost/algorithm/string.hpp>
 #if defined(WIN32)
 #include <mitsuba/core/getopt.h>
@@ -55,6 +57,10 @@ public:
 		cout << "                  optimization method." << endl << endl;
 		cout << "   -f             Try to empirically find the best SAH cost values by" << endl;
 		cout << "                  fitting the cost model to collected performance data" << endl << endl;
+		cout << "   -g value       Instead of tracing rays, compare the point kd-tree against" << endl;
+		cout << "                  the hashed uniform grid for fixed-radius gather queries." << endl;
+		cout << "                  The radius is given relative to the bounding sphere" << endl << endl;
+		cout << "   -n count       Number of surface points used by -g (default: 1000000)" << endl << endl;
 		cout << "Examples:" << endl;
 		cout << "  E.g. to build a tree for the Stanford bunny having a low SAH cost, type " << endl << endl;
 		cout << "  $ mtsutil kdbench -e .9 -l1 -d48 -x100000 data/tests/bunny.ply" << endl << endl;
@@ -62,19 +68,112 @@ public:
 		cout << "  The high -x paramer effectively disables Min-Max binning, which " << endl;
 		cout << "  leads to a slower and more memory-intensive build, so don't try" << endl;
 		cout << "  this on a huge model." << endl << endl;
+		cout << "  To benchmark photon lookups with a radius of 0.1% of the scene size, type" << endl << endl;
+		cout << "  $ mtsutil kdbench -g 0.001 -n 2000000 data/tests/bunny.ply" << endl << endl;
+	}
+
+	typedef SimpleKDNode<Point, uint32_t> GatherNode;
+
+	/// Sample a point on the scene surfaces by tracing a random chord of the bounding sphere
+	bool sampleSurfacePoint(const ShapeKDTree *kdtree, const BSphere &bsphere, Random *random, Point &p) {
+		Point2 sample1(random->nextFloat(), random->nextFloat()),
+			sample2(random->nextFloat(), random->nextFloat());
+		Point p1 = bsphere.center + Warp::squareToUniformSphere(sample1) * bsphere.radius;
+		Point p2 = bsphere.center + Warp::squareToUniformSphere(sample2) * bsphere.radius;
+		Ray r(p1, normalize(p2-p1), 0.0f);
+
+		Intersection its;
+		if (!kdtree->rayIntersect(r, its))
+			return false;
+		p = its.p;
+		return true;
+	}
+
+	/// Compare build and query times of the point kd-tree and the hashed grid
+	void benchmarkGather(const ShapeKDTree *kdtree, Float relRadius, size_t nPoints) {
+		BSphere bsphere(kdtree->getAABB().getBSphere());
+		Float radius = relRadius * bsphere.radius;
+		const size_t nQueries = 1000000;
+		ref<Random> random = new Random();
+
+		PointKDTree<GatherNode> pointTree;
+		PointHashGrid<GatherNode> grid;
+		pointTree.reserve(nPoints);
+		grid.reserve(nPoints);
+		while (pointTree.size() < nPoints) {
+			GatherNode node((uint32_t) pointTree.size());
+			Point p;
+			if (!sampleSurfacePoint(kdtree, bsphere, random, p))
+				continue;
+			node.setPosition(p);
+			pointTree.push_back(node);
+			grid.push_back(node);
+		}
+
+		std::vector<Point> queries;
+		queries.reserve(nQueries);
+		while (queries.size() < nQueries) {
+			Point p;
+			if (sampleSurfacePoint(kdtree, bsphere, random, p))
+				queries.push_back(p);
+		}
+
+		Log(EInfo, "Gather benchmark: " SIZE_T_FMT " points, " SIZE_T_FMT " queries, radius %f",
+			nPoints, nQueries, radius);
+
+		for (int parallel=0; parallel<2; ++parallel) {
+			PointKDTree<GatherNode> tree(pointTree);
+			tree.setParallelBuild(parallel == 1);
+			ref<Timer> timer = new Timer();
+			tree.build(true);
+			Log(EInfo, "  kd-tree build (%s): %i ms", parallel ? "parallel" : "serial",
+				timer->getMilliseconds());
+		}
+		ref<Timer> timer = new Timer();
+		pointTree.build(true);
+		int kdBuildTime = timer->getMilliseconds();
+
+		timer->reset();
+		grid.setCellSize(radius);
+		grid.build(true);
+		int gridBuildTime = timer->getMilliseconds();
+		Log(EInfo, "  Build time: kd-tree %i ms, hash grid %i ms", kdBuildTime, gridBuildTime);
+
+		std::vector<uint32_t> results;
+		size_t kdFound = 0, gridFound = 0;
+		timer->reset();
+		for (size_t i=0; i<nQueries; ++i) {
+			results.clear();
+			kdFound += pointTree.search(queries[i], radius, results);
+		}
+		int kdQueryTime = timer->getMilliseconds();
+
+		timer->reset();
+		for (size_t i=0; i<nQueries; ++i) {
+			results.clear();
+			gridFound += grid.search(queries[i], radius, results);
+		}
+		int gridQueryTime = timer->getMilliseconds();
+
+		Log(EInfo, "  Query time: kd-tree %i ms, hash grid %i ms (avg. %.2f results per query)",
+			kdQueryTime, gridQueryTime, kdFound / (Float) nQueries);
+		if (kdFound != gridFound)
+			Log(EWarn, "  Result count mismatch: kd-tree " SIZE_T_FMT ", hash grid " SIZE_T_FMT,
+				kdFound, gridFound);
 	}
 
 	int run(int argc, char **argv) {
 		ref<FileResolver> fileResolver = Thread::getThread()->getFileResolver();
 		int optchar;
 		char *end_ptr = NULL;
-		Float intersectionCost = -1, traversalCost = -1, emptySpaceBonus = -1;
+		Float intersectionCost = -1, traversalCost = -1, emptySpaceBonus = -1, gatherRadius = -1;
+		size_t gatherPoints = 1000000;
 		int stopPrims = -1, maxDepth = -1, exactPrims = -1, minMaxBins = -1;
 		bool clip = true, parallel = true, retract = true, fitParameters = false;
 		optind = 1;
 
 		/* Parse command-line arguments */
-		while ((optchar = getopt(argc, argv, "i:t:e:c:p:r:l:x:b:d:hf")) != -1) {
+		while ((optchar = getopt(argc, argv, "i:t:e:c:p:r:l:x:b:d:g:n:hf")) != -1) {
 			switch (optchar) {
 				case 'h': {
 						help();
@@ -114,6 +213,16 @@ public:
 					if (*end_ptr != '\0')
 						SLog(EError, "Could not parse the -e parameter!");
 					break;
+				case 'g':
+					gatherRadius = (Float) strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || gatherRadius <= 0)
+						SLog(EError, "Could not parse the gather radius!");
+					break;
+				case 'n':
+					gatherPoints = (size_t) strtoul(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || gatherPoints == 0)
+						SLog(EError, "Could not parse the gather point count!");
+					break;
 				case 'b':
 					minMaxBins = strtol(optarg, &end_ptr, 10);
 					if (*end_ptr != '\0')
@@ -210,7 +319,9 @@ public:
 		BSphere bsphere(kdtree->getAABB().getBSphere());
 		const size_t nRays = 5000000;
 
-		if (!fitParameters) {
+		if (gatherRadius > 0) {
+			benchmarkGather(kdtree, gatherRadius, gatherPoints);
+		} else if (!fitParameters) {
 			Log(EInfo, "Bounding sphere: %s", bsphere.toString().c_str());
 			Float best = 0;
 			for (int j=0; j<3; ++j) {